@@ -48,8 +48,47 @@ enum NETISO_CMD
 
 	/* Replace this with any custom command */
 	NETISO_CMD_CUSTOM_0 = 0x2412,
+
+	/* Protocol extensions. Servers that don't know them close the connection, so a client that gets no reply
+	 * to NETISO_CMD_SET_FEATURES must reconnect and stick to the commands above. */
+
+	/* Enables the requested NETISO_FEATURE_* flags. The server returns the ones it accepted. */
+	NETISO_CMD_SET_FEATURES = 0x2420,
+	/* Reads the active ro file (NETISO_FEATURE_PIPELINE), results are tagged and may come out of order */
+	NETISO_CMD_READ_FILE_TAGGED,
+	/* Reads the active ro file like NETISO_CMD_READ_FILE (NETISO_FEATURE_SPARSE), but the runs of zeros found in the
+	 * data aren't sent: the result lists them, and only the data around them follows. */
+	NETISO_CMD_READ_FILE_SPARSE,
+	/* Gets a page of the open directory (NETISO_FEATURE_DIR_PAGES): netiso_dir_page_entry records, each followed by
+	 * its name. The listing is taken with token 0, the next pages are asked with the token of the previous result. */
+	NETISO_CMD_READ_DIR_PAGE,
+	/* Gets the PARAM.SFO and icon of games in the open directory (NETISO_FEATURE_GAME_INFO): a netiso_game_info
+	 * for each name of the list sent after the command, followed by its files, up to max_size bytes. */
+	NETISO_CMD_GET_GAME_INFO,
+};
+
+enum NETISO_FEATURE
+{
+	NETISO_FEATURE_PIPELINE = 0x00000001,
+	NETISO_FEATURE_SPARSE = 0x00000002,
+	/* The data of NETISO_CMD_READ_FILE, NETISO_CMD_READ_FILE_SPARSE, NETISO_CMD_READ_DIR, NETISO_CMD_READ_DIR_PAGE
+	 * and NETISO_CMD_GET_GAME_INFO comes after a netiso_lz4_header */
+	NETISO_FEATURE_LZ4 = 0x00000004,
+	NETISO_FEATURE_DIR_PAGES = 0x00000008,
+	NETISO_FEATURE_GAME_INFO = 0x00000010,
+};
+
+enum NETISO_GAME_ICON
+{
+	NETISO_GAME_ICON_NONE,
+	NETISO_GAME_ICON_ICON0, // PS3_GAME/ICON0.PNG
+	NETISO_GAME_ICON_JPG,   // cover next to the image
+	NETISO_GAME_ICON_PNG,
 };
 
+/* Maximum number of zero runs in the result of a NETISO_CMD_READ_FILE_SPARSE */
+#define NETISO_MAX_ZERO_RUNS	64
+
 typedef struct _netiso_cmd
 {
 	uint16_t opcode;
@@ -85,6 +124,98 @@ typedef struct _netiso_read_file_result
 	int32_t bytes_read;
 } __attribute__((packed)) netiso_read_file_result;
 
+typedef struct _netiso_read_file_sparse_cmd
+{
+	uint16_t opcode;
+	uint16_t pad;
+	uint32_t num_bytes;
+	uint64_t offset;
+} __attribute__((packed)) netiso_read_file_sparse_cmd;
+
+typedef struct _netiso_read_file_sparse_result
+{
+	int32_t bytes_read; // -1 on error. Includes the zero runs
+	uint16_t num_runs; // netiso_zero_run that follow, before the data
+	uint16_t pad;
+} __attribute__((packed)) netiso_read_file_sparse_result;
+
+typedef struct _netiso_zero_run
+{
+	uint32_t offset; // from the offset read, runs are sorted and don't overlap
+	uint32_t size;
+} __attribute__((packed)) netiso_zero_run;
+
+typedef struct _netiso_lz4_header
+{
+	uint32_t packed_size; // 0: the data follows as is. Else an LZ4 block of the data but the last raw_size bytes,
+	uint32_t raw_size;    // which follow it as they are. Decompressed in place from the end of the data buffer
+} __attribute__((packed)) netiso_lz4_header;
+
+typedef struct _netiso_read_dir_page_cmd
+{
+	uint16_t opcode;
+	uint16_t pad;
+	uint32_t max_entries;
+	uint64_t token; // 0 for the first page
+} __attribute__((packed)) netiso_read_dir_page_cmd;
+
+typedef struct _netiso_read_dir_page_result
+{
+	int64_t dir_size; // entries in the listing, -1 on error
+	uint32_t num_entries; // entries in this page
+	uint32_t size; // bytes of data that follow
+	uint64_t token; // of the next page, 0 after the last one
+} __attribute__((packed)) netiso_read_dir_page_result;
+
+typedef struct _netiso_dir_page_entry
+{
+	int64_t file_size;
+	uint64_t mtime;
+	int8_t is_directory;
+	uint16_t name_len; // name that follows, not terminated, up to 510 bytes
+} __attribute__((packed)) netiso_dir_page_entry;
+
+typedef struct _netiso_get_game_info_cmd
+{
+	uint16_t opcode;
+	uint16_t num_names;
+	uint16_t names_len; // of the list that follows: name of the game, then of its cover without extension, or ""
+	uint8_t want_icon0;
+	uint8_t pad;
+	uint32_t max_size;
+	uint32_t pad2;
+} __attribute__((packed)) netiso_get_game_info_cmd;
+
+typedef struct _netiso_get_game_info_result
+{
+	int32_t num_entries; // names answered, -1 on error
+	uint32_t size;
+} __attribute__((packed)) netiso_get_game_info_result;
+
+typedef struct _netiso_game_info
+{
+	uint32_t sfo_size; // 0 if not a PS3 game
+	uint32_t icon_size;
+	uint8_t icon_type; // NETISO_GAME_ICON_*
+	uint8_t pad[3];
+} __attribute__((packed)) netiso_game_info;
+
+typedef struct _netiso_set_features_cmd
+{
+	uint16_t opcode;
+	uint16_t pad;
+	uint32_t features;
+	uint64_t pad2;
+} __attribute__((packed)) netiso_set_features_cmd;
+
+typedef struct _netiso_set_features_result
+{
+	uint32_t features; // features enabled for the session
+	uint16_t pipeline_depth; // tagged reads processed at the same time
+	uint16_t pad;
+	uint32_t max_tagged_read; // maximum num_bytes of a tagged read
+} __attribute__((packed)) netiso_set_features_result;
+
 typedef struct _netiso_open_cmd
 {
 	uint16_t opcode;
@@ -187,6 +187,7 @@ static void get_iso_icon(char *icon, char *param, char *file, int isdir, int ns,
 		}
 
 #ifndef LITE_EDITION
+		// usually already in WMTMP, got by get_net_game_info if the server sends game info
 		copy_net_file(icon, tempstr, ns, COPY_WHOLE_FILE);
 
 		if(file_exists(icon)) return;
@@ -360,6 +361,124 @@ static void get_folder_icon(char *icon, u8 f1, u8 is_iso, char *param, char *ent
 
 #ifdef COBRA_ONLY
  #ifndef LITE_EDITION
+#define GAME_INFO_NAMES_SIZE	(_64KB_ - _4KB_)
+#define GAME_INFO_MAX_NAMES		(_4KB_ / sizeof(u16))
+// room for the biggest PARAM.SFO (64KB) and icon (1MB) sent by the server, so every game fits alone in a batch
+#define GAME_INFO_DATA_SIZE		(_1MB_ + _128KB_)
+
+// Gets the PARAM.SFO and icon of the games of a remote listing that aren't in WMTMP yet, a batch of them per
+// NETISO_CMD_GET_GAME_INFO, instead of copying their files one by one in add_net_game and get_iso_icon.
+// Those still copy the files that aren't in WMTMP afterwards (old server, error or not enough memory).
+static void get_net_game_info(int ns, netiso_read_dir_result_data *data, int v3_entries, char *templn, char *tempstr, u8 f1)
+{
+	const char icon_ext[4][5] = {"", ".PNG", ".jpg", ".png"};
+
+	if(!(get_remote_features(ns) & NETISO_FEATURE_GAME_INFO)) return;
+
+	if(!IS_PS3_TYPE && webman_config->nocov>1) return; // no icons either
+
+	sys_addr_t sysmem = 0;
+	if(sys_memory_allocate(_64KB_ + GAME_INFO_DATA_SIZE, SYS_MEMORY_PAGE_SIZE_64K, &sysmem)!=0) return;
+
+	// names asked, their entries in the listing, then the files received
+	char *names = (char*)sysmem;
+	u16 *index = (u16*)(sysmem + GAME_INFO_NAMES_SIZE);
+	u8 *info_data = (u8*)(sysmem + _64KB_);
+
+	int v3_entry = 0, abort_connection = 0;
+
+	while(v3_entry < v3_entries)
+	{
+		u16 names_len = 0, num_names = 0;
+
+		for(; v3_entry < v3_entries && num_names < GAME_INFO_MAX_NAMES; v3_entry++)
+		{
+			char *name = data[v3_entry].name;
+
+			// same entries as add_net_game
+			if(!data[v3_entry].is_directory)
+			{
+				int flen = strlen(name)-4;
+				if(flen<0 || !strcasestr(".iso.0|.img|.mdf|.bin", name + flen)) continue;
+			}
+			else if(name[0]=='.' || !IS_JB_FOLDER) continue;
+
+			bool cached = true;
+
+			if(IS_PS3_TYPE)
+			{
+				if(data[v3_entry].is_directory)
+					sprintf(templn, WMTMP "/%s.SFO", name);
+				else
+					{get_name(templn, name, 1); strcat(templn, ".SFO");}
+
+				cached = file_exists(templn);
+			}
+
+			if(cached && webman_config->nocov<2)
+			{
+				cached = false;
+				for(u8 e = 1; e < 4 && !cached; e++) {get_name(templn, name, 1); strcat(templn, icon_ext[e]); cached = file_exists(templn);}
+			}
+
+			if(cached) continue;
+
+			// cover next to the image, as get_iso_icon looks for it
+			if(data[v3_entry].is_directory || webman_config->nocov>1) tempstr[0] = NULL; else get_name(tempstr, name, 0);
+
+			int len = strlen(name) + 1, cover_len = strlen(tempstr) + 1;
+			if(names_len + len + cover_len > GAME_INFO_NAMES_SIZE) break;
+
+			memcpy(names + names_len, name, len); names_len += len;
+			memcpy(names + names_len, tempstr, cover_len); names_len += cover_len;
+			index[num_names++] = v3_entry;
+		}
+
+		if(num_names == 0) break;
+
+		u32 size = 0;
+		int n = get_remote_game_info(ns, names, names_len, num_names, (webman_config->nocov<2), info_data, GAME_INFO_DATA_SIZE, &size, &abort_connection);
+		if(n <= 0) break;
+
+		u8 *p = info_data, *end = info_data + size;
+
+		for(int i = 0; i < n; i++)
+		{
+			netiso_game_info info;
+
+			if(p + sizeof(info) > end) goto done;
+			memcpy(&info, p, sizeof(info)); p += sizeof(info);
+			if(info.sfo_size > (u32)(end - p) || info.icon_size > (u32)(end - p) - info.sfo_size) goto done;
+
+			char *name = data[index[i]].name;
+
+			if(info.sfo_size && IS_PS3_TYPE)
+			{
+				if(data[index[i]].is_directory)
+					sprintf(templn, WMTMP "/%s.SFO", name);
+				else
+					{get_name(templn, name, 1); strcat(templn, ".SFO");}
+
+				if(file_exists(templn)==false) savefile(templn, (char*)p, info.sfo_size);
+			}
+			p += info.sfo_size;
+
+			if(info.icon_size && info.icon_type > NETISO_GAME_ICON_NONE && info.icon_type <= NETISO_GAME_ICON_PNG)
+			{
+				get_name(templn, name, 1); strcat(templn, icon_ext[info.icon_type]);
+				if(file_exists(templn)==false) savefile(templn, (char*)p, info.icon_size);
+			}
+			p += info.icon_size;
+		}
+
+		// the games that didn't fit are asked again
+		if(n < num_names) v3_entry = index[n];
+	}
+
+done:
+	sys_memory_free(sysmem);
+}
+
 static int add_net_game(int ns, netiso_read_dir_result_data *data, int v3_entry, char *neth, char *param, char *templn, char *tempstr, char *enc_dir_name, char *icon, char *tempID, u8 f1, u8 is_html)
 {
 	int abort_connection=0, is_directory=0; int64_t file_size; u64 mtime, ctime, atime;
@@ -386,6 +505,7 @@ static int add_net_game(int ns, netiso_read_dir_result_data *data, int v3_entry,
 		else
 			{get_name(templn, data[v3_entry].name, 1); strcat(templn, ".SFO\0");}
 
+		// usually already got by get_net_game_info if the server sends game info
 		if(file_exists(templn)==false)
 		{
 			sprintf(enc_dir_name, "%s/%s/PS3_GAME/PARAM.SFO", param, data[v3_entry].name);
@@ -718,6 +838,7 @@ static bool game_listing(char *buffer, char *templn, char *param, char *tempstr,
 					v3_entries = read_remote_dir(ns, &data2, &abort_connection);
 					if(data2==NULL) goto continue_reading_folder_html; //continue;
 					data=(netiso_read_dir_result_data*)data2; sprintf(neth, "/net%i", (f0-7));
+					get_net_game_info(ns, data, v3_entries, templn, tempstr, f1);
 				}
  #endif
 #endif
@@ -574,6 +574,7 @@ static bool update_mygames_xml(u64 conn_s_p)
 					v3_entries = read_remote_dir(ns, &data2, &abort_connection);
 					if(data2==NULL) goto continue_reading_folder_xml; //continue;
 					data=(netiso_read_dir_result_data*)data2; sprintf(neth, "/net%i", (f0-7));
+					get_net_game_info(ns, data, v3_entries, templn, tempstr, f1);
 				}
  #endif
 #endif
@@ -17,8 +17,20 @@ static sys_event_queue_t command_queue = -1;
 
 #define MAX_RETRIES    3
 
+#define MAX_NET_SOCKETS    64
+
 static u8 netiso_loaded = 0;
 
+// NETISO_FEATURE_* enabled on the sockets opened by connect_to_remote_server
+static u32 remote_features[MAX_NET_SOCKETS];
+// Servers that closed the connection on NETISO_CMD_SET_FEATURES, one bit per server_id
+static u8 legacy_servers = 0;
+
+// Seconds to wait for the answer to NETISO_CMD_SET_FEATURES
+#define SET_FEATURES_TIMEOUT    3
+// Returned by set_remote_features when the server closed the connection, as a server without the extensions does
+#define FEATURES_REJECTED      (-2)
+
 static int remote_stat(int s, char *path, int *is_directory, int64_t *file_size, uint64_t *mtime, uint64_t *ctime, uint64_t *atime, int *abort_connection)
 {
 	netiso_stat_cmd cmd;
@@ -64,11 +76,252 @@ static int remote_stat(int s, char *path, int *is_directory, int64_t *file_size,
 	return 0;
 }
 
+static int set_remote_features(int s, uint32_t features)
+{
+	netiso_set_features_cmd cmd;
+	netiso_set_features_result res;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = (NETISO_CMD_SET_FEATURES);
+	cmd.features = (features);
+
+	if(send(s, &cmd, sizeof(cmd), 0) != sizeof(cmd))
+	{
+		return FAILED;
+	}
+
+	// a server that ignores the command must not hang the connection
+	struct timeval tv;
+	tv.tv_usec = 0;
+
+	tv.tv_sec = SET_FEATURES_TIMEOUT;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	int ret = recv(s, &res, sizeof(res), MSG_WAITALL);
+
+	tv.tv_sec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if(ret == 0)
+	{
+		return FEATURES_REJECTED;
+	}
+
+	if(ret != sizeof(res))
+	{
+		return FAILED;
+	}
+
+	return (int)(res.features);
+}
+
+static u32 get_remote_features(int s)
+{
+	return (s >= 0 && s < MAX_NET_SOCKETS) ? remote_features[s] : 0;
+}
+
+// Receives the data of a result, of size bytes, keeping the first len bytes in buf. With NETISO_FEATURE_LZ4 it comes
+// after a netiso_lz4_header, and the block is put at the end of the data in buf to be decompressed in place.
+static int recv_remote_data(int s, u8 *buf, int size, int len)
+{
+	netiso_lz4_header header;
+
+	if(size <= 0)
+	{
+		return 0;
+	}
+
+	if(!(get_remote_features(s) & NETISO_FEATURE_LZ4))
+	{
+		return (recv(s, buf, len, MSG_WAITALL) == len) ? 0 : FAILED;
+	}
+
+	if(recv(s, &header, sizeof(header), MSG_WAITALL) != sizeof(header))
+	{
+		return FAILED;
+	}
+
+	int packed = (int)(header.packed_size);
+	int raw = (int)(header.raw_size);
+	int wire = (packed) ? packed + raw : size;
+
+	if(packed < 0 || raw < 0 || wire > size)
+	{
+		return FAILED;
+	}
+
+	if(len == size)
+	{
+		u8 *block = buf + size - wire;
+
+		if(recv(s, block, wire, MSG_WAITALL) != wire)
+		{
+			return FAILED;
+		}
+
+		if(packed && lz4_decompress_block(block, packed, buf, size - raw) != size - raw)
+		{
+			return FAILED;
+		}
+
+		return 0;
+	}
+
+	// less room than data (a clamped directory): the data goes through a buffer of its own
+	sys_addr_t tmp = 0;
+	if(sys_memory_allocate(((wire + _64KB_) / _64KB_) * _64KB_, SYS_MEMORY_PAGE_SIZE_64K, &tmp) != 0)
+	{
+		return FAILED;
+	}
+
+	u8 *block = (u8*)tmp;
+	int ret = FAILED;
+
+	if(recv(s, block, wire, MSG_WAITALL) == wire)
+	{
+		if(!packed)
+		{
+			memcpy(buf, block, len); ret = 0;
+		}
+		else if(len <= size - raw)
+		{
+			if(lz4_decompress_block(block, packed, buf, len) == len) ret = 0;
+		}
+		else if(lz4_decompress_block(block, packed, buf, size - raw) == size - raw)
+		{
+			memcpy(buf + size - raw, block + packed, len - (size - raw)); ret = 0;
+		}
+	}
+
+	sys_memory_free(tmp);
+	return ret;
+}
+
+static int read_remote_file_sparse(int s, void *buf, uint64_t offset, uint32_t size, int *abort_connection)
+{
+	netiso_read_file_sparse_cmd cmd;
+	netiso_read_file_sparse_result res;
+	netiso_zero_run runs[NETISO_MAX_ZERO_RUNS];
+
+	*abort_connection = 1;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = (NETISO_CMD_READ_FILE_SPARSE);
+	cmd.offset = (offset);
+	cmd.num_bytes = (size);
+
+	if(send(s, &cmd, sizeof(cmd), 0) != sizeof(cmd))
+	{
+		return FAILED;
+	}
+
+	if(recv(s, &res, sizeof(res), MSG_WAITALL) != sizeof(res))
+	{
+		return FAILED;
+	}
+
+	int bytes_read = (res.bytes_read);
+	int num_runs = (res.num_runs);
+	int len = num_runs * sizeof(netiso_zero_run);
+
+	if(num_runs > NETISO_MAX_ZERO_RUNS || bytes_read > (int)size)
+	{
+		return FAILED;
+	}
+
+	if(len && recv(s, runs, len, MSG_WAITALL) != len)
+	{
+		return FAILED;
+	}
+
+	*abort_connection = 0;
+
+	if(bytes_read <= 0)
+		return bytes_read;
+
+	// only the data around the runs of zeros is received, the zeros are filled here
+	u8 *data = (u8*)buf;
+	uint32_t pos = 0;
+
+	if(get_remote_features(s) & NETISO_FEATURE_LZ4)
+	{
+		// the data comes packed at the start of buf, it is moved after the runs from the last one
+		uint32_t data_size = bytes_read;
+
+		for(int i = 0; i < num_runs; i++)
+		{
+			if(runs[i].offset < pos || runs[i].offset > (uint32_t)bytes_read || runs[i].size > bytes_read - runs[i].offset)
+			{
+				*abort_connection = 1;
+				return FAILED;
+			}
+
+			pos = runs[i].offset + runs[i].size;
+			data_size -= runs[i].size;
+		}
+
+		if(recv_remote_data(s, data, data_size, data_size) != 0)
+		{
+			*abort_connection = 1;
+			return FAILED;
+		}
+
+		pos = bytes_read;
+
+		for(int i = num_runs - 1; i >= 0; i--)
+		{
+			len = pos - (runs[i].offset + runs[i].size);
+			data_size -= len;
+
+			memmove(data + runs[i].offset + runs[i].size, data + data_size, len);
+			memset(data + runs[i].offset, 0, runs[i].size);
+			pos = runs[i].offset;
+		}
+
+		return bytes_read;
+	}
+
+	for(int i = 0; i <= num_runs; i++)
+	{
+		uint32_t start = (i < num_runs) ? runs[i].offset : (uint32_t)bytes_read;
+
+		if(start < pos || start > (uint32_t)bytes_read || (i < num_runs && runs[i].size > bytes_read - start))
+		{
+			*abort_connection = 1;
+			return FAILED;
+		}
+
+		if(start > pos)
+		{
+			len = start - pos;
+
+			if(recv(s, data + pos, len, MSG_WAITALL) != len)
+			{
+				*abort_connection = 1;
+				return FAILED;
+			}
+		}
+
+		if(i < num_runs)
+		{
+			memset(data + start, 0, runs[i].size);
+			pos = start + runs[i].size;
+		}
+	}
+
+	return bytes_read;
+}
+
 static int read_remote_file(int s, void *buf, uint64_t offset, uint32_t size, int *abort_connection)
 {
 	netiso_read_file_cmd cmd;
 	netiso_read_file_result res;
 
+	if(get_remote_features(s) & NETISO_FEATURE_SPARSE)
+	{
+		return read_remote_file_sparse(s, buf, offset, size, abort_connection);
+	}
+
 	*abort_connection = 1;
 
 	memset(&cmd, 0, sizeof(cmd));
@@ -94,7 +347,7 @@ static int read_remote_file(int s, void *buf, uint64_t offset, uint32_t size, in
 	if(bytes_read <= 0)
 		return bytes_read;
 
-	if(recv(s, buf, bytes_read, MSG_WAITALL) != bytes_read)
+	if(recv_remote_data(s, (u8*)buf, bytes_read, bytes_read) != 0)
 	{
 		//DPRINTF("recv failed (read_remote_file) (errno=%d)!\n", get_network_error());
 		*abort_connection = 1;
@@ -572,7 +825,7 @@ static int connect_to_remote_server(u8 server_id)
 		if(server_id == 4 && webman_config->netd2 && strcmp(webman_config->neth2, webman_config->neth4) == 0 && webman_config->netp2 == webman_config->netp4) return FAILED;
 		if(server_id == 4 && webman_config->netd3 && strcmp(webman_config->neth3, webman_config->neth4) == 0 && webman_config->netp3 == webman_config->netp4) return FAILED;
 #endif
-		u8 retries = 0;
+		u8 retries = 0, ask_features = !(legacy_servers & (1 << server_id));
 
 	reconnect:
 		if(server_id == 0) ns = connect_to_server(webman_config->neth0, webman_config->netp0);
@@ -598,6 +851,29 @@ static int connect_to_remote_server(u8 server_id)
 			ns = connect_to_server(webman_config->allow_ip, webman_config->netp0);
 			if(ns >= 0) strcpy(webman_config->neth0, webman_config->allow_ip);
 		}
+
+		// ask for sparse reads, compression, paged listings and game info, a server that doesn't know the extensions closes the connection
+		if(ns >= 0 && ns < MAX_NET_SOCKETS)
+		{
+			remote_features[ns] = 0;
+
+			if(ask_features)
+			{
+				int features = set_remote_features(ns, NETISO_FEATURE_SPARSE | NETISO_FEATURE_LZ4 | NETISO_FEATURE_DIR_PAGES | NETISO_FEATURE_GAME_INFO);
+
+				if(features < 0)
+				{
+					// after a timeout or a network error, only this connection goes without the extensions
+					if(features == FEATURES_REJECTED) legacy_servers |= (1 << server_id);
+
+					ask_features = 0;
+					sclose(&ns); retries = 0;
+					goto reconnect;
+				}
+
+				remote_features[ns] = features;
+			}
+		}
 	}
 	return ns;
 }
@@ -639,12 +915,124 @@ static int open_remote_dir(int s, char *path, int *abort_connection)
 	return (res.open_result);
 }
 
+// The pages are received at the end of the room left in the array of records and unpacked to its start:
+// a netiso_dir_page_entry with its name is never bigger than a netiso_read_dir_result_data.
+static int read_remote_dir_pages(int s, sys_addr_t *data /*netiso_read_dir_result_data **data*/, int *abort_connection)
+{
+	netiso_read_dir_page_cmd cmd;
+	netiso_read_dir_page_result res;
+	sys_addr_t data1 = 0;
+	int room = 0, count = 0;
+
+	*abort_connection = 1;
+	*data = NULL;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = (NETISO_CMD_READ_DIR_PAGE);
+	cmd.max_entries = 123; // the first page fits in the smallest array
+
+	do
+	{
+		if(send(s, &cmd, sizeof(cmd), 0) != sizeof(cmd))
+		{
+			goto fail;
+		}
+
+		if(recv(s, &res, sizeof(res), MSG_WAITALL) != sizeof(res))
+		{
+			goto fail;
+		}
+
+		if(res.dir_size < 0 || res.num_entries > cmd.max_entries || (int64_t)res.num_entries > res.dir_size)
+		{
+			goto fail;
+		}
+
+		if(!data1)
+		{
+			if(res.dir_size == 0)
+				break;
+
+			for(int64_t retry=16; retry>0; retry--)
+			{
+				room = (int)MIN(res.dir_size, retry*123);
+
+				int len2 = (((sizeof(netiso_read_dir_result_data)*room)+_64KB_)/_64KB_)*_64KB_;
+				if(sys_memory_allocate(len2, SYS_MEMORY_PAGE_SIZE_64K, &data1)==0) break;
+			}
+
+			if(!data1)
+			{
+				return FAILED;
+			}
+		}
+
+		netiso_read_dir_result_data *entries = (netiso_read_dir_result_data*)data1 + count;
+		uint32_t free_size = (room - count) * sizeof(netiso_read_dir_result_data);
+
+		if(res.size > free_size)
+		{
+			goto fail;
+		}
+
+		u8 *page = (u8*)entries + free_size - res.size, *page_end = (u8*)entries + free_size;
+
+		if(recv_remote_data(s, page, res.size, res.size) != 0)
+		{
+			goto fail;
+		}
+
+		for(uint32_t i = 0; i < res.num_entries; i++, entries++)
+		{
+			netiso_dir_page_entry entry;
+
+			if(page + sizeof(entry) > page_end)
+			{
+				goto fail;
+			}
+
+			memcpy(&entry, page, sizeof(entry)); page += sizeof(entry);
+
+			if(entry.name_len > 510 || page + entry.name_len > page_end)
+			{
+				goto fail;
+			}
+
+			memmove(entries->name, page, entry.name_len); page += entry.name_len;
+			memset(entries->name + entry.name_len, 0, sizeof(entries->name) - entry.name_len);
+
+			entries->file_size = entry.file_size;
+			entries->mtime = entry.mtime;
+			entries->is_directory = entry.is_directory;
+		}
+
+		count += res.num_entries;
+		cmd.max_entries = room - count;
+		cmd.token = res.token;
+	}
+	while(res.token && count < room);
+
+	*data = data1;
+	*abort_connection = 0;
+
+	return count;
+
+fail:
+	if(data1) sys_memory_free(data1);
+	return FAILED;
+}
+
 static int read_remote_dir(int s, sys_addr_t *data /*netiso_read_dir_result_data **data*/, int *abort_connection)
 {
 	netiso_read_dir_entry_cmd cmd;
 	netiso_read_dir_result res;
 	int len;
 
+	if(get_remote_features(s) & NETISO_FEATURE_DIR_PAGES)
+	{
+		return read_remote_dir_pages(s, data, abort_connection);
+	}
+
 	*abort_connection = 1;
 
 	memset(&cmd, 0, sizeof(cmd));
@@ -667,6 +1055,7 @@ static int read_remote_dir(int s, sys_addr_t *data /*netiso_read_dir_result_data
 	if(res.dir_size > 0)
 	{
 		sys_addr_t data1=0;
+		int size = (sizeof(netiso_read_dir_result_data)*res.dir_size);
 		for(int64_t retry=16; retry>0; retry--)
 		{
 			if(res.dir_size>retry*123) res.dir_size=retry*123;
@@ -678,7 +1067,7 @@ static int read_remote_dir(int s, sys_addr_t *data /*netiso_read_dir_result_data
 				*data=data1;
 				u8 *data2=(u8*)data1;
 
-				if(recv(s, data2, len, MSG_WAITALL) != len)
+				if(recv_remote_data(s, data2, size, len) != 0)
 				{
 					sys_memory_free(data1);
 					*data=NULL;
@@ -698,6 +1087,53 @@ static int read_remote_dir(int s, sys_addr_t *data /*netiso_read_dir_result_data
 	return (res.dir_size);
 }
 
+// Asks the PARAM.SFO and icon of the games in names (NETISO_FEATURE_GAME_INFO), each one followed by the name of its
+// cover. Their netiso_game_info records and files are put in buf. Returns the number of games answered.
+static int get_remote_game_info(int s, char *names, u16 names_len, u16 num_names, u8 want_icon0, u8 *buf, u32 size, u32 *data_size, int *abort_connection)
+{
+	netiso_get_game_info_cmd cmd;
+	netiso_get_game_info_result res;
+
+	*abort_connection = 1;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = (NETISO_CMD_GET_GAME_INFO);
+	cmd.num_names = num_names;
+	cmd.names_len = names_len;
+	cmd.want_icon0 = want_icon0;
+	cmd.max_size = size;
+
+	if(send(s, &cmd, sizeof(cmd), 0) != sizeof(cmd))
+	{
+		return FAILED;
+	}
+
+	if(send(s, names, names_len, 0) != names_len)
+	{
+		return FAILED;
+	}
+
+	if(recv(s, &res, sizeof(res), MSG_WAITALL) != sizeof(res))
+	{
+		return FAILED;
+	}
+
+	if(res.num_entries > num_names || res.size > size)
+	{
+		return FAILED;
+	}
+
+	if(recv_remote_data(s, buf, res.size, res.size) != 0)
+	{
+		return FAILED;
+	}
+
+	*data_size = res.size;
+	*abort_connection = 0;
+
+	return res.num_entries;
+}
+
 static int copy_net_file(char *local_file, char *remote_file, int ns, uint64_t maxbytes)
 {
 	copy_aborted = false;
@@ -31,6 +31,20 @@ void *memcpy(void *dst0, const void *src0, size_t n)
 	return save;
 }
 
+void *memmove(void *dst0, const void *src0, size_t n)
+{
+	char *dst = (char *)dst0;
+	char *src = (char *)src0;
+
+	if (dst <= src || dst >= src + n)
+		return memcpy(dst0, src0, n);
+
+	while (n--)
+		dst[n] = src[n];
+
+	return dst0;
+}
+
 int memcmp(const void* s1, const void* s2, size_t n)
 {
     const unsigned char *p1 = s1, *p2 = s2;
@@ -58,6 +58,7 @@ static char search_url[50] = "http://google.com/search?q=";
 
 #ifdef COBRA_ONLY
  #include "cobra/netiso.h"
+ #include "ps3netsrv/lz4block.h"
 
  #ifdef LITE_EDITION
     #define EDITION " [Lite]"
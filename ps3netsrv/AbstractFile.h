@@ -5,15 +5,53 @@
 #include <stdint.h>
 #include "compat.h"
 
+// A range of a file that reads as zeros
+typedef struct _zero_run_t
+{
+	int64_t offset;
+	int64_t size;
+} zero_run_t;
+
+// Appends a run to the num_runs sorted ones, merged with the last one when they touch. Returns false if
+// it doesn't fit.
+static inline bool add_zero_run(zero_run_t *runs, int *num_runs, int max_runs, int64_t offset, int64_t size)
+{
+	if (*num_runs > 0 && runs[*num_runs-1].offset + runs[*num_runs-1].size == offset)
+	{
+		runs[*num_runs-1].size += size;
+		return true;
+	}
+
+	if (*num_runs >= max_runs)
+		return false;
+
+	runs[*num_runs].offset = offset;
+	runs[*num_runs].size = size;
+	(*num_runs)++;
+	return true;
+}
+
 class AbstractFile
 {
 public:
+	virtual ~AbstractFile() {}
+
 	virtual int open(const char *path, int flags) = 0;
 	virtual int close(void) = 0;
 	virtual ssize_t read(void *buf, size_t nbyte) = 0;
+	// Reads at offset without moving the file pointer. Safe to call from several threads at a time.
+	virtual ssize_t pread(void *buf, size_t nbyte, int64_t offset) = 0;
 	virtual ssize_t write(void *buf, size_t nbyte) = 0;
 	virtual int64_t seek(int64_t offset, int whence) = 0;
 	virtual int fstat(file_stat_t *fs) = 0;	
+
+	// Sends nbyte bytes at offset directly to socket s. Implementations that can't do it return -2
+	// and the caller has to read() the data and send it itself.
+	virtual int64_t sendfile(int s, int64_t offset, int64_t nbyte) { return -2; }
+
+	// Finds the ranges between offset and offset+nbyte known to read as zeros without reading them, like the
+	// holes of a sparse file. Fills up to max_runs of them, sorted, and returns their number.
+	virtual int get_zero_runs(int64_t offset, int64_t nbyte, zero_run_t *runs, int max_runs) { return 0; }
 };
 
 
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "BlockCache.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+CacheShard BlockCache::shards[CACHE_SHARDS];
+bool BlockCache::enabled = false;
+
+static inline uint64_t hash_key(uint64_t file_id, uint64_t block)
+{
+	uint64_t h = file_id ^ (block * 0x9E3779B97F4A7C15ULL);
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+
+CacheShard *BlockCache::get_shard(uint64_t file_id, uint64_t block)
+{
+	return &shards[hash_key(file_id, block) % CACHE_SHARDS];
+}
+
+// Finds a block and moves it to the front of the LRU. Must be called with the shard mutex held.
+CacheEntry *BlockCache::lookup(CacheShard *shard, uint64_t file_id, uint64_t block)
+{
+	CacheEntry *entry = shard->buckets[(hash_key(file_id, block) / CACHE_SHARDS) % shard->num_buckets];
+
+	while (entry && (entry->file_id != file_id || entry->block != block))
+		entry = entry->hash_next;
+
+	if (entry && entry != shard->lru_head)
+	{
+		entry->lru_prev->lru_next = entry->lru_next;
+
+		if (entry->lru_next)
+			entry->lru_next->lru_prev = entry->lru_prev;
+		else
+			shard->lru_tail = entry->lru_prev;
+
+		entry->lru_prev = NULL;
+		entry->lru_next = shard->lru_head;
+		shard->lru_head->lru_prev = entry;
+		shard->lru_head = entry;
+	}
+
+	return entry;
+}
+
+// Removes a block from the hash chain and the LRU. Must be called with the shard mutex held.
+void BlockCache::unlink(CacheShard *shard, CacheEntry *entry)
+{
+	CacheEntry **p = &shard->buckets[(hash_key(entry->file_id, entry->block) / CACHE_SHARDS) % shard->num_buckets];
+
+	while (*p != entry)
+		p = &(*p)->hash_next;
+
+	*p = entry->hash_next;
+
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		shard->lru_head = entry->lru_next;
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		shard->lru_tail = entry->lru_prev;
+
+	shard->size -= CACHE_BLOCK_SIZE;
+}
+
+// Adds a block, evicting the least recently used ones over the cap. Must be called with the shard mutex held.
+void BlockCache::insert(CacheShard *shard, CacheEntry *entry)
+{
+	while (shard->lru_tail && shard->size + CACHE_BLOCK_SIZE > shard->max_size)
+	{
+		CacheEntry *victim = shard->lru_tail;
+
+		unlink(shard, victim);
+		free(victim->data);
+		free(victim);
+	}
+
+	uint32_t bucket = (hash_key(entry->file_id, entry->block) / CACHE_SHARDS) % shard->num_buckets;
+
+	entry->hash_next = shard->buckets[bucket];
+	shard->buckets[bucket] = entry;
+
+	entry->lru_prev = NULL;
+	entry->lru_next = shard->lru_head;
+
+	if (shard->lru_head)
+		shard->lru_head->lru_prev = entry;
+	else
+		shard->lru_tail = entry;
+
+	shard->lru_head = entry;
+	shard->size += CACHE_BLOCK_SIZE;
+}
+
+ssize_t BlockCache::pread(file_t fd, uint64_t file_id, void *buf, size_t nbyte, int64_t offset)
+{
+	// A file without id can't be told apart from others
+	if (!enabled || file_id == 0)
+		return pread_file(fd, buf, nbyte, offset);
+
+	uint8_t *p = (uint8_t *)buf;
+	ssize_t r = 0;
+
+	while (r < (ssize_t)nbyte)
+	{
+		uint64_t block = offset / CACHE_BLOCK_SIZE;
+		uint32_t block_offset = offset % CACHE_BLOCK_SIZE;
+		uint32_t block_size;
+		size_t n = 0;
+
+		CacheShard *shard = get_shard(file_id, block);
+
+		mutex_lock(&shard->mutex);
+
+		CacheEntry *entry = lookup(shard, file_id, block);
+		if (entry)
+		{
+			shard->hits++;
+			block_size = entry->size;
+
+			if (block_size > block_offset)
+			{
+				n = MIN(nbyte - r, (size_t)(block_size - block_offset));
+				memcpy(p, entry->data + block_offset, n);
+			}
+
+			mutex_unlock(&shard->mutex);
+		}
+		else
+		{
+			shard->misses++;
+			mutex_unlock(&shard->mutex);
+
+			entry = (CacheEntry *)malloc(sizeof(CacheEntry));
+			uint8_t *data = (uint8_t *)malloc(CACHE_BLOCK_SIZE);
+
+			if (!entry || !data)
+			{
+				// Out of memory: read the rest directly
+				if (entry) free(entry);
+				if (data) free(data);
+
+				ssize_t ret = pread_file(fd, p, nbyte - r, offset);
+				if (ret < 0)
+					return (r == 0) ? ret : r;
+
+				return r + ret;
+			}
+
+			ssize_t ret = pread_file(fd, data, CACHE_BLOCK_SIZE, block * CACHE_BLOCK_SIZE);
+			if (ret < 0)
+			{
+				free(entry);
+				free(data);
+				return (r == 0) ? ret : r;
+			}
+
+			block_size = ret;
+
+			if (block_size > block_offset)
+			{
+				n = MIN(nbyte - r, (size_t)(block_size - block_offset));
+				memcpy(p, data + block_offset, n);
+			}
+
+			entry->file_id = file_id;
+			entry->block = block;
+			entry->size = block_size;
+			entry->data = data;
+
+			mutex_lock(&shard->mutex);
+
+			// Another client may have loaded the same block meanwhile
+			if (lookup(shard, file_id, block))
+			{
+				free(entry);
+				free(data);
+			}
+			else
+			{
+				insert(shard, entry);
+			}
+
+			mutex_unlock(&shard->mutex);
+		}
+
+		p += n;
+		r += n;
+		offset += n;
+
+		// A short block is the end of the file
+		if (n == 0 || (block_size < CACHE_BLOCK_SIZE && block_offset + n >= block_size))
+			break;
+	}
+
+	return r;
+}
+
+int BlockCache::initialize(int64_t max_size)
+{
+	if (max_size <= 0)
+		return 0;
+
+	// Every shard holds at least one block
+	int64_t shard_size = max_size / CACHE_SHARDS;
+	if (shard_size < CACHE_BLOCK_SIZE)
+		shard_size = CACHE_BLOCK_SIZE;
+
+	uint32_t num_buckets = 16;
+
+	while (num_buckets < shard_size / CACHE_BLOCK_SIZE)
+		num_buckets <<= 1;
+
+	for (int i = 0; i < CACHE_SHARDS; i++)
+	{
+		CacheShard *shard = &shards[i];
+
+		memset(shard, 0, sizeof(CacheShard));
+		mutex_init(&shard->mutex);
+
+		shard->buckets = (CacheEntry **)calloc(num_buckets, sizeof(CacheEntry *));
+		if (!shard->buckets)
+			return -1;
+
+		shard->num_buckets = num_buckets;
+		shard->max_size = shard_size;
+	}
+
+	enabled = true;
+	return 0;
+}
+
+void BlockCache::get_stats(uint64_t *hits, uint64_t *misses, int64_t *size)
+{
+	*hits = 0;
+	*misses = 0;
+	*size = 0;
+
+	if (!enabled)
+		return;
+
+	for (int i = 0; i < CACHE_SHARDS; i++)
+	{
+		mutex_lock(&shards[i].mutex);
+		*hits += shards[i].hits;
+		*misses += shards[i].misses;
+		*size += shards[i].size;
+		mutex_unlock(&shards[i].mutex);
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef __BLOCKCACHE_H__
+#define __BLOCKCACHE_H__
+
+#include "compat.h"
+
+#define CACHE_BLOCK_SIZE	(256*1024)
+#define CACHE_SHARDS	64
+
+typedef struct _CacheEntry
+{
+	uint64_t file_id;
+	uint64_t block;
+	uint32_t size;
+	uint8_t *data;
+	struct _CacheEntry *hash_next;
+	struct _CacheEntry *lru_prev;
+	struct _CacheEntry *lru_next;
+} CacheEntry;
+
+typedef struct
+{
+	mutex_t mutex;
+	CacheEntry **buckets;
+	uint32_t num_buckets;
+	CacheEntry *lru_head;
+	CacheEntry *lru_tail;
+	int64_t size;
+	int64_t max_size;
+	uint64_t hits;
+	uint64_t misses;
+} CacheShard;
+
+// Block cache shared by all the clients, so several consoles playing the same game (or a
+// VIsoFile reading the same small files over and over) are served from memory. Blocks are keyed
+// by file id and block index and spread over independently locked shards, each one with its own LRU.
+class BlockCache
+{
+private:
+	static CacheShard shards[CACHE_SHARDS];
+	static bool enabled;
+
+	static CacheShard *get_shard(uint64_t file_id, uint64_t block);
+	static CacheEntry *lookup(CacheShard *shard, uint64_t file_id, uint64_t block);
+	static void insert(CacheShard *shard, CacheEntry *entry);
+	static void unlink(CacheShard *shard, CacheEntry *entry);
+
+public:
+	// max_size is the memory cap in bytes; 0 leaves the cache disabled
+	static int initialize(int64_t max_size);
+	static bool is_enabled(void) { return enabled; }
+
+	// Same as pread_file, going through the cache when it is enabled. file_id comes from get_file_id; files
+	// whose id couldn't be got have 0 and are read directly.
+	static ssize_t pread(file_t fd, uint64_t file_id, void *buf, size_t nbyte, int64_t offset);
+
+	static void get_stats(uint64_t *hits, uint64_t *misses, int64_t *size);
+};
+
+#endif
@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "CsoFile.h"
+#include "BlockCache.h"
+#include "lz4block.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+enum
+{
+	METHOD_PLAIN,
+	METHOD_DEFLATE,
+	METHOD_LZ4
+};
+
+static mutex_t queue_mutex;
+static cond_t queue_cond;
+static cond_t done_cond;
+static CsoJob *queue_head = NULL;
+static CsoJob *queue_tail = NULL;
+static bool threads_started = false;
+
+CsoFile::CsoFile()
+{
+	fd = INVALID_FD;
+	index = NULL;
+	position = 0;
+	tick = 0;
+
+	memset(cache, 0, sizeof(cache));
+	mutex_init(&mutex);
+}
+
+CsoFile::~CsoFile()
+{
+	if (FD_OK(fd))
+		this->close();
+
+	mutex_destroy(&mutex);
+}
+
+int CsoFile::open(const char *path, int flags)
+{
+	CsoHeader header;
+
+	if (FD_OK(fd))
+		this->close();
+
+	if ((flags & (O_WRONLY|O_RDWR)) != 0)
+		return -1;
+
+	fd = open_file(path, flags);
+	if (!FD_OK(fd))
+		return -1;
+
+	if (get_file_id(fd, &fid) < 0)
+		fid = 0;
+
+	if (pread_file(fd, &header, sizeof(header), 0) != sizeof(header))
+	{
+		this->close();
+		return -1;
+	}
+
+	magic = LE32(header.magic);
+	version = header.version;
+	align = header.align;
+	block_size = LE32(header.block_size);
+	total_bytes = LE64(header.total_bytes);
+
+	if ((magic != CSO_MAGIC && magic != ZSO_MAGIC) || version > 2 || align > 31 ||
+		block_size < CSO_MIN_BLOCK_SIZE || block_size > CSO_MAX_BLOCK_SIZE || total_bytes <= 0 ||
+		total_bytes / block_size >= 0x7FFFFFFF)
+	{
+		DPRINTF("%s is not a valid compressed image\n", path);
+		this->close();
+		return -1;
+	}
+
+	num_blocks = (uint32_t)((total_bytes + block_size - 1) / block_size);
+	blocks_per_chunk = (block_size < CSO_CHUNK_SIZE) ? CSO_CHUNK_SIZE / block_size : 1;
+	chunk_size = blocks_per_chunk * block_size;
+
+	// One more entry marks the end of the last block
+	index = (uint32_t *)malloc((num_blocks+1) * sizeof(uint32_t));
+	if (!index || pread_file(fd, index, (num_blocks+1) * sizeof(uint32_t), sizeof(header)) != (ssize_t)((num_blocks+1) * sizeof(uint32_t)))
+	{
+		this->close();
+		return -1;
+	}
+
+	for (uint32_t i = 0; i <= num_blocks; i++)
+	{
+		index[i] = LE32(index[i]);
+
+		if (i > 0 && (index[i] & ~CSO_PLAIN_BLOCK) < (index[i-1] & ~CSO_PLAIN_BLOCK))
+		{
+			DPRINTF("Corrupt index in %s\n", path);
+			this->close();
+			return -1;
+		}
+	}
+
+	position = 0;
+	return 0;
+}
+
+int CsoFile::close(void)
+{
+	int ret = 0;
+
+	if (FD_OK(fd))
+	{
+		ret = close_file(fd);
+		fd = INVALID_FD;
+	}
+
+	if (index)
+	{
+		free(index);
+		index = NULL;
+	}
+
+	for (int i = 0; i < CSO_CACHE_CHUNKS; i++)
+	{
+		if (cache[i].data)
+			free(cache[i].data);
+	}
+
+	memset(cache, 0, sizeof(cache));
+	return ret;
+}
+
+int CsoFile::decompress_block(const uint8_t *src, uint32_t src_size, int method, uint8_t *dst, uint32_t size, void *zstream)
+{
+	if (method == METHOD_PLAIN)
+	{
+		if (src_size < size)
+			return -1;
+
+		memcpy(dst, src, size);
+		return 0;
+	}
+
+	if (method == METHOD_LZ4)
+		return (lz4_decompress_block(src, src_size, dst, size) == (int)size) ? 0 : -1;
+
+	z_stream *z = (z_stream *)zstream;
+
+	if (inflateReset(z) != Z_OK)
+		return -1;
+
+	z->next_in = (Bytef *)src;
+	z->avail_in = src_size;
+	z->next_out = dst;
+	z->avail_out = size;
+
+	// The block may be followed by the padding of the alignment
+	int ret = inflate(z, Z_FINISH);
+	if ((ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR) || z->avail_out != 0)
+		return -1;
+
+	return 0;
+}
+
+int CsoFile::decode_chunk(int64_t chunk, uint8_t *buf)
+{
+	uint32_t first = (uint32_t)(chunk * blocks_per_chunk);
+	uint32_t last = MIN(first + blocks_per_chunk, num_blocks);
+	int64_t start = (int64_t)(index[first] & ~CSO_PLAIN_BLOCK) << align;
+	int64_t end = (int64_t)(index[last] & ~CSO_PLAIN_BLOCK) << align;
+	z_stream z;
+	int ret = 0;
+
+	// Stored blocks are a block plus the alignment at most
+	if (end - start > (int64_t)(last - first) * (block_size + ((int64_t)1 << align) + 64))
+		return -1;
+
+	uint8_t *data = (uint8_t *)malloc(end - start + 1);
+	if (!data)
+		return -1;
+
+	// The compressed data goes through the shared cache, which then holds several times more of the iso
+	if (BlockCache::pread(fd, fid, data, end - start, start) != end - start)
+	{
+		free(data);
+		return -1;
+	}
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, -15) != Z_OK)
+	{
+		free(data);
+		return -1;
+	}
+
+	for (uint32_t i = first; i < last && ret == 0; i++)
+	{
+		int64_t block_start = ((int64_t)(index[i] & ~CSO_PLAIN_BLOCK) << align) - start;
+		int64_t block_end = ((int64_t)(index[i+1] & ~CSO_PLAIN_BLOCK) << align) - start;
+		uint32_t size = (uint32_t)MIN((int64_t)block_size, total_bytes - (int64_t)i*block_size);
+		int method;
+
+		// v2 images store a block as is when it doesn't shrink, and the flag selects lz4 instead of deflate
+		if (magic == CSO_MAGIC && version == 2)
+			method = (block_end - block_start >= block_size) ? METHOD_PLAIN : (index[i] & CSO_PLAIN_BLOCK) ? METHOD_LZ4 : METHOD_DEFLATE;
+		else if (index[i] & CSO_PLAIN_BLOCK)
+			method = METHOD_PLAIN;
+		else
+			method = (magic == ZSO_MAGIC) ? METHOD_LZ4 : METHOD_DEFLATE;
+
+		ret = decompress_block(data + block_start, (uint32_t)(block_end - block_start), method, buf + (int64_t)(i-first)*block_size, size, &z);
+		if (ret != 0)
+			DPRINTF("Block %u of the compressed image is corrupt\n", i);
+	}
+
+	inflateEnd(&z);
+	free(data);
+
+	return ret;
+}
+
+// Part of a chunk, from the cache
+int CsoFile::read_chunk(int64_t chunk, uint8_t *buf, uint32_t offset, uint32_t size)
+{
+	mutex_lock(&mutex);
+
+	for (int i = 0; i < CSO_CACHE_CHUNKS; i++)
+	{
+		if (cache[i].data && cache[i].chunk == chunk)
+		{
+			cache[i].last_use = ++tick;
+			memcpy(buf, cache[i].data + offset, size);
+			mutex_unlock(&mutex);
+			return 0;
+		}
+	}
+
+	mutex_unlock(&mutex);
+
+	uint8_t *data = (uint8_t *)malloc(chunk_size);
+	if (!data)
+		return -1;
+
+	if (decode_chunk(chunk, data) != 0)
+	{
+		free(data);
+		return -1;
+	}
+
+	memcpy(buf, data + offset, size);
+
+	mutex_lock(&mutex);
+
+	int victim = -1;
+	bool found = false;
+
+	for (int i = 0; i < CSO_CACHE_CHUNKS; i++)
+	{
+		// Decoded meanwhile by another thread
+		if (cache[i].data && cache[i].chunk == chunk)
+		{
+			found = true;
+			break;
+		}
+
+		if (victim < 0 || (cache[victim].data && (!cache[i].data || cache[i].last_use < cache[victim].last_use)))
+			victim = i;
+	}
+
+	if (!found)
+	{
+		if (cache[victim].data)
+			free(cache[victim].data);
+
+		cache[victim].chunk = chunk;
+		cache[victim].data = data;
+		cache[victim].last_use = ++tick;
+		data = NULL;
+	}
+
+	mutex_unlock(&mutex);
+
+	if (data)
+		free(data);
+
+	return 0;
+}
+
+// Whole chunks, decompressed in parallel to buf. The caller takes the first one and then helps with the others.
+int CsoFile::decode_chunks(int64_t first, int64_t count, uint8_t *buf)
+{
+	if (!threads_started || count == 1)
+	{
+		for (int64_t i = 0; i < count; i++)
+		{
+			if (decode_chunk(first + i, buf + i*chunk_size) != 0)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	CsoJob *jobs = (CsoJob *)malloc(count * sizeof(CsoJob));
+	int errors = 0;
+	int pending = (int)count - 1;
+
+	if (!jobs)
+		return -1;
+
+	mutex_lock(&queue_mutex);
+
+	for (int64_t i = 1; i < count; i++)
+	{
+		jobs[i].file = this;
+		jobs[i].chunk = first + i;
+		jobs[i].buf = buf + i*chunk_size;
+		jobs[i].errors = &errors;
+		jobs[i].pending = &pending;
+		jobs[i].next = NULL;
+
+		if (queue_tail)
+			queue_tail->next = &jobs[i];
+		else
+			queue_head = &jobs[i];
+
+		queue_tail = &jobs[i];
+	}
+
+	cond_broadcast(&queue_cond);
+	mutex_unlock(&queue_mutex);
+
+	int ret = decode_chunk(first, buf);
+
+	mutex_lock(&queue_mutex);
+
+	while (pending > 0)
+	{
+		// Jobs of this read still queued are done here rather than waiting for a thread
+		CsoJob *job = NULL;
+
+		for (CsoJob *j = queue_head, *prev = NULL; j; prev = j, j = j->next)
+		{
+			if (j->pending == &pending)
+			{
+				if (prev)
+					prev->next = j->next;
+				else
+					queue_head = j->next;
+
+				if (queue_tail == j)
+					queue_tail = prev;
+
+				job = j;
+				break;
+			}
+		}
+
+		if (!job)
+		{
+			cond_wait(&done_cond, &queue_mutex);
+			continue;
+		}
+
+		mutex_unlock(&queue_mutex);
+		int job_ret = decode_chunk(job->chunk, job->buf);
+		mutex_lock(&queue_mutex);
+
+		if (job_ret != 0)
+			errors++;
+
+		pending--;
+	}
+
+	mutex_unlock(&queue_mutex);
+	free(jobs);
+
+	return (ret == 0 && errors == 0) ? 0 : -1;
+}
+
+void *CsoFile::decode_thread(void *arg)
+{
+	(void) arg;
+
+	for (;;)
+	{
+		mutex_lock(&queue_mutex);
+
+		while (!queue_head)
+			cond_wait(&queue_cond, &queue_mutex);
+
+		CsoJob *job = queue_head;
+		queue_head = job->next;
+		if (!queue_head)
+			queue_tail = NULL;
+
+		mutex_unlock(&queue_mutex);
+
+		int ret = job->file->decode_chunk(job->chunk, job->buf);
+
+		mutex_lock(&queue_mutex);
+
+		if (ret != 0)
+			(*job->errors)++;
+
+		(*job->pending)--;
+
+		cond_broadcast(&done_cond);
+		mutex_unlock(&queue_mutex);
+	}
+
+	return NULL;
+}
+
+ssize_t CsoFile::read(void *buf, size_t nbyte)
+{
+	ssize_t ret = this->pread(buf, nbyte, position);
+
+	if (ret > 0)
+		position += ret;
+
+	return ret;
+}
+
+ssize_t CsoFile::pread(void *buf, size_t nbyte, int64_t offset)
+{
+	uint8_t *p = (uint8_t *)buf;
+
+	if (!FD_OK(fd) || offset < 0)
+		return -1;
+
+	if (offset >= total_bytes)
+		return 0;
+
+	if ((int64_t)nbyte > total_bytes - offset)
+		nbyte = total_bytes - offset;
+
+	int64_t end = offset + nbyte;
+
+	while (offset < end)
+	{
+		int64_t chunk = offset / chunk_size;
+		uint32_t chunk_offset = (uint32_t)(offset % chunk_size);
+		int64_t chunk_end = MIN((chunk+1) * (int64_t)chunk_size, total_bytes);
+
+		if (chunk_offset == 0 && chunk_end <= end)
+		{
+			// Run of whole chunks
+			int64_t count = 1;
+
+			while ((chunk+count) * (int64_t)chunk_size < total_bytes && MIN((chunk+count+1) * (int64_t)chunk_size, total_bytes) <= end)
+				count++;
+
+			if (decode_chunks(chunk, count, p) != 0)
+				return -1;
+
+			int64_t n = MIN(count * (int64_t)chunk_size, total_bytes - offset);
+			p += n;
+			offset += n;
+			continue;
+		}
+
+		uint32_t n = (uint32_t)MIN(chunk_end - offset, end - offset);
+
+		if (read_chunk(chunk, p, chunk_offset, n) != 0)
+			return -1;
+
+		p += n;
+		offset += n;
+	}
+
+	return nbyte;
+}
+
+ssize_t CsoFile::write(void *buf, size_t nbyte)
+{
+	(void) buf;
+	(void) nbyte;
+
+	return -1;
+}
+
+int64_t CsoFile::seek(int64_t offset, int whence)
+{
+	int64_t new_position;
+
+	if (whence == SEEK_SET)
+		new_position = offset;
+	else if (whence == SEEK_CUR)
+		new_position = position + offset;
+	else if (whence == SEEK_END)
+		new_position = total_bytes + offset;
+	else
+		return -1;
+
+	if (new_position < 0)
+		return -1;
+
+	position = new_position;
+	return position;
+}
+
+int CsoFile::fstat(file_stat_t *fs)
+{
+	if (fstat_file(fd, fs) < 0)
+		return -1;
+
+	fs->file_size = total_bytes;
+	return 0;
+}
+
+bool CsoFile::is_compressed(const char *path)
+{
+	size_t len = strlen(path);
+
+	if (len < 4)
+		return false;
+
+	const char *ext = path + len - 4;
+
+	return (ext[0] == '.' && (ext[1] == 'c' || ext[1] == 'C' || ext[1] == 'z' || ext[1] == 'Z') &&
+			(ext[2] == 's' || ext[2] == 'S') && (ext[3] == 'o' || ext[3] == 'O'));
+}
+
+int64_t CsoFile::get_image_size(const char *path)
+{
+	CsoHeader header;
+	file_t fd = open_file(path, O_RDONLY);
+
+	if (!FD_OK(fd))
+		return -1;
+
+	ssize_t ret = pread_file(fd, &header, sizeof(header), 0);
+	close_file(fd);
+
+	if (ret != sizeof(header) || (LE32(header.magic) != CSO_MAGIC && LE32(header.magic) != ZSO_MAGIC))
+		return -1;
+
+	return LE64(header.total_bytes);
+}
+
+int CsoFile::initialize(int num_threads)
+{
+	mutex_init(&queue_mutex);
+	cond_init(&queue_cond);
+	cond_init(&done_cond);
+
+	for (int i = 0; i < num_threads; i++)
+	{
+		thread_t thread;
+
+		if (create_start_thread(&thread, decode_thread, NULL) != 0)
+			return -1;
+	}
+
+	threads_started = (num_threads > 0);
+	return 0;
+}
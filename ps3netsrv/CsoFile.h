@@ -0,0 +1,101 @@
+#ifndef __CSOFILE_H__
+#define __CSOFILE_H__
+
+#include "AbstractFile.h"
+#include "compat.h"
+
+#define CSO_MAGIC	0x4F534943 // "CISO"
+#define ZSO_MAGIC	0x4F53495A // "ZISO"
+
+// Blocks are decompressed in chunks of this size, the unit of the cache and of the decompression threads
+#define CSO_CHUNK_SIZE	(64*1024)
+#define CSO_CACHE_CHUNKS	32
+#define CSO_MIN_BLOCK_SIZE	512
+#define CSO_MAX_BLOCK_SIZE	(1024*1024)
+
+// Set in an index entry: the block is stored as is
+#define CSO_PLAIN_BLOCK	0x80000000
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t header_size;
+	uint64_t total_bytes;
+	uint32_t block_size;
+	uint8_t version;
+	uint8_t align;
+	uint8_t reserved[2];
+} __attribute__((packed)) CsoHeader;
+
+typedef struct
+{
+	int64_t chunk;
+	uint8_t *data;
+	uint32_t last_use;
+} CsoChunk;
+
+class CsoFile;
+
+typedef struct _CsoJob
+{
+	CsoFile *file;
+	int64_t chunk;
+	uint8_t *buf;
+	int *errors;
+	int *pending;
+	struct _CsoJob *next;
+} CsoJob;
+
+// Read-only access to a CSO (deflate) or ZSO (lz4) image as the iso it contains. The image is an
+// index of the position of every block followed by the blocks, each one compressed on its own.
+// Chunks read partially are kept in a small cache; the ones a read covers entirely are
+// decompressed straight to the buffer, by several threads when there are more than one.
+class CsoFile : public AbstractFile
+{
+private:
+	file_t fd;
+	uint64_t fid;
+	uint32_t magic;
+	uint8_t version;
+	uint8_t align;
+	uint32_t block_size;
+	uint32_t blocks_per_chunk;
+	uint32_t chunk_size;
+	int64_t total_bytes;
+	uint32_t num_blocks;
+	uint32_t *index;
+	int64_t position;
+
+	mutex_t mutex;
+	CsoChunk cache[CSO_CACHE_CHUNKS];
+	uint32_t tick;
+
+	int decompress_block(const uint8_t *src, uint32_t src_size, int method, uint8_t *dst, uint32_t size, void *zstream);
+	int decode_chunk(int64_t chunk, uint8_t *buf);
+	int read_chunk(int64_t chunk, uint8_t *buf, uint32_t offset, uint32_t size);
+	int decode_chunks(int64_t first, int64_t count, uint8_t *buf);
+
+	static void *decode_thread(void *arg);
+
+public:
+	CsoFile();
+	~CsoFile();
+
+	virtual int open(const char *path, int flags);
+	virtual int close(void);
+	virtual ssize_t read(void *buf, size_t nbyte);
+	virtual ssize_t pread(void *buf, size_t nbyte, int64_t offset);
+	virtual ssize_t write(void *buf, size_t nbyte);
+	virtual int64_t seek(int64_t offset, int whence);
+	virtual int fstat(file_stat_t *fs);
+
+	// True if the name of path has the extension of a compressed image
+	static bool is_compressed(const char *path);
+	// Size of the iso in the image at path, -1 if it isn't a valid image
+	static int64_t get_image_size(const char *path);
+
+	// Starts the decompression threads, shared by all the images
+	static int initialize(int num_threads);
+};
+
+#endif
@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "DedupFile.h"
+#include "BlockCache.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+DedupFile::DedupFile()
+{
+	fd = INVALID_FD;
+	chunks = NULL;
+	starts = NULL;
+	position = 0;
+}
+
+DedupFile::~DedupFile()
+{
+	if (FD_OK(fd))
+		this->close();
+}
+
+static bool is_absolute_path(const char *path)
+{
+#ifdef WIN32
+	if (path[0] != 0 && path[1] == ':')
+		return true;
+
+	if (path[0] == '\\')
+		return true;
+#endif
+	return (path[0] == '/');
+}
+
+int DedupFile::open(const char *path, int flags)
+{
+	DedupHeader header;
+	char *data_path = NULL;
+
+	if (FD_OK(fd))
+		this->close();
+
+	if ((flags & (O_WRONLY|O_RDWR)) != 0)
+		return -1;
+
+	file_t mfd = open_file(path, flags);
+	if (!FD_OK(mfd))
+		return -1;
+
+	if (pread_file(mfd, &header, sizeof(header), 0) != sizeof(header) || fstat_file(mfd, &manifest_st) < 0)
+	{
+		close_file(mfd);
+		return -1;
+	}
+
+	total_bytes = LE64(header.total_bytes);
+	num_chunks = LE32(header.num_chunks);
+
+	uint32_t header_size = LE32(header.header_size);
+	uint16_t store_len = LE16(header.store_len);
+
+	if (LE32(header.magic) != DEDUP_MAGIC || header.version != 1 || header_size < sizeof(header) ||
+		total_bytes < 0 || num_chunks >= 0x10000000 || store_len == 0)
+	{
+		DPRINTF("%s is not a valid manifest\n", path);
+		close_file(mfd);
+		return -1;
+	}
+
+	char *store = (char *)malloc(store_len + 1);
+	chunks = (DedupEntry *)malloc(num_chunks * sizeof(DedupEntry) + 1);
+	starts = (int64_t *)malloc((num_chunks + 1) * sizeof(int64_t));
+
+	if (!store || !chunks || !starts ||
+		pread_file(mfd, store, store_len, header_size) != store_len ||
+		pread_file(mfd, chunks, num_chunks * sizeof(DedupEntry), header_size + store_len) != (ssize_t)(num_chunks * sizeof(DedupEntry)))
+	{
+		free(store);
+		close_file(mfd);
+		this->close();
+		return -1;
+	}
+
+	close_file(mfd);
+
+	store[store_len] = 0;
+	data_path = get_store_file(path, store, DEDUP_DATA_FILE);
+	free(store);
+
+	if (!data_path)
+	{
+		this->close();
+		return -1;
+	}
+
+	fd = open_file(data_path, O_RDONLY);
+	if (!FD_OK(fd))
+	{
+		DPRINTF("Cannot open the chunk store %s of %s\n", data_path, path);
+		free(data_path);
+		this->close();
+		return -1;
+	}
+
+	free(data_path);
+
+	if (get_file_id(fd, &fid) < 0)
+		fid = 0;
+
+	starts[0] = 0;
+
+	for (uint32_t i = 0; i < num_chunks; i++)
+	{
+		chunks[i].offset = LE64(chunks[i].offset);
+		chunks[i].size = LE32(chunks[i].size);
+		starts[i+1] = starts[i] + chunks[i].size;
+
+		if (chunks[i].size == 0 || chunks[i].size > DEDUP_MAX_CHUNK_SIZE)
+		{
+			DPRINTF("Corrupt manifest %s\n", path);
+			this->close();
+			return -1;
+		}
+	}
+
+	if (starts[num_chunks] != total_bytes)
+	{
+		DPRINTF("Corrupt manifest %s\n", path);
+		this->close();
+		return -1;
+	}
+
+	position = 0;
+	return 0;
+}
+
+int DedupFile::close(void)
+{
+	int ret = 0;
+
+	if (FD_OK(fd))
+	{
+		ret = close_file(fd);
+		fd = INVALID_FD;
+	}
+
+	if (chunks)
+	{
+		free(chunks);
+		chunks = NULL;
+	}
+
+	if (starts)
+	{
+		free(starts);
+		starts = NULL;
+	}
+
+	return ret;
+}
+
+uint32_t DedupFile::find_chunk(int64_t offset)
+{
+	uint32_t low = 0;
+	uint32_t high = num_chunks - 1;
+
+	while (low < high)
+	{
+		uint32_t mid = low + (high - low + 1) / 2;
+
+		if (starts[mid] <= offset)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	return low;
+}
+
+ssize_t DedupFile::read(void *buf, size_t nbyte)
+{
+	ssize_t ret = this->pread(buf, nbyte, position);
+
+	if (ret > 0)
+		position += ret;
+
+	return ret;
+}
+
+ssize_t DedupFile::pread(void *buf, size_t nbyte, int64_t offset)
+{
+	uint8_t *p = (uint8_t *)buf;
+
+	if (!FD_OK(fd) || offset < 0)
+		return -1;
+
+	if (offset >= total_bytes)
+		return 0;
+
+	if ((int64_t)nbyte > total_bytes - offset)
+		nbyte = total_bytes - offset;
+
+	int64_t end = offset + nbyte;
+
+	for (uint32_t i = find_chunk(offset); offset < end; i++)
+	{
+		int64_t chunk_offset = offset - starts[i];
+		ssize_t n = (ssize_t)MIN(starts[i+1] - offset, end - offset);
+
+		if (chunks[i].offset == DEDUP_ZERO_CHUNK)
+			memset(p, 0, n);
+		else if (BlockCache::pread(fd, fid, p, n, chunks[i].offset + chunk_offset) != n)
+			return -1;
+
+		p += n;
+		offset += n;
+	}
+
+	return nbyte;
+}
+
+int DedupFile::get_zero_runs(int64_t offset, int64_t nbyte, zero_run_t *runs, int max_runs)
+{
+	int num_runs = 0;
+
+	if (!FD_OK(fd) || offset < 0 || offset >= total_bytes)
+		return 0;
+
+	int64_t end = MIN(offset + nbyte, total_bytes);
+
+	// The zero chunks aren't in the store
+	for (uint32_t i = find_chunk(offset); i < num_chunks && starts[i] < end; i++)
+	{
+		if (chunks[i].offset != DEDUP_ZERO_CHUNK)
+			continue;
+
+		int64_t start = (starts[i] > offset) ? starts[i] : offset;
+
+		if (!add_zero_run(runs, &num_runs, max_runs, start, MIN(starts[i+1], end) - start))
+			break;
+	}
+
+	return num_runs;
+}
+
+ssize_t DedupFile::write(void *buf, size_t nbyte)
+{
+	(void) buf;
+	(void) nbyte;
+
+	return -1;
+}
+
+int64_t DedupFile::seek(int64_t offset, int whence)
+{
+	int64_t new_position;
+
+	if (whence == SEEK_SET)
+		new_position = offset;
+	else if (whence == SEEK_CUR)
+		new_position = position + offset;
+	else if (whence == SEEK_END)
+		new_position = total_bytes + offset;
+	else
+		return -1;
+
+	if (new_position < 0)
+		return -1;
+
+	position = new_position;
+	return position;
+}
+
+int DedupFile::fstat(file_stat_t *fs)
+{
+	if (!FD_OK(fd))
+		return -1;
+
+	memcpy(fs, &manifest_st, sizeof(file_stat_t));
+	fs->file_size = total_bytes;
+	return 0;
+}
+
+int64_t DedupFile::sendfile(int s, int64_t offset, int64_t nbyte)
+{
+	// Let the reads go through the shared cache
+	if (BlockCache::is_enabled() || !FD_OK(fd) || offset < 0 || offset >= total_bytes)
+		return -2;
+
+	int64_t end = offset + MIN(nbyte, total_bytes - offset);
+	uint32_t first = find_chunk(offset);
+
+	// Zero chunks have nothing to send from, the whole range is read instead
+	for (uint32_t i = first; i < num_chunks && starts[i] < end; i++)
+	{
+		if (chunks[i].offset == DEDUP_ZERO_CHUNK)
+			return -2;
+	}
+
+	int64_t sent = 0;
+
+	for (uint32_t i = first; offset < end; i++)
+	{
+		int64_t n = MIN(starts[i+1] - offset, end - offset);
+		int64_t ret = send_file(s, fd, chunks[i].offset + (offset - starts[i]), n);
+
+		if (ret < 0)
+			return (sent == 0) ? ret : -1;
+
+		sent += ret;
+		offset += ret;
+
+		if (ret < n)
+			break;
+	}
+
+	return sent;
+}
+
+bool DedupFile::is_manifest(const char *path)
+{
+	size_t len = strlen(path);
+	size_t ext_len = sizeof(DEDUP_EXTENSION) - 1;
+
+	if (len <= ext_len)
+		return false;
+
+	for (size_t i = 0; i < ext_len; i++)
+	{
+		if ((path[len - ext_len + i] | 0x20) != DEDUP_EXTENSION[i])
+			return false;
+	}
+
+	return true;
+}
+
+char *DedupFile::get_store_file(const char *manifest, const char *store, const char *name)
+{
+	size_t dir_len = 0;
+
+	// A relative store is found from the directory of the manifest
+	if (!is_absolute_path(store))
+	{
+		const char *slash = strrchr(manifest, '/');
+#ifdef WIN32
+		if (strrchr(manifest, '\\') > slash)
+			slash = strrchr(manifest, '\\');
+#endif
+		dir_len = (slash) ? slash - manifest + 1 : 0;
+	}
+
+	char *path = (char *)malloc(dir_len + strlen(store) + strlen(name) + 2);
+	if (!path)
+		return NULL;
+
+	memcpy(path, manifest, dir_len);
+	sprintf(path + dir_len, "%s/%s", store, name);
+	return path;
+}
+
+int64_t DedupFile::get_image_size(const char *path)
+{
+	DedupHeader header;
+	file_t fd = open_file(path, O_RDONLY);
+
+	if (!FD_OK(fd))
+		return -1;
+
+	ssize_t ret = pread_file(fd, &header, sizeof(header), 0);
+	close_file(fd);
+
+	if (ret != sizeof(header) || LE32(header.magic) != DEDUP_MAGIC)
+		return -1;
+
+	return LE64(header.total_bytes);
+}
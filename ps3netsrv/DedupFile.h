@@ -0,0 +1,91 @@
+#ifndef __DEDUPFILE_H__
+#define __DEDUPFILE_H__
+
+#include "AbstractFile.h"
+#include "compat.h"
+
+#define DEDUP_MAGIC	0x50554444 // "DDUP"
+#define DEDUP_EXTENSION	".dedup"
+
+// Files of a chunk store: the chunks one after another, and a record of each one for the importer
+#define DEDUP_DATA_FILE	"chunks.dat"
+#define DEDUP_INDEX_FILE	"chunks.idx"
+
+// Chunks are cut at sector boundaries and stored aligned to sectors
+#define DEDUP_SECTOR_SIZE	2048
+#define DEDUP_MAX_CHUNK_SIZE	(4*1024*1024)
+
+// Offset of a chunk that is all zeros, which takes no room in the store
+#define DEDUP_ZERO_CHUNK	0xFFFFFFFFFFFFFFFFULL
+
+// The manifest of an image (X.iso.dedup, served as X.iso) is this header, the path of the store
+// (relative to the directory of the manifest unless it is absolute) and an entry per chunk.
+typedef struct
+{
+	uint32_t magic;
+	uint32_t header_size;
+	uint64_t total_bytes;
+	uint32_t num_chunks;
+	uint16_t store_len;
+	uint8_t version;
+	uint8_t reserved;
+} __attribute__((packed)) DedupHeader;
+
+typedef struct
+{
+	uint64_t offset;
+	uint32_t size;
+	uint32_t reserved;
+} __attribute__((packed)) DedupEntry;
+
+// Record of chunks.idx
+typedef struct
+{
+	uint64_t hash;
+	uint64_t offset;
+	uint32_t size;
+	uint32_t reserved;
+} __attribute__((packed)) DedupRecord;
+
+// Read-only access to an iso kept in a content-addressed chunk store, where the chunks shared by
+// several images (regional variants, updates of a title) are stored once. Chunks are read from the
+// data file of the store through the block cache, so the same chunk of different images is cached
+// once and every client of any of them hits it.
+class DedupFile : public AbstractFile
+{
+private:
+	file_t fd;
+	uint64_t fid;
+	file_stat_t manifest_st;
+	int64_t total_bytes;
+	uint32_t num_chunks;
+	DedupEntry *chunks;
+	// Position of each chunk in the iso, plus the end of the last one
+	int64_t *starts;
+	int64_t position;
+
+	uint32_t find_chunk(int64_t offset);
+
+public:
+	DedupFile();
+	~DedupFile();
+
+	virtual int open(const char *path, int flags);
+	virtual int close(void);
+	virtual ssize_t read(void *buf, size_t nbyte);
+	virtual ssize_t pread(void *buf, size_t nbyte, int64_t offset);
+	virtual ssize_t write(void *buf, size_t nbyte);
+	virtual int64_t seek(int64_t offset, int whence);
+	virtual int fstat(file_stat_t *fs);
+	virtual int64_t sendfile(int s, int64_t offset, int64_t nbyte);
+	virtual int get_zero_runs(int64_t offset, int64_t nbyte, zero_run_t *runs, int max_runs);
+
+	// True if the name of path has the extension of a manifest
+	static bool is_manifest(const char *path);
+	// Size of the iso of the manifest at path, -1 if it isn't a valid manifest
+	static int64_t get_image_size(const char *path);
+	// Path of the file name of the store of a manifest, allocated with malloc
+	static char *get_store_file(const char *manifest, const char *store, const char *name);
+};
+
+#endif
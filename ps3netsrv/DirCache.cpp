@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#endif
+
+#include "common.h"
+#include "DirCache.h"
+
+mutex_t DirCache::mutex;
+DirSnapshot *DirCache::snapshots = NULL;
+int DirCache::max_snapshots = 0;
+int DirCache::inotify_fd = -1;
+uint32_t DirCache::tick = 0;
+uint64_t DirCache::hits = 0;
+uint64_t DirCache::misses = 0;
+
+// Must be called with the mutex held
+DirSnapshot *DirCache::find(const char *path)
+{
+	for (int i = 0; i < max_snapshots; i++)
+	{
+		if (snapshots[i].path && strcmp(snapshots[i].path, path) == 0)
+			return &snapshots[i];
+	}
+
+	return NULL;
+}
+
+// Frees a slot. Must be called with the mutex held.
+void DirCache::drop(DirSnapshot *snapshot)
+{
+#ifdef __linux__
+	if (snapshot->wd >= 0)
+	{
+		// The same directory reached by another path shares the watch
+		bool shared = false;
+
+		for (int i = 0; i < max_snapshots; i++)
+		{
+			if (&snapshots[i] != snapshot && snapshots[i].wd == snapshot->wd)
+			{
+				shared = true;
+				break;
+			}
+		}
+
+		if (!shared)
+			inotify_rm_watch(inotify_fd, snapshot->wd);
+	}
+#endif
+
+	if (snapshot->path)
+		free(snapshot->path);
+
+	if (snapshot->listing)
+		free(snapshot->listing);
+
+	memset(snapshot, 0, sizeof(DirSnapshot));
+	snapshot->wd = -1;
+}
+
+void *DirCache::watch_thread(void *arg)
+{
+	(void) arg;
+
+#ifdef __linux__
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;)
+	{
+		ssize_t len = read(inotify_fd, buf, sizeof(buf));
+
+		if (len <= 0)
+		{
+			if (len < 0 && errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		mutex_lock(&mutex);
+
+		for (char *p = buf; p < buf + len; )
+		{
+			struct inotify_event *event = (struct inotify_event *)p;
+
+			for (int i = 0; i < max_snapshots; i++)
+			{
+				if (snapshots[i].path && (snapshots[i].wd == event->wd || (event->mask & IN_Q_OVERFLOW)))
+				{
+					snapshots[i].valid = false;
+					snapshots[i].generation++;
+
+					if (event->mask & IN_IGNORED)
+						snapshots[i].wd = -1;
+				}
+			}
+
+			p += sizeof(struct inotify_event) + event->len;
+		}
+
+		mutex_unlock(&mutex);
+	}
+
+	// Without events nothing can be trusted anymore: fall back to polling
+	mutex_lock(&mutex);
+
+	for (int i = 0; i < max_snapshots; i++)
+	{
+		snapshots[i].valid = false;
+		snapshots[i].wd = -1;
+	}
+
+	close(inotify_fd);
+	inotify_fd = -1;
+	mutex_unlock(&mutex);
+#endif
+
+	return NULL;
+}
+
+int DirCache::initialize(int max_dirs)
+{
+	mutex_init(&mutex);
+
+	if (max_dirs <= 0)
+		return 0;
+
+	snapshots = (DirSnapshot *)calloc(max_dirs, sizeof(DirSnapshot));
+	if (!snapshots)
+		return -1;
+
+	for (int i = 0; i < max_dirs; i++)
+		snapshots[i].wd = -1;
+
+	max_snapshots = max_dirs;
+
+#ifdef __linux__
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0)
+	{
+		printf("inotify not available, directory listings will be revalidated by mtime.\n");
+		return 0;
+	}
+
+	thread_t thread;
+
+	if (create_start_thread(&thread, watch_thread, NULL) != 0)
+	{
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+#endif
+
+	return 0;
+}
+
+int64_t DirCache::get(const char *path, uint8_t **listing, size_t *listing_size)
+{
+	int64_t num_entries = -1;
+	file_stat_t st;
+	bool polled, stat_ok = false;
+
+	// A snapshot not watched is checked against the directory, which is stat'ed without the mutex
+	mutex_lock(&mutex);
+	DirSnapshot *snapshot = find(path);
+	polled = (snapshot && snapshot->valid && snapshot->wd < 0);
+	mutex_unlock(&mutex);
+
+	if (polled)
+		stat_ok = (stat_file(path, &st) == 0);
+
+	mutex_lock(&mutex);
+
+	snapshot = find(path);
+
+	if (snapshot && snapshot->valid && snapshot->wd < 0)
+	{
+		// The watch was lost meanwhile: not checked, so not served
+		if (!polled || !stat_ok || st.mtime != snapshot->mtime || time(NULL) - snapshot->scan_time >= DIRCACHE_POLL_TTL)
+			snapshot->valid = false;
+	}
+
+	*listing = NULL;
+
+	if (snapshot && snapshot->valid)
+		*listing = (uint8_t *)malloc((snapshot->listing_size > 0) ? snapshot->listing_size : 1);
+
+	if (*listing)
+	{
+		num_entries = snapshot->num_entries;
+		*listing_size = snapshot->listing_size;
+		memcpy(*listing, snapshot->listing, snapshot->listing_size);
+		snapshot->last_use = ++tick;
+		hits++;
+	}
+	else
+	{
+		misses++;
+	}
+
+	mutex_unlock(&mutex);
+	return num_entries;
+}
+
+uint64_t DirCache::prepare(const char *path)
+{
+	if (max_snapshots == 0)
+		return 0;
+
+	mutex_lock(&mutex);
+
+	DirSnapshot *snapshot = find(path);
+
+	if (!snapshot)
+	{
+		snapshot = &snapshots[0];
+
+		for (int i = 0; i < max_snapshots && snapshot->path; i++)
+		{
+			if (!snapshots[i].path || snapshots[i].last_use < snapshot->last_use)
+				snapshot = &snapshots[i];
+		}
+
+		drop(snapshot);
+
+		snapshot->path = strdup(path);
+		if (!snapshot->path)
+		{
+			mutex_unlock(&mutex);
+			return 0;
+		}
+
+		snapshot->last_use = ++tick;
+	}
+
+	// The watch is added before the scan, so a change during the scan invalidates its result
+#ifdef __linux__
+	if (snapshot->wd < 0 && inotify_fd >= 0)
+		snapshot->wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+#endif
+
+	uint64_t token = (snapshot->wd >= 0) ? snapshot->generation : (uint64_t)time(NULL);
+
+	mutex_unlock(&mutex);
+	return token;
+}
+
+void DirCache::put(const char *path, uint64_t token, const uint8_t *listing, size_t listing_size, int64_t num_entries)
+{
+	if (max_snapshots == 0)
+		return;
+
+	file_stat_t st;
+	bool watched;
+
+	// Only needed if the directory isn't watched, but not worth holding the mutex for
+	int stat_ret = stat_file(path, &st);
+
+	mutex_lock(&mutex);
+
+	DirSnapshot *snapshot = find(path);
+
+	if (!snapshot)
+	{
+		// Evicted during the scan
+		mutex_unlock(&mutex);
+		return;
+	}
+
+	watched = (snapshot->wd >= 0);
+
+	if (watched)
+	{
+		if (snapshot->generation != token)
+		{
+			mutex_unlock(&mutex);
+			return;
+		}
+	}
+	else
+	{
+		// The mtime can only be trusted if it is older than the scan
+		if (stat_ret < 0 || st.mtime >= token)
+		{
+			mutex_unlock(&mutex);
+			return;
+		}
+
+		snapshot->mtime = st.mtime;
+	}
+
+	uint8_t *copy = (uint8_t *)malloc((listing_size > 0) ? listing_size : 1);
+
+	if (copy)
+	{
+		// An empty directory has no listing
+		if (listing_size > 0)
+			memcpy(copy, listing, listing_size);
+
+		if (snapshot->listing)
+			free(snapshot->listing);
+
+		snapshot->listing = copy;
+		snapshot->listing_size = listing_size;
+		snapshot->num_entries = num_entries;
+		snapshot->scan_time = time(NULL);
+		snapshot->valid = true;
+	}
+
+	mutex_unlock(&mutex);
+}
+
+void DirCache::get_stats(uint64_t *hits, uint64_t *misses)
+{
+	mutex_lock(&mutex);
+	*hits = DirCache::hits;
+	*misses = DirCache::misses;
+	mutex_unlock(&mutex);
+}
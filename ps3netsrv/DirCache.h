@@ -0,0 +1,62 @@
+#ifndef __DIRCACHE_H__
+#define __DIRCACHE_H__
+
+#include "compat.h"
+#include "netiso.h"
+
+#define DIRCACHE_MAX_DIRS	32
+// Seconds a snapshot is trusted when the directory can't be watched (the dir mtime doesn't
+// change when a file inside it is rewritten in place)
+#define DIRCACHE_POLL_TTL	30
+
+typedef struct _DirSnapshot
+{
+	char *path;
+	uint8_t *listing;
+	size_t listing_size;
+	int64_t num_entries;
+	bool valid;
+	int wd;
+	uint32_t generation;
+	uint64_t mtime;
+	time_t scan_time;
+	uint32_t last_use;
+} DirSnapshot;
+
+// Listings of READ_DIR kept in memory as netiso_dir_page_entry records, so the game list refreshes of
+// every console don't readdir and stat the same folders again. On linux a snapshot is dropped as
+// soon as inotify reports a change in its directory; elsewhere (or if the watch can't be added)
+// it is revalidated against the mtime of the directory.
+class DirCache
+{
+private:
+	static mutex_t mutex;
+	static DirSnapshot *snapshots;
+	static int max_snapshots;
+	static int inotify_fd;
+	static uint32_t tick;
+	static uint64_t hits;
+	static uint64_t misses;
+
+	static DirSnapshot *find(const char *path);
+	static void drop(DirSnapshot *snapshot);
+
+	static void *watch_thread(void *arg);
+
+public:
+	// max_dirs is the number of directories kept; 0 disables the cache
+	static int initialize(int max_dirs);
+
+	// Returns the number of entries of the snapshot of path and a copy of its listing in *listing (to be
+	// freed), or -1 if there is no valid snapshot
+	static int64_t get(const char *path, uint8_t **listing, size_t *listing_size);
+
+	// To be called before scanning path. Returns the token to pass to put with the result.
+	static uint64_t prepare(const char *path);
+	// Stores the listing of path, unless the directory changed since prepare returned token
+	static void put(const char *path, uint64_t token, const uint8_t *listing, size_t listing_size, int64_t num_entries);
+
+	static void get_stats(uint64_t *hits, uint64_t *misses);
+};
+
+#endif
@@ -0,0 +1,891 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#endif
+
+#include "common.h"
+#include "DirSize.h"
+
+typedef struct _WalkDir
+{
+	char *path;
+	struct _WalkDir *next;
+} WalkDir;
+
+typedef struct
+{
+	mutex_t mutex;
+	cond_t cond;
+	WalkDir *queue;
+	int pending;
+	int64_t total;
+	bool error;
+} Walk;
+
+mutex_t DirSize::index_mutex;
+mutex_t DirSize::watch_mutex;
+cond_t DirSize::build_cond;
+cond_t DirSize::busy_cond;
+SizeRoot *DirSize::roots = NULL;
+int DirSize::max_roots = 0;
+SizeNode *DirSize::watches[DIRSIZE_HASH_SIZE];
+int DirSize::inotify_fd = -1;
+bool DirSize::watching = false;
+uint32_t DirSize::overflows = 0;
+uint32_t DirSize::handled_overflows = 0;
+char *DirSize::build_path = NULL;
+uint32_t DirSize::tick = 0;
+
+static inline bool is_dot_entry(const char *name)
+{
+	return (name[0] == 0 || (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))));
+}
+
+// Returns the size of the regular files directly inside path and queues its subdirectories
+static int64_t walk_directory(Walk *walk, const char *path)
+{
+	WalkDir *subdirs = NULL;
+	int num_subdirs = 0;
+	int64_t size = 0;
+	size_t path_len = strlen(path);
+	struct dirent *entry;
+	DIR *d;
+
+	d = opendir(path);
+	if (!d)
+		return -1;
+
+	while ((entry = readdir(d)))
+	{
+		file_stat_t st;
+
+		if (is_dot_entry(entry->d_name))
+			continue;
+
+		if (stat_dir_entry(d, path, entry->d_name, &st) < 0)
+		{
+			DPRINTF("get_dir_size: stat failed on %s/%s\n", path, entry->d_name);
+			size = -1;
+			break;
+		}
+
+		if ((st.mode & S_IFDIR) == S_IFDIR)
+		{
+			WalkDir *subdir = (WalkDir *)malloc(sizeof(WalkDir));
+			if (subdir)
+				subdir->path = (char *)malloc(path_len + strlen(entry->d_name) + 2);
+
+			if (!subdir || !subdir->path)
+			{
+				if (subdir)
+					free(subdir);
+
+				size = -1;
+				break;
+			}
+
+			sprintf(subdir->path, "%s/%s", path, entry->d_name);
+			subdir->next = subdirs;
+			subdirs = subdir;
+			num_subdirs++;
+		}
+		else if ((st.mode & S_IFREG) == S_IFREG)
+		{
+			size += st.file_size;
+		}
+	}
+
+	closedir(d);
+
+	if (size < 0)
+	{
+		while (subdirs)
+		{
+			WalkDir *next = subdirs->next;
+
+			free(subdirs->path);
+			free(subdirs);
+			subdirs = next;
+		}
+
+		return -1;
+	}
+
+	if (subdirs)
+	{
+		WalkDir *last = subdirs;
+
+		while (last->next)
+			last = last->next;
+
+		mutex_lock(&walk->mutex);
+		last->next = walk->queue;
+		walk->queue = subdirs;
+		walk->pending += num_subdirs;
+		cond_broadcast(&walk->cond);
+		mutex_unlock(&walk->mutex);
+	}
+
+	return size;
+}
+
+static void *walk_thread(void *arg)
+{
+	Walk *walk = (Walk *)arg;
+
+	mutex_lock(&walk->mutex);
+
+	for (;;)
+	{
+		while (!walk->queue && walk->pending > 0 && !walk->error)
+			cond_wait(&walk->cond, &walk->mutex);
+
+		if (!walk->queue || walk->error)
+			break;
+
+		WalkDir *dir = walk->queue;
+		walk->queue = dir->next;
+		mutex_unlock(&walk->mutex);
+
+		int64_t size = walk_directory(walk, dir->path);
+		free(dir->path);
+		free(dir);
+
+		mutex_lock(&walk->mutex);
+
+		if (size < 0)
+			walk->error = true;
+		else
+			walk->total += size;
+
+		walk->pending--;
+
+		if (walk->pending == 0 || walk->error)
+			cond_broadcast(&walk->cond);
+	}
+
+	mutex_unlock(&walk->mutex);
+	return NULL;
+}
+
+int64_t DirSize::walk(const char *path)
+{
+	thread_t threads[DIRSIZE_WALK_THREADS];
+	int num_threads = 0;
+	Walk walk;
+
+	walk.queue = (WalkDir *)malloc(sizeof(WalkDir));
+	if (!walk.queue)
+		return -1;
+
+	walk.queue->path = strdup(path);
+	walk.queue->next = NULL;
+	walk.pending = 1;
+	walk.total = 0;
+	walk.error = (walk.queue->path == NULL);
+	mutex_init(&walk.mutex);
+	cond_init(&walk.cond);
+
+	for (int i = 1; i < DIRSIZE_WALK_THREADS; i++)
+	{
+		if (create_start_thread(&threads[num_threads], walk_thread, &walk) == 0)
+			num_threads++;
+	}
+
+	walk_thread(&walk);
+
+	for (int i = 0; i < num_threads; i++)
+		join_thread(threads[i]);
+
+	while (walk.queue)
+	{
+		WalkDir *next = walk.queue->next;
+
+		if (walk.queue->path)
+			free(walk.queue->path);
+
+		free(walk.queue);
+		walk.queue = next;
+	}
+
+	cond_destroy(&walk.cond);
+	mutex_destroy(&walk.mutex);
+
+	return (walk.error) ? -1 : walk.total;
+}
+
+#ifdef __linux__
+
+static int compare_nodes(const void *a, const void *b)
+{
+	return strcmp((*(SizeNode **)a)->name, (*(SizeNode **)b)->name);
+}
+
+static int compare_name_node(const void *key, const void *node)
+{
+	return strcmp((const char *)key, (*(SizeNode **)node)->name);
+}
+
+// Whether path is root or is inside it
+static bool is_inside(const char *path, const char *root)
+{
+	size_t root_len = strlen(root);
+
+	if (strncmp(path, root, root_len) != 0)
+		return false;
+
+	return (path[root_len] == 0 || path[root_len] == '/' || root[root_len-1] == '/');
+}
+
+SizeNode *DirSize::new_node(const char *name, SizeNode *parent)
+{
+	SizeNode *node = (SizeNode *)calloc(1, sizeof(SizeNode));
+	if (!node)
+		return NULL;
+
+	node->name = strdup(name);
+	if (!node->name)
+	{
+		free(node);
+		return NULL;
+	}
+
+	node->parent = parent;
+	node->wd = -1;
+	node->dirty = true;
+	node->stale = true;
+	return node;
+}
+
+// Must be called with watch_mutex held
+void DirSize::remove_watch(SizeNode *node)
+{
+	if (node->wd < 0)
+		return;
+
+	bool shared = false;
+	SizeNode **p = &watches[node->wd % DIRSIZE_HASH_SIZE];
+
+	while (*p)
+	{
+		if (*p == node)
+		{
+			*p = node->wd_next;
+			continue;
+		}
+
+		// A directory reached through a symlink too shares the watch
+		if ((*p)->wd == node->wd)
+			shared = true;
+
+		p = &(*p)->wd_next;
+	}
+
+	if (!shared)
+		inotify_rm_watch(inotify_fd, node->wd);
+
+	node->wd = -1;
+}
+
+// Must be called with watch_mutex held
+void DirSize::free_tree(SizeNode *node)
+{
+	SizeNode *child = node->children;
+
+	while (child)
+	{
+		SizeNode *next = child->next;
+
+		free_tree(child);
+		child = next;
+	}
+
+	remove_watch(node);
+	free(node->name);
+	free(node);
+}
+
+// Flags node to be read again and its ancestors to have their totals recomputed. Must be called with watch_mutex held.
+void DirSize::mark(SizeNode *node)
+{
+	node->dirty = true;
+
+	for (SizeNode *p = node; p && !p->stale; p = p->parent)
+		p->stale = true;
+}
+
+// The tree can't be kept up to date
+void DirSize::mark_broken(SizeNode *node)
+{
+	while (node->parent)
+		node = node->parent;
+
+	node->broken = true;
+}
+
+// The watch is added before the directory is read, so a change while reading marks it again
+bool DirSize::add_watch(SizeNode *node, const char *path)
+{
+	int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+
+	if (wd < 0)
+	{
+		// Gone: the event on the parent will remove the node
+		if (errno != ENOENT)
+			mark_broken(node);
+
+		return false;
+	}
+
+	mutex_lock(&watch_mutex);
+	node->wd = wd;
+	node->wd_next = watches[wd % DIRSIZE_HASH_SIZE];
+	watches[wd % DIRSIZE_HASH_SIZE] = node;
+	mutex_unlock(&watch_mutex);
+
+	return true;
+}
+
+// Reads the entries of a directory again: sums its files and matches its subdirectories with the nodes
+void DirSize::rescan(SizeNode *node, char *path, size_t len)
+{
+	SizeNode **sorted = NULL;
+	SizeNode *added = NULL;
+	int num_children = 0;
+	int64_t files_size = 0;
+	struct dirent *entry;
+	DIR *d;
+
+	node->files_size = -1;
+
+	if (node->wd < 0 && !add_watch(node, path))
+		return;
+
+	d = opendir(path);
+	if (!d)
+		return;
+
+	for (SizeNode *child = node->children; child; child = child->next)
+		num_children++;
+
+	if (num_children > 0)
+	{
+		sorted = (SizeNode **)malloc(num_children * sizeof(SizeNode *));
+		if (!sorted)
+		{
+			closedir(d);
+			mark_broken(node);
+			return;
+		}
+
+		num_children = 0;
+
+		for (SizeNode *child = node->children; child; child = child->next)
+		{
+			child->seen = false;
+			sorted[num_children++] = child;
+		}
+
+		qsort(sorted, num_children, sizeof(SizeNode *), compare_nodes);
+	}
+
+	while ((entry = readdir(d)))
+	{
+		file_stat_t st;
+
+		if (is_dot_entry(entry->d_name))
+			continue;
+
+		if (stat_dir_entry(d, path, entry->d_name, &st) < 0)
+		{
+			files_size = -1;
+			break;
+		}
+
+		if ((st.mode & S_IFDIR) == S_IFDIR)
+		{
+			SizeNode **found = (sorted) ? (SizeNode **)bsearch(entry->d_name, sorted, num_children, sizeof(SizeNode *), compare_name_node) : NULL;
+
+			if (found)
+			{
+				(*found)->seen = true;
+			}
+			else
+			{
+				SizeNode *child = new_node(entry->d_name, node);
+				if (!child)
+				{
+					mark_broken(node);
+					files_size = -1;
+					break;
+				}
+
+				child->next = added;
+				added = child;
+			}
+		}
+		else if ((st.mode & S_IFREG) == S_IFREG)
+		{
+			files_size += st.file_size;
+		}
+	}
+
+	closedir(d);
+
+	// Only a complete listing tells which subdirectories are gone
+	if (files_size >= 0)
+	{
+		mutex_lock(&watch_mutex);
+
+		for (SizeNode **p = &node->children; *p; )
+		{
+			SizeNode *child = *p;
+
+			if (!child->seen)
+			{
+				*p = child->next;
+				free_tree(child);
+				continue;
+			}
+
+			p = &child->next;
+		}
+
+		mutex_unlock(&watch_mutex);
+	}
+
+	if (sorted)
+		free(sorted);
+
+	while (added)
+	{
+		SizeNode *next = added->next;
+
+		added->next = node->children;
+		node->children = added;
+		added = next;
+	}
+
+	node->files_size = files_size;
+}
+
+// Brings the totals of the subtree of node up to date, reading again the directories marked as dirty.
+// path holds the path of node (len characters) and has room for the paths of its descendants.
+int64_t DirSize::refresh(SizeNode *node, char *path, size_t len)
+{
+	bool dirty;
+	int64_t total;
+
+	mutex_lock(&watch_mutex);
+	dirty = node->dirty;
+	node->dirty = false;
+	node->stale = false;
+	mutex_unlock(&watch_mutex);
+
+	if (dirty)
+		rescan(node, path, len);
+
+	total = node->files_size;
+
+	for (SizeNode *child = node->children; child; child = child->next)
+	{
+		bool stale;
+		int64_t size;
+
+		mutex_lock(&watch_mutex);
+		stale = child->stale;
+		mutex_unlock(&watch_mutex);
+
+		size = child->total_size;
+
+		if (stale)
+		{
+			size_t name_len = strlen(child->name);
+
+			if (len + name_len + 2 > DIRSIZE_MAX_PATH)
+			{
+				mark_broken(node);
+				size = -1;
+			}
+			else
+			{
+				path[len] = '/';
+				strcpy(path + len + 1, child->name);
+				size = refresh(child, path, len + name_len + 1);
+				path[len] = 0;
+			}
+		}
+
+		if (total >= 0)
+			total = (size < 0) ? -1 : total + size;
+	}
+
+	node->total_size = total;
+	return total;
+}
+
+// Must be called with index_mutex held. Waits for the tree to be refreshed if it is.
+void DirSize::drop_root(SizeRoot *root)
+{
+	while (root->busy)
+		cond_wait(&busy_cond, &index_mutex);
+
+	if (root->node)
+	{
+		mutex_lock(&watch_mutex);
+		free_tree(root->node);
+		mutex_unlock(&watch_mutex);
+	}
+
+	if (root->path)
+		free(root->path);
+
+	memset(root, 0, sizeof(SizeRoot));
+}
+
+// Takes a free slot or the least recently used one. A NULL node records a tree that can't be indexed.
+// Must be called with index_mutex held.
+SizeRoot *DirSize::set_root(char *path, SizeNode *node)
+{
+	SizeRoot *root = &roots[0];
+
+	for (int i = 0; i < max_roots && root->path; i++)
+	{
+		if (!roots[i].path || roots[i].last_use < root->last_use)
+			root = &roots[i];
+	}
+
+	drop_root(root);
+
+	root->path = path;
+	root->node = node;
+	root->fail_time = (node) ? 0 : time(NULL);
+	root->last_use = ++tick;
+	return root;
+}
+
+void *DirSize::watch_thread(void *arg)
+{
+	(void) arg;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;)
+	{
+		ssize_t len = read(inotify_fd, buf, sizeof(buf));
+
+		if (len <= 0)
+		{
+			if (len < 0 && errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		mutex_lock(&watch_mutex);
+
+		for (char *p = buf; p < buf + len; )
+		{
+			struct inotify_event *event = (struct inotify_event *)p;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				overflows++;
+			}
+			else if (event->wd >= 0)
+			{
+				SizeNode **node = &watches[event->wd % DIRSIZE_HASH_SIZE];
+
+				while (*node)
+				{
+					if ((*node)->wd == event->wd)
+					{
+						mark(*node);
+
+						// The kernel dropped the watch; the directory is watched again when it is read
+						if (event->mask & IN_IGNORED)
+						{
+							(*node)->wd = -1;
+							*node = (*node)->wd_next;
+							continue;
+						}
+					}
+
+					node = &(*node)->wd_next;
+				}
+			}
+
+			p += sizeof(struct inotify_event) + event->len;
+		}
+
+		mutex_unlock(&watch_mutex);
+	}
+
+	mutex_lock(&watch_mutex);
+	watching = false;
+	mutex_unlock(&watch_mutex);
+
+	return NULL;
+}
+
+void *DirSize::build_thread(void *arg)
+{
+	(void) arg;
+	char *path = (char *)malloc(DIRSIZE_MAX_PATH);
+
+	if (!path)
+		return NULL;
+
+	for (;;)
+	{
+		uint32_t start_overflows;
+		bool lost;
+
+		mutex_lock(&index_mutex);
+
+		while (!build_path)
+			cond_wait(&build_cond, &index_mutex);
+
+		// Trees inside the new one would share its watches
+		for (int i = 0; i < max_roots; i++)
+		{
+			if (roots[i].path && is_inside(roots[i].path, build_path))
+				drop_root(&roots[i]);
+		}
+
+		strcpy(path, build_path);
+
+		mutex_unlock(&index_mutex);
+
+		mutex_lock(&watch_mutex);
+		start_overflows = overflows;
+		mutex_unlock(&watch_mutex);
+
+		SizeNode *node = new_node(path, NULL);
+
+		if (node)
+			refresh(node, path, strlen(path));
+
+		mutex_lock(&watch_mutex);
+		lost = (overflows != start_overflows || !watching);
+		mutex_unlock(&watch_mutex);
+
+		mutex_lock(&index_mutex);
+
+		if (node && (node->broken || lost))
+		{
+			mutex_lock(&watch_mutex);
+			free_tree(node);
+			mutex_unlock(&watch_mutex);
+			node = NULL;
+		}
+
+		set_root(build_path, node);
+		build_path = NULL;
+
+		mutex_unlock(&index_mutex);
+	}
+
+	return NULL;
+}
+
+int DirSize::initialize(int max_trees)
+{
+	mutex_init(&index_mutex);
+	mutex_init(&watch_mutex);
+	cond_init(&build_cond);
+	cond_init(&busy_cond);
+
+	if (max_trees <= 0)
+		return 0;
+
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0)
+	{
+		printf("inotify not available, directory sizes won't be indexed.\n");
+		return 0;
+	}
+
+	roots = (SizeRoot *)calloc(max_trees, sizeof(SizeRoot));
+	if (!roots)
+		return -1;
+
+	max_roots = max_trees;
+	watching = true;
+
+	thread_t thread;
+
+	if (create_start_thread(&thread, watch_thread, NULL) != 0 || create_start_thread(&thread, build_thread, NULL) != 0)
+		return -1;
+
+	return 0;
+}
+
+int64_t DirSize::get(const char *path)
+{
+	char *buf;
+	size_t len = strlen(path);
+	int64_t result = -1;
+	bool indexed = false;
+	bool lost, active;
+
+	if (max_roots == 0 || len == 0 || len >= DIRSIZE_MAX_PATH)
+		return walk(path);
+
+	buf = (char *)malloc(DIRSIZE_MAX_PATH);
+	if (!buf)
+		return walk(path);
+
+	strcpy(buf, path);
+
+	while (len > 1 && buf[len-1] == '/')
+		buf[--len] = 0;
+
+	mutex_lock(&index_mutex);
+
+	mutex_lock(&watch_mutex);
+	active = watching;
+	lost = (overflows != handled_overflows || !active);
+	handled_overflows = overflows;
+	mutex_unlock(&watch_mutex);
+
+	// Events were lost, nothing indexed can be trusted
+	if (lost)
+	{
+		for (int i = 0; i < max_roots; i++)
+			drop_root(&roots[i]);
+	}
+
+	SizeRoot *root;
+
+	// One thread at a time refreshes a tree, the roots may change while waiting for it
+	for (;;)
+	{
+		root = NULL;
+
+		for (int i = 0; i < max_roots; i++)
+		{
+			if (roots[i].path && is_inside(buf, roots[i].path))
+			{
+				root = &roots[i];
+				break;
+			}
+		}
+
+		if (!root || !root->busy)
+			break;
+
+		cond_wait(&busy_cond, &index_mutex);
+	}
+
+	if (root && !root->node && time(NULL) - root->fail_time >= DIRSIZE_RETRY_TIME)
+	{
+		drop_root(root);
+		root = NULL;
+	}
+
+	if (root && root->node)
+	{
+		SizeNode *node = root->node;
+		char *scratch = (char *)malloc(DIRSIZE_MAX_PATH);
+
+		root->busy = true;
+		root->last_use = ++tick;
+
+		// The directories are read without index_mutex, the sizes of other trees are answered meanwhile
+		mutex_unlock(&index_mutex);
+
+		if (scratch)
+		{
+			strcpy(scratch, root->path);
+			refresh(node, scratch, strlen(scratch));
+			free(scratch);
+		}
+		else
+		{
+			mark_broken(node);
+		}
+
+		if (!node->broken)
+		{
+			// Look for the directory asked for inside the tree
+			char *p = buf + strlen(root->path);
+
+			while (node && *p)
+			{
+				if (*p == '/')
+				{
+					p++;
+					continue;
+				}
+
+				size_t name_len = strcspn(p, "/");
+				SizeNode *child = node->children;
+
+				while (child && (strncmp(child->name, p, name_len) != 0 || child->name[name_len] != 0))
+					child = child->next;
+
+				node = child;
+				p += name_len;
+			}
+
+			result = (node) ? node->total_size : -1;
+			indexed = true;
+		}
+
+		mutex_lock(&index_mutex);
+
+		if (root->node->broken)
+		{
+			mutex_lock(&watch_mutex);
+			free_tree(root->node);
+			mutex_unlock(&watch_mutex);
+			root->node = NULL;
+			root->fail_time = time(NULL);
+		}
+
+		root->busy = false;
+		cond_broadcast(&busy_cond);
+	}
+	else if (!root && !active)
+	{
+		// Nothing can be indexed anymore
+	}
+	else if (!root && !build_path)
+	{
+		build_path = buf;
+		buf = NULL;
+		cond_signal(&build_cond);
+	}
+
+	mutex_unlock(&index_mutex);
+
+	if (buf)
+		free(buf);
+
+	if (!indexed)
+		result = walk(path);
+
+	return result;
+}
+
+#else
+
+int DirSize::initialize(int max_trees)
+{
+	(void) max_trees;
+	return 0;
+}
+
+int64_t DirSize::get(const char *path)
+{
+	return walk(path);
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef __DIRSIZE_H__
+#define __DIRSIZE_H__
+
+#include <time.h>
+
+#include "compat.h"
+
+#define DIRSIZE_WALK_THREADS	8
+#define DIRSIZE_MAX_ROOTS	16
+#define DIRSIZE_HASH_SIZE	4096
+#define DIRSIZE_MAX_PATH	4096
+// Seconds before indexing a tree that couldn't be watched is attempted again
+#define DIRSIZE_RETRY_TIME	300
+
+typedef struct _SizeNode
+{
+	char *name;
+	struct _SizeNode *parent;
+	struct _SizeNode *children;
+	struct _SizeNode *next;
+	struct _SizeNode *wd_next;
+	int64_t files_size;
+	int64_t total_size;
+	int wd;
+	bool dirty;
+	bool stale;
+	bool seen;
+	bool broken;
+} SizeNode;
+
+typedef struct
+{
+	char *path;
+	SizeNode *node;
+	time_t fail_time;
+	uint32_t last_use;
+	bool busy;
+} SizeRoot;
+
+// Answers GET_DIR_SIZE. The trees asked for are indexed in the background: each directory keeps the
+// size of the files directly inside it and the total of its subtree, and inotify marks the
+// directories that change so only those are read again. Until a tree is indexed (and on systems
+// without inotify) the size is computed by walking the tree with several threads.
+class DirSize
+{
+private:
+	// index_mutex protects the roots, and the trees of those not busy. A busy root's tree is being refreshed
+	// by one thread, without the lock. watch_mutex protects the wd table and the dirty/stale flags.
+	static mutex_t index_mutex;
+	static mutex_t watch_mutex;
+	static cond_t build_cond;
+	static cond_t busy_cond;
+	static SizeRoot *roots;
+	static int max_roots;
+	static SizeNode *watches[DIRSIZE_HASH_SIZE];
+	static int inotify_fd;
+	static bool watching;
+	static uint32_t overflows;
+	static uint32_t handled_overflows;
+	static char *build_path;
+	static uint32_t tick;
+
+	static SizeNode *new_node(const char *name, SizeNode *parent);
+	static void free_tree(SizeNode *node);
+	static void mark(SizeNode *node);
+	static void mark_broken(SizeNode *node);
+	static bool add_watch(SizeNode *node, const char *path);
+	static void remove_watch(SizeNode *node);
+	static void rescan(SizeNode *node, char *path, size_t len);
+	static int64_t refresh(SizeNode *node, char *path, size_t len);
+	static void drop_root(SizeRoot *root);
+	static SizeRoot *set_root(char *path, SizeNode *node);
+
+	static void *watch_thread(void *arg);
+	static void *build_thread(void *arg);
+
+public:
+	// max_trees is the number of directory trees kept indexed; 0 always walks the tree
+	static int initialize(int max_trees);
+
+	// Total size of the regular files under path, or -1 if any of them can't be read
+	static int64_t get(const char *path);
+	static int64_t walk(const char *path);
+};
+
+#endif
@@ -1,14 +1,21 @@
 #include "common.h"
 #include "File.h"
+#include "BlockCache.h"
 #include <stdio.h>
 #include <cstring>
 
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
 File::File()
 {
 	fd = INVALID_FD;
 
-	is_multipart = index = 0;
-	for(int i = 0; i < 64; i++) fp[i] = INVALID_FD;
+	is_multipart = 0;
+	position = 0;
+	part_path = NULL;
+	for(int i = 0; i < MAX_FILE_PARTS; i++) fp[i] = INVALID_FD;
+
+	mutex_init(&mutex);
 }
 
 File::~File()
@@ -17,6 +24,8 @@ File::~File()
 
 	if (FD_OK(fd))
 		this->close();
+
+	mutex_destroy(&mutex);
 }
 
 int File::open(const char *path, int flags)
@@ -28,6 +37,9 @@ int File::open(const char *path, int flags)
 	if (!FD_OK(fd))
 		return -1;
 
+	if (get_file_id(fd, &fid[0]) < 0)
+		fid[0] = 0;
+
 	// multi part
 	int flen = strlen(path)-6;
 	if(flen < 0)
@@ -37,57 +49,173 @@ int File::open(const char *path, int flags)
 
 	if(!is_multipart) return 0;
 
-	char *filepath = (char *)malloc(strlen(path)+2); strcpy(filepath, path);
-
 	file_stat_t st;
-	fstat_file(fd, &st); part_size = st.file_size;
+	if (fstat_file(fd, &st) < 0)
+	{
+		this->close();
+		return -1;
+	}
+
+	// The size of every part is needed to place them, but they are opened when they are read
+	part_path_len = flen + 5;
+	part_path = (char *)malloc(part_path_len + 3);
+	if (!part_path)
+	{
+		this->close();
+		return -1;
+	}
 
+	memcpy(part_path, path, part_path_len);
+	part_flags = flags & ~(O_CREAT|O_TRUNC);
+
+	fp[0] = fd;
+	part_starts[0] = 0;
+	part_starts[1] = st.file_size;
 	is_multipart = 1; // count parts
 
-	for(int i = 1; i < 64; i++)
+	for(int i = 1; i < MAX_FILE_PARTS; i++)
 	{
-		filepath[flen+4] = 0; sprintf(filepath, "%s.%i", filepath, i);
+		sprintf(part_path + part_path_len, "%i", i);
 
-		fp[i] = open_file(filepath, flags);
-		if (!FD_OK(fp[i])) break;
+		if (stat_file(part_path, &st) < 0 || (st.mode & S_IFDIR) == S_IFDIR)
+			break;
 
+		part_starts[i+1] = part_starts[i] + st.file_size;
 		is_multipart++;
 	}
 
-	fp[0] = fd; free(filepath);
-
+	position = 0;
 	return 0;
 }
 
 int File::close(void)
 {
 	if(!is_multipart)
-		return close_file(fd);
+	{
+		int ret = close_file(fd); fd = INVALID_FD;
+		return ret;
+	}
 
 	int ret = close_file(fd); fd = INVALID_FD;
 
-	for(int i = 1; i < 64; i++) close_file(fp[i]);
+	for(int i = 1; i < MAX_FILE_PARTS; i++)
+	{
+		if (FD_OK(fp[i]))
+			close_file(fp[i]);
+	}
+
+	is_multipart = 0;
+	position = 0;
+	for(int i = 0; i < MAX_FILE_PARTS; i++) fp[i] = INVALID_FD;
 
-	is_multipart = index = 0;
-	for(int i = 0; i < 64; i++) fp[i] = INVALID_FD;
+	free(part_path);
+	part_path = NULL;
 
 	return ret;
 }
 
+int File::find_part(int64_t offset)
+{
+	// Parts are usually all the size of the first one but the last, which gives the part straight away
+	int i = (part_starts[1] > 0) ? (int)MIN(offset / part_starts[1], (int64_t)is_multipart - 1) : 0;
+
+	if (part_starts[i] <= offset && offset < part_starts[i+1])
+		return i;
+
+	int low = 0, high = is_multipart - 1;
+
+	while (low < high)
+	{
+		int mid = (low + high + 1) / 2;
+
+		if (part_starts[mid] <= offset)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	return low;
+}
+
+file_t File::get_part(int i)
+{
+	// fid[i] is set before the handle is published, a thread that sees the handle sees its id
+	file_t part = __atomic_load_n(&fp[i], __ATOMIC_ACQUIRE);
+
+	if (FD_OK(part))
+		return part;
+
+	mutex_lock(&mutex);
+
+	// Another thread may have opened it meanwhile
+	part = fp[i];
+
+	if (!FD_OK(part))
+	{
+		sprintf(part_path + part_path_len, "%i", i);
+
+		part = open_file(part_path, part_flags);
+		if (FD_OK(part))
+		{
+			if (get_file_id(part, &fid[i]) < 0)
+				fid[i] = 0;
+
+			__atomic_store_n(&fp[i], part, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			DPRINTF("Cannot open part %s\n", part_path);
+		}
+	}
+
+	mutex_unlock(&mutex);
+	return part;
+}
+
 ssize_t File::read(void *buf, size_t nbyte)
 {
 	if(!is_multipart)
 		return read_file(fd, buf, nbyte);
 
-	ssize_t ret2 = 0, ret = read_file(fp[index], buf, nbyte);
+	ssize_t ret = this->pread(buf, nbyte, position);
 
-	if(ret < nbyte && index < (is_multipart-1))
+	if (ret > 0)
+		position += ret;
+
+	return ret;
+}
+
+ssize_t File::pread(void *buf, size_t nbyte, int64_t offset)
+{
+	if(!is_multipart)
+		return BlockCache::pread(fd, fid[0], buf, nbyte, offset);
+
+	if (offset < 0)
+		return -1;
+
+	ssize_t r = 0;
+
+	for(int i = find_part(offset); r < (ssize_t)nbyte && i < is_multipart; i++)
 	{
-		void *buf2 = (int8_t*)buf + ret;
-		ret2 = read_file(fp[index+1], buf2, nbyte - ret);
+		if (offset >= part_starts[i+1])
+			continue;
+
+		int64_t part_offset = offset - part_starts[i];
+		size_t chunk = (size_t)MIN(part_starts[i+1] - offset, (int64_t)(nbyte - r));
+		file_t part = get_part(i);
+
+		if (!FD_OK(part))
+			return (r == 0) ? -1 : r;
+
+		ssize_t ret = BlockCache::pread(part, fid[i], (int8_t*)buf + r, chunk, part_offset);
+		if(ret < 0)
+			return (r == 0) ? ret : r;
+
+		r += ret; offset += ret;
+		if(ret < (ssize_t)chunk) break;
 	}
 
-	return (ret + ret2);
+	return r;
 }
 
 ssize_t File::write(void *buf, size_t nbyte)
@@ -95,7 +223,27 @@ ssize_t File::write(void *buf, size_t nbyte)
 	if(!is_multipart)
 		return write_file(fd, buf, nbyte);
 
-	return write_file(fp[index], buf, nbyte);
+	// Written to the part at the file pointer, the last one grows
+	int i = find_part(position);
+	file_t part = get_part(i);
+
+	if (!FD_OK(part) || seek_file(part, position - part_starts[i], SEEK_SET) < 0)
+		return -1;
+
+	if (i < is_multipart - 1 && (int64_t)nbyte > part_starts[i+1] - position)
+		nbyte = (size_t)(part_starts[i+1] - position);
+
+	ssize_t ret = write_file(part, buf, nbyte);
+
+	if (ret > 0)
+	{
+		position += ret;
+
+		if (i == is_multipart - 1 && position > part_starts[i+1])
+			part_starts[i+1] = position;
+	}
+
+	return ret;
 }
 
 int64_t File::seek(int64_t offset, int whence)
@@ -103,9 +251,22 @@ int64_t File::seek(int64_t offset, int whence)
 	if(!is_multipart)
 		return seek_file(fd, offset, whence);
 
-	index = (int)(offset / part_size);
+	int64_t new_position;
+
+	if (whence == SEEK_SET)
+		new_position = offset;
+	else if (whence == SEEK_CUR)
+		new_position = position + offset;
+	else if (whence == SEEK_END)
+		new_position = part_starts[is_multipart] + offset;
+	else
+		return -1;
 
-	return seek_file(fp[index], (offset % part_size), whence);
+	if (new_position < 0)
+		return -1;
+
+	position = new_position;
+	return position;
 }
 
 int File::fstat(file_stat_t *fs)
@@ -113,15 +274,95 @@ int File::fstat(file_stat_t *fs)
 	if(!is_multipart)
 		return fstat_file(fd, fs);
 
-	int64_t size = 0;
-	file_stat_t statbuf;
+	int ret = fstat_file(fd, fs);
+	fs->file_size = part_starts[is_multipart];
+	return ret;
+}
 
-	for(int i = 0; i < is_multipart; i++)
+int64_t File::sendfile(int s, int64_t offset, int64_t nbyte)
+{
+	// Let the reads go through the shared cache
+	if(BlockCache::is_enabled())
+		return -2;
+
+	if(!is_multipart)
+		return send_file(s, fd, offset, nbyte);
+
+	int64_t sent = 0;
+
+	for(int i = find_part(offset); sent < nbyte && i < is_multipart; i++)
 	{
-		fstat_file(fp[i], &statbuf);
-		size += statbuf.file_size;
+		if (offset >= part_starts[i+1])
+			continue;
+
+		int64_t part_offset = offset - part_starts[i];
+		int64_t chunk = MIN(part_starts[i+1] - offset, nbyte - sent);
+		file_t part = get_part(i);
+
+		if (!FD_OK(part))
+			return (sent == 0) ? -1 : sent;
+
+		int64_t ret = send_file(s, part, part_offset, chunk);
+		if(ret < 0)
+			return (sent == 0) ? ret : -1;
+
+		sent += ret; offset += ret;
+		if(ret < chunk) break;
 	}
 
-	int ret = fstat_file(fd, fs); statbuf.file_size = size; *fs = statbuf;
-	return ret;
+	return sent;
+}
+
+// Adds the holes of a part between start and end, which are offsets in the part, placed at base in the image
+static bool add_holes(file_t fd, int64_t base, int64_t start, int64_t end, zero_run_t *runs, int *num_runs, int max_runs)
+{
+	while (start < end)
+	{
+		int64_t hole_end;
+		int64_t hole = find_hole(fd, start, &hole_end);
+
+		// At the end of the file there is an empty hole
+		if (hole < 0 || hole >= end || hole_end <= hole)
+			break;
+
+		hole_end = MIN(hole_end, end);
+
+		if (!add_zero_run(runs, num_runs, max_runs, base + hole, hole_end - hole))
+			return false;
+
+		start = hole_end;
+	}
+
+	return true;
+}
+
+int File::get_zero_runs(int64_t offset, int64_t nbyte, zero_run_t *runs, int max_runs)
+{
+	int num_runs = 0;
+	int64_t end = offset + nbyte;
+
+	if (offset < 0)
+		return 0;
+
+	if(!is_multipart)
+	{
+		add_holes(fd, 0, offset, end, runs, &num_runs, max_runs);
+		return num_runs;
+	}
+
+	for(int i = find_part(offset); offset < end && i < is_multipart; i++)
+	{
+		if (offset >= part_starts[i+1])
+			continue;
+
+		int64_t part_end = MIN(part_starts[i+1], end);
+		file_t part = get_part(i);
+
+		if (!FD_OK(part) || !add_holes(part, part_starts[i], offset - part_starts[i], part_end - part_starts[i], runs, &num_runs, max_runs))
+			break;
+
+		offset = part_end;
+	}
+
+	return num_runs;
 }
@@ -4,14 +4,31 @@
 #include "AbstractFile.h"
 #include "compat.h"
 
+#define MAX_FILE_PARTS	64
+
+// A file, or a multipart image (X.iso.0 to X.iso.63) seen as a single file. The parts may have any
+// size: their positions in the image are kept in a table, and reads span as many parts as needed.
+// Parts other than the first are only opened when they are read.
 class File :  public AbstractFile
 {
 protected:
 	file_t fd;
-	file_t fp[64];
+	file_t fp[MAX_FILE_PARTS];
+	uint64_t fid[MAX_FILE_PARTS];
 	int8_t is_multipart;
-	int64_t part_size;
-	int8_t index;
+	// Position of each part in the image, plus the end of the last one
+	int64_t part_starts[MAX_FILE_PARTS+1];
+	int64_t position;
+
+	// Name of the parts up to their number, and flags they are opened with
+	char *part_path;
+	size_t part_path_len;
+	int part_flags;
+	mutex_t mutex;
+
+	int find_part(int64_t offset);
+	file_t get_part(int i);
+
 public:
 	File();
 	~File();
@@ -19,9 +36,12 @@ public:
 	virtual int open(const char *path, int flags);
 	virtual int close(void);
 	virtual ssize_t read(void *buf, size_t nbyte);
+	virtual ssize_t pread(void *buf, size_t nbyte, int64_t offset);
 	virtual ssize_t write(void *buf, size_t nbyte);
 	virtual int64_t seek(int64_t offset, int whence);
 	virtual int fstat(file_stat_t *fs);
+	virtual int64_t sendfile(int s, int64_t offset, int64_t nbyte);
+	virtual int get_zero_runs(int64_t offset, int64_t nbyte, zero_run_t *runs, int max_runs);
 };
 
 #endif
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "GameInfo.h"
+#include "File.h"
+#include "CsoFile.h"
+#include "DedupFile.h"
+#include "iso9660.h"
+
+#define SECTOR_SIZE	2048
+// Offset of the identifier in a directory record
+#define RECORD_FI_OFFSET	33
+
+mutex_t GameInfo::mutex;
+GameInfoEntry *GameInfo::games = NULL;
+int GameInfo::max_games = 0;
+int64_t GameInfo::memory_size = 0;
+int64_t GameInfo::max_memory_size = 0;
+uint32_t GameInfo::tick = 0;
+
+int GameInfo::initialize(int max_size)
+{
+	mutex_init(&mutex);
+
+	if (max_size <= 0)
+		return 0;
+
+	games = (GameInfoEntry *)calloc(GAMEINFO_MAX_GAMES, sizeof(GameInfoEntry));
+	if (!games)
+		return -1;
+
+	max_games = GAMEINFO_MAX_GAMES;
+	max_memory_size = (int64_t)max_size * 1048576;
+	return 0;
+}
+
+// Frees a slot. Must be called with the mutex held.
+void GameInfo::drop(GameInfoEntry *game)
+{
+	if (game->path)
+		free(game->path);
+
+	if (game->data)
+	{
+		free(game->data);
+		memory_size -= game->sfo_size + game->icon_size;
+	}
+
+	memset(game, 0, sizeof(GameInfoEntry));
+}
+
+int64_t GameInfo::read_whole_file(const char *path, uint8_t **data, int64_t max_size)
+{
+	file_t fd = open_file(path, O_RDONLY);
+	file_stat_t st;
+
+	*data = NULL;
+
+	if (!FD_OK(fd))
+		return -1;
+
+	if (fstat_file(fd, &st) < 0 || (int64_t)st.file_size > max_size)
+	{
+		close_file(fd);
+		return -1;
+	}
+
+	*data = (uint8_t *)malloc((st.file_size > 0) ? st.file_size : 1);
+
+	if (!*data || read_file(fd, *data, st.file_size) != (ssize_t)st.file_size)
+	{
+		close_file(fd);
+		free(*data);
+		*data = NULL;
+		return -1;
+	}
+
+	close_file(fd);
+	return st.file_size;
+}
+
+// ISO9660 names are compared without case and without their version (";1")
+static bool same_name(const char *fi, int len_fi, const char *name)
+{
+	int len = strlen(name);
+
+	if (len_fi >= 2 && fi[len_fi-2] == ';')
+		len_fi -= 2;
+
+	return (len_fi == len && strncasecmp(fi, name, len) == 0);
+}
+
+// Looks for name in the directory at lba, of size bytes
+static int find_record(AbstractFile *file, uint32_t lba, uint32_t size, const char *name, uint32_t *file_lba, uint32_t *file_size)
+{
+	int ret = -1;
+
+	if (size > GAMEINFO_MAX_DIR_SIZE)
+		return -1;
+
+	uint8_t *dir = (uint8_t *)malloc((size > 0) ? size : 1);
+	if (!dir)
+		return -1;
+
+	if (file->pread(dir, size, (int64_t)lba * SECTOR_SIZE) == (ssize_t)size)
+	{
+		uint32_t pos = 0;
+
+		while (pos + RECORD_FI_OFFSET < size)
+		{
+			Iso9660DirectoryRecord *record = (Iso9660DirectoryRecord *)(dir + pos);
+
+			// Records don't cross sectors, the rest of a sector is padded with zeros
+			if (record->len_dr == 0)
+			{
+				pos = (pos / SECTOR_SIZE + 1) * SECTOR_SIZE;
+				continue;
+			}
+
+			if (record->len_dr < RECORD_FI_OFFSET || pos + record->len_dr > size || RECORD_FI_OFFSET + record->len_fi > record->len_dr)
+				break;
+
+			if (same_name(&record->fi, record->len_fi, name))
+			{
+				*file_lba = LE32(record->lsbStart);
+				*file_size = LE32(record->lsbDataLength);
+				ret = 0;
+				break;
+			}
+
+			pos += record->len_dr;
+		}
+	}
+
+	free(dir);
+	return ret;
+}
+
+int GameInfo::read_image(const char *path, uint8_t **data, uint32_t *sfo_size, uint32_t *icon_size)
+{
+	AbstractFile *file;
+	Iso9660PVD pvd;
+	uint32_t game_lba, game_size, sfo_lba, icon_lba;
+	int ret = -1;
+
+	if (CsoFile::is_compressed(path))
+		file = new CsoFile();
+	else if (DedupFile::is_manifest(path))
+		file = new DedupFile();
+	else
+		file = new File();
+
+	*data = NULL;
+
+	if (file->open(path, O_RDONLY) < 0)
+	{
+		delete file;
+		return -1;
+	}
+
+	if (file->pread(&pvd, sizeof(pvd), 16 * SECTOR_SIZE) != sizeof(pvd) || pvd.VDType != 1 || memcmp(pvd.VSStdId, "CD001", 5) != 0)
+		goto done;
+
+	{
+		Iso9660DirectoryRecord *root = (Iso9660DirectoryRecord *)pvd.rootDirectoryRecord;
+
+		if (find_record(file, LE32(root->lsbStart), LE32(root->lsbDataLength), "PS3_GAME", &game_lba, &game_size) != 0 ||
+			find_record(file, game_lba, game_size, "PARAM.SFO", &sfo_lba, sfo_size) != 0 || *sfo_size > GAMEINFO_MAX_SFO_SIZE)
+			goto done;
+	}
+
+	if (find_record(file, game_lba, game_size, "ICON0.PNG", &icon_lba, icon_size) != 0 || *icon_size > GAMEINFO_MAX_ICON_SIZE)
+		*icon_size = 0;
+
+	*data = (uint8_t *)malloc(*sfo_size + *icon_size + 1);
+	if (!*data)
+		goto done;
+
+	if (file->pread(*data, *sfo_size, (int64_t)sfo_lba * SECTOR_SIZE) != (ssize_t)*sfo_size)
+		goto done;
+
+	if (*icon_size > 0 && file->pread(*data + *sfo_size, *icon_size, (int64_t)icon_lba * SECTOR_SIZE) != (ssize_t)*icon_size)
+		*icon_size = 0;
+
+	ret = 0;
+
+done:
+	if (ret != 0 && *data)
+	{
+		free(*data);
+		*data = NULL;
+	}
+
+	file->close();
+	delete file;
+	return ret;
+}
+
+int GameInfo::read_folder(const char *path, uint8_t **data, uint32_t *sfo_size, uint32_t *icon_size)
+{
+	char *file_path = (char *)malloc(strlen(path) + sizeof("/PS3_GAME/PARAM.SFO"));
+	uint8_t *sfo, *icon;
+	int64_t size;
+
+	*data = NULL;
+
+	if (!file_path)
+		return -1;
+
+	sprintf(file_path, "%s/PS3_GAME/PARAM.SFO", path);
+	size = read_whole_file(file_path, &sfo, GAMEINFO_MAX_SFO_SIZE);
+
+	if (size < 0)
+	{
+		free(file_path);
+		return -1;
+	}
+
+	*sfo_size = (uint32_t)size;
+
+	sprintf(file_path, "%s/PS3_GAME/ICON0.PNG", path);
+	size = read_whole_file(file_path, &icon, GAMEINFO_MAX_ICON_SIZE);
+	*icon_size = (size > 0) ? (uint32_t)size : 0;
+
+	free(file_path);
+
+	uint8_t *grown = (uint8_t *)realloc(sfo, *sfo_size + *icon_size + 1);
+	if (!grown)
+	{
+		free(sfo);
+		free(icon);
+		return -1;
+	}
+
+	if (*icon_size > 0)
+		memcpy(grown + *sfo_size, icon, *icon_size);
+
+	free(icon);
+	*data = grown;
+	return 0;
+}
+
+// Copies what fits of the PARAM.SFO and icon of a game
+static int copy_game(const uint8_t *data, uint32_t sfo_size, uint32_t icon_size, uint8_t *buf, uint32_t size, bool want_icon, uint32_t *copied_sfo_size, uint32_t *copied_icon_size)
+{
+	int ret = 0;
+
+	*copied_sfo_size = 0;
+	*copied_icon_size = 0;
+
+	if (sfo_size <= size)
+	{
+		memcpy(buf, data, sfo_size);
+		*copied_sfo_size = sfo_size;
+	}
+	else
+	{
+		ret = 1;
+	}
+
+	if (want_icon && icon_size > 0)
+	{
+		if (*copied_sfo_size + icon_size <= size)
+		{
+			memcpy(buf + *copied_sfo_size, data + sfo_size, icon_size);
+			*copied_icon_size = icon_size;
+		}
+		else
+		{
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+int GameInfo::get(const char *path, uint8_t *buf, uint32_t size, bool want_icon, uint32_t *sfo_size, uint32_t *icon_size)
+{
+	file_stat_t st;
+	bool is_folder;
+
+	if (stat_file(path, &st) < 0)
+		return -1;
+
+	is_folder = ((st.mode & S_IFDIR) == S_IFDIR);
+
+	// A folder is checked by its PARAM.SFO
+	if (is_folder)
+	{
+		char *sfo_path = (char *)malloc(strlen(path) + sizeof("/PS3_GAME/PARAM.SFO"));
+
+		if (!sfo_path)
+			return -1;
+
+		sprintf(sfo_path, "%s/PS3_GAME/PARAM.SFO", path);
+		int ret = stat_file(sfo_path, &st);
+		free(sfo_path);
+
+		if (ret < 0)
+			return -1;
+	}
+
+	mutex_lock(&mutex);
+
+	for (int i = 0; i < max_games; i++)
+	{
+		GameInfoEntry *game = &games[i];
+
+		if (game->path && game->file_size == st.file_size && game->mtime == st.mtime && strcmp(game->path, path) == 0)
+		{
+			game->last_use = ++tick;
+
+			int ret = copy_game(game->data, game->sfo_size, game->icon_size, buf, size, want_icon, sfo_size, icon_size);
+
+			mutex_unlock(&mutex);
+			return ret;
+		}
+	}
+
+	mutex_unlock(&mutex);
+
+	uint8_t *data;
+	uint32_t data_sfo_size, data_icon_size;
+
+	if (((is_folder) ? read_folder(path, &data, &data_sfo_size, &data_icon_size) : read_image(path, &data, &data_sfo_size, &data_icon_size)) != 0)
+		return -1;
+
+	// Only PARAM.SFO files are taken
+	if (data_sfo_size < 4 || memcmp(data, "\0PSF", 4) != 0)
+	{
+		free(data);
+		return -1;
+	}
+
+	int ret = copy_game(data, data_sfo_size, data_icon_size, buf, size, want_icon, sfo_size, icon_size);
+	int64_t data_size = data_sfo_size + data_icon_size;
+
+	mutex_lock(&mutex);
+
+	if (max_games > 0 && data_size <= max_memory_size)
+	{
+		GameInfoEntry *slot = NULL;
+
+		// Replaces the entry of an older version of the game, or the one used least recently
+		for (int i = 0; i < max_games; i++)
+		{
+			if (games[i].path && strcmp(games[i].path, path) == 0)
+			{
+				slot = &games[i];
+				break;
+			}
+
+			if (!slot || (slot->path && (!games[i].path || games[i].last_use < slot->last_use)))
+				slot = &games[i];
+		}
+
+		drop(slot);
+
+		while (memory_size + data_size > max_memory_size)
+		{
+			GameInfoEntry *oldest = NULL;
+
+			for (int i = 0; i < max_games; i++)
+			{
+				if (games[i].path && (!oldest || games[i].last_use < oldest->last_use))
+					oldest = &games[i];
+			}
+
+			drop(oldest);
+		}
+
+		slot->path = strdup(path);
+
+		if (slot->path)
+		{
+			slot->file_size = st.file_size;
+			slot->mtime = st.mtime;
+			slot->data = data;
+			slot->sfo_size = data_sfo_size;
+			slot->icon_size = data_icon_size;
+			slot->last_use = ++tick;
+			memory_size += data_size;
+			data = NULL;
+		}
+	}
+
+	mutex_unlock(&mutex);
+
+	if (data)
+		free(data);
+
+	return ret;
+}
@@ -0,0 +1,57 @@
+#ifndef __GAMEINFO_H__
+#define __GAMEINFO_H__
+
+#include "AbstractFile.h"
+#include "compat.h"
+
+#define GAMEINFO_MAX_GAMES	1024
+// Default memory of the cache in MB
+#define GAMEINFO_CACHE_SIZE	16
+#define GAMEINFO_MAX_SFO_SIZE	(64*1024)
+#define GAMEINFO_MAX_ICON_SIZE	(1024*1024)
+// Directories of an image bigger than this aren't searched
+#define GAMEINFO_MAX_DIR_SIZE	(256*1024)
+
+typedef struct _GameInfoEntry
+{
+	char *path;
+	uint64_t file_size;
+	uint64_t mtime;
+	// The PARAM.SFO followed by the ICON0.PNG
+	uint8_t *data;
+	uint32_t sfo_size;
+	uint32_t icon_size;
+	uint32_t last_use;
+} GameInfoEntry;
+
+// PARAM.SFO and ICON0.PNG of PS3 games for GET_GAME_INFO, read from the ISO9660 filesystem of an image
+// (compressed or not) or from the PS3_GAME folder of a JB game. They are kept in memory while the size
+// and mtime of the image, or of the PARAM.SFO of a folder, don't change.
+class GameInfo
+{
+private:
+	static mutex_t mutex;
+	static GameInfoEntry *games;
+	static int max_games;
+	static int64_t memory_size;
+	static int64_t max_memory_size;
+	static uint32_t tick;
+
+	static void drop(GameInfoEntry *game);
+	static int read_image(const char *path, uint8_t **data, uint32_t *sfo_size, uint32_t *icon_size);
+	static int read_folder(const char *path, uint8_t **data, uint32_t *sfo_size, uint32_t *icon_size);
+
+public:
+	// max_size is the memory of the cache in MB; 0 disables it
+	static int initialize(int max_size);
+
+	// Copies the PARAM.SFO of the game at path (an image or a JB folder) to buf, followed by its ICON0.PNG
+	// if want_icon is set, as long as they fit in size bytes. Returns -1 if path isn't a PS3 game, 1 if
+	// something didn't fit, 0 otherwise.
+	static int get(const char *path, uint8_t *buf, uint32_t size, bool want_icon, uint32_t *sfo_size, uint32_t *icon_size);
+
+	// Reads a whole file of at most max_size bytes to a new buffer. Returns its size, or -1.
+	static int64_t read_whole_file(const char *path, uint8_t **data, int64_t max_size);
+};
+
+#endif
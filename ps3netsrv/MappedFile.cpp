@@ -0,0 +1,285 @@
+#ifndef WIN32
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "MappedFile.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+// Set while a thread copies from a mapping, to get back from a SIGBUS
+static __thread sigjmp_buf *fault_jump = NULL;
+
+static void sigbus_handler(int sig)
+{
+	if (fault_jump)
+		siglongjmp(*fault_jump, 1);
+
+	// Not a read of a mapped image: what SIGBUS does by default
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+int MappedFile::initialize(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigbus_handler;
+	sigemptyset(&sa.sa_mask);
+
+	return sigaction(SIGBUS, &sa, NULL);
+}
+
+MappedFile::MappedFile()
+{
+	num_maps = 0;
+	total_size = 0;
+	next_offset = -1;
+	advised_end = 0;
+	sequential = 0;
+	truncated = false;
+
+	mutex_init(&mutex);
+}
+
+MappedFile::~MappedFile()
+{
+	unmap();
+	mutex_destroy(&mutex);
+}
+
+int MappedFile::open(const char *path, int flags)
+{
+	unmap();
+
+	if (File::open(path, flags) < 0)
+		return -1;
+
+	// Only images being read are mapped
+	if ((flags & (O_WRONLY|O_RDWR)) != 0)
+		return 0;
+
+	int parts = (is_multipart) ? is_multipart : 1;
+
+	for (int i = 0; i < parts; i++)
+	{
+		file_t part = (is_multipart) ? get_part(i) : fd;
+		file_stat_t st;
+
+		if (fstat_file(part, &st) < 0 || st.file_size < 0 || (uint64_t)st.file_size > (size_t)-1)
+			break;
+
+		// Empty parts have nothing to map
+		void *map = NULL;
+
+		if (st.file_size > 0)
+		{
+			map = mmap(NULL, (size_t)st.file_size, PROT_READ, MAP_SHARED, part, 0);
+			if (map == MAP_FAILED)
+				break;
+		}
+
+		maps[i] = (uint8_t *)map;
+		map_sizes[i] = st.file_size;
+		total_size += st.file_size;
+		num_maps++;
+	}
+
+	if (num_maps != parts)
+	{
+		DPRINTF("%s can't be mapped, reading it instead\n", path);
+		unmap();
+	}
+
+	next_offset = -1;
+	advised_end = 0;
+	sequential = 0;
+	truncated = false;
+	return 0;
+}
+
+void MappedFile::unmap(void)
+{
+	for (int i = 0; i < num_maps; i++)
+	{
+		if (maps[i])
+			munmap(maps[i], (size_t)map_sizes[i]);
+	}
+
+	num_maps = 0;
+	total_size = 0;
+}
+
+int MappedFile::close(void)
+{
+	unmap();
+	return File::close();
+}
+
+void MappedFile::advise_range(int64_t offset, int64_t nbyte, int advice)
+{
+	static int64_t page_size = sysconf(_SC_PAGESIZE);
+
+	for (int i = 0; i < num_maps && nbyte > 0; i++)
+	{
+		if (offset >= map_sizes[i])
+		{
+			offset -= map_sizes[i];
+			continue;
+		}
+
+		// madvise takes whole pages
+		int64_t start = offset & ~(page_size - 1);
+		int64_t end = MIN(offset + nbyte, map_sizes[i]);
+
+		madvise(maps[i] + start, (size_t)(end - start), advice);
+
+		nbyte -= end - offset;
+		offset = 0;
+	}
+}
+
+void MappedFile::access(int64_t offset, int64_t nbyte)
+{
+	mutex_lock(&mutex);
+
+	if (offset == next_offset)
+	{
+		if (++sequential == MMAP_SEQUENTIAL_READS)
+		{
+			// Aggressive read-ahead, and pages behind the stream are dropped first
+			advise_range(0, total_size, MADV_SEQUENTIAL);
+			advised_end = offset;
+		}
+
+		// The window is advised again once half of it was consumed
+		if (sequential >= MMAP_SEQUENTIAL_READS && advised_end < total_size && advised_end - (offset + nbyte) < MMAP_WILLNEED_SIZE / 2)
+		{
+			int64_t start = (advised_end > offset + nbyte) ? advised_end : offset + nbyte;
+			int64_t end = MIN(offset + nbyte + MMAP_WILLNEED_SIZE, total_size);
+
+			if (end > start)
+				advise_range(start, end - start, MADV_WILLNEED);
+
+			advised_end = end;
+		}
+	}
+	else
+	{
+		// Back to the default read-ahead once the stream is left
+		if (sequential >= MMAP_SEQUENTIAL_READS)
+			advise_range(0, total_size, MADV_NORMAL);
+
+		sequential = 0;
+		advised_end = 0;
+	}
+
+	next_offset = offset + nbyte;
+	mutex_unlock(&mutex);
+}
+
+ssize_t MappedFile::pread(void *buf, size_t nbyte, int64_t offset)
+{
+	if (num_maps == 0 || truncated)
+		return File::pread(buf, nbyte, offset);
+
+	if (offset < 0)
+		return -1;
+
+	access(offset, nbyte);
+
+	const int64_t start = offset;
+	sigjmp_buf jump;
+
+	// The file got shorter than its mapping: what is left of it is read instead
+	if (sigsetjmp(jump, 1) != 0)
+	{
+		fault_jump = NULL;
+		truncated = true;
+		DPRINTF("Mapped file truncated, reading it instead\n");
+		return File::pread(buf, nbyte, start);
+	}
+
+	fault_jump = &jump;
+
+	uint8_t *p = (uint8_t *)buf;
+	ssize_t r = 0;
+
+	for (int i = 0; i < num_maps && r < (ssize_t)nbyte; i++)
+	{
+		if (offset >= map_sizes[i])
+		{
+			offset -= map_sizes[i];
+			continue;
+		}
+
+		size_t n = (size_t)MIN(map_sizes[i] - offset, (int64_t)(nbyte - r));
+
+		memcpy(p + r, maps[i] + offset, n);
+		r += n;
+		offset = 0;
+	}
+
+	fault_jump = NULL;
+	return r;
+}
+
+int64_t MappedFile::sendfile(int s, int64_t offset, int64_t nbyte)
+{
+	if (num_maps == 0 || truncated)
+		return File::sendfile(s, offset, nbyte);
+
+	if (offset < 0)
+		return -1;
+
+	access(offset, nbyte);
+
+	const int64_t start = offset;
+	int64_t sent = 0;
+
+	for (int i = 0; i < num_maps && sent < nbyte; i++)
+	{
+		if (offset >= map_sizes[i])
+		{
+			offset -= map_sizes[i];
+			continue;
+		}
+
+		int64_t end = MIN(map_sizes[i], offset + (nbyte - sent));
+
+		// The socket copies from the mapped pages, there is no buffer in between
+		while (offset < end)
+		{
+			int ret = send(s, (char *)maps[i] + offset, (int)MIN(end - offset, 0x40000000LL), 0);
+			if (ret <= 0)
+			{
+				// The kernel reports the missing pages of a truncated file instead of raising SIGBUS
+				if (ret < 0 && errno == EFAULT)
+				{
+					truncated = true;
+					DPRINTF("Mapped file truncated, reading it instead\n");
+
+					if (sent == 0)
+						return File::sendfile(s, start, nbyte);
+				}
+
+				return -1;
+			}
+
+			offset += ret;
+			sent += ret;
+		}
+
+		offset = 0;
+	}
+
+	return sent;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __MAPPEDFILE_H__
+#define __MAPPEDFILE_H__
+
+#include "File.h"
+#include "compat.h"
+
+#ifndef WIN32
+
+// Prefetched ahead of a sequential stream, in steps of half this size
+#define MMAP_WILLNEED_SIZE	(8*1048576)
+// Reads in a row at the position the previous one ended before the stream is seen as sequential
+#define MMAP_SEQUENTIAL_READS	2
+
+// A File whose parts are mapped in memory. Reads are copied from the mapped pages and sends go from
+// them straight to the socket, with no read() into a buffer. The kernel is told how the file is read
+// (madvise): a sequential stream gets the window after it prefetched. The block cache is not used,
+// the page cache does its job. If a part can't be mapped (no address space left on 32 bits) the file
+// is read as a plain File. Reading the pages of an image truncated while it is mapped raises SIGBUS:
+// the handler set by initialize() brings the read back, and the file is read as a plain File from then.
+// A send already under way when that happens fails.
+class MappedFile : public File
+{
+private:
+	uint8_t *maps[64];
+	int64_t map_sizes[64];
+	int num_maps;
+	int64_t total_size;
+
+	mutex_t mutex;
+	int64_t next_offset;
+	int64_t advised_end;
+	int sequential;
+	volatile bool truncated;
+
+	void unmap(void);
+	void advise_range(int64_t offset, int64_t nbyte, int advice);
+	void access(int64_t offset, int64_t nbyte);
+
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Installs the SIGBUS handler, once before any file is mapped
+	static int initialize(void);
+
+	virtual int open(const char *path, int flags);
+	virtual int close(void);
+	virtual ssize_t pread(void *buf, size_t nbyte, int64_t offset);
+	virtual int64_t sendfile(int s, int64_t offset, int64_t nbyte);
+
+	bool is_mapped(void) { return num_maps > 0; }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "Pipeline.h"
+#include "Stats.h"
+
+static mutex_t queue_mutex;
+static cond_t queue_cond;
+static PipelineRequest *queue_head = NULL;
+static PipelineRequest *queue_tail = NULL;
+
+Pipeline::Pipeline(int s, int client_id)
+{
+	this->s = s;
+	this->client_id = client_id;
+
+	memset(requests, 0, sizeof(requests));
+	free_list = NULL;
+
+	for (int i = PIPELINE_DEPTH-1; i >= 0; i--)
+	{
+		requests[i].owner = this;
+		requests[i].next = free_list;
+		free_list = &requests[i];
+	}
+
+	done_head = done_tail = NULL;
+	pending = 0;
+	error = 0;
+	sending = false;
+
+	mutex_init(&mutex);
+	cond_init(&cond);
+}
+
+Pipeline::~Pipeline()
+{
+	wait();
+
+	for (int i = 0; i < PIPELINE_DEPTH; i++)
+	{
+		if (requests[i].buf)
+			free(requests[i].buf);
+	}
+
+	cond_destroy(&cond);
+	mutex_destroy(&mutex);
+}
+
+int Pipeline::submit(AbstractFile *file, uint16_t tag, uint32_t size, int64_t offset)
+{
+	PipelineRequest *req;
+
+	mutex_lock(&mutex);
+
+	while (!free_list && !error)
+		cond_wait(&cond, &mutex);
+
+	if (error)
+	{
+		mutex_unlock(&mutex);
+		return -1;
+	}
+
+	req = free_list;
+	free_list = req->next;
+	pending++;
+
+	mutex_unlock(&mutex);
+
+	if (!req->buf)
+	{
+		req->buf = (uint8_t *)malloc(sizeof(netiso_read_file_tagged_result) + PIPELINE_MAX_READ);
+	}
+
+	// Requests that can't be served are still answered, with an error
+	req->file = (req->buf && size <= PIPELINE_MAX_READ) ? file : NULL;
+	req->tag = tag;
+	req->size = size;
+	req->offset = offset;
+	req->submit_time = (Stats::is_enabled()) ? get_time_usec() : 0;
+	req->next = NULL;
+
+	mutex_lock(&queue_mutex);
+
+	if (queue_tail)
+		queue_tail->next = req;
+	else
+		queue_head = req;
+
+	queue_tail = req;
+
+	cond_signal(&queue_cond);
+	mutex_unlock(&queue_mutex);
+
+	return 0;
+}
+
+int Pipeline::wait(void)
+{
+	mutex_lock(&mutex);
+
+	while (pending > 0)
+		cond_wait(&cond, &mutex);
+
+	int ret = (error) ? -1 : 0;
+	mutex_unlock(&mutex);
+
+	return ret;
+}
+
+int Pipeline::send_result(PipelineRequest *req)
+{
+	netiso_read_file_tagged_result result;
+	int len = sizeof(result);
+
+	result.tag = BE16(req->tag);
+	result.pad = 0;
+	result.bytes_read = (int32_t)BE32(req->bytes_read);
+
+	if (!req->buf)
+		return (send(s, (char *)&result, len, 0) == len);
+
+	memcpy(req->buf, &result, sizeof(result));
+
+	if (req->bytes_read > 0)
+		len += req->bytes_read;
+
+	return (send(s, (char *)req->buf, len, 0) == len);
+}
+
+// Queues the result of a read. The thread that finds no other sending for the client sends the queue.
+void Pipeline::complete(PipelineRequest *req)
+{
+	mutex_lock(&mutex);
+
+	req->next = NULL;
+
+	if (done_tail)
+		done_tail->next = req;
+	else
+		done_head = req;
+
+	done_tail = req;
+
+	if (sending)
+	{
+		mutex_unlock(&mutex);
+		return;
+	}
+
+	sending = true;
+
+	while ((req = done_head))
+	{
+		done_head = req->next;
+		if (!done_head)
+			done_tail = NULL;
+
+		// After a failed send the connection is dropped, the results left aren't sent
+		int send_ok = !error;
+
+		mutex_unlock(&mutex);
+
+		if (send_ok)
+		{
+			send_ok = send_result(req);
+
+			if (!send_ok)
+			{
+				DPRINTF("send failed on tagged read %d\n", req->tag);
+			}
+		}
+
+		// The latency of a tagged read is counted until its result is sent
+		if (Stats::is_enabled())
+		{
+			Stats::command_done(client_id, NETISO_CMD_READ_FILE_TAGGED, get_time_usec() - req->submit_time, !send_ok || req->bytes_read < 0);
+
+			if (send_ok && req->bytes_read > 0)
+				Stats::add_sent(client_id, req->bytes_read);
+		}
+
+		mutex_lock(&mutex);
+
+		if (!send_ok)
+			error = 1;
+
+		req->next = free_list;
+		free_list = req;
+		pending--;
+
+		cond_broadcast(&cond);
+	}
+
+	sending = false;
+	mutex_unlock(&mutex);
+}
+
+void *Pipeline::io_thread(void *arg)
+{
+	(void) arg;
+
+	for (;;)
+	{
+		PipelineRequest *req;
+
+		mutex_lock(&queue_mutex);
+
+		while (!queue_head)
+			cond_wait(&queue_cond, &queue_mutex);
+
+		req = queue_head;
+		queue_head = req->next;
+		if (!queue_head)
+			queue_tail = NULL;
+
+		mutex_unlock(&queue_mutex);
+
+		req->bytes_read = -1;
+
+		if (req->file)
+		{
+			req->bytes_read = req->file->pread(req->buf + sizeof(netiso_read_file_tagged_result), req->size, req->offset);
+			if (req->bytes_read < 0)
+			{
+				DPRINTF("read_file failed on tagged read %d\n", req->tag);
+				req->bytes_read = -1;
+			}
+		}
+
+		// The owner can't go away while the request is pending
+		req->owner->complete(req);
+	}
+
+	return NULL;
+}
+
+int Pipeline::initialize(int num_threads)
+{
+	mutex_init(&queue_mutex);
+	cond_init(&queue_cond);
+
+	for (int i = 0; i < num_threads; i++)
+	{
+		thread_t thread;
+
+		if (create_start_thread(&thread, io_thread, NULL) != 0)
+			return -1;
+	}
+
+	return 0;
+}
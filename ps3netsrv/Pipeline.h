@@ -0,0 +1,68 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "AbstractFile.h"
+#include "compat.h"
+#include "netiso.h"
+
+#define PIPELINE_DEPTH	8
+#define PIPELINE_MAX_READ	(512*1024)
+
+class Pipeline;
+
+typedef struct _PipelineRequest
+{
+	Pipeline *owner;
+	AbstractFile *file;
+	uint8_t *buf; // result header followed by the data
+	int64_t offset;
+	uint32_t size;
+	int32_t bytes_read;
+	uint16_t tag;
+	uint64_t submit_time;
+	struct _PipelineRequest *next;
+} PipelineRequest;
+
+// Tagged reads of a client that negotiated NETISO_FEATURE_PIPELINE. The worker thread submits the
+// commands as they arrive; I/O threads read them concurrently and queue the results in completion
+// order. One I/O thread at a time sends the results of a client, the others go on reading for
+// everyone, so a client that doesn't read its results holds one thread until the send times out
+// (the sockets of the clients have a send timeout).
+class Pipeline
+{
+private:
+	int s;
+	int client_id;
+
+	mutex_t mutex;
+	cond_t cond;
+
+	PipelineRequest requests[PIPELINE_DEPTH];
+	PipelineRequest *free_list;
+	PipelineRequest *done_head;
+	PipelineRequest *done_tail;
+	int pending;
+	int error;
+	bool sending;
+
+	int send_result(PipelineRequest *req);
+	void complete(PipelineRequest *req);
+
+	static void *io_thread(void *arg);
+
+public:
+	// client_id is the slot of the client in the stats
+	Pipeline(int s, int client_id);
+	~Pipeline();
+
+	// Queues a read of file. Blocks while PIPELINE_DEPTH reads are in flight.
+	// Returns -1 if sending a previous result failed.
+	int submit(AbstractFile *file, uint16_t tag, uint32_t size, int64_t offset);
+
+	// Waits for all the reads in flight. Returns -1 if sending a result failed.
+	int wait(void);
+
+	static int initialize(int num_threads);
+};
+
+#endif
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "ReadAhead.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+// Number of requests in a row continuing the previous one that start the read-ahead
+#define SEQUENTIAL_TRIGGER	2
+
+static mutex_t queue_mutex;
+static cond_t queue_cond;
+static ReadAheadBlock *queue_head = NULL;
+static ReadAheadBlock *queue_tail = NULL;
+
+static mutex_t stats_mutex;
+static uint64_t total_hits = 0;
+static uint64_t total_misses = 0;
+
+ReadAhead::ReadAhead(AbstractFile *file, int64_t file_size, int window_size)
+{
+	this->file = file;
+	this->file_size = file_size;
+
+	num_blocks = window_size / READAHEAD_BLOCK_SIZE;
+	if (num_blocks < 2)
+		num_blocks = 2;
+
+	// Buffers are only allocated once the client actually streams the file
+	blocks = new ReadAheadBlock[num_blocks];
+	memset(blocks, 0, num_blocks * sizeof(ReadAheadBlock));
+
+	for (int i = 0; i < num_blocks; i++)
+		blocks[i].owner = this;
+
+	head = 0;
+	active = 0;
+	pending = 0;
+	window_start = 0;
+	next_offset = -1;
+	sequential = 0;
+	hits = 0;
+	misses = 0;
+
+	mutex_init(&mutex);
+	cond_init(&cond);
+}
+
+ReadAhead::~ReadAhead()
+{
+	mutex_lock(&mutex);
+	drop();
+	mutex_unlock(&mutex);
+
+	if (hits > 0)
+	{
+		DPRINTF("read-ahead: %u%% hit rate, %llu KB served from memory\n", (unsigned int)((hits*100) / (hits+misses)), (long long unsigned int)(hits/1024));
+	}
+
+	for (int i = 0; i < num_blocks; i++)
+	{
+		if (blocks[i].buf)
+			free(blocks[i].buf);
+	}
+
+	delete[] blocks;
+
+	cond_destroy(&cond);
+	mutex_destroy(&mutex);
+}
+
+// Queues fetches until the window is full. Must be called with the mutex held.
+void ReadAhead::schedule(void)
+{
+	while (active < num_blocks)
+	{
+		int64_t offset = window_start + (int64_t)active * READAHEAD_BLOCK_SIZE;
+		if (offset >= file_size)
+			break;
+
+		ReadAheadBlock *block = &blocks[(head+active) % num_blocks];
+
+		if (!block->buf)
+		{
+			block->buf = (uint8_t *)malloc(READAHEAD_BLOCK_SIZE);
+			if (!block->buf)
+				break;
+		}
+
+		block->offset = offset;
+		block->size = MIN(READAHEAD_BLOCK_SIZE, file_size - offset);
+		block->state = RA_BLOCK_QUEUED;
+		block->next_job = NULL;
+
+		pending++;
+		active++;
+
+		mutex_lock(&queue_mutex);
+
+		if (queue_tail)
+			queue_tail->next_job = block;
+		else
+			queue_head = block;
+
+		queue_tail = block;
+
+		cond_signal(&queue_cond);
+		mutex_unlock(&queue_mutex);
+	}
+}
+
+// Discards the window and waits for the fetches in progress. Must be called with the mutex held.
+void ReadAhead::drop(void)
+{
+	ReadAheadBlock *prev = NULL;
+
+	mutex_lock(&queue_mutex);
+
+	for (ReadAheadBlock *block = queue_head; block; )
+	{
+		ReadAheadBlock *next = block->next_job;
+
+		if (block->owner == this)
+		{
+			if (prev)
+				prev->next_job = next;
+			else
+				queue_head = next;
+
+			if (queue_tail == block)
+				queue_tail = prev;
+
+			block->state = RA_BLOCK_EMPTY;
+			pending--;
+		}
+		else
+		{
+			prev = block;
+		}
+
+		block = next;
+	}
+
+	mutex_unlock(&queue_mutex);
+
+	while (pending > 0)
+		cond_wait(&cond, &mutex);
+
+	for (int i = 0; i < num_blocks; i++)
+		blocks[i].state = RA_BLOCK_EMPTY;
+
+	head = 0;
+	active = 0;
+}
+
+ssize_t ReadAhead::read(void *buf, size_t nbyte, int64_t offset)
+{
+	mutex_lock(&mutex);
+
+	int64_t window_end = MIN(window_start + (int64_t)active * READAHEAD_BLOCK_SIZE, file_size);
+
+	if (active > 0 && offset >= window_start && offset + (int64_t)nbyte <= window_end)
+	{
+		uint8_t *p = (uint8_t *)buf;
+		int64_t pos = offset;
+		size_t remaining = nbyte;
+
+		while (remaining > 0)
+		{
+			ReadAheadBlock *block = &blocks[(head + (pos-window_start) / READAHEAD_BLOCK_SIZE) % num_blocks];
+
+			while (block->state == RA_BLOCK_QUEUED || block->state == RA_BLOCK_LOADING)
+				cond_wait(&cond, &mutex);
+
+			if (block->state != RA_BLOCK_READY)
+			{
+				// Let the caller do the read and report the error
+				drop();
+				sequential = 0;
+				next_offset = -1;
+				mutex_unlock(&mutex);
+				return -2;
+			}
+
+			size_t n = MIN(remaining, (size_t)(block->offset + block->size - pos));
+			memcpy(p, block->buf + (pos - block->offset), n);
+
+			p += n;
+			pos += n;
+			remaining -= n;
+		}
+
+		// Recycle the blocks already consumed and fetch the ones after the window
+		while (active > 0 && window_start + READAHEAD_BLOCK_SIZE <= offset + (int64_t)nbyte)
+		{
+			blocks[head].state = RA_BLOCK_EMPTY;
+			head = (head+1) % num_blocks;
+			window_start += READAHEAD_BLOCK_SIZE;
+			active--;
+		}
+
+		schedule();
+
+		next_offset = offset + nbyte;
+		hits += nbyte;
+		mutex_unlock(&mutex);
+
+		mutex_lock(&stats_mutex);
+		total_hits += nbyte;
+		mutex_unlock(&stats_mutex);
+		return nbyte;
+	}
+
+	if (active > 0 || pending > 0)
+		drop();
+
+	sequential = (offset == next_offset) ? sequential+1 : 0;
+	next_offset = offset + nbyte;
+	misses += nbyte;
+
+	mutex_lock(&stats_mutex);
+	total_misses += nbyte;
+	mutex_unlock(&stats_mutex);
+
+	if (sequential < SEQUENTIAL_TRIGGER)
+	{
+		mutex_unlock(&mutex);
+		return -2;
+	}
+
+	// Sequential stream detected: read this request now and start fetching what follows it
+	window_start = offset + nbyte;
+	schedule();
+	mutex_unlock(&mutex);
+
+	return file->pread(buf, nbyte, offset);
+}
+
+void *ReadAhead::io_thread(void *arg)
+{
+	(void) arg;
+
+	for (;;)
+	{
+		ReadAheadBlock *block;
+
+		mutex_lock(&queue_mutex);
+
+		while (!queue_head)
+			cond_wait(&queue_cond, &queue_mutex);
+
+		block = queue_head;
+		queue_head = block->next_job;
+		if (!queue_head)
+			queue_tail = NULL;
+
+		mutex_unlock(&queue_mutex);
+
+		// The owner can't go away while the block is pending
+		ReadAhead *ra = block->owner;
+
+		mutex_lock(&ra->mutex);
+		block->state = RA_BLOCK_LOADING;
+		mutex_unlock(&ra->mutex);
+
+		ssize_t ret = ra->file->pread(block->buf, block->size, block->offset);
+
+		mutex_lock(&ra->mutex);
+		block->state = (ret == (ssize_t)block->size) ? RA_BLOCK_READY : RA_BLOCK_FAILED;
+		ra->pending--;
+		cond_broadcast(&ra->cond);
+		mutex_unlock(&ra->mutex);
+	}
+
+	return NULL;
+}
+
+int ReadAhead::initialize(int num_threads)
+{
+	mutex_init(&queue_mutex);
+	mutex_init(&stats_mutex);
+	cond_init(&queue_cond);
+
+	for (int i = 0; i < num_threads; i++)
+	{
+		thread_t thread;
+
+		if (create_start_thread(&thread, io_thread, NULL) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+void ReadAhead::get_stats(uint64_t *hits, uint64_t *misses)
+{
+	mutex_lock(&stats_mutex);
+	*hits = total_hits;
+	*misses = total_misses;
+	mutex_unlock(&stats_mutex);
+}
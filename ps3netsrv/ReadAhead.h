@@ -0,0 +1,73 @@
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+#include "AbstractFile.h"
+#include "compat.h"
+
+#define READAHEAD_BLOCK_SIZE	(512*1024)
+#define READAHEAD_THREADS	2
+
+enum
+{
+	RA_BLOCK_EMPTY,
+	RA_BLOCK_QUEUED,
+	RA_BLOCK_LOADING,
+	RA_BLOCK_READY,
+	RA_BLOCK_FAILED
+};
+
+class ReadAhead;
+
+typedef struct _ReadAheadBlock
+{
+	ReadAhead *owner;
+	uint8_t *buf;
+	int64_t offset;
+	uint32_t size;
+	int state;
+	struct _ReadAheadBlock *next_job;
+} ReadAheadBlock;
+
+// Sequential read-ahead attached to the ro_file of a client. Once a client reads a file
+// sequentially, the blocks following the last request are fetched by a background I/O thread
+// into a ring of buffers, so the next requests are served from memory.
+class ReadAhead
+{
+private:
+	AbstractFile *file;
+	int64_t file_size;
+
+	mutex_t mutex;
+	cond_t cond;
+
+	ReadAheadBlock *blocks;
+	int num_blocks;
+	int head;
+	int active;
+	int pending;
+	int64_t window_start;
+
+	int64_t next_offset;
+	int sequential;
+
+	uint64_t hits;
+	uint64_t misses;
+
+	void schedule(void);
+	void drop(void);
+
+	static void *io_thread(void *arg);
+
+public:
+	ReadAhead(AbstractFile *file, int64_t file_size, int window_size);
+	~ReadAhead();
+
+	// Reads nbyte bytes at offset into buf. Returns -2 if the request is not part of a sequential
+	// stream; in that case nothing was read and no read-ahead I/O is in flight on the file.
+	ssize_t read(void *buf, size_t nbyte, int64_t offset);
+
+	static int initialize(int num_threads);
+	static void get_stats(uint64_t *hits, uint64_t *misses);
+};
+
+#endif
@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "netiso.h"
+#include "Stats.h"
+#include "ReadAhead.h"
+#include "BlockCache.h"
+#include "DirCache.h"
+
+#define LOAD(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define ADD(x, n)	__atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+
+static const char *command_names[STATS_NUM_COMMANDS] =
+{
+	"open_file",
+	"read_file_critical",
+	"read_cd_2048_critical",
+	"read_file",
+	"create_file",
+	"write_file",
+	"open_dir",
+	"read_dir_entry",
+	"delete_file",
+	"mkdir",
+	"rmdir",
+	"read_dir_entry_v2",
+	"stat_file",
+	"get_dir_size",
+	"read_dir",
+	"set_features",
+	"read_file_tagged",
+	"read_file_sparse",
+	"read_dir_page",
+	"get_game_info",
+	"unknown"
+};
+
+// Upper bounds of the buckets of the exported histograms, in microseconds
+static const uint64_t histogram_bounds[] =
+{
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+bool Stats::enabled = false;
+CommandStats Stats::commands[STATS_NUM_COMMANDS];
+ClientStats *Stats::clients = NULL;
+int Stats::max_clients = 0;
+uint64_t Stats::start_time = 0;
+uint64_t Stats::sessions = 0;
+uint64_t Stats::bytes_sent = 0;
+int Stats::http_socket = -1;
+int Stats::log_interval = 0;
+
+static inline int bucket_index(uint64_t usec)
+{
+	if (usec < (1 << STATS_SUB_BITS))
+		return (int)usec;
+
+	int bits = 63 - __builtin_clzll(usec);
+	if (bits > STATS_MAX_BITS)
+		return STATS_NUM_BUCKETS - 1;
+
+	return ((bits - STATS_SUB_BITS + 1) << STATS_SUB_BITS) | (int)((usec >> (bits - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1));
+}
+
+// Values in the bucket are lower than this
+static inline uint64_t bucket_limit(int index)
+{
+	int group = index >> STATS_SUB_BITS;
+	int sub = index & ((1 << STATS_SUB_BITS) - 1);
+
+	if (group == 0)
+		return sub + 1;
+
+	return ((uint64_t)((1 << STATS_SUB_BITS) | sub) + 1) << (group - 1);
+}
+
+int Stats::command_index(uint16_t opcode)
+{
+	if (opcode >= NETISO_CMD_OPEN_FILE && opcode <= NETISO_CMD_READ_DIR)
+		return opcode - NETISO_CMD_OPEN_FILE;
+
+	if (opcode == NETISO_CMD_SET_FEATURES)
+		return 15;
+
+	if (opcode == NETISO_CMD_READ_FILE_TAGGED)
+		return 16;
+
+	if (opcode == NETISO_CMD_READ_FILE_SPARSE)
+		return 17;
+
+	if (opcode == NETISO_CMD_READ_DIR_PAGE)
+		return 18;
+
+	if (opcode == NETISO_CMD_GET_GAME_INFO)
+		return 19;
+
+	return 20;
+}
+
+void Stats::command_done(int id, uint16_t opcode, uint64_t usec, bool error)
+{
+	CommandStats *stats = &commands[command_index(opcode)];
+
+	ADD(clients[id].commands, 1);
+	ADD(stats->count, 1);
+	ADD(stats->total_usec, usec);
+	ADD(stats->buckets[bucket_index(usec)], 1);
+
+	if (error)
+		ADD(stats->errors, 1);
+}
+
+void Stats::client_connected(int id, struct in_addr ip_addr)
+{
+	if (!enabled)
+		return;
+
+	ClientStats *client = &clients[id];
+
+	client->ip_addr = ip_addr;
+	client->connect_time = get_time_usec();
+	__atomic_store_n(&client->bytes_sent, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&client->commands, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&client->connected, true, __ATOMIC_RELEASE);
+	ADD(sessions, 1);
+}
+
+void Stats::client_disconnected(int id)
+{
+	if (!enabled)
+		return;
+
+	__atomic_store_n(&clients[id].connected, false, __ATOMIC_RELEASE);
+}
+
+void Stats::add_sent(int id, uint64_t bytes)
+{
+	if (!enabled)
+		return;
+
+	ADD(clients[id].bytes_sent, bytes);
+	ADD(bytes_sent, bytes);
+}
+
+static void format_ip(struct in_addr ip_addr, char *ip)
+{
+	uint32_t a = BE32(ip_addr.s_addr);
+
+	sprintf(ip, "%u.%u.%u.%u", a >> 24, (a >> 16) & 0xFF, (a >> 8) & 0xFF, a & 0xFF);
+}
+
+// Copies the buckets of command i, returns the number of commands in them
+uint64_t Stats::snapshot(int i, CommandStats *stats)
+{
+	uint64_t count = 0;
+
+	for (int j = 0; j < STATS_NUM_BUCKETS; j++)
+	{
+		stats->buckets[j] = LOAD(commands[i].buckets[j]);
+		count += stats->buckets[j];
+	}
+
+	return count;
+}
+
+// Latency under which percentile % of the count commands of buckets were done, in microseconds
+uint64_t Stats::get_percentile(CommandStats *stats, uint64_t count, double percentile)
+{
+	uint64_t target = (uint64_t)(count * percentile / 100.0);
+	uint64_t sum = 0;
+
+	for (int i = 0; i < STATS_NUM_BUCKETS; i++)
+	{
+		sum += stats->buckets[i];
+		if (sum > target)
+			return bucket_limit(i);
+	}
+
+	return bucket_limit(STATS_NUM_BUCKETS - 1);
+}
+
+// Prometheus text format
+int Stats::format(char *buf, int size)
+{
+	int len = 0;
+	uint64_t hits, misses;
+	int64_t cache_size;
+	int active = 0;
+	CommandStats stats;
+	char ip[16];
+
+#define APPEND(...) \
+	do { if (len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); } while (0)
+
+	APPEND("# TYPE ps3netsrv_uptime_seconds gauge\nps3netsrv_uptime_seconds %llu\n", (long long unsigned int)((get_time_usec() - start_time) / 1000000));
+
+	// Every family must come in one group, so the commands are walked once for each of them
+	for (int family = 0; family < 4; family++)
+	{
+		static const char *types[4] =
+		{
+			"# TYPE ps3netsrv_commands_total counter\n",
+			"# TYPE ps3netsrv_command_errors_total counter\n",
+			"# TYPE ps3netsrv_command_duration_seconds histogram\n",
+			"# TYPE ps3netsrv_command_latency_seconds summary\n"
+		};
+
+		APPEND("%s", types[family]);
+
+		for (int i = 0; i < STATS_NUM_COMMANDS; i++)
+		{
+			uint64_t count = snapshot(i, &stats);
+
+			if (count == 0)
+				continue;
+
+			const char *name = command_names[i];
+
+			if (family == 0)
+			{
+				APPEND("ps3netsrv_commands_total{command=\"%s\"} %llu\n", name, (long long unsigned int)count);
+			}
+			else if (family == 1)
+			{
+				APPEND("ps3netsrv_command_errors_total{command=\"%s\"} %llu\n", name, (long long unsigned int)LOAD(commands[i].errors));
+			}
+			else if (family == 2)
+			{
+				unsigned int b = 0;
+				uint64_t cumulative = 0;
+
+				for (int j = 0; j < STATS_NUM_BUCKETS; j++)
+				{
+					while (b < sizeof(histogram_bounds)/sizeof(uint64_t) && bucket_limit(j) > histogram_bounds[b] + 1)
+					{
+						APPEND("ps3netsrv_command_duration_seconds_bucket{command=\"%s\",le=\"%g\"} %llu\n", name, histogram_bounds[b] / 1000000.0, (long long unsigned int)cumulative);
+						b++;
+					}
+
+					cumulative += stats.buckets[j];
+				}
+
+				for (; b < sizeof(histogram_bounds)/sizeof(uint64_t); b++)
+					APPEND("ps3netsrv_command_duration_seconds_bucket{command=\"%s\",le=\"%g\"} %llu\n", name, histogram_bounds[b] / 1000000.0, (long long unsigned int)cumulative);
+
+				APPEND("ps3netsrv_command_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n", name, (long long unsigned int)count);
+				APPEND("ps3netsrv_command_duration_seconds_sum{command=\"%s\"} %.6f\n", name, LOAD(commands[i].total_usec) / 1000000.0);
+				APPEND("ps3netsrv_command_duration_seconds_count{command=\"%s\"} %llu\n", name, (long long unsigned int)count);
+			}
+			else
+			{
+				APPEND("ps3netsrv_command_latency_seconds{command=\"%s\",quantile=\"0.5\"} %.6f\n", name, get_percentile(&stats, count, 50) / 1000000.0);
+				APPEND("ps3netsrv_command_latency_seconds{command=\"%s\",quantile=\"0.99\"} %.6f\n", name, get_percentile(&stats, count, 99) / 1000000.0);
+				APPEND("ps3netsrv_command_latency_seconds{command=\"%s\",quantile=\"0.999\"} %.6f\n", name, get_percentile(&stats, count, 99.9) / 1000000.0);
+			}
+		}
+	}
+
+	APPEND("# TYPE ps3netsrv_client_bytes_sent_total counter\n");
+
+	for (int i = 0; i < max_clients; i++)
+	{
+		if (!__atomic_load_n(&clients[i].connected, __ATOMIC_ACQUIRE))
+			continue;
+
+		format_ip(clients[i].ip_addr, ip);
+		APPEND("ps3netsrv_client_bytes_sent_total{client=\"%s\"} %llu\n", ip, (long long unsigned int)LOAD(clients[i].bytes_sent));
+		active++;
+	}
+
+	APPEND("# TYPE ps3netsrv_client_commands_total counter\n");
+
+	for (int i = 0; i < max_clients; i++)
+	{
+		if (!__atomic_load_n(&clients[i].connected, __ATOMIC_ACQUIRE))
+			continue;
+
+		format_ip(clients[i].ip_addr, ip);
+		APPEND("ps3netsrv_client_commands_total{client=\"%s\"} %llu\n", ip, (long long unsigned int)LOAD(clients[i].commands));
+	}
+
+	APPEND("# TYPE ps3netsrv_bytes_sent_total counter\nps3netsrv_bytes_sent_total %llu\n", (long long unsigned int)LOAD(bytes_sent));
+	APPEND("# TYPE ps3netsrv_sessions_active gauge\nps3netsrv_sessions_active %d\n", active);
+	APPEND("# TYPE ps3netsrv_sessions_total counter\nps3netsrv_sessions_total %llu\n", (long long unsigned int)LOAD(sessions));
+
+	ReadAhead::get_stats(&hits, &misses);
+	APPEND("# TYPE ps3netsrv_readahead_bytes_total counter\n");
+	APPEND("ps3netsrv_readahead_bytes_total{result=\"hit\"} %llu\nps3netsrv_readahead_bytes_total{result=\"miss\"} %llu\n", (long long unsigned int)hits, (long long unsigned int)misses);
+
+	BlockCache::get_stats(&hits, &misses, &cache_size);
+	APPEND("# TYPE ps3netsrv_block_cache_lookups_total counter\n");
+	APPEND("ps3netsrv_block_cache_lookups_total{result=\"hit\"} %llu\nps3netsrv_block_cache_lookups_total{result=\"miss\"} %llu\n", (long long unsigned int)hits, (long long unsigned int)misses);
+	APPEND("# TYPE ps3netsrv_block_cache_bytes gauge\nps3netsrv_block_cache_bytes %lld\n", (long long int)cache_size);
+
+	DirCache::get_stats(&hits, &misses);
+	APPEND("# TYPE ps3netsrv_dir_cache_lookups_total counter\n");
+	APPEND("ps3netsrv_dir_cache_lookups_total{result=\"hit\"} %llu\nps3netsrv_dir_cache_lookups_total{result=\"miss\"} %llu\n", (long long unsigned int)hits, (long long unsigned int)misses);
+
+#undef APPEND
+
+	return (len < size) ? len : size - 1;
+}
+
+void *Stats::http_thread(void *arg)
+{
+	char *buf = (char *)arg;
+
+	for (;;)
+	{
+		int cs = accept(http_socket, NULL, NULL);
+
+		if (cs < 0)
+			continue;
+
+		// Whatever is asked, the answer is the metrics
+#ifdef WIN32
+		DWORD timeout = 2000;
+#else
+		struct timeval timeout = { 2, 0 };
+#endif
+		char request[1024];
+
+		setsockopt(cs, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+		recv(cs, request, sizeof(request), 0);
+
+		int len = format(buf + 128, STATS_HTTP_BUFFER - 128);
+		int header_len = sprintf(buf, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", len);
+
+		// Move the header right before the body so everything goes in one send
+		memmove(buf + 128 - header_len, buf, header_len);
+		send(cs, buf + 128 - header_len, header_len + len, 0);
+		closesocket(cs);
+	}
+
+	return NULL;
+}
+
+void *Stats::log_thread(void *arg)
+{
+	(void) arg;
+	CommandStats *last = (CommandStats *)calloc(STATS_NUM_COMMANDS, sizeof(CommandStats));
+	CommandStats *reads = (CommandStats *)malloc(sizeof(CommandStats));
+	uint64_t last_bytes = 0;
+
+	if (!last || !reads)
+		return NULL;
+
+	for (;;)
+	{
+#ifdef WIN32
+		Sleep(log_interval * 1000);
+#else
+		sleep(log_interval);
+#endif
+
+		uint64_t count = 0, reads_count = 0;
+		uint64_t bytes = LOAD(bytes_sent);
+		uint64_t hits, misses;
+		int active = 0;
+
+		memset(reads, 0, sizeof(CommandStats));
+
+		for (int i = 0; i < STATS_NUM_COMMANDS; i++)
+		{
+			bool is_read = (i == command_index(NETISO_CMD_READ_FILE_CRITICAL) || i == command_index(NETISO_CMD_READ_CD_2048_CRITICAL) ||
+							i == command_index(NETISO_CMD_READ_FILE) || i == command_index(NETISO_CMD_READ_FILE_TAGGED) ||
+							i == command_index(NETISO_CMD_READ_FILE_SPARSE));
+
+			for (int j = 0; j < STATS_NUM_BUCKETS; j++)
+			{
+				uint64_t n = LOAD(commands[i].buckets[j]);
+				uint64_t delta = n - last[i].buckets[j];
+
+				last[i].buckets[j] = n;
+				count += delta;
+
+				if (is_read)
+				{
+					reads->buckets[j] += delta;
+					reads_count += delta;
+				}
+			}
+		}
+
+		for (int i = 0; i < max_clients; i++)
+		{
+			if (__atomic_load_n(&clients[i].connected, __ATOMIC_ACQUIRE))
+				active++;
+		}
+
+		ReadAhead::get_stats(&hits, &misses);
+
+		printf("stats: %d clients, %.1f cmd/s, %.2f MB/s sent, read p50 %.2f ms p99 %.2f ms, read-ahead %u%% hit\n",
+			active, (double)count / log_interval, (double)(bytes - last_bytes) / log_interval / 1048576,
+			(reads_count) ? get_percentile(reads, reads_count, 50) / 1000.0 : 0.0,
+			(reads_count) ? get_percentile(reads, reads_count, 99) / 1000.0 : 0.0,
+			(hits+misses) ? (unsigned int)((hits*100) / (hits+misses)) : 0);
+
+		fflush(stdout);
+		last_bytes = bytes;
+	}
+
+	return NULL;
+}
+
+int Stats::initialize(int num_clients, int http_port, int interval)
+{
+	start_time = get_time_usec();
+
+	if (http_port == 0 && interval == 0)
+		return 0;
+
+	clients = (ClientStats *)calloc(num_clients, sizeof(ClientStats));
+	if (!clients)
+		return -1;
+
+	max_clients = num_clients;
+	log_interval = interval;
+	enabled = true;
+
+	thread_t thread;
+
+	if (http_port != 0)
+	{
+		struct sockaddr_in addr;
+		int flag = 1;
+		char *buf = (char *)malloc(STATS_HTTP_BUFFER);
+
+		http_socket = socket(AF_INET, SOCK_STREAM, 0);
+		if (!buf || http_socket < 0)
+			return -1;
+
+		setsockopt(http_socket, SOL_SOCKET, SO_REUSEADDR, (const char *)&flag, sizeof(flag));
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(http_port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if (bind(http_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(http_socket, 4) < 0)
+		{
+			printf("Cannot listen on metrics port %d.\n", http_port);
+			return -1;
+		}
+
+		if (create_start_thread(&thread, http_thread, buf) != 0)
+			return -1;
+	}
+
+	if (interval != 0 && create_start_thread(&thread, log_thread, NULL) != 0)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "compat.h"
+
+// 0x1224-0x1232, SET_FEATURES, READ_FILE_TAGGED and one slot for unknown opcodes
+#define STATS_NUM_COMMANDS	21
+
+// Latencies in microseconds, in buckets of 3 significant bits (12.5% precision) up to about 9 hours
+#define STATS_SUB_BITS	3
+#define STATS_MAX_BITS	35
+#define STATS_NUM_BUCKETS	((STATS_MAX_BITS - STATS_SUB_BITS + 2) << STATS_SUB_BITS)
+
+#define STATS_HTTP_BUFFER	(128*1024)
+
+typedef struct
+{
+	uint64_t count;
+	uint64_t errors;
+	uint64_t total_usec;
+	uint64_t buckets[STATS_NUM_BUCKETS];
+} CommandStats;
+
+typedef struct
+{
+	bool connected;
+	struct in_addr ip_addr;
+	uint64_t connect_time;
+	uint64_t bytes_sent;
+	uint64_t commands;
+} ClientStats;
+
+// Counters for the metrics endpoint and the periodic stats line. The updates are lock-free atomic
+// adds, and are skipped altogether when neither of them is enabled.
+class Stats
+{
+private:
+	static bool enabled;
+	static CommandStats commands[STATS_NUM_COMMANDS];
+	static ClientStats *clients;
+	static int max_clients;
+	static uint64_t start_time;
+	static uint64_t sessions;
+	static uint64_t bytes_sent;
+	static int http_socket;
+	static int log_interval;
+
+	static int command_index(uint16_t opcode);
+	static uint64_t snapshot(int i, CommandStats *stats);
+	static uint64_t get_percentile(CommandStats *stats, uint64_t count, double percentile);
+	static int format(char *buf, int size);
+
+	static void *http_thread(void *arg);
+	static void *log_thread(void *arg);
+
+public:
+	// http_port is the port of the metrics listener (bound to localhost), interval the seconds between
+	// stats lines; 0 disables them
+	static int initialize(int num_clients, int http_port, int interval);
+	static bool is_enabled(void) { return enabled; }
+
+	// Called by the worker after each command of client id
+	static void command_done(int id, uint16_t opcode, uint64_t usec, bool error);
+	static void client_connected(int id, struct in_addr ip_addr);
+	static void client_disconnected(int id);
+	static void add_sent(int id, uint64_t bytes);
+};
+
+#endif
@@ -7,6 +7,7 @@
 
 #include "common.h"
 #include "VIsoFile.h"
+#include "BlockCache.h"
 
 #ifdef WIN32
 #include "dirent2.h"
@@ -69,22 +70,40 @@ static char *createPath(char *dir, char *file)
 	return ret;
 }
 
-static bool getFileSizeAndProcessMultipart(char *file, off64_t *size)
+static uint64_t hashString(const char *str, uint64_t h)
+{
+	while (*str)
+	{
+		h ^= (uint8_t)*str++;
+		h *= 0x100000001B3ULL;
+	}
+	
+	return h;
+}
+
+static bool getFileSizeAndProcessMultipart(char *file, off64_t *size, uint64_t *mtime, int *numParts, off64_t **partEnds)
 {
 	file_stat_t statbuf;
 	
+	*numParts = 1;
+	*partEnds = NULL;
+	
 	if (stat_file(file, &statbuf) < 0)
 		return false;
 	
 	*size = statbuf.file_size;
+	*mtime = statbuf.mtime;
 	
 	char *p = strrchr(file, '.');
 	if (!p || strcmp(p+1, "66600") != 0)
 		return true;
 	
 	off64_t prev_size;
+	off64_t ends[100];
+	
+	ends[0] = *size;
 	
-	for (int i = 1; ; i++)
+	for (int i = 1; i < 100; i++)
 	{
 		p[4] = '0' + (i/10);
 		p[5] = '0' + (i%10);
@@ -93,6 +112,8 @@ static bool getFileSizeAndProcessMultipart(char *file, off64_t *size)
 			break;
 		
 		*size += statbuf.file_size;	
+		ends[i] = *size;
+		*numParts = i+1;
 		
 		if (i > 1)
 		{
@@ -105,19 +126,29 @@ static bool getFileSizeAndProcessMultipart(char *file, off64_t *size)
 		prev_size = statbuf.file_size;
 	}	
 	
+	*partEnds = new off64_t[*numParts];
+	memcpy(*partEnds, ends, *numParts * sizeof(off64_t));
+	
 	*p = 0;	
 	return true;
 }
 
 static void genIso9660Time(time_t t, Iso9660DirectoryRecord *record)
 {
-	struct tm *timeinfo = localtime(&t);	
-	record->year = timeinfo->tm_year;
-	record->month = timeinfo->tm_mon+1;
-	record->day = timeinfo->tm_mday;
-	record->hour = timeinfo->tm_hour;
-	record->minute = timeinfo->tm_min;
-	record->second = timeinfo->tm_sec;
+	struct tm timeinfo;
+	
+	// Called by the iso and joliet builds at the same time
+#ifdef WIN32
+	localtime_s(&timeinfo, &t);
+#else
+	localtime_r(&t, &timeinfo);
+#endif
+	record->year = timeinfo.tm_year;
+	record->month = timeinfo.tm_mon+1;
+	record->day = timeinfo.tm_mday;
+	record->hour = timeinfo.tm_hour;
+	record->minute = timeinfo.tm_min;
+	record->second = timeinfo.tm_sec;
 }
 
 static void genIso9660TimePvd(time_t t, char *volumeTime)
@@ -370,6 +401,15 @@ VIsoFile::VIsoFile(bool ps3Mode)
 	pathTableJolietL = NULL;
 	pathTableJolietM = NULL;
 	rootList = NULL;
+	extents = NULL;
+	numExtents = 0;
+	
+	mutex_init(&openFilesMutex);
+	memset(openFiles, 0, sizeof(openFiles));
+	openFilesTick = 0;
+	
+	for (int i = 0; i < VISO_MAX_OPEN_FILES; i++)
+		openFiles[i].fd = INVALID_FD;
 	
 	vFilePtr = 0;
 	filesSizeSectors = 0;
@@ -387,10 +427,13 @@ VIsoFile::~VIsoFile()
 	DPRINTF("VISO file destructor\n");
 	close();
 	reset();
+	mutex_destroy(&openFilesMutex);
 }
 
 void VIsoFile::reset(void)
 {
+	closeFiles();
+	
 	if (fsBuf)
 	{
 		delete[] fsBuf;
@@ -449,6 +492,9 @@ void VIsoFile::reset(void)
 			if (fileList->path)
 				delete[] fileList->path;
 			
+			if (fileList->partEnds)
+				delete[] fileList->partEnds;
+			
 			delete fileList;
 			fileList = nextFile;
 		}
@@ -457,6 +503,14 @@ void VIsoFile::reset(void)
 		rootList = next;
 	}
 	
+	if (extents)
+	{
+		delete[] extents;
+		extents = NULL;
+	}
+	
+	numExtents = 0;
+	
 	vFilePtr = 0;
 	filesSizeSectors = 0;
 	dirsSizeSectors = 0;
@@ -470,44 +524,7 @@ void VIsoFile::reset(void)
 
 DirList *VIsoFile::getParent(DirList *dirList)
 {
-	DirList *tempList = rootList;
-	char *parentPath;
-	
-	if (dirList == rootList)
-		return dirList;
-	
-	parentPath = dupString(dirList->path);
-	*(strrchr(parentPath, '/')) = 0;
-	
-	while (tempList)
-	{
-		if (strcmp(parentPath, tempList->path) == 0)
-		{
-			delete[] parentPath;
-			return tempList;
-		}
-		
-		tempList = tempList->next;
-	}
-	
-	delete[] parentPath;
-	return dirList;
-}
-
-bool VIsoFile::isDirectChild(DirList *dir, DirList *parentCheck)
-{
-	if (strcmp(dir->path, parentCheck->path) == 0)
-		return false;
-	
-	char *p = strstr(dir->path, parentCheck->path);
-	if (p != dir->path)
-		return false;
-	
-	p += strlen(parentCheck->path) + 1;
-	if (strchr(p, '/'))
-		return false;
-	
-	return true;
+	return dirList->parent;
 }
 
 Iso9660DirectoryRecord *VIsoFile::findDirRecord(char *dirName, Iso9660DirectoryRecord *parentRecord, size_t size, bool joliet)
@@ -631,14 +648,14 @@ uint8_t *VIsoFile::buildPathTable(bool msb, bool joliet, size_t *retSize)
 	return ret;
 }
 
-bool VIsoFile::buildContent(DirList *dirList, bool joliet)
+bool VIsoFile::buildContent(DirList *dirList, bool joliet, uint8_t *buf, size_t bufSize)
 {
 	Iso9660DirectoryRecord *record, *parentRecord = NULL;
 	DirList *tempList, *parent;
-	uint8_t *p = tempBuf;
-	file_stat_t statbuf;
+	uint8_t *p = buf;
 	
-	memset(tempBuf, 0, tempBufSize);	
+	// Only the bytes used are cleared: the buffer is big and there is a call per directory
+	memset(buf, 0, 0x50);
 	parent = getParent(dirList);
 	
 	// . entry	
@@ -647,10 +664,7 @@ bool VIsoFile::buildContent(DirList *dirList, bool joliet)
 	record->lsbStart = (!joliet) ? LE32(dirsSizeSectors) : LE32(dirsSizeSectorsJoliet);
 	record->msbStart = (!joliet) ? BE32(dirsSizeSectors) : BE32(dirsSizeSectorsJoliet);
 						
-	if (stat_file(dirList->path, &statbuf) < 0)
-		return false;
-	
-	genIso9660Time(statbuf.mtime, record);
+	genIso9660Time(dirList->mtime, record);
 	record->fileFlags = ISO_DIRECTORY;
 	record->lsbVolSetSeqNum = LE16(1);
 	record->msbVolSetSeqNum = BE16(1);
@@ -670,10 +684,7 @@ bool VIsoFile::buildContent(DirList *dirList, bool joliet)
 		record->msbDataLength = parentRecord-> msbDataLength;
 	}
 	
-	if (stat_file(parent->path, &statbuf) < 0)
-		return false;
-	
-	genIso9660Time(statbuf.mtime, record);
+	genIso9660Time(parent->mtime, record);
 	record->fileFlags = ISO_DIRECTORY;
 	record->lsbVolSetSeqNum = LE16(1);
 	record->msbVolSetSeqNum = BE16(1);
@@ -705,30 +716,7 @@ bool VIsoFile::buildContent(DirList *dirList, bool joliet)
 			record->lsbStart = LE32(lba);
 			record->msbStart = BE32(lba);
 			
-			if (!fileList->multipart)
-			{			
-				if (stat_file(fileList->path, &statbuf) < 0)
-				{
-					free(record);
-					return false;
-				}
-			}
-			else
-			{
-				char *s = new char[strlen(fileList->path)+7];
-				sprintf(s, "%s.66600", fileList->path);
-				
-				if (stat_file(s, &statbuf) < 0)
-				{
-					free(record);
-					delete[] s;
-					return false;
-				}
-				
-				delete[] s;
-			}
-	
-			genIso9660Time(statbuf.mtime, record);
+			genIso9660Time(fileList->mtime, record);
 			
 			if (parts == 1)
 			{
@@ -782,15 +770,16 @@ bool VIsoFile::buildContent(DirList *dirList, bool joliet)
 				record->len_dr++;
 			}
 			
-			offs = (p-tempBuf);
+			offs = (p-buf);
 			
 			if ((offs/0x800) < ((offs+record->len_dr)/0x800))
 			{
 				offs = (offs+0x7ff)&~0x7ff;
-				p = (tempBuf+offs);
+				memset(p, 0, (buf+offs)-p);
+				p = (buf+offs);
 			}
 			
-			if ((p+record->len_dr) >= (tempBuf+tempBufSize))
+			if ((p+record->len_dr) >= (buf+bufSize))
 			{
 				free(record);
 				return false;
@@ -804,73 +793,66 @@ bool VIsoFile::buildContent(DirList *dirList, bool joliet)
 		fileList = fileList->next;
 	}
 	
-	tempList = dirList->next;
-	while (tempList)
+	tempList = dirList->firstChild;
+	for (int i = 0; i < dirList->numChildren; i++)
 	{
-		if (isDirectChild(tempList, dirList))
+		uint32_t offs;			
+		record = (Iso9660DirectoryRecord *)malloc(2048);
+		memset(record, 0, 2048);
+	
+		genIso9660Time(tempList->mtime, record);
+		record->fileFlags = ISO_DIRECTORY;
+		
+		record->lsbVolSetSeqNum = LE16(1);
+		record->msbVolSetSeqNum = BE16(1);	
+		
+		char *fileName = strrchr(tempList->path, '/')+1;
+		
+		
+		if (!joliet)
+		{				
+			strncpy_upper(&record->fi, fileName, MAX_ISODIR);
+			record->len_fi = strlen(&record->fi);
+		}
+		else
 		{
-			uint32_t offs;			
-			record = (Iso9660DirectoryRecord *)malloc(2048);
-			memset(record, 0, 2048);
+			record->len_fi = utf8_to_ucs2((const unsigned char *)fileName, (uint16_t *)&record->fi, MAX_ISODIR/2) * 2;
+		}
 		
-			if (stat_file(tempList->path, &statbuf) < 0)
-			{
-				free(record);
-				return false;
-			}
-			
-			genIso9660Time(statbuf.mtime, record);
-			record->fileFlags = ISO_DIRECTORY;
-			
-			record->lsbVolSetSeqNum = LE16(1);
-			record->msbVolSetSeqNum = BE16(1);	
-			
-			char *fileName = strrchr(tempList->path, '/')+1;
-			
-			
-			if (!joliet)
-			{				
-				strncpy_upper(&record->fi, fileName, MAX_ISODIR);
-				record->len_fi = strlen(&record->fi);
-			}
-			else
-			{
-				record->len_fi = utf8_to_ucs2((const unsigned char *)fileName, (uint16_t *)&record->fi, MAX_ISODIR/2) * 2;
-			}
-			
-			record->len_dr = 0x27 + record->len_fi;
-			if (record->len_dr&1)
-			{
-				record->len_dr++;
-			}
-			
-			offs = (p-tempBuf);
-			
-			if ((offs/0x800) < ((offs+record->len_dr)/0x800))
-			{
-				offs = (offs+0x7ff)&~0x7ff;
-				p = (tempBuf+offs);
-			}
-			
-			if ((p+record->len_dr) >= (tempBuf+tempBufSize))
-			{
-				free(record);
-				return false;
-			}			
+		record->len_dr = 0x27 + record->len_fi;
+		if (record->len_dr&1)
+		{
+			record->len_dr++;
+		}
 		
-			memcpy(p, record, record->len_dr);
-			p += record->len_dr;	
-			free(record);					
+		offs = (p-buf);
+		
+		if ((offs/0x800) < ((offs+record->len_dr)/0x800))
+		{
+			offs = (offs+0x7ff)&~0x7ff;
+			memset(p, 0, (buf+offs)-p);
+			p = (buf+offs);
 		}
 		
+		if ((p+record->len_dr) >= (buf+bufSize))
+		{
+			free(record);
+			return false;
+		}			
+	
+		memcpy(p, record, record->len_dr);
+		p += record->len_dr;	
+		free(record);					
+	
 		tempList = tempList->next;
 	}
 	
-	size_t size = (p-tempBuf);
+	size_t size = (p-buf);
 	size = (size+0x7ff)&~0x7ff;
+	memset(p, 0, (buf+size)-p);
 		
 	p = new uint8_t[size];
-	memcpy(p, tempBuf, size);
+	memcpy(p, buf, size);
 	
 	record = (Iso9660DirectoryRecord *)p;
 	record->lsbDataLength = LE32(size);
@@ -994,134 +976,274 @@ void VIsoFile::fixLba(uint32_t isoLba, uint32_t jolietLba, uint32_t filesLba)
 	fixPathTableLba(pathTableJolietM, pathTableSizeJoliet, jolietLba, true);
 }
 
-bool VIsoFile::build(char *inDir)
+typedef struct
 {
-	DirList *dirList, *tail;
-	struct dirent2 **dirs;
+	DirList **dirs;
+	int count;
+	int next;
+	bool error;
+	mutex_t mutex;
+} ScanJob;
+
+typedef struct
+{
+	VIsoFile *viso;
+	uint8_t *buf;
+	bool ret;
+} JolietJob;
+
+static DirList *newDirList(char *path, DirList *parent)
+{
+	DirList *dirList = new DirList;
+	
+	dirList->path = path;
+	dirList->content = NULL;
+	dirList->contentJoliet = NULL;
+	dirList->idx = 0;
+	dirList->mtime = 0;
+	dirList->fileList = NULL;
+	dirList->parent = (parent) ? parent : dirList;
+	dirList->firstChild = NULL;
+	dirList->numChildren = 0;
+	dirList->next = NULL;
+	return dirList;
+}
+
+// Lists the subdirectories and files of a directory, in alphasort order, and stats them.
+// The subdirectories are left linked to each other from dirList->firstChild.
+static bool scanDirectory(DirList *dirList)
+{
+	struct dirent2 **entries;
+	file_stat_t statbuf;
+	DirList *tail = NULL;
+	FileList *fileList = NULL;
+	bool error = false;
 	int count;
-	int idx = 0;
 	
-	rootList = new DirList;	
-	rootList->path = dupString(inDir);
-	rootList->content = NULL;
-	rootList->contentJoliet = NULL;
-	rootList->fileList = NULL;
-	rootList->idx = idx++;
-	rootList->next = NULL;
-	dirList = tail = rootList;	
+	if (stat_file(dirList->path, &statbuf) < 0)
+		return false;
+	
+	dirList->mtime = statbuf.mtime;
+	
+	count = scandir(dirList->path, &entries, select_directories, alphasort);	
+	if (count < 0)
+		return false;
+	
+	for (int i = 0; i < count; i++)
+	{
+		DirList *child = newDirList(createPath(dirList->path, entries[i]->d_name), dirList);
 		
-	while (dirList)
-	{		
-		count = scandir(dirList->path, &dirs, select_directories, alphasort);	
-		if (count < 0)
-			return false;		
-				
-		for (int i = 0; i < count; i++)
-		{
-			tail = tail->next = new DirList;
-			tail->path = createPath(dirList->path, dirs[i]->d_name);
-			tail->content = NULL;
-			tail->contentJoliet = NULL;
-			tail->idx = idx++;
-			tail->fileList = NULL;
-			tail->next = NULL;			
-		
-			free(dirs[i]);			
-		}	
-	
-		free(dirs);
-		dirList = dirList->next;
+		if (tail)
+			tail->next = child;
+		else
+			dirList->firstChild = child;
+		
+		tail = child;
+		dirList->numChildren++;
+		free(entries[i]);
 	}
 	
-	dirList = rootList;
-	while (dirList)
+	free(entries);
+	
+	count = scandir(dirList->path, &entries, select_files, alphasort);
+	for (int i = 0; i < count; i++)
 	{
-		struct dirent2 **files;
-		FileList *fileList = NULL;
-		bool error = false;
-		
-		count = scandir(dirList->path, &files, select_files, alphasort);
-		for (int i = 0; i < count; i++)
+		if (!error)
 		{
-			if (!error)
+			bool multipart = false;
+			
+			char *p = strrchr(entries[i]->d_name, '.');
+			if (p && strlen(p+1) == 5)
 			{
-				bool multipart = false;
-				
-				char *p = strrchr(files[i]->d_name, '.');
-				if (p && strlen(p+1) == 5)
+				if (p[1] == '6' && p[2] == '6' && p[3] == '6' && isdigit(p[4]) && isdigit(p[5]))
 				{
-					if (p[1] == '6' && p[2] == '6' && p[3] == '6' && isdigit(p[4]) && isdigit(p[5]))
+					multipart = true;
+					
+					if (p[4] != '0' || p[5] != '0')
 					{
-						multipart = true;
-						
-						if (p[4] != '0' || p[5] != '0')
-						{
-							free(files[i]);
-							continue;
-						}
+						free(entries[i]);
+						continue;
 					}
 				}
-				
-				if (i == 0)
-				{
-					fileList = dirList->fileList = new FileList;
-				}
-				else
-				{
-					fileList = fileList->next = new FileList;
-				}
-				
-				fileList->path = createPath(dirList->path, files[i]->d_name);
-				fileList->multipart = multipart;
-				fileList->next = NULL;
-				
-				if (getFileSizeAndProcessMultipart(fileList->path, &fileList->size))
-				{
-					fileList->rlba = filesSizeSectors;
-					filesSizeSectors += bytesToSectors(fileList->size);					
-				}
-				else
-				{
-					error = true;
-				}				
 			}
 			
-			free(files[i]);
+			if (fileList)
+				fileList = fileList->next = new FileList;
+			else
+				fileList = dirList->fileList = new FileList;
+			
+			fileList->path = createPath(dirList->path, entries[i]->d_name);
+			fileList->rlba = 0;
+			fileList->multipart = multipart;
+			fileList->next = NULL;
+			
+			if (!getFileSizeAndProcessMultipart(fileList->path, &fileList->size, &fileList->mtime, &fileList->numParts, &fileList->partEnds))
+				error = true;
 		}
 		
-		if (count >= 0)
-			free(files);
+		free(entries[i]);
+	}
+	
+	if (count >= 0)
+		free(entries);
+	
+	return !error;
+}
+
+static void *scan_thread(void *arg)
+{
+	ScanJob *job = (ScanJob *)arg;
+	
+	for (;;)
+	{
+		mutex_lock(&job->mutex);
+		int i = job->next++;
+		mutex_unlock(&job->mutex);
 		
-		if (error)
-			return false;
+		if (i >= job->count)
+			break;
 		
-		dirList = dirList->next;
+		if (!scanDirectory(job->dirs[i]))
+		{
+			mutex_lock(&job->mutex);
+			job->error = true;
+			mutex_unlock(&job->mutex);
+		}
 	}
 	
-	// Add iso directories
-	dirList = rootList;
-	while (dirList)
+	return NULL;
+}
+
+// Scans the directories with up to VISO_SCAN_THREADS threads, the calling one included
+static bool scanDirectories(DirList **dirs, int count)
+{
+	thread_t threads[VISO_SCAN_THREADS];
+	int numThreads = 0;
+	ScanJob job;
+	
+	job.dirs = dirs;
+	job.count = count;
+	job.next = 0;
+	job.error = false;
+	mutex_init(&job.mutex);
+	
+	for (int i = 1; i < MIN(count, VISO_SCAN_THREADS); i++)
 	{
-		if (!buildContent(dirList, false))
+		if (create_start_thread(&threads[numThreads], scan_thread, &job) == 0)
+			numThreads++;
+	}
+	
+	scan_thread(&job);
+	
+	for (int i = 0; i < numThreads; i++)
+		join_thread(threads[i]);
+	
+	mutex_destroy(&job.mutex);
+	return !job.error;
+}
+
+void *VIsoFile::buildJolietThread(void *arg)
+{
+	JolietJob *job = (JolietJob *)arg;
+	
+	job->ret = true;
+	
+	for (DirList *dirList = job->viso->rootList; dirList && job->ret; dirList = dirList->next)
+		job->ret = job->viso->buildContent(dirList, true, job->buf, TEMP_BUF_SIZE);
+	
+	return NULL;
+}
+
+bool VIsoFile::build(char *inDir)
+{
+	DirList *dirList, *tail;
+	DirList *level;
+	int levelCount;
+	int idx = 0;
+	bool ret = true;
+	
+	rootList = newDirList(dupString(inDir), NULL);
+	rootList->idx = idx++;
+	tail = level = rootList;
+	levelCount = 1;
+	
+	// Scan a level of the tree at a time. The subdirectories are appended to the list in the
+	// same breadth first order a serial scan gives, so the image doesn't depend on timing.
+	while (levelCount > 0)
+	{
+		DirList **dirs = new DirList *[levelCount];
+		DirList *nextLevel = NULL;
+		int nextCount = 0;
+		
+		dirList = level;
+		for (int i = 0; i < levelCount; i++, dirList = dirList->next)
+			dirs[i] = dirList;
+		
+		ret = scanDirectories(dirs, levelCount);
+		
+		for (int i = 0; i < levelCount; i++)
 		{
-			return false;
+			DirList *child = dirs[i]->firstChild;
+			
+			for (int j = 0; j < dirs[i]->numChildren; j++)
+			{
+				DirList *sibling = child->next;
+				
+				child->idx = idx++;
+				tail = tail->next = child;
+				child->next = NULL;
+				
+				if (!nextLevel)
+					nextLevel = child;
+				
+				nextCount++;
+				child = sibling;
+			}
 		}
 		
-		dirList = dirList->next;
+		delete[] dirs;
+		
+		if (!ret)
+			return false;
+		
+		level = nextLevel;
+		levelCount = nextCount;
 	}
 	
-	// Add joliet directories
-	dirList = rootList;
-	while (dirList)
+	for (dirList = rootList; dirList; dirList = dirList->next)
 	{
-		if (!buildContent(dirList, true))
+		for (FileList *fileList = dirList->fileList; fileList; fileList = fileList->next)
 		{
-			return false;
+			fileList->rlba = filesSizeSectors;
+			filesSizeSectors += bytesToSectors(fileList->size);
 		}
-		
-		dirList = dirList->next;
 	}
 	
+	// The iso and joliet directories are independent, build them at the same time
+	JolietJob jolietJob;
+	thread_t jolietThread;
+	bool threaded = false;
+	
+	jolietJob.viso = this;
+	jolietJob.buf = new uint8_t[TEMP_BUF_SIZE];
+	jolietJob.ret = false;
+	
+	if (create_start_thread(&jolietThread, buildJolietThread, &jolietJob) == 0)
+		threaded = true;
+	
+	for (dirList = rootList; dirList && ret; dirList = dirList->next)
+		ret = buildContent(dirList, false, tempBuf, tempBufSize);
+	
+	if (threaded)
+		join_thread(jolietThread);
+	else
+		buildJolietThread(&jolietJob);
+	
+	delete[] jolietJob.buf;
+	
+	if (!ret || !jolietJob.ret)
+		return false;
+	
 	pathTableL = buildPathTable(false, false, &pathTableSize);
 	pathTableM = buildPathTable(true, false, &pathTableSize);
 	pathTableJolietL = buildPathTable(false, true, &pathTableSizeJoliet);
@@ -1305,6 +1427,252 @@ void VIsoFile::write(const char *volumeName, const char *gameCode)
 	}
 }
 
+// Builds the table used by pread to find the file at an offset. Files are laid out in list order,
+// so the extents come out sorted.
+bool VIsoFile::buildExtents(void)
+{
+	uint32_t count = 0;
+	
+	for (DirList *dirList = rootList; dirList; dirList = dirList->next)
+	{
+		for (FileList *fileList = dirList->fileList; fileList; fileList = fileList->next)
+		{
+			if (fileList->size > 0)
+				count++;
+		}
+	}
+	
+	extents = new FileExtent[count+1];
+	numExtents = 0;
+	
+	for (DirList *dirList = rootList; dirList; dirList = dirList->next)
+	{
+		for (FileList *fileList = dirList->fileList; fileList; fileList = fileList->next)
+		{
+			if (fileList->size == 0)
+				continue;
+			
+			FileExtent *extent = &extents[numExtents++];
+			
+			extent->startLba = fileList->rlba;
+			extent->endLba = fileList->rlba + bytesToSectors(fileList->size);
+			extent->file = fileList;
+			
+			if (numExtents > 1 && extent->startLba < extent[-1].endLba)
+			{
+				fprintf(stderr, "VISO: overlapping files %s and %s\n", extent[-1].file->path, fileList->path);
+				return false;
+			}
+		}
+	}
+	
+	return true;
+}
+
+// Looks for the handle of a backing file in the cache and takes it. Must be called with openFilesMutex held.
+int VIsoFile::findOpenFile(FileList *fileList, int part, file_t *fd, uint64_t *fileId)
+{
+	for (int i = 0; i < VISO_MAX_OPEN_FILES; i++)
+	{
+		OpenFile *openFile = &openFiles[i];
+		
+		if (openFile->file == fileList && openFile->part == part)
+		{
+			openFile->users++;
+			openFile->lastUse = ++openFilesTick;
+			*fd = openFile->fd;
+			*fileId = openFile->fileId;
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+// Gets an open handle of a backing file, reusing the one of a previous read if possible.
+// Returns the cache slot, -1 if the handle couldn't be cached and -2 on error.
+// The file is opened without the lock, a slow open doesn't hold the reads of the other files.
+int VIsoFile::acquireFile(FileList *fileList, int part, file_t *fd, uint64_t *fileId)
+{
+	file_t unused = INVALID_FD;
+	file_t newFd;
+	uint64_t newFileId;
+	int slot;
+	
+	mutex_lock(&openFilesMutex);
+	slot = findOpenFile(fileList, part, fd, fileId);
+	mutex_unlock(&openFilesMutex);
+	
+	if (slot >= 0)
+		return slot;
+	
+	if (fileList->multipart)
+	{
+		char path[MAX_PATH];
+		
+		snprintf(path, sizeof(path), "%s.666%02d", fileList->path, part);
+		newFd = open_file(path, O_RDONLY);
+	}
+	else
+	{
+		newFd = open_file(fileList->path, O_RDONLY);
+	}
+	
+	if (!FD_OK(newFd))
+		return -2;
+	
+	if (get_file_id(newFd, &newFileId) < 0)
+		newFileId = 0;
+	
+	mutex_lock(&openFilesMutex);
+	
+	// Another thread may have opened it meanwhile
+	slot = findOpenFile(fileList, part, fd, fileId);
+	
+	if (slot >= 0)
+	{
+		unused = newFd;
+	}
+	else
+	{
+		*fd = newFd;
+		*fileId = newFileId;
+		
+		// Evict the least recently used handle not being read
+		for (int i = 0; i < VISO_MAX_OPEN_FILES; i++)
+		{
+			if (openFiles[i].users == 0 && (slot < 0 || openFiles[i].lastUse < openFiles[slot].lastUse))
+				slot = i;
+		}
+		
+		if (slot >= 0)
+		{
+			OpenFile *openFile = &openFiles[slot];
+			
+			unused = openFile->fd;
+			openFile->file = fileList;
+			openFile->part = part;
+			openFile->fd = newFd;
+			openFile->fileId = newFileId;
+			openFile->users = 1;
+			openFile->lastUse = ++openFilesTick;
+		}
+	}
+	
+	mutex_unlock(&openFilesMutex);
+	
+	if (FD_OK(unused))
+		close_file(unused);
+	
+	return slot;
+}
+
+void VIsoFile::releaseFile(int slot, file_t fd)
+{
+	if (slot < 0)
+	{
+		close_file(fd);
+		return;
+	}
+	
+	mutex_lock(&openFilesMutex);
+	openFiles[slot].users--;
+	mutex_unlock(&openFilesMutex);
+}
+
+void VIsoFile::closeFiles(void)
+{
+	mutex_lock(&openFilesMutex);
+	
+	for (int i = 0; i < VISO_MAX_OPEN_FILES; i++)
+	{
+		if (FD_OK(openFiles[i].fd))
+			close_file(openFiles[i].fd);
+		
+		openFiles[i].file = NULL;
+		openFiles[i].fd = INVALID_FD;
+		openFiles[i].users = 0;
+	}
+	
+	mutex_unlock(&openFilesMutex);
+}
+
+// Reads size bytes at offset of a backing file. Split files are read from the .666XX part(s) holding the data.
+bool VIsoFile::readFile(FileList *fileList, uint8_t *buf, uint64_t size, uint64_t offset)
+{
+	while (size > 0)
+	{
+		int part = 0;
+		uint64_t partStart = 0;
+		uint64_t partEnd = fileList->size;
+		file_t fd;
+		uint64_t file_id;
+		ssize_t this_r;
+		
+		if (fileList->multipart)
+		{
+			while (part < fileList->numParts-1 && offset >= (uint64_t)fileList->partEnds[part])
+				part++;
+			
+			partStart = (part > 0) ? fileList->partEnds[part-1] : 0;
+			partEnd = fileList->partEnds[part];
+		}
+		
+		uint64_t to_read = MIN(size, partEnd-offset);
+		
+		int slot = acquireFile(fileList, part, &fd, &file_id);
+		if (slot == -2)
+		{
+			fprintf(stderr, "VISO: file %s (part %d) cannot be opened!\n", fileList->path, part);
+			return false;
+		}
+		
+		if (file_id != 0)
+			this_r = BlockCache::pread(fd, file_id, buf, to_read, offset-partStart);
+		else
+			this_r = pread_file(fd, buf, to_read, offset-partStart);
+		
+		releaseFile(slot, fd);
+		
+		if (this_r < 0)
+		{
+			fprintf(stderr, "VISO: read_file failed on %s\n", fileList->path);
+			return false;
+		}
+		
+		if ((uint64_t)this_r != to_read)
+		{
+			fprintf(stderr, "VISO: read on file %s returned less data than expected (file modified?)\n", fileList->path);
+			return false;
+		}
+		
+		buf += to_read;
+		size -= to_read;
+		offset += to_read;
+	}
+	
+	return true;
+}
+
+// Returns the index of the first extent ending after lba, numExtents if there is none
+uint32_t VIsoFile::findExtent(uint32_t lba)
+{
+	uint32_t low = 0;
+	uint32_t high = numExtents;
+	
+	while (low < high)
+	{
+		uint32_t mid = low + (high-low) / 2;
+		
+		if (extents[mid].endLba <= lba)
+			low = mid+1;
+		else
+			high = mid;
+	}
+	
+	return low;
+}
+
 bool VIsoFile::generate(char *inDir, const char *volumeName, const char *gameCode)
 {
 	off64_t padSectors;
@@ -1317,7 +1685,7 @@ bool VIsoFile::generate(char *inDir, const char *volumeName, const char *gameCod
 	delete[] tempBuf;
 	tempBuf = NULL;
 	
-	if (!ret)
+	if (!ret || !buildExtents())
 		return false;
 	
 	fsBufSize = (0xA000/0x800) + (bytesToSectors(pathTableSize) * 2) + (bytesToSectors(pathTableSizeJoliet) * 2) + dirsSizeSectors + dirsSizeSectorsJoliet;	
@@ -1347,6 +1715,243 @@ bool VIsoFile::generate(char *inDir, const char *volumeName, const char *gameCod
 	return true;
 }
 
+char *VIsoFile::cacheDir = NULL;
+
+void VIsoFile::setCacheDirectory(const char *dir)
+{
+	if (cacheDir)
+		delete[] cacheDir;
+	
+	cacheDir = (dir) ? dupString(dir) : NULL;
+}
+
+void VIsoFile::getCachePath(const char *inDir, char *cachePath, size_t size)
+{
+	uint64_t h = hashString(inDir, 0xCBF29CE484222325ULL);
+	
+	snprintf(cachePath, size, "%s/%016llx.%s", cacheDir, (long long unsigned int)h, (ps3Mode) ? "ps3" : "dvd");
+}
+
+// Restores the image built by a previous open, if no directory or file size changed since then
+bool VIsoFile::loadCache(const char *inDir, const char *volumeName, const char *gameCode)
+{
+	char cachePath[MAX_PATH];
+	VIsoCacheHeader header;
+	file_stat_t st;
+	FileList *fileList = NULL;
+	char *path = NULL;
+	bool ret = false;
+	
+	getCachePath(inDir, cachePath, sizeof(cachePath));
+	
+	FILE *f = fopen(cachePath, "rb");
+	if (!f)
+		return false;
+	
+	if (fread(&header, 1, sizeof(header), f) != sizeof(header) || header.magic != VISO_CACHE_MAGIC || header.version != VISO_CACHE_VERSION ||
+		header.ps3Mode != ps3Mode || header.pathLen != strlen(inDir) || header.pathLen >= MAX_PATH ||
+		strncmp(header.volumeName, volumeName, sizeof(header.volumeName)) != 0 || (ps3Mode && strncmp(header.gameCode, gameCode, sizeof(header.gameCode)) != 0))
+	{
+		fclose(f);
+		return false;
+	}
+	
+	path = new char[MAX_PATH];
+	
+	if (fread(path, 1, header.pathLen, f) != header.pathLen || memcmp(path, inDir, header.pathLen) != 0)
+		goto done;
+	
+	for (uint32_t i = 0; i < header.numDirs; i++)
+	{
+		uint32_t len;
+		uint64_t mtime;
+		
+		if (fread(&len, 1, sizeof(len), f) != sizeof(len) || fread(&mtime, 1, sizeof(mtime), f) != sizeof(mtime) || len >= MAX_PATH)
+			goto done;
+		
+		if (fread(path, 1, len, f) != len)
+			goto done;
+		
+		path[len] = 0;
+		
+		// Entries added, removed or renamed change the mtime of their directory
+		if (stat_file(path, &st) != 0 || st.mtime != mtime)
+			goto done;
+	}
+	
+	rootList = newDirList(dupString(inDir), NULL);
+	
+	for (uint32_t i = 0; i < header.numFiles; i++)
+	{
+		uint32_t len, rlba, numParts;
+		uint64_t size;
+		
+		if (fread(&len, 1, sizeof(len), f) != sizeof(len) || fread(&rlba, 1, sizeof(rlba), f) != sizeof(rlba) ||
+			fread(&size, 1, sizeof(size), f) != sizeof(size) || fread(&numParts, 1, sizeof(numParts), f) != sizeof(numParts) ||
+			len >= MAX_PATH - 8 || numParts < 1 || numParts > 100)
+			goto done;
+		
+		if (fileList)
+			fileList = fileList->next = new FileList;
+		else
+			fileList = rootList->fileList = new FileList;
+		
+		fileList->path = new char[len+1];
+		fileList->rlba = rlba;
+		fileList->size = size;
+		fileList->mtime = 0;
+		fileList->multipart = (numParts > 1);
+		fileList->numParts = numParts;
+		fileList->partEnds = NULL;
+		fileList->next = NULL;
+		
+		if (fread(fileList->path, 1, len, f) != len)
+			goto done;
+		
+		fileList->path[len] = 0;
+		
+		if (fileList->multipart)
+		{
+			fileList->partEnds = new off64_t[numParts];
+			
+			if (fread(fileList->partEnds, sizeof(off64_t), numParts, f) != numParts)
+				goto done;
+			
+			for (uint32_t j = 0; j < numParts; j++)
+			{
+				snprintf(path, MAX_PATH, "%s.666%02d", fileList->path, j);
+				
+				if (stat_file(path, &st) != 0 || (off64_t)st.file_size != fileList->partEnds[j] - ((j > 0) ? fileList->partEnds[j-1] : 0))
+					goto done;
+			}
+		}
+		else if (stat_file(fileList->path, &st) != 0 || (off64_t)st.file_size != fileList->size)
+		{
+			goto done;
+		}
+	}
+	
+	// fsBuf takes the rest of the file
+	{
+		long pos = ftell(f);
+		
+		if (pos < 0 || fseek(f, 0, SEEK_END) != 0 || (uint64_t)(ftell(f) - pos) != header.fsBufSize || fseek(f, pos, SEEK_SET) != 0)
+			goto done;
+	}
+	
+	fsBufSize = header.fsBufSize;
+	fsBuf = new uint8_t[fsBufSize];
+	
+	if (fread(fsBuf, 1, fsBufSize, f) != fsBufSize || !buildExtents())
+		goto done;
+	
+	volumeSize = header.volumeSize;
+	totalSize = header.totalSize;
+	padAreaStart = header.padAreaStart;
+	padAreaSize = header.padAreaSize;
+	ret = true;
+	
+done:
+	fclose(f);
+	delete[] path;
+	
+	if (!ret)
+		reset();
+	
+	return ret;
+}
+
+void VIsoFile::saveCache(const char *inDir, const char *volumeName, const char *gameCode, time_t buildTime)
+{
+	char cachePath[MAX_PATH];
+	char tempPath[MAX_PATH];
+	VIsoCacheHeader header;
+	file_stat_t st;
+	bool ok = true;
+	
+	memset(&header, 0, sizeof(header));
+	header.magic = VISO_CACHE_MAGIC;
+	header.version = VISO_CACHE_VERSION;
+	header.ps3Mode = ps3Mode;
+	strncpy(header.volumeName, volumeName, sizeof(header.volumeName)-1);
+	
+	if (ps3Mode)
+		strncpy(header.gameCode, gameCode, sizeof(header.gameCode)-1);
+	
+	header.pathLen = strlen(inDir);
+	header.volumeSize = volumeSize;
+	header.fsBufSize = fsBufSize;
+	header.totalSize = totalSize;
+	header.padAreaStart = padAreaStart;
+	header.padAreaSize = padAreaSize;
+	
+	for (DirList *dirList = rootList; dirList; dirList = dirList->next)
+	{
+		header.numDirs++;
+		
+		for (FileList *fileList = dirList->fileList; fileList; fileList = fileList->next)
+			header.numFiles++;
+	}
+	
+	getCachePath(inDir, cachePath, sizeof(cachePath));
+	snprintf(tempPath, sizeof(tempPath), "%s.%p", cachePath, (void *)this);
+	
+	FILE *f = fopen(tempPath, "wb");
+	if (!f)
+		return;
+	
+	ok = (fwrite(&header, 1, sizeof(header), f) == sizeof(header) && fwrite(inDir, 1, header.pathLen, f) == header.pathLen);
+	
+	for (DirList *dirList = rootList; ok && dirList; dirList = dirList->next)
+	{
+		uint32_t len = strlen(dirList->path);
+		
+		// Don't save a tree that changed while being scanned
+		if (stat_file(dirList->path, &st) != 0 || st.mtime >= (uint64_t)buildTime)
+		{
+			ok = false;
+			break;
+		}
+		
+		ok = (fwrite(&len, 1, sizeof(len), f) == sizeof(len) && fwrite(&st.mtime, 1, sizeof(st.mtime), f) == sizeof(st.mtime) &&
+			fwrite(dirList->path, 1, len, f) == len);
+	}
+	
+	for (DirList *dirList = rootList; ok && dirList; dirList = dirList->next)
+	{
+		for (FileList *fileList = dirList->fileList; ok && fileList; fileList = fileList->next)
+		{
+			uint32_t len = strlen(fileList->path);
+			uint32_t numParts = (fileList->multipart) ? fileList->numParts : 1;
+			uint64_t size = fileList->size;
+			
+			ok = (fwrite(&len, 1, sizeof(len), f) == sizeof(len) && fwrite(&fileList->rlba, 1, sizeof(fileList->rlba), f) == sizeof(fileList->rlba) &&
+				fwrite(&size, 1, sizeof(size), f) == sizeof(size) && fwrite(&numParts, 1, sizeof(numParts), f) == sizeof(numParts) &&
+				fwrite(fileList->path, 1, len, f) == len);
+			
+			if (ok && numParts > 1)
+				ok = (fwrite(fileList->partEnds, sizeof(off64_t), numParts, f) == numParts);
+		}
+	}
+	
+	if (ok)
+		ok = (fwrite(fsBuf, 1, fsBufSize, f) == fsBufSize);
+	
+	if (fclose(f) != 0)
+		ok = false;
+	
+	if (ok)
+	{
+#ifdef WIN32
+		unlink(cachePath);
+#endif
+		ok = (rename(tempPath, cachePath) == 0);
+	}
+	
+	if (!ok)
+		unlink(tempPath);
+}
+
 int VIsoFile::open(const char *path, int flags)
 {
 	file_stat_t st;
@@ -1390,9 +1995,20 @@ int VIsoFile::open(const char *path, int flags)
 		snprintf(volumeName, sizeof(volumeName), "%s", dn);
 	}
 	
+	if (cacheDir && loadCache(path, volumeName, gameCode))
+	{
+		DPRINTF("VISO: %s loaded from cache\n", path);
+		return 0;
+	}
+	
+	time_t buildTime = time(NULL);
+	
 	if (!generate((char *)path, volumeName, gameCode))
 		return -1;
 	
+	if (cacheDir)
+		saveCache(path, volumeName, gameCode, buildTime);
+	
 	return 0;
 }
 
@@ -1405,9 +2021,8 @@ int VIsoFile::close(void)
 	return 0;
 }
 
-ssize_t VIsoFile::read(void *buf, size_t nbyte)
+ssize_t VIsoFile::pread(void *buf, size_t nbyte, int64_t offset)
 {
-	DirList *dirList;
 	uint64_t remaining, to_read;
 	uint64_t r;
 	uint8_t *p;
@@ -1419,126 +2034,100 @@ ssize_t VIsoFile::read(void *buf, size_t nbyte)
 	r = 0;
 	p = (uint8_t *)buf;
 	
-	if (vFilePtr >= totalSize || remaining == 0)
+	if (offset >= totalSize || remaining == 0)
 	{
 		return 0;
 	}
-	else if (vFilePtr < 0)
+	else if (offset < 0)
 	{
 		return -1;
 	}
 	
-	if (vFilePtr < fsBufSize)
+	if (offset < (int64_t)fsBufSize)
 	{
 		// Read FS structure from RAM
-		to_read = MIN(fsBufSize-vFilePtr, remaining);
-		memcpy(p, fsBuf+vFilePtr, to_read);
+		to_read = MIN(fsBufSize-offset, remaining);
+		memcpy(p, fsBuf+offset, to_read);
 		
 		remaining -= to_read;
 		r += to_read;
 		p += to_read;
-		vFilePtr += to_read;
+		offset += to_read;
 	}
 	
-	if (remaining == 0 || vFilePtr >= totalSize)
+	if (remaining == 0 || offset >= totalSize)
 		return r;
 	
-	if (vFilePtr < padAreaStart)
+	if (offset < padAreaStart)
 	{
 		// Read from file(s)
-		dirList = rootList;	
-		while (dirList)
-		{
-			FileList *fileList = dirList->fileList;
+		uint32_t i = findExtent((offset-fsBufSize) / 0x800);
 		
-			while (fileList)
-			{
-				uint64_t fStart = (uint64_t)fsBufSize + (uint64_t)fileList->rlba * 0x800;
-				uint64_t fEnd = fStart + fileList->size;
-				uint64_t fEndSector = ((fEnd+0x7ffULL)&~0x7ffULL);
+		for (; i < numExtents; i++)
+		{
+			FileList *fileList = extents[i].file;
+			uint64_t fStart = (uint64_t)fsBufSize + (uint64_t)extents[i].startLba * 0x800;
+			uint64_t fEnd = fStart + fileList->size;
+			uint64_t fEndSector = (uint64_t)fsBufSize + (uint64_t)extents[i].endLba * 0x800;
 			
-				if (vFilePtr >= fStart && vFilePtr < fEndSector)
-				{
-					if (fileList->multipart)
-					{
-						fprintf(stderr, "Sorry no support for 666 files. I have the feeling that your game is about to crash ^_^\n");
-						return r;
-					}
-				
-					if (vFilePtr < fEnd)
-					{
-						file_t fd;
-						ssize_t this_r;
-					
-						to_read = MIN(fileList->size-(vFilePtr-fStart), remaining);
-						fd = open_file(fileList->path, O_RDONLY);
-					
-						if (!FD_OK(fd))
-						{
-							fprintf(stderr, "VISO: file %s cannot be opened!\n", fileList->path);
-							return r;
-						}
-					
-						seek_file(fd, vFilePtr-fStart, SEEK_SET);
-						this_r = read_file(fd, p, to_read);
-						close_file(fd);
-					
-						if (this_r < 0)
-						{
-							fprintf(stderr, "VISO: read_file failed on %s\n", fileList->path);
-							return r;
-						}
-					
-						if (this_r != to_read)
-						{
-							fprintf(stderr, "VISO: read on file %s returned less data than expected (file modified?)\n", fileList->path);
-							return r;
-						}
-					
-						remaining -= to_read;
-						r += to_read;
-						p += to_read;
-						vFilePtr += to_read;
-					}
+			if ((uint64_t)offset < fStart)
+				break;
+			
+			if ((uint64_t)offset < fEnd)
+			{
+				to_read = MIN(fileList->size-(offset-fStart), remaining);
 				
-					if (remaining > 0 && fEnd != fEndSector)
-					{
-						// This is a zero area after the file to fill the sector
-						to_read = MIN((fEndSector-fEnd)-(vFilePtr-fEnd), remaining);
-						memset(p, 0, to_read);
-					
-						remaining -= to_read;
-						r += to_read;
-						p += to_read;
-						vFilePtr += to_read;
-					}
+				if (!readFile(fileList, p, to_read, offset-fStart))
+					return r;
 				
-					if (remaining == 0)
-						return r;
-				}
+				remaining -= to_read;
+				r += to_read;
+				p += to_read;
+				offset += to_read;
+			}
 			
-				fileList = fileList->next;
+			if (remaining > 0 && fEnd != fEndSector)
+			{
+				// This is a zero area after the file to fill the sector
+				to_read = MIN((fEndSector-fEnd)-(offset-fEnd), remaining);
+				memset(p, 0, to_read);
+				
+				remaining -= to_read;
+				r += to_read;
+				p += to_read;
+				offset += to_read;
 			}
-		
-			dirList = dirList->next;
+			
+			if (remaining == 0)
+				return r;
 		}
 	}
 	
-	if (vFilePtr >= padAreaStart && vFilePtr < totalSize)
+	if (offset >= padAreaStart && offset < totalSize)
 	{
 		// Pad at the end
-		to_read = MIN(padAreaSize-(vFilePtr-padAreaStart), remaining);
+		to_read = MIN(padAreaSize-(offset-padAreaStart), remaining);
 		memset(p, 0, to_read);
 		
 		remaining -= to_read;
 		r += to_read;
 		p += to_read;
-		vFilePtr += to_read;
+		offset += to_read;
 	}
 	
 	return r;
 }
 
+ssize_t VIsoFile::read(void *buf, size_t nbyte)
+{
+	ssize_t r = pread(buf, nbyte, vFilePtr);
+	
+	if (r > 0)
+		vFilePtr += r;
+	
+	return r;
+}
+
 ssize_t VIsoFile::write(void *buf, size_t nbyte)
 {
 	return -1;
@@ -1577,3 +2166,20 @@ int VIsoFile::fstat(file_stat_t *fs)
 	
 	return 0;
 }
+
+int VIsoFile::get_zero_runs(int64_t offset, int64_t nbyte, zero_run_t *runs, int max_runs)
+{
+	int num_runs = 0;
+	
+	if (!fsBuf || max_runs <= 0)
+		return 0;
+	
+	// Only the pad at the end is reported, the padding after each file is less than a sector
+	int64_t start = (offset > (int64_t)padAreaStart) ? offset : (int64_t)padAreaStart;
+	int64_t end = MIN(offset + nbyte, (int64_t)totalSize);
+	
+	if (start < end)
+		add_zero_run(runs, &num_runs, max_runs, start, end - start);
+	
+	return num_runs;
+}
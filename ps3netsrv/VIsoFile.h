@@ -6,12 +6,21 @@
 #include "compat.h"
 #include "iso9660.h"
 
+#define VISO_MAX_OPEN_FILES	16
+#define VISO_SCAN_THREADS	8
+
+#define VISO_CACHE_MAGIC	0x484341434F534956ULL // "VISOCACH"
+#define VISO_CACHE_VERSION	1
+
 typedef struct _FileList
 {
 	char *path;
 	uint32_t rlba;
 	off64_t size;
+	uint64_t mtime;
 	bool multipart;
+	int numParts;
+	off64_t *partEnds; // multipart: offset of the end of each part
 	struct _FileList *next;
 } FileList;
 
@@ -23,10 +32,52 @@ typedef struct _DirList
 	size_t contentSize;
 	size_t contentJolietSize;
 	int idx;
+	uint64_t mtime;
 	FileList *fileList;
+	struct _DirList *parent;
+	struct _DirList *firstChild; // the children follow it in the list
+	int numChildren;
 	struct _DirList *next;
 } DirList;
 
+// Location of a file in the virtual iso, sectors relative to the start of the files area
+typedef struct
+{
+	uint32_t startLba; // inclusive
+	uint32_t endLba; // exclusive
+	FileList *file;
+} FileExtent;
+
+// Header of a metadata cache file. It is followed by the path of the directory, the directories
+// (mtime, path), the files (rlba, size, parts, path) and finally fsBuf.
+typedef struct
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t ps3Mode;
+	char volumeName[32];
+	char gameCode[64];
+	uint32_t pathLen;
+	uint32_t numDirs;
+	uint32_t numFiles;
+	uint32_t volumeSize;
+	uint64_t fsBufSize;
+	uint64_t totalSize;
+	uint64_t padAreaStart;
+	uint64_t padAreaSize;
+} VIsoCacheHeader;
+
+// Backing file kept open between reads
+typedef struct
+{
+	FileList *file;
+	int part;
+	file_t fd;
+	uint64_t fileId;
+	int users;
+	uint32_t lastUse;
+} OpenFile;
+
 typedef struct 
 {
 	/*00*/uint32_t startSector;// first sector of the range (inclusive)
@@ -66,6 +117,13 @@ private:
 		
 	DirList *rootList;
 	
+	FileExtent *extents;
+	uint32_t numExtents;
+	
+	mutex_t openFilesMutex;
+	OpenFile openFiles[VISO_MAX_OPEN_FILES];
+	uint32_t openFilesTick;
+	
 	uint32_t filesSizeSectors;
 	uint32_t dirsSizeSectors;
 	uint32_t dirsSizeSectorsJoliet;
@@ -86,18 +144,31 @@ private:
 	void reset(void);
 	
 	DirList *getParent(DirList *dirList);	
-	bool isDirectChild(DirList *dir, DirList *parentCheck);
 	Iso9660DirectoryRecord *findDirRecord(char *dirName, Iso9660DirectoryRecord *parentRecord, size_t size, bool joliet);
 	
 	uint8_t *buildPathTable(bool msb, bool joliet, size_t *retSize);
-	bool buildContent(DirList *dirList, bool joliet);
+	bool buildContent(DirList *dirList, bool joliet, uint8_t *buf, size_t bufSize);
+	static void *buildJolietThread(void *arg);
 	void fixDirLba(Iso9660DirectoryRecord *record, size_t size, uint32_t dirLba, uint32_t filesLba);
 	void fixPathTableLba(uint8_t *pathTable, size_t size, uint32_t dirLba, bool msb);
 	void fixLba(uint32_t isoLba, uint32_t jolietLba, uint32_t filesLba);
 	bool build(char *inDir);
+	bool buildExtents(void);
+	uint32_t findExtent(uint32_t lba);
+	int findOpenFile(FileList *fileList, int part, file_t *fd, uint64_t *fileId);
+	int acquireFile(FileList *fileList, int part, file_t *fd, uint64_t *fileId);
+	void releaseFile(int slot, file_t fd);
+	void closeFiles(void);
+	bool readFile(FileList *fileList, uint8_t *buf, uint64_t size, uint64_t offset);
 	void write(const char *volumeName, const char *gameCode);
 	bool generate(char *inDir, const char *volumeName, const char *gameCode);
 	
+	static char *cacheDir;
+	
+	void getCachePath(const char *inDir, char *cachePath, size_t size);
+	bool loadCache(const char *inDir, const char *volumeName, const char *gameCode);
+	void saveCache(const char *inDir, const char *volumeName, const char *gameCode, time_t buildTime);
+	
 public:
 	VIsoFile(bool ps3Mode);
 	~VIsoFile();
@@ -105,9 +176,14 @@ public:
 	virtual int open(const char *path, int flags);
 	virtual int close(void);
 	virtual ssize_t read(void *buf, size_t nbyte);
+	virtual ssize_t pread(void *buf, size_t nbyte, int64_t offset);
 	virtual ssize_t write(void *buf, size_t nbyte);
 	virtual int64_t seek(int64_t offset, int whence);
 	virtual int fstat(file_stat_t *fs);
+	virtual int get_zero_runs(int64_t offset, int64_t nbyte, zero_run_t *runs, int max_runs);
+	
+	// Directory where the metadata of the generated images is saved, so they are opened again without rescanning
+	static void setCacheDirectory(const char *dir);
 };
 
 #endif
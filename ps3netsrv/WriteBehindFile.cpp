@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "WriteBehindFile.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+WriteBehindFile::WriteBehindFile(int max_buffers, int64_t preallocate_size)
+{
+	fd = INVALID_FD;
+	position = 0;
+	allocated = 0;
+	this->max_buffers = (max_buffers > 0) ? max_buffers : 1;
+	this->preallocate_size = preallocate_size;
+	num_buffers = 0;
+	error = 0;
+	stop = false;
+
+	current = NULL;
+	queue_head = queue_tail = NULL;
+	free_buffers = NULL;
+	writing = false;
+	thread_started = false;
+
+	mutex_init(&mutex);
+	cond_init(&cond);
+}
+
+WriteBehindFile::~WriteBehindFile()
+{
+	if (FD_OK(fd))
+		this->close();
+
+	cond_destroy(&cond);
+	mutex_destroy(&mutex);
+}
+
+int WriteBehindFile::open(const char *path, int flags)
+{
+	if (FD_OK(fd))
+		this->close();
+
+	if ((flags & (O_WRONLY|O_RDWR)) == 0)
+		return -1;
+
+	fd = open_file(path, flags);
+	if (!FD_OK(fd))
+		return -1;
+
+	position = 0;
+	allocated = 0;
+	error = 0;
+	stop = false;
+
+	if (create_start_thread(&thread, flush_thread, this) != 0)
+	{
+		close_file(fd);
+		fd = INVALID_FD;
+		return -1;
+	}
+
+	thread_started = true;
+	return 0;
+}
+
+void *WriteBehindFile::flush_thread(void *arg)
+{
+	WriteBehindFile *file = (WriteBehindFile *)arg;
+
+	mutex_lock(&file->mutex);
+
+	for (;;)
+	{
+		while (!file->queue_head && !file->stop)
+			cond_wait(&file->cond, &file->mutex);
+
+		WriteBuffer *buffer = file->queue_head;
+		if (!buffer)
+			break;
+
+		file->queue_head = buffer->next;
+		if (!file->queue_head)
+			file->queue_tail = NULL;
+
+		file->writing = true;
+		mutex_unlock(&file->mutex);
+
+		int ret = file->write_buffer(buffer);
+
+		mutex_lock(&file->mutex);
+
+		if (ret != 0)
+			file->error = 1;
+
+		buffer->next = file->free_buffers;
+		file->free_buffers = buffer;
+		file->writing = false;
+		cond_broadcast(&file->cond);
+	}
+
+	mutex_unlock(&file->mutex);
+	return NULL;
+}
+
+int WriteBehindFile::write_buffer(WriteBuffer *buffer)
+{
+	int64_t end = buffer->offset + buffer->size;
+
+	// The space is reserved in big steps so the file isn't fragmented by the small writes of other files
+	if (preallocate_size > 0 && end > allocated)
+	{
+		int64_t start = (buffer->offset > allocated) ? buffer->offset : allocated;
+
+		if (allocate_file(fd, start, end - start + preallocate_size) == 0)
+			allocated = end + preallocate_size;
+		else
+			preallocate_size = 0;
+	}
+
+	uint32_t written = 0;
+
+	while (written < buffer->size)
+	{
+		ssize_t ret = pwrite_file(fd, buffer->data + written, buffer->size - written, buffer->offset + written);
+
+		if (ret <= 0)
+		{
+			DPRINTF("Error writing %u bytes at %llx of an upload\n", buffer->size - written, (long long unsigned int)(buffer->offset + written));
+			return -1;
+		}
+
+		written += ret;
+	}
+
+	return 0;
+}
+
+WriteBuffer *WriteBehindFile::get_buffer(void)
+{
+	// Called with the mutex locked
+	while (!free_buffers && num_buffers >= max_buffers)
+		cond_wait(&cond, &mutex);
+
+	WriteBuffer *buffer = free_buffers;
+
+	if (buffer)
+	{
+		free_buffers = buffer->next;
+		return buffer;
+	}
+
+	buffer = (WriteBuffer *)malloc(sizeof(WriteBuffer));
+	if (!buffer)
+		return NULL;
+
+	buffer->data = (uint8_t *)malloc(WRITEBEHIND_BUFFER_SIZE);
+	if (!buffer->data)
+	{
+		free(buffer);
+		return NULL;
+	}
+
+	num_buffers++;
+	return buffer;
+}
+
+void WriteBehindFile::queue_current(void)
+{
+	// Called with the mutex locked
+	if (!current)
+		return;
+
+	current->next = NULL;
+
+	if (queue_tail)
+		queue_tail->next = current;
+	else
+		queue_head = current;
+
+	queue_tail = current;
+	current = NULL;
+	cond_broadcast(&cond);
+}
+
+ssize_t WriteBehindFile::write(void *buf, size_t nbyte)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	size_t remaining = nbyte;
+
+	if (!FD_OK(fd))
+		return -1;
+
+	mutex_lock(&mutex);
+
+	while (remaining > 0 && !error)
+	{
+		// Only data that follows the buffer is appended to it
+		if (current && (current->offset + current->size != position || current->size == current->capacity))
+			queue_current();
+
+		if (!current)
+		{
+			current = get_buffer();
+			if (!current)
+			{
+				error = 1;
+				break;
+			}
+
+			current->offset = position;
+			current->size = 0;
+			current->capacity = WRITEBEHIND_BUFFER_SIZE - (uint32_t)(position % WRITEBEHIND_BUFFER_SIZE);
+		}
+
+		uint32_t n = (uint32_t)MIN(remaining, (size_t)(current->capacity - current->size));
+
+		memcpy(current->data + current->size, p, n);
+		current->size += n;
+		position += n;
+		p += n;
+		remaining -= n;
+
+		if (current->size == current->capacity)
+			queue_current();
+	}
+
+	int failed = error;
+	mutex_unlock(&mutex);
+
+	return (failed) ? -1 : (ssize_t)nbyte;
+}
+
+int WriteBehindFile::flush(void)
+{
+	mutex_lock(&mutex);
+	queue_current();
+
+	while (queue_head || writing)
+		cond_wait(&cond, &mutex);
+
+	int failed = error;
+	mutex_unlock(&mutex);
+
+	return (failed) ? -1 : 0;
+}
+
+int WriteBehindFile::close(void)
+{
+	if (!FD_OK(fd))
+		return -1;
+
+	int ret = flush();
+
+	mutex_lock(&mutex);
+	stop = true;
+	cond_broadcast(&cond);
+	mutex_unlock(&mutex);
+
+	if (thread_started)
+	{
+		join_thread(thread);
+		thread_started = false;
+	}
+
+	// Releases the space reserved past the end
+	file_stat_t st;
+
+	if (allocated > 0 && fstat_file(fd, &st) == 0)
+		truncate_file(fd, st.file_size);
+
+	// The upload is on disk once the file is closed
+	if (sync_file(fd) != 0)
+		ret = -1;
+
+	if (close_file(fd) != 0)
+		ret = -1;
+
+	fd = INVALID_FD;
+
+	while (free_buffers)
+	{
+		WriteBuffer *buffer = free_buffers;
+
+		free_buffers = buffer->next;
+		free(buffer->data);
+		free(buffer);
+	}
+
+	num_buffers = 0;
+
+	if (ret != 0)
+		DPRINTF("Error closing an upload\n");
+
+	return ret;
+}
+
+ssize_t WriteBehindFile::read(void *buf, size_t nbyte)
+{
+	(void) buf;
+	(void) nbyte;
+
+	return -1;
+}
+
+ssize_t WriteBehindFile::pread(void *buf, size_t nbyte, int64_t offset)
+{
+	(void) buf;
+	(void) nbyte;
+	(void) offset;
+
+	return -1;
+}
+
+int64_t WriteBehindFile::seek(int64_t offset, int whence)
+{
+	int64_t new_position;
+
+	if (whence == SEEK_SET)
+	{
+		new_position = offset;
+	}
+	else if (whence == SEEK_CUR)
+	{
+		new_position = position + offset;
+	}
+	else if (whence == SEEK_END)
+	{
+		file_stat_t st;
+
+		if (this->fstat(&st) < 0)
+			return -1;
+
+		new_position = st.file_size + offset;
+	}
+	else
+	{
+		return -1;
+	}
+
+	if (new_position < 0)
+		return -1;
+
+	// The buffer being filled is queued by the next write if it doesn't follow it
+	position = new_position;
+	return position;
+}
+
+int WriteBehindFile::fstat(file_stat_t *fs)
+{
+	if (!FD_OK(fd) || flush() != 0)
+		return -1;
+
+	return fstat_file(fd, fs);
+}
@@ -0,0 +1,67 @@
+#ifndef __WRITEBEHINDFILE_H__
+#define __WRITEBEHINDFILE_H__
+
+#include "AbstractFile.h"
+#include "compat.h"
+
+// Writes are gathered in buffers of this size, which end at multiples of it in the file
+#define WRITEBEHIND_BUFFER_SIZE	(4*1048576)
+
+typedef struct _WriteBuffer
+{
+	uint8_t *data;
+	int64_t offset;
+	uint32_t size;
+	uint32_t capacity;
+	struct _WriteBuffer *next;
+} WriteBuffer;
+
+// Write-only file for uploads. write() copies the data to a buffer and returns, a thread of the file
+// writes the buffers in order, so the client sends the next chunk while the disk works. Small
+// writes are coalesced into big aligned ones, space can be preallocated ahead of them (uploads
+// don't tell their size), and close() waits for all the data to be on disk. When more than max_buffers are waiting, write() waits
+// for the disk. An error writing a buffer fails the following write() calls and close().
+class WriteBehindFile : public AbstractFile
+{
+private:
+	file_t fd;
+	int64_t position;
+	int64_t allocated;
+	int64_t preallocate_size;
+	int max_buffers;
+	int num_buffers;
+	int error;
+	bool stop;
+
+	WriteBuffer *current;
+	WriteBuffer *queue_head;
+	WriteBuffer *queue_tail;
+	WriteBuffer *free_buffers;
+	bool writing;
+
+	mutex_t mutex;
+	cond_t cond;
+	thread_t thread;
+	bool thread_started;
+
+	void queue_current(void);
+	WriteBuffer *get_buffer(void);
+	int flush(void);
+	int write_buffer(WriteBuffer *buffer);
+
+	static void *flush_thread(void *arg);
+
+public:
+	WriteBehindFile(int max_buffers, int64_t preallocate_size);
+	~WriteBehindFile();
+
+	virtual int open(const char *path, int flags);
+	virtual int close(void);
+	virtual ssize_t read(void *buf, size_t nbyte);
+	virtual ssize_t pread(void *buf, size_t nbyte, int64_t offset);
+	virtual ssize_t write(void *buf, size_t nbyte);
+	virtual int64_t seek(int64_t offset, int whence);
+	virtual int fstat(file_stat_t *fs);
+};
+
+#endif
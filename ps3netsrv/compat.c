@@ -1,7 +1,34 @@
+#ifdef __linux__
+// fallocate, SEEK_HOLE
+#define _GNU_SOURCE
+#endif
+
+#include <time.h>
+
 #include "compat.h"
 
+// mtime_nsec tells apart the versions of a file rewritten within the same second. 0 is left for files without id.
+static uint64_t hash_file_id(uint64_t dev, uint64_t ino, uint64_t size, uint64_t mtime, uint64_t mtime_nsec)
+{
+	uint64_t values[5] = { dev, ino, size, mtime, mtime_nsec };
+	uint64_t h = 0xCBF29CE484222325ULL;
+	
+	for (int i = 0; i < 5; i++)
+	{
+		h ^= values[i];
+		h *= 0x100000001B3ULL;
+		h ^= h >> 29;
+	}
+	
+	return (h != 0) ? h : 1;
+}
+
 #ifdef WIN32
 
+#include <stdio.h>
+#include <string.h>
+#include <mswsock.h>
+
 int create_start_thread(thread_t *thread, void *(*start_routine)(void*), void *arg)
 {
 	thread_t t = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)start_routine, arg, 0, NULL);	
@@ -21,6 +48,111 @@ int join_thread(thread_t thread)
 	return 0;
 }
 
+int get_cpu_count(void)
+{
+	SYSTEM_INFO si;
+	
+	GetSystemInfo(&si);
+	return (int)si.dwNumberOfProcessors;
+}
+
+uint64_t get_time_usec(void)
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+int mutex_init(mutex_t *mutex)
+{
+	InitializeCriticalSection(mutex);
+	return 0;
+}
+
+int mutex_lock(mutex_t *mutex)
+{
+	EnterCriticalSection(mutex);
+	return 0;
+}
+
+int mutex_unlock(mutex_t *mutex)
+{
+	LeaveCriticalSection(mutex);
+	return 0;
+}
+
+int mutex_destroy(mutex_t *mutex)
+{
+	DeleteCriticalSection(mutex);
+	return 0;
+}
+
+int cond_init(cond_t *cond)
+{
+	InitializeConditionVariable(cond);
+	return 0;
+}
+
+int cond_wait(cond_t *cond, mutex_t *mutex)
+{
+	if (!SleepConditionVariableCS(cond, mutex, INFINITE))
+		return -1;
+	
+	return 0;
+}
+
+int cond_signal(cond_t *cond)
+{
+	WakeConditionVariable(cond);
+	return 0;
+}
+
+int cond_broadcast(cond_t *cond)
+{
+	WakeAllConditionVariable(cond);
+	return 0;
+}
+
+int cond_destroy(cond_t *cond)
+{
+	(void) cond;
+	return 0;
+}
+
+int recv_nonblock(int s, void *buf, int size)
+{
+	u_long available = 0;
+	
+	if (ioctlsocket(s, FIONREAD, &available) != 0)
+		return -1;
+	
+	// Nothing pending: the peer closed the connection if the socket is readable, else nothing came yet
+	if (available == 0)
+	{
+		fd_set fds;
+		struct timeval timeout = { 0, 0 };
+
+		FD_ZERO(&fds);
+		FD_SET(s, &fds);
+
+		int ret = select(s + 1, &fds, NULL, NULL, &timeout);
+		if (ret <= 0)
+			return (ret == 0) ? -2 : -1;
+
+		return recv(s, (char *)buf, size, 0);
+	}
+	
+	if ((int)available < size)
+		size = (int)available;
+	
+	return recv(s, (char *)buf, size, 0);
+}
+
 // Files
 
 file_t open_file(const char *path, int oflag)
@@ -105,6 +237,25 @@ ssize_t read_file(file_t fd, void *buf, size_t nbyte)
 	return rd;
 }
 
+ssize_t pread_file(file_t fd, void *buf, size_t nbyte, int64_t offset)
+{
+	OVERLAPPED ov = { 0 };
+	DWORD rd;
+	
+	ov.Offset = (DWORD)(offset&0xFFFFFFFF);
+	ov.OffsetHigh = (DWORD)(offset>>32);
+	
+	if (!ReadFile(fd, buf, nbyte, &rd, &ov))
+	{
+		if (GetLastError() == ERROR_HANDLE_EOF)
+			return 0;
+		
+		return -1;
+	}
+	
+	return rd;
+}
+
 ssize_t write_file(file_t fd, void *buf, size_t nbyte)
 {
 	DWORD wr;
@@ -117,6 +268,49 @@ ssize_t write_file(file_t fd, void *buf, size_t nbyte)
 	return wr;
 }
 
+ssize_t pwrite_file(file_t fd, void *buf, size_t nbyte, int64_t offset)
+{
+	OVERLAPPED ov = { 0 };
+	DWORD wr;
+	
+	ov.Offset = (DWORD)(offset&0xFFFFFFFF);
+	ov.OffsetHigh = (DWORD)(offset>>32);
+	
+	if (!WriteFile(fd, buf, nbyte, &wr, &ov))
+	{
+		return -1;
+	}
+	
+	return wr;
+}
+
+int sync_file(file_t fd)
+{
+	return (FlushFileBuffers(fd)) ? 0 : -1;
+}
+
+int truncate_file(file_t fd, int64_t size)
+{
+	LARGE_INTEGER li;
+	
+	li.QuadPart = size;
+	
+	if (!SetFilePointerEx(fd, li, NULL, FILE_BEGIN) || !SetEndOfFile(fd))
+		return -1;
+	
+	return 0;
+}
+
+int allocate_file(file_t fd, int64_t offset, int64_t nbyte)
+{
+	return -1;
+}
+
+int64_t find_hole(file_t fd, int64_t offset, int64_t *hole_end)
+{
+	return -1;
+}
+
 int64_t seek_file(file_t fd, int64_t offset, int whence)
 {
 	LONG low;
@@ -282,6 +476,49 @@ int fstat_file(file_t fd, file_stat_t *fs)
 	return 0;
 }
 
+int64_t send_file(int s, file_t fd, int64_t offset, int64_t nbyte)
+{
+	LARGE_INTEGER size;
+	int64_t sent = 0;
+	
+	if (!GetFileSizeEx(fd, &size))
+		return -2;
+	
+	if (offset >= size.QuadPart)
+		return 0;
+	
+	if (nbyte > size.QuadPart-offset)
+		nbyte = size.QuadPart-offset;
+	
+	if (seek_file(fd, offset, SEEK_SET) < 0)
+		return -1;
+	
+	while (sent < nbyte)
+	{
+		DWORD chunk = (nbyte-sent > 0x40000000) ? 0x40000000 : (DWORD)(nbyte-sent);
+		
+		// TransmitFile sends from the current file pointer and advances it
+		if (!TransmitFile(s, fd, chunk, 0, NULL, NULL, 0))
+			return (sent == 0 && WSAGetLastError() == WSAENOTSOCK) ? -2 : -1;
+		
+		sent += chunk;
+	}
+	
+	return sent;
+}
+
+int get_file_id(file_t fd, uint64_t *id)
+{
+	BY_HANDLE_FILE_INFORMATION fi;
+	
+	if (!GetFileInformationByHandle(fd, &fi))
+		return -1;
+	
+	*id = hash_file_id(fi.dwVolumeSerialNumber, ((uint64_t)fi.nFileIndexHigh << 32) | fi.nFileIndexLow,
+		((uint64_t)fi.nFileSizeHigh << 32) | fi.nFileSizeLow, ((uint64_t)fi.ftLastWriteTime.dwHighDateTime << 32) | fi.ftLastWriteTime.dwLowDateTime, 0);
+	return 0;
+}
+
 int stat_file(const char *path, file_stat_t *fs)
 {
 	WIN32_FIND_DATA wfd;
@@ -325,6 +562,15 @@ int stat_file(const char *path, file_stat_t *fs)
 	return 0;
 }
 
+int stat_dir_entry(DIR *dir, const char *dirpath, const char *name, file_stat_t *fs)
+{
+	char path[strlen(dirpath) + strlen(name) + 2];
+	
+	(void) dir;
+	sprintf(path, "%s/%s", dirpath, name);
+	return stat_file(path, fs);
+}
+
 #else
 
 int create_start_thread(thread_t *thread, void *(*start_routine)(void*), void *arg)
@@ -337,9 +583,78 @@ int join_thread(thread_t thread)
 	return pthread_join(thread, NULL);
 }
 
+int get_cpu_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (int)n : 1;
+}
+
+uint64_t get_time_usec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int mutex_init(mutex_t *mutex)
+{
+	return pthread_mutex_init(mutex, NULL);
+}
+
+int mutex_lock(mutex_t *mutex)
+{
+	return pthread_mutex_lock(mutex);
+}
+
+int mutex_unlock(mutex_t *mutex)
+{
+	return pthread_mutex_unlock(mutex);
+}
+
+int mutex_destroy(mutex_t *mutex)
+{
+	return pthread_mutex_destroy(mutex);
+}
+
+int cond_init(cond_t *cond)
+{
+	return pthread_cond_init(cond, NULL);
+}
+
+int cond_wait(cond_t *cond, mutex_t *mutex)
+{
+	return pthread_cond_wait(cond, mutex);
+}
+
+int cond_signal(cond_t *cond)
+{
+	return pthread_cond_signal(cond);
+}
+
+int cond_broadcast(cond_t *cond)
+{
+	return pthread_cond_broadcast(cond);
+}
+
+int cond_destroy(cond_t *cond)
+{
+	return pthread_cond_destroy(cond);
+}
+
+int recv_nonblock(int s, void *buf, int size)
+{
+	int ret = recv(s, buf, size, MSG_DONTWAIT);
+	
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return -2;
+	
+	return ret;
+}
+
 file_t open_file(const char *path, int oflag)
 {
-	return open(path, oflag);
+	return open(path, oflag, 0666);
 }
 
 int close_file(file_t fd)
@@ -352,16 +667,71 @@ ssize_t read_file(file_t fd, void *buf, size_t nbyte)
 	return read(fd, buf, nbyte);
 }
 
+ssize_t pread_file(file_t fd, void *buf, size_t nbyte, int64_t offset)
+{
+	return pread(fd, buf, nbyte, offset);
+}
+
 ssize_t write_file(file_t fd, void *buf, size_t nbyte)
 {
 	return write(fd, buf, nbyte);
 }
 
+ssize_t pwrite_file(file_t fd, void *buf, size_t nbyte, int64_t offset)
+{
+	return pwrite(fd, buf, nbyte, offset);
+}
+
+int sync_file(file_t fd)
+{
+	return fsync(fd);
+}
+
+int truncate_file(file_t fd, int64_t size)
+{
+	return ftruncate(fd, size);
+}
+
+int allocate_file(file_t fd, int64_t offset, int64_t nbyte)
+{
+#ifdef __linux__
+	return fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, nbyte);
+#else
+	return -1;
+#endif
+}
+
 int64_t seek_file(file_t fd, int64_t offset, int whence)
 {
 	return lseek(fd, offset, whence);
 }
 
+int64_t find_hole(file_t fd, int64_t offset, int64_t *hole_end)
+{
+#ifdef SEEK_HOLE
+	off_t hole = lseek(fd, offset, SEEK_HOLE);
+	if (hole < 0)
+		return -1;
+
+	off_t data = lseek(fd, hole, SEEK_DATA);
+	if (data < 0)
+	{
+		// The hole runs to the end of the file
+		struct stat st;
+
+		if (errno != ENXIO || fstat(fd, &st) < 0)
+			return -1;
+
+		data = st.st_size;
+	}
+
+	*hole_end = data;
+	return hole;
+#else
+	return -1;
+#endif
+}
+
 int fstat_file(file_t fd, file_stat_t *fs)
 {
 	struct stat st;
@@ -394,4 +764,409 @@ int stat_file(const char *path, file_stat_t *fs)
 	return 0;
 }
 
+int get_file_id(file_t fd, uint64_t *id)
+{
+	struct stat st;
+	
+	if (fstat(fd, &st) < 0)
+		return -1;
+	
+	*id = hash_file_id(st.st_dev, st.st_ino, st.st_size, st.st_mtime, st.st_mtim.tv_nsec);
+	return 0;
+}
+
+int stat_file_at(int dirfd, const char *path, file_stat_t *fs)
+{
+	struct stat st;
+	
+	int ret = fstatat(dirfd, path, &st, 0);
+	if (ret < 0)
+		return ret;
+	
+	fs->file_size = st.st_size;
+	fs->mtime = st.st_mtime;
+	fs->ctime = st.st_ctime;
+	fs->atime = st.st_atime;
+	fs->mode = st.st_mode;
+	return 0;
+}
+
+int stat_dir_entry(DIR *dir, const char *dirpath, const char *name, file_stat_t *fs)
+{
+	(void) dirpath;
+	return stat_file_at(dirfd(dir), name, fs);
+}
+
+DIR *opendir_at(int dirfd, const char *path)
+{
+	int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	
+	DIR *dir = fdopendir(fd);
+	if (!dir)
+		close(fd);
+	
+	return dir;
+}
+
+#ifdef __linux__
+
+#include <sys/sendfile.h>
+
+int64_t send_file(int s, file_t fd, int64_t offset, int64_t nbyte)
+{
+	off_t off = offset;
+	int64_t sent = 0;
+	
+	while (sent < nbyte)
+	{
+		size_t chunk = (nbyte-sent > 0x40000000) ? 0x40000000 : (size_t)(nbyte-sent);
+		ssize_t ret = sendfile(s, fd, &off, chunk);
+		
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			
+			// Some filesystems don't support sendfile, let the caller use read+send
+			if (sent == 0 && (errno == EINVAL || errno == ENOSYS))
+				return -2;
+			
+			return -1;
+		}
+		
+		if (ret == 0)
+			break;
+		
+		sent += ret;
+	}
+	
+	return sent;
+}
+
+#else
+
+int64_t send_file(int s, file_t fd, int64_t offset, int64_t nbyte)
+{
+	return -2;
+}
+
+#endif
+
+#endif
+
+// Poller
+
+#if defined(__linux__) && !defined(NO_EPOLL)
+
+#include <sys/epoll.h>
+
+#define POLLER_MAX_EVENTS	64
+
+struct _poller_t
+{
+	int epfd;
+};
+
+poller_t *poller_create(void)
+{
+	poller_t *poller = (poller_t *)malloc(sizeof(poller_t));
+	if (!poller)
+		return NULL;
+	
+	poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (poller->epfd < 0)
+	{
+		free(poller);
+		return NULL;
+	}
+	
+	return poller;
+}
+
+static int poller_ctl(poller_t *poller, int op, int s, void *data)
+{
+	struct epoll_event ev;
+	
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = data;
+	return epoll_ctl(poller->epfd, op, s, &ev);
+}
+
+int poller_add(poller_t *poller, int s, void *data)
+{
+	return poller_ctl(poller, EPOLL_CTL_ADD, s, data);
+}
+
+int poller_rearm(poller_t *poller, int s, void *data)
+{
+	return poller_ctl(poller, EPOLL_CTL_MOD, s, data);
+}
+
+int poller_remove(poller_t *poller, int s)
+{
+	struct epoll_event ev;
+	return epoll_ctl(poller->epfd, EPOLL_CTL_DEL, s, &ev);
+}
+
+int poller_wait(poller_t *poller, void **ready, int max_ready)
+{
+	struct epoll_event events[POLLER_MAX_EVENTS];
+	int n;
+	
+	if (max_ready > POLLER_MAX_EVENTS)
+		max_ready = POLLER_MAX_EVENTS;
+	
+	do
+	{
+		n = epoll_wait(poller->epfd, events, max_ready, -1);
+	} while (n < 0 && errno == EINTR);
+	
+	for (int i = 0; i < n; i++)
+		ready[i] = events[i].data.ptr;
+	
+	return n;
+}
+
+void poller_destroy(poller_t *poller)
+{
+	close(poller->epfd);
+	free(poller);
+}
+
+#else
+
+#ifdef WIN32
+typedef WSAPOLLFD pollfd_t;
+#define poll_sockets WSAPoll
+#define POLL_INTERRUPTED	WSAEINTR
+#else
+#include <poll.h>
+typedef struct pollfd pollfd_t;
+#define poll_sockets poll
+#define POLL_INTERRUPTED	EINTR
+#endif
+
+typedef struct _poller_entry_t
+{
+	int s;
+	void *data;
+	int armed;
+} poller_entry_t;
+
+// Generic backend: a registry of sockets polled by every waiting thread. A loopback datagram
+// socket is used to wake up the waiters whenever the registry changes.
+struct _poller_t
+{
+	mutex_t mutex;
+	poller_entry_t *entries;
+	int num_entries;
+	int max_entries;
+	int wake_s;
+	struct sockaddr_in wake_addr;
+};
+
+poller_t *poller_create(void)
+{
+	socklen_t len = sizeof(struct sockaddr_in);
+	poller_t *poller = (poller_t *)calloc(1, sizeof(poller_t));
+	if (!poller)
+		return NULL;
+	
+	poller->wake_s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (poller->wake_s < 0)
+	{
+		free(poller);
+		return NULL;
+	}
+	
+	poller->wake_addr.sin_family = AF_INET;
+	poller->wake_addr.sin_port = 0;
+	poller->wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	
+	if (bind(poller->wake_s, (struct sockaddr *)&poller->wake_addr, len) < 0 ||
+		getsockname(poller->wake_s, (struct sockaddr *)&poller->wake_addr, &len) < 0)
+	{
+		closesocket(poller->wake_s);
+		free(poller);
+		return NULL;
+	}
+	
+	mutex_init(&poller->mutex);
+	return poller;
+}
+
+static void poller_wakeup(poller_t *poller)
+{
+	char c = 0;
+	sendto(poller->wake_s, &c, 1, 0, (struct sockaddr *)&poller->wake_addr, sizeof(poller->wake_addr));
+}
+
+static poller_entry_t *poller_find(poller_t *poller, int s)
+{
+	for (int i = 0; i < poller->num_entries; i++)
+	{
+		if (poller->entries[i].s == s)
+			return &poller->entries[i];
+	}
+	
+	return NULL;
+}
+
+int poller_add(poller_t *poller, int s, void *data)
+{
+	mutex_lock(&poller->mutex);
+	
+	if (poller->num_entries == poller->max_entries)
+	{
+		int max_entries = (poller->max_entries) ? poller->max_entries*2 : 64;
+		poller_entry_t *entries = (poller_entry_t *)realloc(poller->entries, max_entries*sizeof(poller_entry_t));
+		if (!entries)
+		{
+			mutex_unlock(&poller->mutex);
+			return -1;
+		}
+		
+		poller->entries = entries;
+		poller->max_entries = max_entries;
+	}
+	
+	poller->entries[poller->num_entries].s = s;
+	poller->entries[poller->num_entries].data = data;
+	poller->entries[poller->num_entries].armed = 1;
+	poller->num_entries++;
+	
+	mutex_unlock(&poller->mutex);
+	poller_wakeup(poller);
+	return 0;
+}
+
+int poller_rearm(poller_t *poller, int s, void *data)
+{
+	poller_entry_t *entry;
+	
+	mutex_lock(&poller->mutex);
+	
+	entry = poller_find(poller, s);
+	if (entry)
+	{
+		entry->data = data;
+		entry->armed = 1;
+	}
+	
+	mutex_unlock(&poller->mutex);
+	
+	if (!entry)
+		return -1;
+	
+	poller_wakeup(poller);
+	return 0;
+}
+
+int poller_remove(poller_t *poller, int s)
+{
+	poller_entry_t *entry;
+	
+	mutex_lock(&poller->mutex);
+	
+	entry = poller_find(poller, s);
+	if (entry)
+		*entry = poller->entries[--poller->num_entries];
+	
+	mutex_unlock(&poller->mutex);
+	return (entry) ? 0 : -1;
+}
+
+int poller_wait(poller_t *poller, void **ready, int max_ready)
+{
+	pollfd_t *fds = NULL;
+	int max_fds = 0;
+	int n = 0;
+	
+	while (n == 0)
+	{
+		int num_fds = 1;
+		
+		mutex_lock(&poller->mutex);
+		
+		if (max_fds < poller->num_entries+1)
+		{
+			pollfd_t *new_fds = (pollfd_t *)realloc(fds, (poller->num_entries+1)*sizeof(pollfd_t));
+			if (!new_fds)
+			{
+				mutex_unlock(&poller->mutex);
+				free(fds);
+				return -1;
+			}
+			
+			fds = new_fds;
+			max_fds = poller->num_entries+1;
+		}
+		
+		fds[0].fd = poller->wake_s;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		
+		for (int i = 0; i < poller->num_entries; i++)
+		{
+			if (!poller->entries[i].armed)
+				continue;
+			
+			fds[num_fds].fd = poller->entries[i].s;
+			fds[num_fds].events = POLLIN;
+			fds[num_fds].revents = 0;
+			num_fds++;
+		}
+		
+		mutex_unlock(&poller->mutex);
+		
+		if (poll_sockets(fds, num_fds, -1) < 0)
+		{
+			if (get_network_error() == POLL_INTERRUPTED)
+				continue;
+			
+			free(fds);
+			return -1;
+		}
+		
+		if (fds[0].revents)
+		{
+			char c[64];
+			recv(poller->wake_s, c, sizeof(c), 0);
+		}
+		
+		mutex_lock(&poller->mutex);
+		
+		// Another thread may have claimed a socket in the meantime, only the one that disarms it gets it
+		for (int i = 1; i < num_fds && n < max_ready; i++)
+		{
+			poller_entry_t *entry;
+			
+			if (!fds[i].revents)
+				continue;
+			
+			entry = poller_find(poller, fds[i].fd);
+			if (entry && entry->armed)
+			{
+				entry->armed = 0;
+				ready[n++] = entry->data;
+			}
+		}
+		
+		mutex_unlock(&poller->mutex);
+	}
+	
+	free(fds);
+	return n;
+}
+
+void poller_destroy(poller_t *poller)
+{
+	closesocket(poller->wake_s);
+	mutex_destroy(&poller->mutex);
+	free(poller->entries);
+	free(poller);
+}
+
 #endif
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <sys/stat.h>
 
 #ifdef __cplusplus
@@ -22,11 +23,17 @@ typedef struct _file_stat_t
 
 #ifdef WIN32
 
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+
+#include <winsock2.h>
 #include <windows.h>
-#include <winsock.h>
 
 // Threads
 typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
 
 // Files
 #define INVALID_FD	INVALID_HANDLE_VALUE
@@ -66,6 +73,8 @@ typedef int socklen_t;
 
 // Threads
 typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
 
 // Files
 #define INVALID_FD	-1
@@ -81,15 +90,72 @@ typedef int file_t;
 
 int create_start_thread(thread_t *thread, void *(*start_routine)(void*), void *arg);
 int join_thread(thread_t thread);
+int get_cpu_count(void);
+// Monotonic clock in microseconds, for measuring durations
+uint64_t get_time_usec(void);
+
+int mutex_init(mutex_t *mutex);
+int mutex_lock(mutex_t *mutex);
+int mutex_unlock(mutex_t *mutex);
+int mutex_destroy(mutex_t *mutex);
+
+int cond_init(cond_t *cond);
+int cond_wait(cond_t *cond, mutex_t *mutex);
+int cond_signal(cond_t *cond);
+int cond_broadcast(cond_t *cond);
+int cond_destroy(cond_t *cond);
+
+// Socket readiness notification. Sockets are registered one-shot: once a socket has been
+// reported as readable it won't be reported again until it is rearmed, so only one thread
+// at a time owns a connection. Backend is epoll on linux and (WSA)poll elsewhere.
+typedef struct _poller_t poller_t;
+
+poller_t *poller_create(void);
+int poller_add(poller_t *poller, int s, void *data);
+int poller_rearm(poller_t *poller, int s, void *data);
+int poller_remove(poller_t *poller, int s);
+int poller_wait(poller_t *poller, void **ready, int max_ready);
+void poller_destroy(poller_t *poller);
+
+// Returns bytes read, 0 on connection closed, -1 on error and -2 if no data is available
+int recv_nonblock(int s, void *buf, int size);
 
 file_t open_file(const char *path, int oflag);
 int close_file(file_t fd);
 ssize_t read_file(file_t fd, void *buf, size_t nbyte);
+ssize_t pread_file(file_t fd, void *buf, size_t nbyte, int64_t offset);
 ssize_t write_file(file_t fd, void *buf, size_t nbyte);
+ssize_t pwrite_file(file_t fd, void *buf, size_t nbyte, int64_t offset);
+// Flushes the data of the file to the disk
+int sync_file(file_t fd);
+int truncate_file(file_t fd, int64_t size);
+// Reserves disk space for a range without changing the size of the file, -1 where it can't be done
+int allocate_file(file_t fd, int64_t offset, int64_t nbyte);
 int64_t seek_file(file_t fd, int64_t offset, int whence);
+// Finds the first hole of a sparse file at or after offset. Returns its start, the end of the file if there
+// is none, and sets *hole_end to where the data resumes. Moves the file pointer. -1 where it can't be done.
+int64_t find_hole(file_t fd, int64_t offset, int64_t *hole_end);
 int fstat_file(file_t fd, file_stat_t *fs);
 int stat_file(const char *path, file_stat_t *fs);
 
+// Stats the entry name of the open directory dir, whose path is dirpath. Where it can, the entry
+// is looked up from the directory itself instead of walking the whole path again.
+int stat_dir_entry(DIR *dir, const char *dirpath, const char *name, file_stat_t *fs);
+
+#ifndef WIN32
+// Same as stat_file and opendir for a path relative to the directory open as dirfd
+int stat_file_at(int dirfd, const char *path, file_stat_t *fs);
+DIR *opendir_at(int dirfd, const char *path);
+#endif
+
+// Identifies the content of an open file (device, inode, size and modification time), never 0
+int get_file_id(file_t fd, uint64_t *id);
+
+// Sends nbyte bytes of a file starting at offset directly to a socket, without going through a user buffer.
+// Returns the bytes sent (less than nbyte only at end of file), -1 on error, and -2 if the file can't be
+// sent this way, in which case nothing was sent and the caller must fall back to read+send.
+int64_t send_file(int s, file_t fd, int64_t offset, int64_t nbyte);
+
 #ifdef __cplusplus
 }
 #endif
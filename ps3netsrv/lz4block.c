@@ -0,0 +1,277 @@
+#include <string.h>
+
+#include "lz4block.h"
+
+#define HASH_BITS	12
+#define MIN_MATCH	4
+// The last match must start 12 bytes before the end of the block, and the last 5 bytes are literals
+#define MF_LIMIT	12
+#define LAST_LITERALS	5
+#define MAX_DISTANCE	65535
+
+// webMAN builds this file for the decoder only
+#ifndef LZ4_DECOMPRESS_ONLY
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t x;
+
+	memcpy(&x, p, 4);
+	return x;
+}
+
+static inline uint32_t hash32(uint32_t x)
+{
+	return (x * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t *write_length(uint8_t *op, int length)
+{
+	while (length >= 255)
+	{
+		*op++ = 255;
+		length -= 255;
+	}
+
+	*op++ = (uint8_t)length;
+	return op;
+}
+
+static uint8_t *write_sequence(uint8_t *op, uint8_t *end, const uint8_t *literals, int num_literals, int distance, int match_length)
+{
+	// token + lengths + literals + offset
+	if (op + 1 + num_literals/255 + 1 + num_literals + 2 + match_length/255 + 1 > end)
+		return NULL;
+
+	uint8_t *token = op++;
+	int ml = match_length - MIN_MATCH;
+
+	*token = (uint8_t)(((num_literals < 15) ? num_literals : 15) << 4);
+	if (num_literals >= 15)
+		op = write_length(op, num_literals - 15);
+
+	memcpy(op, literals, num_literals);
+	op += num_literals;
+
+	if (match_length == 0)
+		return op;
+
+	*op++ = (uint8_t)distance;
+	*op++ = (uint8_t)(distance >> 8);
+
+	*token |= (uint8_t)((ml < 15) ? ml : 15);
+	if (ml >= 15)
+		op = write_length(op, ml - 15);
+
+	return op;
+}
+
+// Greedy parsing: each position is looked up in a hash table of the last position with the same 4 bytes.
+// Writes the sequences with a match at *op, and returns where the literals left at the end start.
+static int write_matches(const uint8_t *src, int size, uint8_t **op, uint8_t *end)
+{
+	int32_t table[1 << HASH_BITS];
+	int anchor = 0;
+	int ip = 0;
+
+	memset(table, 0xFF, sizeof(table));
+
+	while (ip < size - MF_LIMIT)
+	{
+		uint32_t sequence = read32(src + ip);
+		uint32_t h = hash32(sequence);
+		int ref = table[h];
+
+		table[h] = ip;
+
+		if (ref < 0 || ip - ref > MAX_DISTANCE || read32(src + ref) != sequence)
+		{
+			ip++;
+			continue;
+		}
+
+		int length = MIN_MATCH;
+		while (ip + length < size - LAST_LITERALS && src[ref + length] == src[ip + length])
+			length++;
+
+		*op = write_sequence(*op, end, src + anchor, ip - anchor, ip - ref, length);
+		if (!*op)
+			return -1;
+
+		ip += length;
+		anchor = ip;
+	}
+
+	return anchor;
+}
+
+int lz4_compress_block(const uint8_t *src, int size, uint8_t *dst, int capacity)
+{
+	uint8_t *op = dst;
+	uint8_t *end = dst + capacity;
+	int anchor = write_matches(src, size, &op, end);
+
+	if (anchor < 0)
+		return -1;
+
+	op = write_sequence(op, end, src + anchor, size - anchor, 0, 0);
+	if (!op)
+		return -1;
+
+	return (int)(op - dst);
+}
+
+// True if the block can be put at the end of a buffer of size bytes and decompressed to its start
+static int fits_in_place(const uint8_t *src, int src_size, int size)
+{
+	// The block starts at base in the buffer, the output at 0
+	int base = size - src_size;
+	int ip = 0;
+	int op = 0;
+
+	while (ip < src_size)
+	{
+		uint8_t token = src[ip++];
+		int length = token >> 4;
+
+		if (length == 15)
+		{
+			uint8_t b;
+
+			do
+			{
+				b = src[ip++];
+				length += b;
+			} while (b == 255);
+		}
+
+		// Literals are copied forward from further in the buffer
+		ip += length + 2;
+		op += length;
+		length = token & 15;
+
+		if (length == 15)
+		{
+			uint8_t b;
+
+			do
+			{
+				b = src[ip++];
+				length += b;
+			} while (b == 255);
+		}
+
+		// A match must not reach the part of the block not read yet
+		op += length + MIN_MATCH;
+		if (op > base + ip)
+			return 0;
+	}
+
+	return 1;
+}
+
+int lz4_compress_in_place(const uint8_t *src, int size, uint8_t *dst, int capacity, int *literals)
+{
+	uint8_t *op = dst;
+	int anchor = write_matches(src, size, &op, dst + capacity);
+	int packed = (int)(op - dst);
+
+	// The literals at the end would take more room in the block than as they are
+	if (anchor <= 0 || packed + (size - anchor) > capacity || !fits_in_place(dst, packed, anchor))
+		return -1;
+
+	*literals = size - anchor;
+	return packed;
+}
+
+#endif
+
+int lz4_decompress_block(const uint8_t *src, int src_size, uint8_t *dst, int size)
+{
+	const uint8_t *ip = src;
+	const uint8_t *ip_end = src + src_size;
+	uint8_t *op = dst;
+	uint8_t *op_end = dst + size;
+
+	while (ip < ip_end && op < op_end)
+	{
+		uint8_t token = *ip++;
+		int length = token >> 4;
+
+		if (length == 15)
+		{
+			uint8_t b;
+
+			do
+			{
+				if (ip >= ip_end)
+					return -1;
+
+				b = *ip++;
+				length += b;
+			} while (b == 255);
+		}
+
+		if (length > ip_end - ip)
+			return -1;
+
+		if (length > op_end - op)
+			length = (int)(op_end - op);
+
+		// Decompressing in place, the literals are further in the same buffer
+		memmove(op, ip, length);
+		ip += length;
+		op += length;
+
+		// The last sequence has no match
+		if (op == op_end || ip_end - ip < 2)
+			break;
+
+		int distance = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (distance == 0 || distance > op - dst)
+			return -1;
+
+		length = token & 15;
+		if (length == 15)
+		{
+			uint8_t b;
+
+			do
+			{
+				if (ip >= ip_end)
+					return -1;
+
+				b = *ip++;
+				length += b;
+			} while (b == 255);
+		}
+
+		length += MIN_MATCH;
+		if (length > op_end - op)
+			length = (int)(op_end - op);
+
+		// The match may overlap the bytes it produces, copies of 8 bytes are safe from 8 bytes away
+		const uint8_t *match = op - distance;
+		int i = 0;
+
+		if (distance >= length)
+		{
+			memcpy(op, match, length);
+			i = length;
+		}
+		else if (distance >= 8)
+		{
+			for (; i + 8 <= length; i += 8)
+				memcpy(op + i, match + i, 8);
+		}
+
+		for (; i < length; i++)
+			op[i] = match[i];
+
+		op += length;
+	}
+
+	return (int)(op - dst);
+}
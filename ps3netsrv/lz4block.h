@@ -0,0 +1,32 @@
+#ifndef __LZ4BLOCK_H__
+#define __LZ4BLOCK_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Worst case size of the compression of size bytes
+#define LZ4_BOUND(size)	((size) + (size)/255 + 16)
+
+// Raw LZ4 blocks (no frame), as used by ZSO images. Compresses size bytes of src into dst (room
+// for capacity bytes). Returns the compressed size, or -1 if it doesn't fit.
+int lz4_compress_block(const uint8_t *src, int size, uint8_t *dst, int capacity);
+
+// Compresses the start of src into a block ending with a match, and leaves the literals after it, whose
+// number goes to *literals. The block decompresses in place: put at the end of a buffer of size - *literals
+// bytes, it can be decompressed to the start of the buffer. Returns its size, or -1 if the block and the
+// literals don't fit in capacity or the block can't be decompressed in place.
+int lz4_compress_in_place(const uint8_t *src, int size, uint8_t *dst, int capacity, int *literals);
+
+// Decompresses until size bytes were written to dst or src is exhausted; bytes after the end of the
+// block in src are ignored. Returns the number of bytes written, or -1 if the block is corrupt.
+// src may be in dst for a block made by lz4_compress_in_place.
+int lz4_decompress_block(const uint8_t *src, int src_size, uint8_t *dst, int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,6 +5,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -14,12 +15,47 @@
 
 #include "File.h"
 #include "VIsoFile.h"
+#include "CsoFile.h"
+#include "DedupFile.h"
+#include "MappedFile.h"
+#include "WriteBehindFile.h"
+#include "ReadAhead.h"
+#include "BlockCache.h"
+#include "DirCache.h"
+#include "GameInfo.h"
+#include "DirSize.h"
+#include "Pipeline.h"
+#include "Stats.h"
+#include "lz4block.h"
 
 
 #define BUFFER_SIZE	(3*1048576)
-#define MAX_CLIENTS	5
+
+#define DEFAULT_MAX_CLIENTS	1024
+// Seconds a client can leave a result half sent before its connection is dropped
+#define SEND_TIMEOUT	30
+#define MIN_WORKERS	4
+
+#define DEFAULT_READAHEAD_SIZE	8
+#define DEFAULT_WRITEBEHIND_SIZE	0
 
 #define MAX_ENTRIES	4093
+// Room for a path received from a client, whose length is 16 bits
+#define MAX_PATH_LEN	65536
+
+#define SUPPORTED_FEATURES	(NETISO_FEATURE_PIPELINE|NETISO_FEATURE_SPARSE|NETISO_FEATURE_LZ4|NETISO_FEATURE_DIR_PAGES|NETISO_FEATURE_GAME_INFO)
+
+// Sparse reads look for zeros in blocks of this size, aligned in the file
+#define ZERO_BLOCK_SIZE	2048
+// Room before the data of a result for what is sent ahead of it: the result, the zero runs of a sparse
+// read and the header of compressed data
+#define RESULT_ROOM	(sizeof(netiso_read_file_sparse_result) + NETISO_MAX_ZERO_RUNS*sizeof(netiso_zero_run) + sizeof(netiso_lz4_header))
+
+// Data smaller than this isn't compressed, and compression must save at least 1/LZ4_MIN_GAIN of it
+#define LZ4_MIN_SIZE	512
+#define LZ4_MIN_GAIN	8
+// File data that doesn't compress is sent as is for the next reads, twice as many each time up to this
+#define LZ4_MAX_BACKOFF	64
 
 #define MIN(a, b)	((a) <= (b) ? (a) : (b))
 
@@ -37,20 +73,89 @@ typedef struct
 	int s;
 	AbstractFile *ro_file;
 	AbstractFile *wo_file;
+	// Path of the upload, and of the last one whose end couldn't be written to be reported by STAT
+	char *wo_path;
+	char *failed_upload;
+	ReadAhead *read_ahead;
+	Pipeline *pipeline;
 	DIR *dir;
 	char *dirpath;
+	// Listing of the open directory being sent by pages, and the index and position of the next entry to send
+	uint8_t *listing;
+	size_t listing_size;
+	int64_t listing_entries;
+	uint64_t listing_next;
+	size_t listing_pos;
 	uint8_t *buf;
+	uint8_t *zbuf;
 	int connected;
 	int restarted;
 	struct in_addr ip_addr;
-	thread_t thread;
 	uint32_t CD_SECTOR_SIZE;
+	uint32_t features;
+	int lz4_skip;
+	int lz4_backoff;
+	// Command being received: its header, then what follows it (a path, the data of a write...)
+	netiso_cmd cmd;
+	uint32_t cmd_len;
+	uint8_t *payload;
+	uint32_t payload_size;
+	uint32_t payload_len;
+	uint32_t payload_capacity;
 } client_t;
 
-static client_t clients[MAX_CLIENTS];
+typedef struct
+{
+	const char *name;
+	int *value;
+	int min;
+	int max;
+	const char *description;
+	char **string; // set for options taking a string instead of a number
+} option_t;
+
+static client_t *clients;
+static mutex_t clients_mutex;
+static poller_t *poller;
+
+static int max_clients = DEFAULT_MAX_CLIENTS;
+static int num_workers = 0;
+static int readahead_size = DEFAULT_READAHEAD_SIZE;
+static int cache_size = 0;
+static int use_mmap = 0;
+static int write_behind_size = DEFAULT_WRITEBEHIND_SIZE;
+static int preallocate_size = 0;
+static int dir_cache_size = DIRCACHE_MAX_DIRS;
+static int game_cache_size = GAMEINFO_CACHE_SIZE;
+static int size_index = DIRSIZE_MAX_ROOTS;
+static int metrics_port = 0;
+static int stats_interval = 0;
+static char *viso_cache_dir = NULL;
+
+static option_t options[] =
+{
+	{ "max-clients", &max_clients, 1, 65536, "maximum number of simultaneous connections" },
+	{ "workers", &num_workers, 1, 256, "number of threads serving requests (default: 2 per cpu)" },
+	{ "readahead", &readahead_size, 0, 256, "read-ahead window of each client in MB, 0 to disable (default: 8)" },
+	{ "cache", &cache_size, 0, 65536, "memory used by the block cache shared by all clients in MB (default: 0, disabled)" },
+#ifndef WIN32
+	{ "mmap", &use_mmap, 0, 1, "1 to serve isos from memory mappings instead of reading them, an image truncated while served is read again, a send under way fails (default: 0)" },
+#endif
+	{ "write-behind", &write_behind_size, 0, 1024, "data of an upload waiting to be written to disk in MB, 0 to write it before replying (default: 0)" },
+	{ "preallocate", &preallocate_size, 0, 4096, "disk space reserved ahead of the data of an upload in MB, against fragmentation (default: 0, disabled)" },
+	{ "dir-cache", &dir_cache_size, 0, 4096, "number of directory listings kept in memory, 0 to disable (default: 32)" },
+	{ "game-cache", &game_cache_size, 0, 1024, "memory keeping the PARAM.SFO and icon of games in MB, 0 to disable (default: 16)" },
+	{ "size-index", &size_index, 0, 1024, "number of directory trees whose size is kept up to date, 0 to disable (default: 16)" },
+	{ "metrics-port", &metrics_port, 0, 65535, "port of the metrics endpoint for Prometheus, on localhost (default: 0, disabled)" },
+	{ "stats-interval", &stats_interval, 0, 86400, "seconds between the stats lines printed, 0 to disable (default: 0)" },
+	{ "viso-cache", NULL, 0, 0, "directory where the metadata of virtual isos is saved to reopen them faster", &viso_cache_dir },
+};
 
 static char root_directory[4096];
 static size_t root_len = 0;
+#ifndef WIN32
+static int root_fd = -1;
+#endif
 
 static char *ignore_drives;
 
@@ -98,58 +203,95 @@ static int initialize_socket(uint16_t port)
 	return s;
 }
 
-#ifndef WIN32
-static int recv_all(int s, void *buf, int size)
+
+static int initialize_client(client_t *client)
 {
-	return recv(s, buf, size, MSG_WAITALL);
+	memset(client, 0, sizeof(client_t));
+
+	// The transfer buffers are lent by the worker thread serving each command
+	client->buf = NULL;
+	client->zbuf = NULL;
+	client->ro_file = NULL;
+	client->wo_file = NULL;
+	client->wo_path = NULL;
+	client->failed_upload = NULL;
+	client->read_ahead = NULL;
+	client->pipeline = NULL;
+	client->dir = NULL;
+	client->dirpath = NULL;
+	client->listing = NULL;
+	client->connected = 1;
+    client->CD_SECTOR_SIZE = 2352;
+	return 0;
 }
-#else
-// stupid windows...
-static int recv_all(int s, void *buf, int size)
-{
-	int total_read = 0;
-	char *buf_b = (char *)buf;
 
-	while (size > 0)
+static void free_listing(client_t *client)
+{
+	if (client->listing)
 	{
-		int r = recv(s, buf_b, size, 0);
-		if (r <= 0)
-			return r;
-
-		total_read += r;
-		buf_b += r;
-		size -= r;
+		free(client->listing);
+		client->listing = NULL;
 	}
 
-	return total_read;
+	client->listing_size = 0;
+	client->listing_entries = 0;
+	client->listing_next = 0;
+	client->listing_pos = 0;
 }
-#endif
 
-
-static int initialize_client(client_t *client)
+// With write-behind the end of an upload is only written when it is closed. An error then
+// fails the next CREATE_FILE, and a STAT of its path until another upload of it.
+static int close_upload(client_t *client)
 {
-	memset(client, 0, sizeof(client_t));
+	int ret = client->wo_file->close();
+
+	delete client->wo_file;
+	client->wo_file = NULL;
 
-	client->buf = (uint8_t *)malloc(BUFFER_SIZE);
-	if (!client->buf)
+	if (client->failed_upload)
 	{
-		DPRINTF("Memory allocation error!\n");
-		return -1;
+		free(client->failed_upload);
+		client->failed_upload = NULL;
 	}
 
-	client->ro_file = NULL;
-	client->wo_file = NULL;
-	client->dir = NULL;
-	client->dirpath = NULL;
-	client->connected = 1;
-    client->CD_SECTOR_SIZE = 2352;
-	return 0;
+	if (ret != 0)
+	{
+		DPRINTF("Upload of \"%s\" failed when closed\n", client->wo_path);
+		client->failed_upload = client->wo_path;
+	}
+	else
+	{
+		free(client->wo_path);
+	}
+
+	client->wo_path = NULL;
+	return ret;
 }
 
 static void finalize_client(client_t *client)
 {
+	poller_remove(poller, client->s);
+	Stats::client_disconnected((int)(client - clients));
+
+	// Tagged reads in flight still use the socket and the ro_file
+	if (client->pipeline)
+	{
+		delete client->pipeline;
+		client->pipeline = NULL;
+	}
+
+	// The accept loop may shutdown the socket of a reconnecting client, don't let it see a recycled descriptor
+	mutex_lock(&clients_mutex);
 	shutdown(client->s, SHUT_RDWR);
 	closesocket(client->s);
+	client->s = -1;
+	mutex_unlock(&clients_mutex);
+
+	if (client->read_ahead)
+	{
+		delete client->read_ahead;
+		client->read_ahead = NULL;
+	}
 
 	if (client->ro_file)
 	{
@@ -159,8 +301,17 @@ static void finalize_client(client_t *client)
 
 	if (client->wo_file)
 	{
-		delete client->wo_file;
-		client->wo_file = NULL;
+		close_upload(client);
+	}
+
+	if (client->failed_upload)
+	{
+		free(client->failed_upload);
+	}
+
+	if (client->payload)
+	{
+		free(client->payload);
 	}
 
 	if (client->dir)
@@ -173,25 +324,36 @@ static void finalize_client(client_t *client)
 		free(client->dirpath);
 	}
 
-	if (client->buf)
-	{
-		free(client->buf);
-	}
+	free_listing(client);
 
+	mutex_lock(&clients_mutex);
 	memset(client, 0, sizeof(client_t));
+	mutex_unlock(&clients_mutex);
+}
+
+// Copies the path received with a command to the worker buffer. The path is valid until the buffer
+// is used for something else.
+static char *get_path(client_t *client, uint16_t len)
+{
+	char *path = (char *)client->buf;
+
+	if (len > client->payload_len)
+		return NULL;
+
+	memcpy(path, client->payload, len);
+	path[len] = 0;
+	return path;
 }
 
-static char *translate_path(char *path, int del, int *viso)
+// Builds root_directory + path in the worker buffer, right after the path got by get_path.
+// Returns NULL if the path is not allowed.
+static char *translate_path(client_t *client, char *path, int *viso)
 {
 	char *p;
 
 	if (path[0] != '/')
 	{
 		DPRINTF("path must start by '/'. Path received: %s\n", path);
-		if (del)
-		{
-			free(path);
-		}
 		return NULL;
 	}
 
@@ -205,10 +367,6 @@ static char *translate_path(char *path, int del, int *viso)
 				if (p[2] == 0 || p[2] == '/' || p[2] == '\\')
 				{
 					DPRINTF("The path \"%s\" is unsecure!\n", path);
-					if (del)
-					{
-						free(path);
-					}
 					return NULL;
 				}
 			}
@@ -217,14 +375,9 @@ static char *translate_path(char *path, int del, int *viso)
 		p += 2;
 	}
 
-	p = (char *)malloc(root_len + strlen(path)+1);
-	if (!p)
-	{
-		printf("Memory allocation error\n");
-		exit(-1);
-	}
-
-	sprintf(p, "%s%s", root_directory, path);
+	p = (char *)client->buf + MAX_PATH_LEN;
+	memcpy(p, root_directory, root_len);
+	strcpy(p + root_len, path);
 
 	if (viso)
 	{
@@ -282,69 +435,90 @@ static char *translate_path(char *path, int del, int *viso)
 		printf("%s\n", p);
 	}
 
-	if (del)
-	{
-		free(path);
-	}
-
 	return p;
 }
 
-static int64_t calculate_directory_size(char *path)
+#ifndef WIN32
+static inline const char *relative_path(const char *path)
 {
-	int64_t result = 0;
-	DIR *d;
-	struct dirent *entry;
+	while (*path == '/')
+		path++;
 
-	//DPRINTF("Calculate %s\n", path);
+	return (*path) ? path : ".";
+}
+#endif
 
-	d = opendir(path);
-	if (!d)
-		return -1;
+// path is the path sent by the client and full_path its translation. The lookups are done from the
+// root directory fd where possible, instead of walking root_directory again for every request.
+static int stat_path(const char *path, const char *full_path, file_stat_t *st)
+{
+#ifndef WIN32
+	if (root_fd >= 0)
+		return stat_file_at(root_fd, relative_path(path), st);
+#else
+	(void) path;
+#endif
+	return stat_file(full_path, st);
+}
+
+static DIR *open_dir_path(const char *path, const char *full_path)
+{
+#ifndef WIN32
+	if (root_fd >= 0)
+		return opendir_at(root_fd, relative_path(path));
+#else
+	(void) path;
+#endif
+	return opendir(full_path);
+}
 
-	uint16_t name_len, path_len;
-	path_len = strlen(path);
+// Size of the iso in a compressed image or a chunk store manifest, -1 if path is neither
+static int64_t get_packed_image_size(const char *path)
+{
+	if (CsoFile::is_compressed(path))
+		return CsoFile::get_image_size(path);
 
-	while ((entry = readdir(d)))
-	{
-		if(entry->d_name[0] == '.' && (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)) continue;
+	if (DedupFile::is_manifest(path))
+		return DedupFile::get_image_size(path);
 
-		name_len = strlen(entry->d_name);
-		if (name_len == 0) continue;
+	return -1;
+}
 
-		//DPRINTF("name: %s\n", entry->d_name);
+// A compressed image or a chunk store manifest is served in place of an iso that doesn't exist: X.iso is
+// read from X.cso, X.zso or X.iso.dedup. On success filepath is left with the name of the image.
+static int find_packed_image(char *filepath, file_stat_t *st)
+{
+	static const char *extensions[] = { ".cso", ".zso", ".CSO", ".ZSO" };
+	size_t len = strlen(filepath);
+	char ext[4];
 
-		file_stat_t st;
-		char newpath[path_len + name_len + 2];
+	if (len < 4 || filepath[len-4] != '.' || (filepath[len-3] | 0x20) != 'i' || (filepath[len-2] | 0x20) != 's' || (filepath[len-1] | 0x20) != 'o')
+		return -1;
 
-		sprintf(newpath, "%s/%s", path, entry->d_name);
+	memcpy(ext, filepath + len - 4, 4);
 
-		if (stat_file(newpath, &st) < 0)
-		{
-			DPRINTF("calculate_directory_size: stat failed on %s\n", newpath);
-			result = -1;
-			break;
-		}
+	for (unsigned int i = 0; i < sizeof(extensions)/sizeof(char *); i++)
+	{
+		memcpy(filepath + len - 4, extensions[i], 4);
 
-		if ((st.mode & S_IFDIR) == S_IFDIR)
-		{
-			int64_t temp = calculate_directory_size(newpath);
-			if (temp < 0)
-			{
-				result = temp;
-				break;
-			}
+		if (stat_file(filepath, st) == 0 && (st->mode & S_IFDIR) != S_IFDIR)
+			return 0;
+	}
 
-			result += temp;
-		}
-		else if ((st.mode & S_IFREG) == S_IFREG)
-		{
-			result += st.file_size;
-		}
+	memcpy(filepath + len - 4, ext, 4);
+
+	// filepath lives in a buffer of MAX_PATH_LEN
+	if (len + sizeof(DEDUP_EXTENSION) <= MAX_PATH_LEN)
+	{
+		strcpy(filepath + len, DEDUP_EXTENSION);
+
+		if (stat_file(filepath, st) == 0 && (st->mode & S_IFDIR) != S_IFDIR)
+			return 0;
+
+		filepath[len] = 0;
 	}
 
-	closedir(d);
-	return result;
+	return -1;
 }
 
 // NOTE: All process_XXX function return an error ONLY if connection must be aborted. If only a not critical error must be returned to the client, that error will be
@@ -358,33 +532,34 @@ static int process_open_cmd(client_t *client, netiso_open_cmd *cmd)
 	uint16_t fp_len;
 	int ret, viso;
 	int error = 0;
+#ifndef WIN32
+	MappedFile *mapped_file = NULL;
+#endif
 
 	client->CD_SECTOR_SIZE = 2352;
 
 	fp_len = BE16(cmd->fp_len);
 	//DPRINTF("fp_len = %d\n", fp_len);
-	filepath = (char *)malloc(fp_len+1);
-	if (!filepath)
+	if (client->read_ahead)
 	{
-		DPRINTF("CRITICAL: memory allocation error\n");
-		return -1;
+		delete client->read_ahead;
+		client->read_ahead = NULL;
 	}
 
 	if (client->ro_file)
 	{
 		delete client->ro_file;
+		client->ro_file = NULL;
 	}
 
-	filepath[fp_len] = 0;
-	ret = recv_all(client->s, (void *)filepath, fp_len);
-	if (ret != fp_len || !strcmp(filepath, "/CLOSEFILE"))
+	filepath = get_path(client, fp_len);
+	if (!filepath || !strcmp(filepath, "/CLOSEFILE"))
 	{
-		DPRINTF("recv failed, getting filename for open: %d %d\n", ret, get_network_error());
-		free(filepath);
+		DPRINTF("recv failed, getting filename for open: %d\n", get_network_error());
 		return -1;
 	}
 
-	filepath = translate_path(filepath, 1, &viso);
+	filepath = translate_path(client, filepath, &viso);
 	if (!filepath)
 	{
 		DPRINTF("Path cannot be translated. Connection with this client will be aborted.\n");
@@ -395,7 +570,19 @@ static int process_open_cmd(client_t *client, netiso_open_cmd *cmd)
 
 	if (viso == VISO_NONE)
 	{
-		client->ro_file = new File();
+		if (!CsoFile::is_compressed(filepath) && !DedupFile::is_manifest(filepath) && stat_file(filepath, &st) < 0)
+			find_packed_image(filepath, &st);
+
+		if (CsoFile::is_compressed(filepath))
+			client->ro_file = new CsoFile();
+		else if (DedupFile::is_manifest(filepath))
+			client->ro_file = new DedupFile();
+#ifndef WIN32
+		else if (use_mmap)
+			client->ro_file = mapped_file = new MappedFile();
+#endif
+		else
+			client->ro_file = new File();
 	}
 	else
 	{
@@ -432,6 +619,17 @@ static int process_open_cmd(client_t *client, netiso_open_cmd *cmd)
 				client->ro_file->seek(0x9220, SEEK_SET); client->ro_file->read(buffer, 0xC); if(memcmp(buffer, "PLAYSTATION ", 0xC)==0) {client->CD_SECTOR_SIZE = 2336; printf("cd sector size: %i\n", client->CD_SECTOR_SIZE);} else {
 				client->ro_file->seek(0x9920, SEEK_SET); client->ro_file->read(buffer, 0xC); if(memcmp(buffer, "PLAYSTATION ", 0xC)==0) {client->CD_SECTOR_SIZE = 2448; printf("cd sector size: %i\n", client->CD_SECTOR_SIZE);} }}}
 			}
+
+			// The read-ahead of a mapped file is done by the kernel
+			bool mapped = false;
+#ifndef WIN32
+			mapped = (mapped_file && mapped_file->is_mapped());
+#endif
+
+			if (readahead_size > 0 && st.file_size > 0 && !mapped)
+			{
+				client->read_ahead = new ReadAhead(client->ro_file, st.file_size, readahead_size*1048576);
+			}
 		}
 	}
 
@@ -447,7 +645,6 @@ static int process_open_cmd(client_t *client, netiso_open_cmd *cmd)
 		result.mtime = BE64(0);
 	}
 
-	free(filepath);
 
 	ret = send(client->s, (char *)&result, sizeof(result), 0);
 	if (ret != sizeof(result))
@@ -459,6 +656,66 @@ static int process_open_cmd(client_t *client, netiso_open_cmd *cmd)
 	return 0;
 }
 
+// Sends the result of a command and the data after it at once: sent apart, the end of the data may wait for
+// the delayed ACK of the client. data must have RESULT_ROOM bytes free before it. With NETISO_FEATURE_LZ4 the
+// data is compressed when it pays off; adaptive is set for file data, which is sent as is for a while after
+// some of it didn't compress.
+static int send_result_data(client_t *client, const void *result, int result_size, uint8_t *data, int size, bool adaptive)
+{
+	uint8_t *p = data;
+	int n = size;
+
+	if ((client->features & NETISO_FEATURE_LZ4) && size > 0)
+	{
+		netiso_lz4_header header;
+
+		header.packed_size = 0;
+		header.raw_size = 0;
+
+		if (adaptive && client->lz4_skip > 0)
+		{
+			client->lz4_skip--;
+		}
+		else if (size >= LZ4_MIN_SIZE)
+		{
+			uint8_t *block = client->zbuf + RESULT_ROOM;
+			int raw_size;
+			int packed = lz4_compress_in_place(data, size, block, size - size/LZ4_MIN_GAIN, &raw_size);
+
+			if (packed > 0)
+			{
+				// The bytes after the last match are sent as they are
+				memcpy(block + packed, data + size - raw_size, raw_size);
+				header.packed_size = BE32(packed);
+				header.raw_size = BE32(raw_size);
+				p = block;
+				n = packed + raw_size;
+				client->lz4_backoff = 0;
+			}
+			else if (adaptive)
+			{
+				client->lz4_backoff = (client->lz4_backoff > 0) ? MIN(client->lz4_backoff*2, LZ4_MAX_BACKOFF) : 1;
+				client->lz4_skip = client->lz4_backoff;
+			}
+		}
+
+		p -= sizeof(header);
+		n += sizeof(header);
+		memcpy(p, &header, sizeof(header));
+	}
+
+	p -= result_size;
+	n += result_size;
+	memcpy(p, result, result_size);
+
+	if (send(client->s, (char *)p, n, 0) != n)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
 static int process_read_file_critical(client_t *client, netiso_read_file_critical_cmd *cmd)
 {
 	uint64_t offset;
@@ -475,23 +732,44 @@ static int process_read_file_critical(client_t *client, netiso_read_file_critica
 	DPRINTF("Read %llx %x\n", (long long unsigned int)offset, remaining);
 #endif
 
-	if (client->ro_file->seek(offset, SEEK_SET) < 0)
-	{
-		DPRINTF("seek_file failed!\n");
-		return -1;
-	}
-
 	uint32_t read_size = MIN(BUFFER_SIZE, remaining);
 
 	while (remaining > 0)
 	{
+		ssize_t ret = -2;
 
 		if (remaining < read_size)
 		{
 			read_size = remaining;
 		}
 
-		if (client->ro_file->read(client->buf, read_size) != read_size)
+		// Sequential streams are served by the read-ahead, plain files go straight from disk to the socket
+		if (client->read_ahead)
+		{
+			ret = client->read_ahead->read(client->buf, read_size, offset);
+		}
+
+		if (ret == -2)
+		{
+			int64_t sent = client->ro_file->sendfile(client->s, offset, read_size);
+			if (sent != -2)
+			{
+				if (sent != read_size)
+				{
+					DPRINTF("sendfile failed on read file critical command!\n");
+					return -1;
+				}
+
+				Stats::add_sent((int)(client - clients), read_size);
+				offset += read_size;
+				remaining -= read_size;
+				continue;
+			}
+
+			ret = client->ro_file->pread(client->buf, read_size, offset);
+		}
+
+		if (ret != read_size)
 		{
 			DPRINTF("read_file failed on read file critical command!\n");
 			return -1;
@@ -503,6 +781,8 @@ static int process_read_file_critical(client_t *client, netiso_read_file_critica
 			return -1;
 		}
 
+		Stats::add_sent((int)(client - clients), read_size);
+		offset += read_size;
 		remaining -= read_size;
 	}
 
@@ -530,18 +810,32 @@ static int process_read_cd_2048_critical_cmd(client_t *client, netiso_read_cd_20
 		return -1;
 	}
 
-	buf = client->buf;
-	for (uint32_t i = 0; i < sector_count; i++)
+	// From the start of the first sector to the end of the user data of the last one
+	uint64_t span = (uint64_t)(sector_count-1)*client->CD_SECTOR_SIZE + 24 + 2048;
+
+	// Read the raw sectors at once, then strip the sync/header and EDC/ECC around the user data of each one
+	if (sector_count > 0 && span <= BUFFER_SIZE && client->ro_file->pread(client->buf, span, offset) == (ssize_t)span)
 	{
-    	client->ro_file->seek(offset+24, SEEK_SET);
-		if (client->ro_file->read(buf, 2048) != 2048)
+		for (uint32_t i = 0; i < sector_count; i++)
 		{
-			DPRINTF("read_file failed on read cd 2048 critical command!\n");
-			return -1;
+			memmove(client->buf + i*2048, client->buf + i*client->CD_SECTOR_SIZE + 24, 2048);
 		}
+	}
+	else
+	{
+		// The span doesn't fit in the buffer, or a short read: let the sector that fails be reported
+		buf = client->buf;
+		for (uint32_t i = 0; i < sector_count; i++)
+		{
+			if (client->ro_file->pread(buf, 2048, offset+24) != 2048)
+			{
+				DPRINTF("read_file failed on read cd 2048 critical command!\n");
+				return -1;
+			}
 
-		buf += 2048;
-		offset += client->CD_SECTOR_SIZE;
+			buf += 2048;
+			offset += client->CD_SECTOR_SIZE;
+		}
 	}
 
 	if (send(client->s, (char *)client->buf, sector_count*2048, 0) != (sector_count*2048))
@@ -550,6 +844,8 @@ static int process_read_cd_2048_critical_cmd(client_t *client, netiso_read_cd_20
 		return -1;
 	}
 
+	Stats::add_sent((int)(client - clients), sector_count*2048);
+
 	return 0;
 }
 
@@ -559,6 +855,7 @@ static int process_read_file_cmd(client_t *client, netiso_read_file_cmd *cmd)
 	uint32_t remaining;
 	int32_t bytes_read;
 	netiso_read_file_result result;
+	uint8_t *data = client->buf + RESULT_ROOM;
 
 	offset = BE64(cmd->offset);
 	remaining = BE32(cmd->num_bytes);
@@ -575,13 +872,7 @@ static int process_read_file_cmd(client_t *client, netiso_read_file_cmd *cmd)
 		goto send_result_read_file;
 	}
 
-	if (client->ro_file->seek(offset, SEEK_SET) < 0)
-	{
-		bytes_read = -1;
-		goto send_result_read_file;
-	}
-
-	bytes_read = client->ro_file->read(client->buf, remaining);
+	bytes_read = client->ro_file->pread(data, remaining, offset);
 	if (bytes_read < 0)
 	{
 		bytes_read = -1;
@@ -591,16 +882,15 @@ send_result_read_file:
 
 	result.bytes_read = (int32_t)BE32(bytes_read);
 
-	if (send(client->s, (char *)&result, sizeof(result), 0) != 4)
+	if (send_result_data(client, &result, sizeof(result), data, (bytes_read > 0) ? bytes_read : 0, true) != 0)
 	{
-		DPRINTF("send failed on send result (read file)\n");
+		DPRINTF("send failed on read file!\n");
 		return -1;
 	}
 
-	if (bytes_read > 0 && send(client->s, (char *)client->buf, bytes_read, 0) != bytes_read)
+	if (bytes_read > 0)
 	{
-		DPRINTF("send failed on read file!\n");
-		return -1;
+		Stats::add_sent((int)(client - clients), bytes_read);
 	}
 
 	return 0;
@@ -615,23 +905,14 @@ static int process_create_cmd(client_t *client, netiso_create_cmd *cmd)
 
 	fp_len = BE16(cmd->fp_len);
 	//DPRINTF("fp_len = %d\n", fp_len);
-	filepath = (char *)malloc(fp_len+1);
+	filepath = get_path(client, fp_len);
 	if (!filepath)
 	{
-		DPRINTF("CRITICAL: memory allocation error\n");
+		DPRINTF("recv failed, getting filename for create: %d\n", get_network_error());
 		return -1;
 	}
 
-	filepath[fp_len] = 0;
-	ret = recv_all(client->s, (void *)filepath, fp_len);
-	if (ret != fp_len)
-	{
-		DPRINTF("recv failed, getting filename for create: %d %d\n", ret, get_network_error());
-		free(filepath);
-		return -1;
-	}
-
-	filepath = translate_path(filepath, 1, NULL);
+	filepath = translate_path(client, filepath, NULL);
 	if (!filepath)
 	{
 		DPRINTF("Path cannot be translated. Connection with this client will be aborted.\n");
@@ -640,26 +921,41 @@ static int process_create_cmd(client_t *client, netiso_create_cmd *cmd)
 
 	DPRINTF("create %s\n", filepath);
 
-	if (client->wo_file)
+	if (client->wo_file && close_upload(client) != 0)
 	{
-		delete client->wo_file;
+		result.create_result = BE32(-1);
+		goto send_result_create;
+	}
+
+	if (client->failed_upload && strcmp(client->failed_upload, filepath) == 0)
+	{
+		free(client->failed_upload);
+		client->failed_upload = NULL;
 	}
 
-	client->wo_file = new File();
+	// Uploads are written to disk while the next chunks arrive
+	if (write_behind_size > 0)
+		client->wo_file = new WriteBehindFile(write_behind_size * 1048576 / WRITEBEHIND_BUFFER_SIZE, (int64_t)preallocate_size * 1048576);
+	else
+		client->wo_file = new File();
+
+	client->wo_path = strdup(filepath);
 
-	if (client->wo_file->open(filepath, O_WRONLY|O_CREAT|O_TRUNC) < 0)
+	if (!client->wo_path || client->wo_file->open(filepath, O_WRONLY|O_CREAT|O_TRUNC) < 0)
 	{
 		DPRINTF("create error on \"%s\"\n", filepath);
 		result.create_result = BE32(-1);
 		delete client->wo_file;
 		client->wo_file = NULL;
+		free(client->wo_path);
+		client->wo_path = NULL;
 	}
 	else
 	{
 		result.create_result = BE32(0);
 	}
 
-	free(filepath);
+send_result_create:
 
 	ret = send(client->s, (char *)&result, sizeof(result), 0);
 	if (ret != sizeof(result))
@@ -692,17 +988,8 @@ static int process_write_file_cmd(client_t *client, netiso_write_file_cmd *cmd)
 
 	//DPRINTF("Remaining: %d\n", remaining);
 
-	if (remaining > 0)
-	{
-		int ret = recv_all(client->s, (void *)client->buf, remaining);
-		if (ret != remaining)
-		{
-			DPRINTF("recv failed on write file: %d %d\n", ret, get_network_error());
-			return -1;
-		}
-	}
-
-	bytes_written = client->wo_file->write(client->buf, remaining);
+	// The data was received with the command
+	bytes_written = client->wo_file->write(client->payload, remaining);
 	if (bytes_written < 0)
 	{
 		bytes_written = -1;
@@ -729,23 +1016,14 @@ static int process_delete_file_cmd(client_t *client, netiso_delete_file_cmd *cmd
 	int ret;
 
 	fp_len = BE16(cmd->fp_len);
-	filepath = (char *)malloc(fp_len+1);
+	filepath = get_path(client, fp_len);
 	if (!filepath)
 	{
-		DPRINTF("CRITICAL: memory allocation error\n");
-		return -1;
-	}
-
-	filepath[fp_len] = 0;
-	ret = recv_all(client->s, (void *)filepath, fp_len);
-	if (ret != fp_len)
-	{
-		DPRINTF("recv failed, getting filename for delete file: %d %d\n", ret, get_network_error());
-		free(filepath);
+		DPRINTF("recv failed, getting filename for delete file: %d\n", get_network_error());
 		return -1;
 	}
 
-	filepath = translate_path(filepath, 1, NULL);
+	filepath = translate_path(client, filepath, NULL);
 	if (!filepath)
 	{
 		DPRINTF("Path cannot be translated. Connection with this client will be aborted.\n");
@@ -756,7 +1034,6 @@ static int process_delete_file_cmd(client_t *client, netiso_delete_file_cmd *cmd
 	printf("delete %s\n", filepath + root_len);
 
 	result.delete_result = BE32(unlink(filepath));
-	free(filepath);
 
 	ret = send(client->s, (char *)&result, sizeof(result), 0);
 	if (ret != sizeof(result))
@@ -776,23 +1053,14 @@ static int process_mkdir_cmd(client_t *client, netiso_mkdir_cmd *cmd)
 	int ret;
 
 	dp_len = BE16(cmd->dp_len);
-	dirpath = (char *)malloc(dp_len+1);
+	dirpath = get_path(client, dp_len);
 	if (!dirpath)
 	{
-		DPRINTF("CRITICAL: memory allocation error\n");
-		return -1;
-	}
-
-	dirpath[dp_len] = 0;
-	ret = recv_all(client->s, (void *)dirpath, dp_len);
-	if (ret != dp_len)
-	{
-		DPRINTF("recv failed, getting dirname for mkdir: %d %d\n", ret, get_network_error());
-		free(dirpath);
+		DPRINTF("recv failed, getting dirname for mkdir: %d\n", get_network_error());
 		return -1;
 	}
 
-	dirpath = translate_path(dirpath, 1, NULL);
+	dirpath = translate_path(client, dirpath, NULL);
 	if (!dirpath)
 	{
 		DPRINTF("Path cannot be translated. Connection with this client will be aborted.\n");
@@ -807,7 +1075,6 @@ static int process_mkdir_cmd(client_t *client, netiso_mkdir_cmd *cmd)
 #else
 	result.mkdir_result = BE32(mkdir(dirpath, 0777));
 #endif
-	free(dirpath);
 
 	ret = send(client->s, (char *)&result, sizeof(result), 0);
 	if (ret != sizeof(result))
@@ -827,23 +1094,14 @@ static int process_rmdir_cmd(client_t *client, netiso_rmdir_cmd *cmd)
 	int ret;
 
 	dp_len = BE16(cmd->dp_len);
-	dirpath = (char *)malloc(dp_len+1);
+	dirpath = get_path(client, dp_len);
 	if (!dirpath)
 	{
-		DPRINTF("CRITICAL: memory allocation error\n");
-		return -1;
-	}
-
-	dirpath[dp_len] = 0;
-	ret = recv_all(client->s, (void *)dirpath, dp_len);
-	if (ret != dp_len)
-	{
-		DPRINTF("recv failed, getting dirname for rmdir: %d %d\n", ret, get_network_error());
-		free(dirpath);
+		DPRINTF("recv failed, getting dirname for rmdir: %d\n", get_network_error());
 		return -1;
 	}
 
-	dirpath = translate_path(dirpath, 1, NULL);
+	dirpath = translate_path(client, dirpath, NULL);
 	if (!dirpath)
 	{
 		DPRINTF("Path cannot be translated. Connection with this client will be aborted.\n");
@@ -854,7 +1112,6 @@ static int process_rmdir_cmd(client_t *client, netiso_rmdir_cmd *cmd)
     printf("rmdir %s\n", dirpath + root_len);
 
 	result.rmdir_result = BE32(rmdir(dirpath));
-	free(dirpath);
 
 	ret = send(client->s, (char *)&result, sizeof(result), 0);
 	if (ret != sizeof(result))
@@ -869,29 +1126,20 @@ static int process_rmdir_cmd(client_t *client, netiso_rmdir_cmd *cmd)
 static int process_open_dir_cmd(client_t *client, netiso_open_dir_cmd *cmd)
 {
 	netiso_open_dir_result result;
-	char *dirpath;
+	char *path, *dirpath;
 	uint16_t dp_len;
 	int ret;
 
 	dp_len = BE16(cmd->dp_len);
 	//DPRINTF("fp_len = %d\n", fp_len);
-	dirpath = (char *)malloc(dp_len+1);
-	if (!dirpath)
+	path = get_path(client, dp_len);
+	if (!path)
 	{
-		DPRINTF("CRITICAL: memory allocation error\n");
+		DPRINTF("recv failed, getting dirname for open dir: %d\n", get_network_error());
 		return -1;
 	}
 
-	dirpath[dp_len] = 0;
-	ret = recv_all(client->s, (void *)dirpath, dp_len);
-	if (ret != dp_len)
-	{
-		DPRINTF("recv failed, getting dirname for open dir: %d %d\n", ret, get_network_error());
-		free(dirpath);
-		return -1;
-	}
-
-	dirpath = translate_path(dirpath, 1, NULL);
+	dirpath = translate_path(client, path, NULL);
 	if (!dirpath)
 	{
 		DPRINTF("Path cannot be translated. Connection with this client will be aborted.\n");
@@ -912,22 +1160,28 @@ static int process_open_dir_cmd(client_t *client, netiso_open_dir_cmd *cmd)
 	}
 
 	client->dirpath = NULL;
+	free_listing(client);
 
-	client->dir = opendir(dirpath);
-	if (!client->dir)
+	client->dir = open_dir_path(path, dirpath);
+	if (client->dir)
+		client->dirpath = strdup(dirpath);
+
+	if (!client->dirpath)
 	{
 		DPRINTF("open dir error on \"%s\"\n", dirpath);
 		result.open_result = BE32(-1);
+
+		if (client->dir)
+		{
+			closedir(client->dir);
+			client->dir = NULL;
+		}
 	}
 	else
 	{
-		client->dirpath = dirpath;
 		result.open_result = BE32(0);
 	}
 
-	if (!client->dirpath)
-		free(dirpath);
-
 	ret = send(client->s, (char *)&result, sizeof(result), 0);
 	if (ret != sizeof(result))
 	{
@@ -944,7 +1198,6 @@ static int process_read_dir_entry_cmd(client_t *client, netiso_read_dir_entry_cm
 	netiso_read_dir_entry_result_v2 result_v2;
 	file_stat_t st;
 	struct dirent *entry;
-	char *path;
 
 	if (version == 1)
 	{
@@ -993,12 +1246,10 @@ static int process_read_dir_entry_cmd(client_t *client, netiso_read_dir_entry_cm
 		goto send_result_read_dir;
 	}
 
-	path = (char *)malloc(strlen(client->dirpath)+strlen(entry->d_name)+2);
-	sprintf(path, "%s/%s", client->dirpath, entry->d_name);
-
-	DPRINTF("Read dir entry: %s\n", path);
-	if (stat_file(path, &st) < 0)
+	DPRINTF("Read dir entry: %s/%s\n", client->dirpath, entry->d_name);
+	if (stat_dir_entry(client->dir, client->dirpath, entry->d_name, &st) < 0)
 	{
+		DPRINTF("Stat failed on read dir entry: %s/%s\n", client->dirpath, entry->d_name);
 		closedir(client->dir);
 		free(client->dirpath);
 		client->dir = NULL;
@@ -1013,13 +1264,9 @@ static int process_read_dir_entry_cmd(client_t *client, netiso_read_dir_entry_cm
 		{
 			result_v2.file_size = BE64(-1);
 		}
-		DPRINTF("Stat failed on read dir entry: %s\n", path);
-		free(path);
 		goto send_result_read_dir;
 	}
 
-	free(path);
-
 	if ((st.mode & S_IFDIR) == S_IFDIR)
 	{
 		if (version == 1)
@@ -1090,25 +1337,66 @@ send_result_read_dir:
 	return 0;
 }
 
-static int process_read_dir_cmd(client_t *client, netiso_read_dir_entry_cmd *cmd)
+// Adds an entry to a listing of netiso_dir_page_entry records, grown as needed
+static int append_dir_entry(uint8_t **listing, size_t *size, size_t *capacity, const char *name, int64_t file_size, uint64_t mtime, int8_t is_directory)
 {
-	(void) cmd;
-	netiso_read_dir_result result;
-	netiso_read_dir_result_data *dir_entries = (netiso_read_dir_result_data *) malloc(sizeof(netiso_read_dir_result_data)*4096);
-	int64_t dir_size; dir_size=0;
+	netiso_dir_page_entry entry;
+	uint16_t name_len = strlen(name);
 
-	file_stat_t st;
-	struct dirent *entry;
+	if (*size + sizeof(entry) + name_len > *capacity)
+	{
+		size_t new_capacity = (*capacity > 0) ? *capacity * 2 : 65536;
+		uint8_t *p = (uint8_t *)realloc(*listing, new_capacity);
 
-	memset(&result, 0, sizeof(result));
-	memset(dir_entries, 0, sizeof(netiso_read_dir_result_data)*4096);
+		if (!p)
+			return -1;
 
-	if (!client->dir || !client->dirpath)
+		*listing = p;
+		*capacity = new_capacity;
+	}
+
+	entry.file_size = BE64(file_size);
+	entry.mtime = BE64(mtime);
+	entry.is_directory = is_directory;
+	entry.name_len = BE16(name_len);
+
+	memcpy(*listing + *size, &entry, sizeof(entry));
+	memcpy(*listing + *size + sizeof(entry), name, name_len);
+	*size += sizeof(entry) + name_len;
+	return 0;
+}
+
+// Takes the listing of the open directory, from the cache or by reading it, and closes the directory. Returns
+// the number of entries, the listing is left in *listing (to be freed). client->buf is used for paths.
+static int64_t list_dir(client_t *client, uint8_t **listing, size_t *listing_size)
+{
+	int64_t dir_size; dir_size=0;
+	size_t capacity = 0;
+	uint64_t snapshot_token;
+	bool complete = true;
+
+	file_stat_t st;
+	struct dirent *entry;
+
+	*listing = NULL;
+	*listing_size = 0;
+
+	if (!client->dir || !client->dirpath)
+		return 0;
+
+#if !defined(WIN32) || !defined(MERGE_DRIVES)
+	dir_size = DirCache::get(client->dirpath, listing, listing_size);
+	if (dir_size >= 0)
 	{
-		result.dir_size = (0);
-		goto send_result_read_dir_cmd;
+		closedir(client->dir);
+		client->dir = NULL;
+		return dir_size;
 	}
 
+	dir_size = 0;
+	snapshot_token = DirCache::prepare(client->dirpath);
+#endif
+
 	uint16_t d_name_len, dirpath_len;
 	dirpath_len = strlen(client->dirpath);
 
@@ -1121,39 +1409,66 @@ static int process_read_dir_cmd(client_t *client, netiso_read_dir_entry_cmd *cmd
 
 		if (d_name_len <= 510)
 		{
-			char *path = (char*)malloc(dirpath_len + d_name_len + 2);
+			char name[512];
+			int64_t file_size;
 
-			sprintf(path, "%s/%s", client->dirpath, entry->d_name);
 			st.file_size=0;
 			st.mode=S_IFDIR;
 			st.mtime=0;
 			st.atime=0;
 			st.ctime=0;
-			stat_file(path, &st);
+			stat_dir_entry(client->dir, client->dirpath, entry->d_name, &st);
 
 			if(!st.mtime) st.mtime=st.ctime;
 			if(!st.mtime) st.mtime=st.atime;
 
-			if ((st.mode & S_IFDIR) == S_IFDIR)
+			file_size = ((st.mode & S_IFDIR) == S_IFDIR) ? 0 : st.file_size;
+			strcpy(name, entry->d_name);
+
+			// Compressed images and chunk store manifests are listed as the isos they contain
+			if ((st.mode & S_IFDIR) != S_IFDIR && (CsoFile::is_compressed(entry->d_name) || DedupFile::is_manifest(entry->d_name)) && dirpath_len + d_name_len + 2 <= MAX_PATH_LEN)
 			{
-					dir_entries[dir_size].file_size = (0);
-					dir_entries[dir_size].is_directory = 1;
+				char *path = (char *)client->buf;
+				int64_t image_size;
+
+				sprintf(path, "%s/%s", client->dirpath, entry->d_name);
+				image_size = get_packed_image_size(path);
+
+				if (image_size >= 0)
+				{
+					file_stat_t iso_st;
+
+					if (DedupFile::is_manifest(entry->d_name))
+						name[d_name_len - (sizeof(DEDUP_EXTENSION) - 1)] = 0;
+					else
+						memcpy(name + d_name_len - 3, (entry->d_name[d_name_len-1] == 'O') ? "ISO" : "iso", 3);
+
+					// X.iso is served from this image only if it doesn't exist and no other image comes first (see find_packed_image)
+					sprintf(path, "%s/%s", client->dirpath, name);
+
+					if (stat_file(path, &iso_st) == 0 || find_packed_image(path, &iso_st) != 0 || strcmp(path + dirpath_len + 1, entry->d_name) != 0)
+						continue;
+
+					file_size = image_size;
+				}
 			}
-			else
+
+			if (append_dir_entry(listing, listing_size, &capacity, name, file_size, st.mtime, (st.mode & S_IFDIR) == S_IFDIR) != 0)
 			{
-					dir_entries[dir_size].file_size =  BE64(st.file_size);
-					dir_entries[dir_size].is_directory = 0;
+				complete = false;
+				break;
 			}
 
-			snprintf(dir_entries[dir_size].name, 510, "%s", entry->d_name);
-			dir_entries[dir_size].mtime = BE64(st.mtime);
-
-			free(path);
 			dir_size++;
-			if(dir_size > MAX_ENTRIES) break;
 		}
 	}
 
+#if !defined(WIN32) || !defined(MERGE_DRIVES)
+	// A listing cut short would be served until the directory changes
+	if (complete)
+		DirCache::put(client->dirpath, snapshot_token, *listing, *listing_size, dir_size);
+#endif
+
 #ifdef WIN32
 	#ifdef MERGE_DRIVES
 	if(root_len > 2 && dirpath_len > (root_len + 1) && strncmp(client->dirpath, root_directory, root_len) == 0)
@@ -1168,8 +1483,6 @@ static int process_read_dir_cmd(client_t *client, netiso_read_dir_entry_cmd *cmd
 
 		for(int drive = 'C'; drive <= 'Z'; drive++)
 		{
-			if(dir_size > MAX_ENTRIES) break;
-
 			if(ignore_drives)
 			{
 				bool ignore; ignore = false;
@@ -1207,25 +1520,17 @@ static int process_read_dir_cmd(client_t *client, netiso_read_dir_entry_cmd *cmd
 					if(!st.mtime) st.mtime=st.ctime;
 					if(!st.mtime) st.mtime=st.atime;
 
-					if ((st.mode & S_IFDIR) == S_IFDIR)
-					{
-							dir_entries[dir_size].file_size = (0);
-							dir_entries[dir_size].is_directory = 1;
-					}
-					else
-					{
-							dir_entries[dir_size].file_size =  BE64(st.file_size);
-							dir_entries[dir_size].is_directory = 0;
-					}
+					free(path);
 
-					snprintf(dir_entries[dir_size].name, 510, "%s", entry->d_name);
-					dir_entries[dir_size].mtime = BE64(st.mtime);
+					if (append_dir_entry(listing, listing_size, &capacity, entry->d_name, ((st.mode & S_IFDIR) == S_IFDIR) ? 0 : st.file_size, st.mtime, (st.mode & S_IFDIR) == S_IFDIR) != 0)
+						break;
 
-					free(path);
 					dir_size++;
-					if(dir_size > MAX_ENTRIES) break;
 				}
 			}
+
+			closedir(client->dir);
+			client->dir = NULL;
 		}
 	}
 	#endif
@@ -1233,25 +1538,309 @@ static int process_read_dir_cmd(client_t *client, netiso_read_dir_entry_cmd *cmd
 
 	if(client->dir) {closedir(client->dir); client->dir = NULL;}
 
-send_result_read_dir_cmd:
+	return dir_size;
+}
+
+static int process_read_dir_cmd(client_t *client, netiso_read_dir_entry_cmd *cmd)
+{
+	(void) cmd;
+	netiso_read_dir_result result;
+	// The entries are built in the worker buffer, which is large enough for MAX_ENTRIES+1 of them
+	netiso_read_dir_result_data *dir_entries = (netiso_read_dir_result_data *)(client->buf + RESULT_ROOM);
+	int64_t dir_size = 0;
+	uint8_t *listing;
+	size_t listing_size, pos = 0;
+
+	list_dir(client, &listing, &listing_size);
+
+	// Clients of READ_DIR get the fixed size records, up to MAX_ENTRIES+1 of them
+	while (pos < listing_size && dir_size <= MAX_ENTRIES)
+	{
+		netiso_dir_page_entry entry;
+
+		memcpy(&entry, listing + pos, sizeof(entry));
+		pos += sizeof(entry);
+
+		uint16_t name_len = BE16(entry.name_len);
+
+		memset(&dir_entries[dir_size], 0, sizeof(netiso_read_dir_result_data));
+		dir_entries[dir_size].file_size = entry.file_size;
+		dir_entries[dir_size].mtime = entry.mtime;
+		dir_entries[dir_size].is_directory = entry.is_directory;
+		memcpy(dir_entries[dir_size].name, listing + pos, name_len);
 
+		pos += name_len;
+		dir_size++;
+	}
+
+	free(listing);
+
+	memset(&result, 0, sizeof(result));
 	result.dir_size = BE64(dir_size);
-	if (send(client->s, (const char*)&result, sizeof(result), 0) != sizeof(result))
+
+	if (send_result_data(client, &result, sizeof(result), (uint8_t *)dir_entries, (int)(sizeof(netiso_read_dir_result_data)*dir_size), false) != 0)
 	{
-		if(dir_entries) free(dir_entries);
 		return -1;
 	}
 
-	if (dir_size > 0)
+	return 0;
+}
+
+// Size of the entry at pos in the listing, 0 if there isn't a whole one
+static size_t listing_entry_size(client_t *client, size_t pos)
+{
+	netiso_dir_page_entry entry;
+
+	if (pos + sizeof(entry) > client->listing_size)
+		return 0;
+
+	memcpy(&entry, client->listing + pos, sizeof(entry));
+
+	size_t entry_size = sizeof(entry) + BE16(entry.name_len);
+
+	return (pos + entry_size <= client->listing_size) ? entry_size : 0;
+}
+
+// Finds the position of the entry of index in the listing. Pages are asked in order, so it is usually the one
+// kept after the last page; otherwise the listing is walked from the start.
+static int seek_listing(client_t *client, uint64_t index)
+{
+	if (index > (uint64_t)client->listing_entries)
+		return -1;
+
+	if (index != client->listing_next)
 	{
-		if (send(client->s, (const char*)dir_entries, (sizeof(netiso_read_dir_result_data)*dir_size), 0) != (int)(sizeof(netiso_read_dir_result_data)*dir_size))
+		client->listing_next = 0;
+		client->listing_pos = 0;
+
+		while (client->listing_next < index)
 		{
-			if(dir_entries) free(dir_entries);
-			return -1;
+			size_t entry_size = listing_entry_size(client, client->listing_pos);
+
+			if (entry_size == 0)
+				return -1;
+
+			client->listing_pos += entry_size;
+			client->listing_next++;
 		}
 	}
 
-	if(dir_entries) free(dir_entries);
+	return 0;
+}
+
+static int process_read_dir_page_cmd(client_t *client, netiso_read_dir_page_cmd *cmd)
+{
+	netiso_read_dir_page_result result;
+	uint8_t *data = client->buf + RESULT_ROOM;
+	uint32_t max_entries = BE32(cmd->max_entries);
+	uint64_t token = BE64(cmd->token);
+	uint32_t num_entries = 0;
+	size_t size = 0;
+
+	if (!(client->features & NETISO_FEATURE_DIR_PAGES))
+	{
+		DPRINTF("Paged read dir without NETISO_FEATURE_DIR_PAGES!\n");
+		return -1;
+	}
+
+	memset(&result, 0, sizeof(result));
+
+	// The token is the index of the next entry in the listing, which is kept until its last page was sent
+	if (token == 0)
+	{
+		free_listing(client);
+		client->listing_entries = list_dir(client, &client->listing, &client->listing_size);
+	}
+	else if (!client->listing || seek_listing(client, token) != 0)
+	{
+		result.dir_size = BE64(-1);
+		goto send_result_read_dir_page;
+	}
+
+	while (num_entries < max_entries)
+	{
+		size_t entry_size = listing_entry_size(client, client->listing_pos);
+
+		// A listing cut short ends here
+		if (entry_size == 0)
+		{
+			client->listing_pos = client->listing_size;
+			break;
+		}
+
+		if (size + entry_size > BUFFER_SIZE)
+			break;
+
+		memcpy(data + size, client->listing + client->listing_pos, entry_size);
+		size += entry_size;
+		client->listing_pos += entry_size;
+		client->listing_next++;
+		num_entries++;
+	}
+
+	result.dir_size = BE64(client->listing_entries);
+	result.num_entries = BE32(num_entries);
+	result.size = BE32((uint32_t)size);
+
+	if (client->listing_pos < client->listing_size && client->listing_next < (uint64_t)client->listing_entries)
+		result.token = BE64(client->listing_next);
+	else
+		free_listing(client);
+
+send_result_read_dir_page:
+
+	if (send_result_data(client, &result, sizeof(result), data, (int)size, false) != 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+// A name of the list of NETISO_CMD_GET_GAME_INFO is taken in the open directory, never out of it
+static inline bool is_entry_name(const char *name)
+{
+	return (name[0] && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && !strchr(name, '/') && !strchr(name, '\\'));
+}
+
+// Reads the cover of a game next to it, to path + ".jpg" or path + ".png". Returns its NETISO_GAME_ICON_* type.
+static int read_cover(char *path, uint8_t **cover, int64_t *cover_size)
+{
+	static const char *extensions[] = { ".jpg", ".png" };
+	size_t len = strlen(path);
+
+	for (unsigned int i = 0; i < sizeof(extensions)/sizeof(char *); i++)
+	{
+		strcpy(path + len, extensions[i]);
+		*cover_size = GameInfo::read_whole_file(path, cover, GAMEINFO_MAX_ICON_SIZE);
+
+		if (*cover_size >= 0)
+		{
+			path[len] = 0;
+			return NETISO_GAME_ICON_JPG + i;
+		}
+	}
+
+	path[len] = 0;
+	return NETISO_GAME_ICON_NONE;
+}
+
+static int process_get_game_info_cmd(client_t *client, netiso_get_game_info_cmd *cmd)
+{
+	netiso_get_game_info_result result;
+	uint8_t *data = client->buf + RESULT_ROOM;
+	uint16_t num_names = BE16(cmd->num_names);
+	uint16_t names_len = BE16(cmd->names_len);
+	uint32_t max_size = MIN(BE32(cmd->max_size), (uint32_t)BUFFER_SIZE);
+	int32_t num_entries = 0;
+	uint32_t size = 0;
+	char *names, *path;
+
+	if (!(client->features & NETISO_FEATURE_GAME_INFO))
+	{
+		DPRINTF("Get game info without NETISO_FEATURE_GAME_INFO!\n");
+		return -1;
+	}
+
+	// The list and the paths built from it use the compression buffer, which is only needed once they are done
+	names = (char *)client->zbuf;
+	path = names + MAX_PATH_LEN + 2;
+
+	memcpy(names, client->payload, names_len);
+
+	// A list cut short ends with empty names
+	names[names_len] = names[names_len+1] = 0;
+
+	if (!client->dirpath || max_size < sizeof(netiso_game_info))
+	{
+		num_entries = -1;
+		goto send_result_get_game_info;
+	}
+
+	for (char *name = names; num_entries < num_names; num_entries++)
+	{
+		char *cover_name = name + strlen(name) + 1;
+		char *next = cover_name + strlen(cover_name) + 1;
+		size_t dir_len = strlen(client->dirpath);
+		netiso_game_info info;
+		uint32_t sfo_size = 0, icon_size = 0;
+		uint8_t *cover = NULL;
+		int64_t cover_size = 0;
+		int ret = -1;
+
+		memset(&info, 0, sizeof(info));
+
+		if (name >= names + names_len || size + sizeof(info) > max_size)
+			break;
+
+		uint8_t *files = data + size + sizeof(info);
+		uint32_t room = max_size - size - sizeof(info);
+
+		if (is_entry_name(name) && dir_len + strlen(name) + strlen(cover_name) + 8 < MAX_PATH_LEN)
+		{
+			file_stat_t st;
+
+			sprintf(path, "%s/", client->dirpath);
+
+			if (is_entry_name(cover_name))
+			{
+				strcpy(path + dir_len + 1, cover_name);
+				info.icon_type = read_cover(path, &cover, &cover_size);
+			}
+
+			strcpy(path + dir_len + 1, name);
+
+			if (stat_file(path, &st) < 0)
+				find_packed_image(path, &st);
+
+			ret = GameInfo::get(path, files, room, (cmd->want_icon0 && !cover), &sfo_size, &icon_size);
+
+			if (icon_size > 0)
+				info.icon_type = NETISO_GAME_ICON_ICON0;
+
+			if (cover)
+			{
+				if (sfo_size + cover_size <= room)
+				{
+					memcpy(files + sfo_size, cover, cover_size);
+					icon_size = (uint32_t)cover_size;
+				}
+				else
+				{
+					ret = 1;
+				}
+
+				free(cover);
+			}
+		}
+
+		// What doesn't fit is asked again in another command, but the first game is sent with what fits
+		if (ret == 1 && num_entries > 0)
+			break;
+
+		if (icon_size == 0)
+			info.icon_type = NETISO_GAME_ICON_NONE;
+
+		DPRINTF("game info %s: sfo %u, icon %u (%d)\n", name, sfo_size, icon_size, info.icon_type);
+
+		size += sizeof(info) + sfo_size + icon_size;
+		info.sfo_size = BE32(sfo_size);
+		info.icon_size = BE32(icon_size);
+		memcpy(files - sizeof(info), &info, sizeof(info));
+
+		name = next;
+	}
+
+send_result_get_game_info:
+
+	result.num_entries = BE32(num_entries);
+	result.size = BE32(size);
+
+	if (send_result_data(client, &result, sizeof(result), data, (int)size, false) != 0)
+	{
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -1259,29 +1848,20 @@ static int process_stat_cmd(client_t *client, netiso_stat_cmd *cmd)
 {
 	netiso_stat_result result;
 	file_stat_t st;
-	char *filepath;
+	char *path, *filepath;
 	uint16_t fp_len;
 	int ret;
 
 	fp_len = BE16(cmd->fp_len);
 	//DPRINTF("fp_len = %d\n", fp_len);
-	filepath = (char *)malloc(fp_len+1);
-	if (!filepath)
-	{
-		DPRINTF("CRITICAL: memory allocation error\n");
-		return -1;
-	}
-
-	filepath[fp_len] = 0;
-	ret = recv_all(client->s, (char *)filepath, fp_len);
-	if (ret != fp_len)
+	path = get_path(client, fp_len);
+	if (!path)
 	{
-		DPRINTF("recv failed, getting filename for stat: %d %d\n", ret, get_network_error());
-		free(filepath);
+		DPRINTF("recv failed, getting filename for stat: %d\n", get_network_error());
 		return -1;
 	}
 
-	filepath = translate_path(filepath, 1, NULL);
+	filepath = translate_path(client, path, NULL);
 	if (!filepath)
 	{
 		DPRINTF("Path cannot be translated. Connection with this client will be aborted.\n");
@@ -1289,7 +1869,37 @@ static int process_stat_cmd(client_t *client, netiso_stat_cmd *cmd)
 	}
 
 	DPRINTF("stat %s\n", filepath);
-	if (stat_file(filepath, &st) < 0 && !strstr(filepath, "/is_ps3_compat1/"))
+
+	int stat_ret;
+
+	// The upload being written is flushed first, so its size is the one sent and its errors are seen
+	if (client->wo_file && strcmp(client->wo_path, filepath) == 0)
+		stat_ret = client->wo_file->fstat(&st);
+	else if (client->failed_upload && strcmp(client->failed_upload, filepath) == 0)
+		stat_ret = -1;
+	else
+		stat_ret = stat_path(path, filepath, &st);
+
+	if (stat_ret < 0 && find_packed_image(filepath, &st) == 0)
+	{
+		int64_t image_size = get_packed_image_size(filepath);
+
+		if (image_size >= 0)
+		{
+			st.file_size = image_size;
+			stat_ret = 0;
+		}
+	}
+	else if (stat_ret == 0 && (st.mode & S_IFDIR) != S_IFDIR)
+	{
+		// Opened by its own name, a compressed image or a manifest is the iso too
+		int64_t image_size = get_packed_image_size(filepath);
+
+		if (image_size >= 0)
+			st.file_size = image_size;
+	}
+
+	if (stat_ret < 0 && !strstr(filepath, "/is_ps3_compat1/"))
 //	if (stat_file(filepath, &st) < 0)
 	{
 		DPRINTF("stat error on \"%s\"\n", filepath);
@@ -1313,7 +1923,6 @@ static int process_stat_cmd(client_t *client, netiso_stat_cmd *cmd)
 		result.atime = BE64(st.atime);
 	}
 
-	free(filepath);
 
 	ret = send(client->s, (char *)&result, sizeof(result), 0);
 	if (ret != sizeof(result))
@@ -1333,23 +1942,14 @@ static int process_get_dir_size_cmd(client_t *client, netiso_get_dir_size_cmd *c
 	int ret;
 
 	dp_len = BE16(cmd->dp_len);
-	dirpath = (char *)malloc(dp_len+1);
+	dirpath = get_path(client, dp_len);
 	if (!dirpath)
 	{
-		DPRINTF("CRITICAL: memory allocation error\n");
-		return -1;
-	}
-
-	dirpath[dp_len] = 0;
-	ret = recv_all(client->s, (char *)dirpath, dp_len);
-	if (ret != dp_len)
-	{
-		DPRINTF("recv failed, getting dirname for get_dir_size: %d %d\n", ret, get_network_error());
-		free(dirpath);
+		DPRINTF("recv failed, getting dirname for get_dir_size: %d\n", get_network_error());
 		return -1;
 	}
 
-	dirpath = translate_path(dirpath, 1, NULL);
+	dirpath = translate_path(client, dirpath, NULL);
 	if (!dirpath)
 	{
 		DPRINTF("Path cannot be translated. Connection with this client will be aborted.\n");
@@ -1358,8 +1958,7 @@ static int process_get_dir_size_cmd(client_t *client, netiso_get_dir_size_cmd *c
 
 	DPRINTF("get_dir_size %s\n", dirpath);
 
-	result.dir_size = BE64(calculate_directory_size(dirpath));
-	free(dirpath);
+	result.dir_size = BE64(DirSize::get(dirpath));
 
 	ret = send(client->s, (char *)&result, sizeof(result), 0);
 	if (ret != sizeof(result))
@@ -1371,98 +1970,480 @@ static int process_get_dir_size_cmd(client_t *client, netiso_get_dir_size_cmd *c
 	return 0;
 }
 
-void *client_thread(void *arg)
+static int process_set_features_cmd(client_t *client, netiso_set_features_cmd *cmd)
 {
-	client_t *client = (client_t *)arg;
+	netiso_set_features_result result;
+	uint32_t features;
 
-	for(;;)
+	features = BE32(cmd->features) & SUPPORTED_FEATURES;
+
+	DPRINTF("Set features %08X, accepted %08X\n", BE32(cmd->features), features);
+
+	if ((features & NETISO_FEATURE_PIPELINE) && !client->pipeline)
+	{
+		client->pipeline = new Pipeline(client->s, (int)(client - clients));
+	}
+	else if (!(features & NETISO_FEATURE_PIPELINE) && client->pipeline)
+	{
+		delete client->pipeline;
+		client->pipeline = NULL;
+	}
+
+	client->features = features;
+	client->lz4_skip = 0;
+	client->lz4_backoff = 0;
+
+	memset(&result, 0, sizeof(result));
+	result.features = BE32(features);
+
+	if (features & NETISO_FEATURE_PIPELINE)
+	{
+		result.pipeline_depth = BE16(PIPELINE_DEPTH);
+		result.max_tagged_read = BE32(PIPELINE_MAX_READ);
+	}
+
+	if (send(client->s, (char *)&result, sizeof(result), 0) != sizeof(result))
 	{
-		netiso_cmd cmd;
-		int ret;
+		DPRINTF("send failed on set features!\n");
+		return -1;
+	}
+
+	return 0;
+}
 
-		ret = recv_all(client->s, (void *)&cmd, sizeof(cmd));
-		if (ret != sizeof(cmd))
+static int process_read_file_tagged_cmd(client_t *client, netiso_read_file_tagged_cmd *cmd)
+{
+	if (!client->pipeline)
+	{
+		DPRINTF("Tagged read without NETISO_FEATURE_PIPELINE!\n");
+		return -1;
+	}
+
+	return client->pipeline->submit(client->ro_file, BE16(cmd->tag), BE32(cmd->num_bytes), BE64(cmd->offset));
+}
+
+static inline bool is_zero(const uint8_t *p, size_t size)
+{
+	return p[0] == 0 && memcmp(p, p + 1, size - 1) == 0;
+}
+
+// Reads nbyte bytes at offset to buf and finds the runs of zeros in them, with offsets in buf. The ranges
+// the file knows to be zeros aren't read, the rest is checked by blocks. Returns the bytes read, -1 on error.
+static ssize_t read_zero_runs(AbstractFile *file, uint8_t *buf, uint32_t nbyte, int64_t offset, zero_run_t *runs, int *num_runs)
+{
+	zero_run_t known[NETISO_MAX_ZERO_RUNS];
+	int num_known = file->get_zero_runs(offset, nbyte, known, NETISO_MAX_ZERO_RUNS);
+	uint32_t size = nbyte;
+	uint32_t pos = 0;
+
+	for (int i = 0; i <= num_known; i++)
+	{
+		uint32_t start = (i < num_known) ? (uint32_t)(known[i].offset - offset) : nbyte;
+
+		if (start > pos)
 		{
-			break;
+			ssize_t ret = file->pread(buf + pos, start - pos, offset + pos);
+
+			if (ret < 0 && pos == 0)
+				return -1;
+
+			if (ret < (ssize_t)(start - pos))
+			{
+				size = pos + ((ret > 0) ? ret : 0);
+				break;
+			}
 		}
 
-		switch (BE16(cmd.opcode))
+		if (i < num_known)
 		{
-			case NETISO_CMD_READ_FILE_CRITICAL:
-				ret = process_read_file_critical(client, (netiso_read_file_critical_cmd *)&cmd);
-			break;
+			memset(buf + start, 0, known[i].size);
+			pos = start + known[i].size;
+		}
+	}
 
-			case NETISO_CMD_READ_CD_2048_CRITICAL:
-				ret = process_read_cd_2048_critical_cmd(client, (netiso_read_cd_2048_critical_cmd *)&cmd);
-			break;
+	*num_runs = 0;
 
-			case NETISO_CMD_READ_FILE:
-				ret = process_read_file_cmd(client, (netiso_read_file_cmd *)&cmd);
-			break;
+	for (uint32_t block = 0; block < size; )
+	{
+		uint32_t block_end = MIN(size, block + ZERO_BLOCK_SIZE - (uint32_t)((offset + block) % ZERO_BLOCK_SIZE));
 
-			case NETISO_CMD_WRITE_FILE:
-				ret = process_write_file_cmd(client, (netiso_write_file_cmd *)&cmd);
+		// Once there is no room for more runs, the zeros left are sent as data
+		if (is_zero(buf + block, block_end - block) && !add_zero_run(runs, num_runs, NETISO_MAX_ZERO_RUNS, block, block_end - block))
 			break;
 
-			case NETISO_CMD_READ_DIR_ENTRY:
-				ret = process_read_dir_entry_cmd(client, (netiso_read_dir_entry_cmd *)&cmd, 1);
-			break;
+		block = block_end;
+	}
 
-			case NETISO_CMD_READ_DIR_ENTRY_V2:
-				ret = process_read_dir_entry_cmd(client, (netiso_read_dir_entry_cmd *)&cmd, 2);
-			break;
+	return size;
+}
 
-			case NETISO_CMD_STAT_FILE:
-				ret = process_stat_cmd(client, (netiso_stat_cmd *)&cmd);
-			break;
+static int process_read_file_sparse_cmd(client_t *client, netiso_read_file_sparse_cmd *cmd)
+{
+	uint64_t offset = BE64(cmd->offset);
+	uint32_t num_bytes = BE32(cmd->num_bytes);
+	uint8_t *data = client->buf + RESULT_ROOM;
+	uint8_t header[sizeof(netiso_read_file_sparse_result) + NETISO_MAX_ZERO_RUNS*sizeof(netiso_zero_run)];
+	netiso_read_file_sparse_result *result = (netiso_read_file_sparse_result *)header;
+	netiso_zero_run *result_runs = (netiso_zero_run *)(result + 1);
+	zero_run_t runs[NETISO_MAX_ZERO_RUNS];
+	int num_runs = 0;
+	int32_t bytes_read = -1;
+
+	if (!(client->features & NETISO_FEATURE_SPARSE))
+	{
+		DPRINTF("Sparse read without NETISO_FEATURE_SPARSE!\n");
+		return -1;
+	}
 
-			case NETISO_CMD_OPEN_FILE:
-				ret = process_open_cmd(client, (netiso_open_cmd *)&cmd);
-			break;
+	if (client->ro_file && num_bytes <= BUFFER_SIZE)
+	{
+		bytes_read = (int32_t)read_zero_runs(client->ro_file, data, num_bytes, offset, runs, &num_runs);
+	}
 
-			case NETISO_CMD_CREATE_FILE:
-				ret = process_create_cmd(client, (netiso_create_cmd *)&cmd);
-			break;
+	// The data is packed without the runs, which are sent ahead of it
+	uint32_t data_size = 0;
+	uint32_t pos = 0;
 
-			case NETISO_CMD_DELETE_FILE:
-				ret = process_delete_file_cmd(client, (netiso_delete_file_cmd *)&cmd);
-			break;
+	for (int i = 0; i <= num_runs; i++)
+	{
+		uint32_t start = (i < num_runs) ? (uint32_t)runs[i].offset : (uint32_t)((bytes_read > 0) ? bytes_read : 0);
 
-			case NETISO_CMD_OPEN_DIR:
-				ret = process_open_dir_cmd(client, (netiso_open_dir_cmd *)&cmd);
-			break;
+		if (start > pos)
+		{
+			memmove(data + data_size, data + pos, start - pos);
+			data_size += start - pos;
+		}
 
-			case NETISO_CMD_READ_DIR:
-				ret = process_read_dir_cmd(client, (netiso_read_dir_entry_cmd *)&cmd);
-			break;
+		if (i < num_runs)
+		{
+			result_runs[i].offset = BE32((uint32_t)runs[i].offset);
+			result_runs[i].size = BE32((uint32_t)runs[i].size);
+			pos = runs[i].offset + runs[i].size;
+		}
+	}
 
-			case NETISO_CMD_GET_DIR_SIZE:
-				ret = process_get_dir_size_cmd(client, (netiso_get_dir_size_cmd *)&cmd);
-			break;
+	memset(result, 0, sizeof(netiso_read_file_sparse_result));
+	result->bytes_read = (int32_t)BE32(bytes_read);
+	result->num_runs = BE16(num_runs);
 
-			case NETISO_CMD_MKDIR:
-				ret = process_mkdir_cmd(client, (netiso_mkdir_cmd *)&cmd);
-			break;
+	if (send_result_data(client, header, sizeof(netiso_read_file_sparse_result) + num_runs*sizeof(netiso_zero_run), data, data_size, true) != 0)
+	{
+		DPRINTF("send failed on sparse read!\n");
+		return -1;
+	}
 
-			case NETISO_CMD_RMDIR:
-				ret = process_rmdir_cmd(client, (netiso_rmdir_cmd *)&cmd);
-			break;
+	if (data_size > 0)
+	{
+		Stats::add_sent((int)(client - clients), data_size);
+	}
+
+	return 0;
+}
+
+static int process_command(client_t *client, netiso_cmd *cmd)
+{
+	int ret;
+	uint16_t opcode = BE16(cmd->opcode);
+	uint64_t start_time = 0;
+
+	// Other commands are processed once the tagged reads in flight are done, as they may change the ro_file
+	if (client->pipeline && opcode != NETISO_CMD_READ_FILE_TAGGED && client->pipeline->wait() != 0)
+	{
+		return -1;
+	}
+
+	if (Stats::is_enabled())
+	{
+		start_time = get_time_usec();
+	}
+
+	switch (opcode)
+	{
+		case NETISO_CMD_READ_FILE_CRITICAL:
+			ret = process_read_file_critical(client, (netiso_read_file_critical_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_READ_CD_2048_CRITICAL:
+			ret = process_read_cd_2048_critical_cmd(client, (netiso_read_cd_2048_critical_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_READ_FILE:
+			ret = process_read_file_cmd(client, (netiso_read_file_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_WRITE_FILE:
+			ret = process_write_file_cmd(client, (netiso_write_file_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_READ_DIR_ENTRY:
+			ret = process_read_dir_entry_cmd(client, (netiso_read_dir_entry_cmd *)cmd, 1);
+		break;
+
+		case NETISO_CMD_READ_DIR_ENTRY_V2:
+			ret = process_read_dir_entry_cmd(client, (netiso_read_dir_entry_cmd *)cmd, 2);
+		break;
+
+		case NETISO_CMD_STAT_FILE:
+			ret = process_stat_cmd(client, (netiso_stat_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_OPEN_FILE:
+			ret = process_open_cmd(client, (netiso_open_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_CREATE_FILE:
+			ret = process_create_cmd(client, (netiso_create_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_DELETE_FILE:
+			ret = process_delete_file_cmd(client, (netiso_delete_file_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_OPEN_DIR:
+			ret = process_open_dir_cmd(client, (netiso_open_dir_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_READ_DIR:
+			ret = process_read_dir_cmd(client, (netiso_read_dir_entry_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_GET_DIR_SIZE:
+			ret = process_get_dir_size_cmd(client, (netiso_get_dir_size_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_MKDIR:
+			ret = process_mkdir_cmd(client, (netiso_mkdir_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_RMDIR:
+			ret = process_rmdir_cmd(client, (netiso_rmdir_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_SET_FEATURES:
+			ret = process_set_features_cmd(client, (netiso_set_features_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_READ_FILE_TAGGED:
+			ret = process_read_file_tagged_cmd(client, (netiso_read_file_tagged_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_READ_FILE_SPARSE:
+			ret = process_read_file_sparse_cmd(client, (netiso_read_file_sparse_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_READ_DIR_PAGE:
+			ret = process_read_dir_page_cmd(client, (netiso_read_dir_page_cmd *)cmd);
+		break;
+
+		case NETISO_CMD_GET_GAME_INFO:
+			ret = process_get_game_info_cmd(client, (netiso_get_game_info_cmd *)cmd);
+		break;
+
+		default:
+			DPRINTF("Unknown command received: %04X\n", opcode);
+			ret = -1;
+	}
+
+	// Tagged reads are counted by the pipeline when they complete
+	if (Stats::is_enabled() && opcode != NETISO_CMD_READ_FILE_TAGGED)
+	{
+		Stats::command_done((int)(client - clients), opcode, get_time_usec() - start_time, ret != 0);
+	}
+
+	return ret;
+}
+
+// Bytes sent after the header of a command, -1 if there are too many
+static int64_t get_payload_size(netiso_cmd *cmd)
+{
+	switch (BE16(cmd->opcode))
+	{
+		// The length of the path follows the opcode
+		case NETISO_CMD_OPEN_FILE:
+		case NETISO_CMD_CREATE_FILE:
+		case NETISO_CMD_DELETE_FILE:
+		case NETISO_CMD_OPEN_DIR:
+		case NETISO_CMD_MKDIR:
+		case NETISO_CMD_RMDIR:
+		case NETISO_CMD_STAT_FILE:
+		case NETISO_CMD_GET_DIR_SIZE:
+			return BE16(((netiso_open_cmd *)cmd)->fp_len);
+
+		case NETISO_CMD_WRITE_FILE:
+		{
+			uint32_t num_bytes = BE32(((netiso_write_file_cmd *)cmd)->num_bytes);
+			return (num_bytes > BUFFER_SIZE) ? -1 : num_bytes;
+		}
+
+		case NETISO_CMD_GET_GAME_INFO:
+			return BE16(((netiso_get_game_info_cmd *)cmd)->names_len);
+	}
+
+	return 0;
+}
 
-			default:
-				DPRINTF("Unknown command received: %04X\n", BE16(cmd.opcode));
-				ret = -1;
+// Receives what is available of the size bytes of buf. Returns 1 once they are all there, 0 if more has
+// to come and -1 on error.
+static int recv_pending(int s, uint8_t *buf, uint32_t size, uint32_t *len)
+{
+	while (*len < size)
+	{
+		int ret = recv_nonblock(s, buf + *len, size - *len);
+		if (ret == -2)
+		{
+			return 0;
+		}
+
+		if (ret <= 0)
+		{
+			return -1;
 		}
 
+		*len += ret;
+	}
+
+	return 1;
+}
+
+// Called when the client socket is readable. A command, with the path or data that follow it, is
+// accumulated without blocking and processed once complete, so a console that stays idle or sends
+// slowly doesn't hold a worker thread. Results are sent by the worker, with the socket's send timeout.
+// Clients using tagged reads get the commands already queued in the socket submitted in one go.
+static int process_client_event(client_t *client)
+{
+	for (int n = 0; n < PIPELINE_DEPTH; n++)
+	{
+		if (client->cmd_len < sizeof(netiso_cmd))
+		{
+			int ret = recv_pending(client->s, (uint8_t *)&client->cmd, sizeof(netiso_cmd), &client->cmd_len);
+			if (ret <= 0)
+			{
+				return ret;
+			}
+
+			int64_t payload_size = get_payload_size(&client->cmd);
+			if (payload_size < 0)
+			{
+				DPRINTF("Command %04X carries too much data\n", BE16(client->cmd.opcode));
+				return -1;
+			}
+
+			// Kept for the next commands, an upload sends chunks of the same size
+			if (payload_size > client->payload_capacity)
+			{
+				uint8_t *payload = (uint8_t *)realloc(client->payload, payload_size);
+				if (!payload)
+				{
+					return -1;
+				}
+
+				client->payload = payload;
+				client->payload_capacity = (uint32_t)payload_size;
+			}
+
+			client->payload_size = (uint32_t)payload_size;
+			client->payload_len = 0;
+		}
+
+		int ret = recv_pending(client->s, client->payload, client->payload_size, &client->payload_len);
+		if (ret <= 0)
+		{
+			return ret;
+		}
+
+		client->cmd_len = 0;
+
+		ret = process_command(client, &client->cmd);
+		if (ret != 0 || !client->pipeline)
+		{
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void *worker_thread(void *arg)
+{
+	uint8_t *buf = (uint8_t *)arg;
+
+	for(;;)
+	{
+		void *ready;
+
+		if (poller_wait(poller, &ready, 1) != 1)
+		{
+			continue;
+		}
+
+		client_t *client = (client_t *)ready;
+
+		client->buf = buf;
+		client->zbuf = buf + BUFFER_SIZE + RESULT_ROOM;
+		int ret = process_client_event(client);
+		client->buf = NULL;
+		client->zbuf = NULL;
+
 		if (ret != 0)
 		{
-			break;
+			finalize_client(client);
+		}
+		else
+		{
+			poller_rearm(poller, client->s, client);
 		}
 	}
 
-	finalize_client(client);
 	return NULL;
 }
 
+static int parse_options(int argc, char *argv[])
+{
+	int n = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--", 2) != 0)
+		{
+			argv[n++] = argv[i];
+			continue;
+		}
+
+		char *p = strchr(argv[i], '=');
+		unsigned int j;
+
+		for (j = 0; j < sizeof(options)/sizeof(option_t); j++)
+		{
+			if (p && strlen(options[j].name) == (size_t)(p-argv[i]-2) && strncmp(argv[i]+2, options[j].name, p-argv[i]-2) == 0)
+				break;
+		}
+
+		if (j == sizeof(options)/sizeof(option_t))
+		{
+			printf("Unknown option %s\n", argv[i]);
+			return -1;
+		}
+
+		if (options[j].string)
+		{
+			*options[j].string = p+1;
+			continue;
+		}
+
+		int value;
+
+		if (sscanf(p+1, "%d", &value) != 1 || value < options[j].min || value > options[j].max)
+		{
+			printf("Option --%s must be in %d-%d range.\n", options[j].name, options[j].min, options[j].max);
+			return -1;
+		}
+
+		*options[j].value = value;
+	}
+
+	return n;
+}
+
 int main(int argc, char *argv[])
 {
 	int s;
@@ -1480,9 +2461,20 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	argc = parse_options(argc, argv);
+	if (argc < 0)
+	{
+		return -1;
+	}
+
 	if (argc < 2)
 	{
-		printf("Usage: %s rootdirectory [port] [whitelist]\nDefault port: %d\nWhitelist: x.x.x.x, where x is 0-255 or * (e.g 192.168.1.* to allow only connections from 192.168.1.0-192.168.1.255)\n", argv[0], NETISO_PORT);
+		printf("Usage: %s [options] rootdirectory [port] [whitelist]\nDefault port: %d\nWhitelist: x.x.x.x, where x is 0-255 or * (e.g 192.168.1.* to allow only connections from 192.168.1.0-192.168.1.255)\n", argv[0], NETISO_PORT);
+		printf("Options:\n");
+		for (unsigned int i = 0; i < sizeof(options)/sizeof(option_t); i++)
+		{
+			printf("  --%s=%s: %s\n", options[i].name, (options[i].string) ? "path" : "n", options[i].description);
+		}
 		return -1;
 	}
 
@@ -1510,6 +2502,11 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+#ifndef WIN32
+	// The paths of the clients are looked up from here; if it can't be open, from root_directory
+	root_fd = open(root_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+
 	if (argc > 2)
 	{
 		uint32_t u;
@@ -1624,7 +2621,107 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	memset(clients, 0, sizeof(clients));
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+
+	if (use_mmap && MappedFile::initialize() != 0)
+	{
+		printf("Cannot handle truncated mapped files.\n");
+		return -1;
+	}
+#endif
+
+	if (num_workers == 0)
+	{
+		num_workers = get_cpu_count()*2;
+		if (num_workers < MIN_WORKERS)
+			num_workers = MIN_WORKERS;
+	}
+
+	clients = (client_t *)calloc(max_clients, sizeof(client_t));
+	poller = poller_create();
+	if (!clients || !poller)
+	{
+		printf("Error in initialization.\n");
+		return -1;
+	}
+
+	mutex_init(&clients_mutex);
+
+	if (readahead_size > 0 && ReadAhead::initialize(READAHEAD_THREADS) != 0)
+	{
+		printf("System seems low in resources.\n");
+		return -1;
+	}
+
+	if (Pipeline::initialize(num_workers) != 0)
+	{
+		printf("System seems low in resources.\n");
+		return -1;
+	}
+
+	if (BlockCache::initialize((int64_t)cache_size*1048576) != 0)
+	{
+		printf("Cannot allocate the block cache.\n");
+		return -1;
+	}
+
+	if (DirCache::initialize(dir_cache_size) != 0)
+	{
+		printf("System seems low in resources.\n");
+		return -1;
+	}
+
+	if (GameInfo::initialize(game_cache_size) != 0)
+	{
+		printf("System seems low in resources.\n");
+		return -1;
+	}
+
+	if (CsoFile::initialize(get_cpu_count()) != 0)
+	{
+		printf("System seems low in resources.\n");
+		return -1;
+	}
+
+	if (DirSize::initialize(size_index) != 0)
+	{
+		printf("System seems low in resources.\n");
+		return -1;
+	}
+
+	if (Stats::initialize(max_clients, metrics_port, stats_interval) != 0)
+	{
+		printf("Cannot start the metrics.\n");
+		return -1;
+	}
+
+	if (viso_cache_dir)
+	{
+		file_stat_t st;
+
+		if (stat_file(viso_cache_dir, &st) != 0 || (st.mode & S_IFDIR) != S_IFDIR)
+		{
+			printf("Virtual iso cache directory %s doesn't exist.\n", viso_cache_dir);
+			return -1;
+		}
+
+		VIsoFile::setCacheDirectory(viso_cache_dir);
+	}
+
+	for (int i = 0; i < num_workers; i++)
+	{
+		thread_t thread;
+		// Transfer buffer and compression buffer, which is only touched by clients using compression
+		uint8_t *buf = (uint8_t *)malloc(2*(BUFFER_SIZE + RESULT_ROOM));
+
+		if (!buf || create_start_thread(&thread, worker_thread, buf) != 0)
+		{
+			printf("System seems low in resources.\n");
+			return -1;
+		}
+	}
+
 	printf("Waiting for client...\n");
 
 	for (;;)
@@ -1632,7 +2729,7 @@ int main(int argc, char *argv[])
 		struct sockaddr_in addr;
 		unsigned int size;
 		int cs;
-		int i;
+		int i, reconnection;
 
 		size = sizeof(addr);
 		cs = accept(s, (struct sockaddr *)&addr, (socklen_t *)&size);
@@ -1644,20 +2741,21 @@ int main(int argc, char *argv[])
 			break;
 		}
 
+		mutex_lock(&clients_mutex);
 
 		// Check for same client
-		for (i = 0; i < MAX_CLIENTS; i++)
+		for (i = 0; i < max_clients; i++)
 		{
-			if (clients[i].connected && clients[i].ip_addr.s_addr == addr.sin_addr.s_addr)
+			if (clients[i].connected && clients[i].s >= 0 && clients[i].ip_addr.s_addr == addr.sin_addr.s_addr)
 				break;
 		}
 
-		if (i != MAX_CLIENTS)
+		reconnection = (i != max_clients);
+
+		if (reconnection)
 		{
-			// Shutdown socket and wait for thread to complete
+			// Shutdown socket, the worker owning it will release the old session
 			shutdown(clients[i].s, SHUT_RDWR);
-			closesocket(clients[i].s);
-			join_thread(clients[i].thread);
 			printf("Reconnection from %s\n",  inet_ntoa(addr.sin_addr));
 		}
 		else
@@ -1668,37 +2766,54 @@ int main(int argc, char *argv[])
 
 				if (ip < whitelist_start || ip > whitelist_end)
 				{
+					mutex_unlock(&clients_mutex);
 					printf("Rejected connection from %s (not in whitelist)\n", inet_ntoa(addr.sin_addr));
 					closesocket(cs);
 					continue;
 				}
 			}
+		}
 
-			for (i = 0; i < MAX_CLIENTS; i++)
-			{
-				if (!clients[i].connected)
-					break;
-			}
-
-			if (i == MAX_CLIENTS)
-			{
-				printf("Too many connections! (rejected client: %s)\n", inet_ntoa(addr.sin_addr));
-				closesocket(cs);
-				continue;
-			}
+		for (i = 0; i < max_clients; i++)
+		{
+			if (!clients[i].connected)
+				break;
+		}
 
-			printf("Connection from %s\n",  inet_ntoa(addr.sin_addr));
+		if (i == max_clients)
+		{
+			mutex_unlock(&clients_mutex);
+			printf("Too many connections! (rejected client: %s)\n", inet_ntoa(addr.sin_addr));
+			closesocket(cs);
+			continue;
 		}
 
-		if (initialize_client(&clients[i]) != 0)
+		if (!reconnection)
 		{
-			printf("System seems low in resources.\n");
-			break;
+			printf("Connection from %s\n",  inet_ntoa(addr.sin_addr));
 		}
 
+		// Commands are received without blocking, but results are sent by the worker (or I/O) thread
+#ifdef WIN32
+		DWORD timeout = SEND_TIMEOUT * 1000;
+#else
+		struct timeval timeout = { SEND_TIMEOUT, 0 };
+#endif
+
+		setsockopt(cs, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+
+		initialize_client(&clients[i]);
 		clients[i].s = cs;
 		clients[i].ip_addr = addr.sin_addr;
-		create_start_thread(&clients[i].thread, client_thread, &clients[i]);
+		Stats::client_connected(i, addr.sin_addr);
+
+		mutex_unlock(&clients_mutex);
+
+		if (poller_add(poller, cs, &clients[i]) != 0)
+		{
+			printf("System seems low in resources.\n");
+			finalize_client(&clients[i]);
+		}
 	}
 
 	if (ignore_drives)
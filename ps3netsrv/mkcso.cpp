@@ -0,0 +1,497 @@
+// mkcso: builds the CSO (deflate) and ZSO (lz4) images served by ps3netsrv, compressing with several threads.
+// Also extracts the iso of an image, to check it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "compat.h"
+#include "File.h"
+#include "CsoFile.h"
+#include "lz4block.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+// Blocks compressed by a thread at a time
+#define BATCH_BLOCKS	512
+#define EXTRACT_BUFFER_SIZE	(4*1048576)
+
+typedef struct
+{
+	const char *name;
+	int *value;
+	int min;
+	int max;
+	const char *description;
+	char **string; // set for options taking a string instead of a number
+} option_t;
+
+typedef struct _batch_t
+{
+	uint8_t *in;
+	uint8_t *out;
+	uint32_t *sizes; // compressed size of each block, 0 if it's stored as is
+	uint32_t num_blocks;
+	uint32_t in_size;
+	int state;
+	struct _batch_t *next;
+} batch_t;
+
+enum
+{
+	BATCH_FREE,
+	BATCH_QUEUED,
+	BATCH_DONE
+};
+
+static int num_threads = 0;
+static int block_size = 2048;
+static int level = 9;
+static int extract = 0;
+static char *format = NULL;
+
+static option_t options[] =
+{
+	{ "threads", &num_threads, 1, 256, "number of compression threads (default: 1 per cpu)" },
+	{ "block", &block_size, CSO_MIN_BLOCK_SIZE, CSO_MAX_BLOCK_SIZE, "size of the blocks, a multiple of 512 (default: 2048)" },
+	{ "level", &level, 1, 9, "deflate compression level of the cso images (default: 9)" },
+	{ "extract", &extract, 0, 1, "1 to write the iso of an image instead of compressing one" },
+	{ "format", NULL, 0, 0, "cso or zso (default: from the extension of the output)", &format },
+};
+
+static int use_lz4 = 0;
+static uint32_t batch_capacity = 0;
+
+static mutex_t mutex;
+static cond_t cond;
+static batch_t *queue_head = NULL;
+static batch_t *queue_tail = NULL;
+
+static void *compress_thread(void *arg)
+{
+	(void) arg;
+	z_stream z;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	for (;;)
+	{
+		mutex_lock(&mutex);
+
+		while (!queue_head)
+			cond_wait(&cond, &mutex);
+
+		batch_t *batch = queue_head;
+		queue_head = batch->next;
+		if (!queue_head)
+			queue_tail = NULL;
+
+		mutex_unlock(&mutex);
+
+		uint8_t *out = batch->out;
+
+		for (uint32_t i = 0; i < batch->num_blocks; i++)
+		{
+			uint8_t *in = batch->in + i*block_size;
+			uint32_t in_size = MIN(batch->in_size - i*block_size, (uint32_t)block_size);
+			int size;
+
+			if (use_lz4)
+			{
+				size = lz4_compress_block(in, in_size, out, in_size - 1);
+			}
+			else
+			{
+				deflateReset(&z);
+				z.next_in = in;
+				z.avail_in = in_size;
+				z.next_out = out;
+				z.avail_out = in_size - 1;
+
+				size = (deflate(&z, Z_FINISH) == Z_STREAM_END) ? (int)z.total_out : -1;
+			}
+
+			// Blocks that don't shrink are stored as is
+			batch->sizes[i] = (size > 0) ? size : 0;
+			out += (size > 0) ? size : 0;
+		}
+
+		mutex_lock(&mutex);
+		batch->state = BATCH_DONE;
+		cond_broadcast(&cond);
+		mutex_unlock(&mutex);
+	}
+
+	return NULL;
+}
+
+static int write_padding(FILE *f, int64_t *position, int align)
+{
+	static const uint8_t zeros[1 << 12] = { 0 };
+	int64_t padding = (((*position + (1 << align) - 1) >> align) << align) - *position;
+
+	if (padding > 0 && fwrite(zeros, 1, (size_t)padding, f) != (size_t)padding)
+		return -1;
+
+	*position += padding;
+	return 0;
+}
+
+static int compress_image(const char *input, const char *output)
+{
+	File in;
+	file_stat_t st;
+	CsoHeader header;
+
+	if (in.open(input, O_RDONLY) < 0 || in.fstat(&st) < 0)
+	{
+		printf("Cannot open %s.\n", input);
+		return -1;
+	}
+
+	int64_t total_bytes = st.file_size;
+	uint32_t num_blocks = (uint32_t)((total_bytes + block_size - 1) / block_size);
+	int64_t index_size = (num_blocks + 1) * sizeof(uint32_t);
+	int align = 0;
+
+	// Positions are stored in 31 bits, shifted by align
+	while (((int64_t)sizeof(header) + index_size + total_bytes + ((int64_t)num_blocks << align)) >> align >= 0x80000000LL)
+		align++;
+
+	if (align > 12)
+	{
+		printf("%s is too big.\n", input);
+		return -1;
+	}
+
+	uint32_t *index = (uint32_t *)calloc(num_blocks + 1, sizeof(uint32_t));
+	FILE *f = fopen(output, "wb");
+
+	if (!index || !f)
+	{
+		printf("Cannot create %s.\n", output);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = LE32(use_lz4 ? ZSO_MAGIC : CSO_MAGIC);
+	header.header_size = LE32(sizeof(header));
+	header.total_bytes = LE64(total_bytes);
+	header.block_size = LE32(block_size);
+	header.version = 1;
+	header.align = align;
+
+	// The index is written again at the end
+	if (fwrite(&header, 1, sizeof(header), f) != sizeof(header) || fwrite(index, 1, index_size, f) != (size_t)index_size)
+	{
+		printf("Error writing %s.\n", output);
+		return -1;
+	}
+
+	int num_batches = num_threads * 2;
+	batch_t *batches = (batch_t *)calloc(num_batches, sizeof(batch_t));
+
+	batch_capacity = BATCH_BLOCKS * block_size;
+
+	for (int i = 0; i < num_batches; i++)
+	{
+		batches[i].in = (uint8_t *)malloc(batch_capacity);
+		batches[i].out = (uint8_t *)malloc(batch_capacity);
+		batches[i].sizes = (uint32_t *)malloc(BATCH_BLOCKS * sizeof(uint32_t));
+
+		if (!batches[i].in || !batches[i].out || !batches[i].sizes)
+		{
+			printf("Out of memory.\n");
+			return -1;
+		}
+	}
+
+	uint32_t total_batches = (num_blocks + BATCH_BLOCKS - 1) / BATCH_BLOCKS;
+	uint32_t next_read = 0, next_write = 0;
+	int64_t position = sizeof(header) + index_size;
+
+	if (write_padding(f, &position, align) != 0)
+	{
+		printf("Error writing %s.\n", output);
+		return -1;
+	}
+
+	// Batches are read and queued in order, compressed in any order and written in order
+	while (next_write < total_batches)
+	{
+		while (next_read < total_batches && next_read - next_write < (uint32_t)num_batches)
+		{
+			batch_t *batch = &batches[next_read % num_batches];
+			int64_t offset = (int64_t)next_read * batch_capacity;
+
+			batch->in_size = (uint32_t)MIN(total_bytes - offset, (int64_t)batch_capacity);
+			batch->num_blocks = (batch->in_size + block_size - 1) / block_size;
+
+			if (in.pread(batch->in, batch->in_size, offset) != batch->in_size)
+			{
+				printf("Error reading %s.\n", input);
+				return -1;
+			}
+
+			mutex_lock(&mutex);
+			batch->state = BATCH_QUEUED;
+			batch->next = NULL;
+
+			if (queue_tail)
+				queue_tail->next = batch;
+			else
+				queue_head = batch;
+
+			queue_tail = batch;
+			cond_broadcast(&cond);
+			mutex_unlock(&mutex);
+
+			next_read++;
+		}
+
+		batch_t *batch = &batches[next_write % num_batches];
+
+		mutex_lock(&mutex);
+
+		while (batch->state != BATCH_DONE)
+			cond_wait(&cond, &mutex);
+
+		mutex_unlock(&mutex);
+
+		uint8_t *out = batch->out;
+
+		for (uint32_t i = 0; i < batch->num_blocks; i++)
+		{
+			uint32_t block = next_write * BATCH_BLOCKS + i;
+			uint32_t size = batch->sizes[i];
+			uint8_t *data = out;
+
+			index[block] = (uint32_t)(position >> align);
+
+			if (size == 0)
+			{
+				data = batch->in + i*block_size;
+				size = MIN(batch->in_size - i*block_size, (uint32_t)block_size);
+				index[block] |= CSO_PLAIN_BLOCK;
+			}
+			else
+			{
+				out += size;
+			}
+
+			if (fwrite(data, 1, size, f) != size)
+			{
+				printf("Error writing %s.\n", output);
+				return -1;
+			}
+
+			position += size;
+
+			if (write_padding(f, &position, align) != 0)
+			{
+				printf("Error writing %s.\n", output);
+				return -1;
+			}
+		}
+
+		batch->state = BATCH_FREE;
+		next_write++;
+
+		if ((next_write % 256) == 0 || next_write == total_batches)
+		{
+			printf("\r%3d%%", (int)((int64_t)next_write * 100 / total_batches));
+			fflush(stdout);
+		}
+	}
+
+	index[num_blocks] = (uint32_t)(position >> align);
+
+	for (uint32_t i = 0; i <= num_blocks; i++)
+		index[i] = LE32(index[i]);
+
+	if (fseek(f, sizeof(header), SEEK_SET) != 0 || fwrite(index, 1, index_size, f) != (size_t)index_size || fclose(f) != 0)
+	{
+		printf("Error writing %s.\n", output);
+		return -1;
+	}
+
+	for (int i = 0; i < num_batches; i++)
+	{
+		free(batches[i].in);
+		free(batches[i].out);
+		free(batches[i].sizes);
+	}
+
+	free(batches);
+	free(index);
+
+	printf("\r%s: %lld bytes, %.1f%% of the iso\n", output, (long long int)position, (total_bytes > 0) ? position * 100.0 / total_bytes : 0.0);
+	return 0;
+}
+
+static int extract_image(const char *input, const char *output)
+{
+	CsoFile in;
+	file_stat_t st;
+
+	if (in.open(input, O_RDONLY) < 0 || in.fstat(&st) < 0)
+	{
+		printf("%s is not a valid image.\n", input);
+		return -1;
+	}
+
+	FILE *f = fopen(output, "wb");
+	uint8_t *buf = (uint8_t *)malloc(EXTRACT_BUFFER_SIZE);
+
+	if (!f || !buf)
+	{
+		printf("Cannot create %s.\n", output);
+		return -1;
+	}
+
+	for (int64_t offset = 0; offset < (int64_t)st.file_size; offset += EXTRACT_BUFFER_SIZE)
+	{
+		ssize_t size = (ssize_t)MIN((int64_t)st.file_size - offset, (int64_t)EXTRACT_BUFFER_SIZE);
+
+		if (in.pread(buf, size, offset) != size)
+		{
+			printf("Block at %lld of %s is corrupt.\n", (long long int)offset, input);
+			return -1;
+		}
+
+		if (fwrite(buf, 1, size, f) != (size_t)size)
+		{
+			printf("Error writing %s.\n", output);
+			return -1;
+		}
+	}
+
+	free(buf);
+
+	if (fclose(f) != 0)
+	{
+		printf("Error writing %s.\n", output);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int parse_options(int argc, char *argv[])
+{
+	int n = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--", 2) != 0)
+		{
+			argv[n++] = argv[i];
+			continue;
+		}
+
+		char *p = strchr(argv[i], '=');
+		unsigned int j;
+
+		for (j = 0; j < sizeof(options)/sizeof(option_t); j++)
+		{
+			if (p && strlen(options[j].name) == (size_t)(p-argv[i]-2) && strncmp(argv[i]+2, options[j].name, p-argv[i]-2) == 0)
+				break;
+		}
+
+		if (j == sizeof(options)/sizeof(option_t))
+		{
+			printf("Unknown option %s\n", argv[i]);
+			return -1;
+		}
+
+		if (options[j].string)
+		{
+			*options[j].string = p+1;
+			continue;
+		}
+
+		int value;
+
+		if (sscanf(p+1, "%d", &value) != 1 || value < options[j].min || value > options[j].max)
+		{
+			printf("Option --%s must be in %d-%d range.\n", options[j].name, options[j].min, options[j].max);
+			return -1;
+		}
+
+		*options[j].value = value;
+	}
+
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	argc = parse_options(argc, argv);
+
+	if (argc != 3)
+	{
+		printf("Usage: %s [options] input output\nOptions:\n", argv[0]);
+
+		for (unsigned int i = 0; i < sizeof(options)/sizeof(option_t); i++)
+		{
+			printf("  --%s=%s  %s\n", options[i].name, (options[i].string) ? "s" : "n", options[i].description);
+		}
+
+		return -1;
+	}
+
+	if (num_threads == 0)
+	{
+		num_threads = get_cpu_count();
+	}
+
+	if (extract)
+	{
+		if (CsoFile::initialize(num_threads) != 0)
+			return -1;
+
+		return extract_image(argv[1], argv[2]);
+	}
+
+	if (format)
+	{
+		if (strcmp(format, "zso") != 0 && strcmp(format, "cso") != 0)
+		{
+			printf("Unknown format %s.\n", format);
+			return -1;
+		}
+
+		use_lz4 = (format[0] == 'z');
+	}
+	else
+	{
+		size_t len = strlen(argv[2]);
+		use_lz4 = (len > 4 && (argv[2][len-3] | 0x20) == 'z');
+	}
+
+	if ((block_size % 512) != 0)
+	{
+		printf("The block size must be a multiple of 512.\n");
+		return -1;
+	}
+
+	mutex_init(&mutex);
+	cond_init(&cond);
+
+	for (int i = 0; i < num_threads; i++)
+	{
+		thread_t thread;
+
+		if (create_start_thread(&thread, compress_thread, NULL) != 0)
+		{
+			printf("System seems low in resources.\n");
+			return -1;
+		}
+	}
+
+	return compress_image(argv[1], argv[2]);
+}
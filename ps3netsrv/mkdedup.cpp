@@ -0,0 +1,647 @@
+// mkdedup: imports isos into a content-addressed chunk store and writes the X.iso.dedup manifest that
+// ps3netsrv serves as X.iso. Chunks already in the store (from another region or update of the
+// same title) are not stored again. Also extracts the iso of a manifest, to check it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/file.h>
+#endif
+
+#include "common.h"
+#include "compat.h"
+#include "File.h"
+#include "DedupFile.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+// Room for several chunks of the biggest size, refilled as they are consumed
+#define READ_BUFFER_SIZE	(4*DEDUP_MAX_CHUNK_SIZE)
+#define EXTRACT_BUFFER_SIZE	(4*1048576)
+
+#define HASH_PRIME	0x9E3779B97F4A7C15ULL
+
+typedef struct
+{
+	const char *name;
+	int *value;
+	int min;
+	int max;
+	const char *description;
+	char **string; // set for options taking a string instead of a number
+} option_t;
+
+static int chunk_kb = 64;
+static int cdc = 1;
+static int extract = 0;
+static char *store = NULL;
+
+static option_t options[] =
+{
+	{ "store", NULL, 0, 0, "directory of the chunk store, relative to the directory of the output (required)", &store },
+	{ "chunk", &chunk_kb, 8, DEDUP_MAX_CHUNK_SIZE / 4096, "average size of the chunks in KB (default: 64)" },
+	{ "cdc", &cdc, 0, 1, "1 to cut chunks where the content says so, 0 for chunks of a fixed size (default: 1)" },
+	{ "extract", &extract, 0, 1, "1 to write the iso of a manifest instead of importing one" },
+};
+
+static file_t data_fd = INVALID_FD;
+static FILE *index_file = NULL;
+static int64_t data_size = 0;
+
+static DedupRecord *records = NULL;
+static uint32_t num_records = 0;
+static uint32_t records_capacity = 0;
+
+// Open addressing table of record index + 1, keyed by chunk hash
+static uint32_t *table = NULL;
+static uint32_t table_size = 0;
+
+static uint8_t *compare_buf = NULL;
+
+static int64_t new_bytes = 0;
+static int64_t shared_bytes = 0;
+static int64_t zero_bytes = 0;
+
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t hash_sector(const uint8_t *p, uint32_t size)
+{
+	uint64_t h = size;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= size; i += 8)
+	{
+		uint64_t w;
+
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * HASH_PRIME;
+	}
+
+	for (; i < size; i++)
+		h = (h ^ p[i]) * HASH_PRIME;
+
+	return mix64(h);
+}
+
+static bool is_zero(const uint8_t *p, uint32_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i + 8 <= size; i += 8)
+	{
+		uint64_t w;
+
+		memcpy(&w, p + i, 8);
+		if (w != 0)
+			return false;
+	}
+
+	for (; i < size; i++)
+	{
+		if (p[i] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static void table_insert(uint32_t record)
+{
+	uint32_t slot = (uint32_t)records[record].hash & (table_size - 1);
+
+	while (table[slot] != 0)
+		slot = (slot + 1) & (table_size - 1);
+
+	table[slot] = record + 1;
+}
+
+static int add_record(DedupRecord *record)
+{
+	if (num_records == records_capacity)
+	{
+		uint32_t capacity = (records_capacity) ? records_capacity * 2 : 65536;
+		DedupRecord *r = (DedupRecord *)realloc(records, capacity * sizeof(DedupRecord));
+
+		if (!r)
+			return -1;
+
+		records = r;
+		records_capacity = capacity;
+	}
+
+	// The table is kept at most half full
+	if ((num_records + 1) * 2 > table_size)
+	{
+		free(table);
+		table_size = (table_size) ? table_size * 2 : 131072;
+		table = (uint32_t *)calloc(table_size, sizeof(uint32_t));
+
+		if (!table)
+			return -1;
+
+		for (uint32_t i = 0; i < num_records; i++)
+			table_insert(i);
+	}
+
+	records[num_records] = *record;
+	table_insert(num_records);
+	num_records++;
+	return 0;
+}
+
+static int open_store(const char *dir)
+{
+	char path[4096];
+	file_stat_t st;
+
+#ifdef WIN32
+	mkdir(dir);
+#else
+	mkdir(dir, 0777);
+#endif
+
+	// Created if they don't exist
+	snprintf(path, sizeof(path), "%s/%s", dir, DEDUP_DATA_FILE);
+	FILE *f = fopen(path, "ab");
+	if (!f || fclose(f) != 0)
+		return -1;
+
+	data_fd = open_file(path, O_RDWR);
+	if (!FD_OK(data_fd) || fstat_file(data_fd, &st) < 0)
+		return -1;
+
+#ifndef WIN32
+	if (flock(data_fd, LOCK_EX|LOCK_NB) != 0)
+	{
+		printf("The chunk store %s is in use.\n", dir);
+		return -1;
+	}
+#endif
+
+	data_size = st.file_size;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, DEDUP_INDEX_FILE);
+	f = fopen(path, "rb");
+
+	bool truncated = false;
+
+	if (f)
+	{
+		DedupRecord record;
+
+		while (fread(&record, 1, sizeof(record), f) == sizeof(record))
+		{
+			record.hash = LE64(record.hash);
+			record.offset = LE64(record.offset);
+			record.size = LE32(record.size);
+
+			// Records of chunks whose data didn't make it to the store, when an import was interrupted
+			if ((int64_t)(record.offset + record.size) > data_size)
+			{
+				truncated = true;
+				break;
+			}
+
+			if (add_record(&record) != 0)
+			{
+				fclose(f);
+				return -1;
+			}
+		}
+
+		if (!feof(f))
+			truncated = true;
+
+		fclose(f);
+	}
+
+	// The index is written again without the broken tail, new records are appended
+	index_file = fopen(path, truncated ? "wb" : "ab");
+	if (!index_file)
+		return -1;
+
+	if (truncated)
+	{
+		for (uint32_t i = 0; i < num_records; i++)
+		{
+			DedupRecord record = records[i];
+
+			record.hash = LE64(record.hash);
+			record.offset = LE64(record.offset);
+			record.size = LE32(record.size);
+
+			if (fwrite(&record, 1, sizeof(record), index_file) != sizeof(record))
+				return -1;
+		}
+	}
+
+	// Chunks are stored aligned to sectors
+	data_size = (data_size + DEDUP_SECTOR_SIZE - 1) & ~(int64_t)(DEDUP_SECTOR_SIZE - 1);
+
+	compare_buf = (uint8_t *)malloc(DEDUP_MAX_CHUNK_SIZE);
+	return (compare_buf) ? 0 : -1;
+}
+
+// Finds the chunk in the store or adds it, setting offset to its position in the data file
+static int store_chunk(const uint8_t *data, uint32_t size, uint64_t hash, uint64_t *offset)
+{
+	uint32_t slot = (uint32_t)hash & (table_size - 1);
+
+	// Chunks with the same hash are compared, so a collision never mixes up two chunks
+	while (table_size > 0 && table[slot] != 0)
+	{
+		DedupRecord *record = &records[table[slot] - 1];
+
+		if (record->hash == hash && record->size == size &&
+			pread_file(data_fd, compare_buf, size, record->offset) == (ssize_t)size && memcmp(compare_buf, data, size) == 0)
+		{
+			shared_bytes += size;
+			*offset = record->offset;
+			return 0;
+		}
+
+		slot = (slot + 1) & (table_size - 1);
+	}
+
+	DedupRecord record;
+	uint32_t padded_size = (size + DEDUP_SECTOR_SIZE - 1) & ~(DEDUP_SECTOR_SIZE - 1);
+
+	// The data goes first: a record is only trusted if its data is there
+	if (seek_file(data_fd, data_size, SEEK_SET) != data_size || write_file(data_fd, (void *)data, size) != (ssize_t)size)
+		return -1;
+
+	if (padded_size > size)
+	{
+		memset(compare_buf, 0, padded_size - size);
+
+		if (write_file(data_fd, compare_buf, padded_size - size) != (ssize_t)(padded_size - size))
+			return -1;
+	}
+
+	record.hash = hash;
+	record.offset = data_size;
+	record.size = size;
+	record.reserved = 0;
+
+	if (add_record(&record) != 0)
+		return -1;
+
+	record.hash = LE64(record.hash);
+	record.offset = LE64(record.offset);
+	record.size = LE32(record.size);
+
+	if (fwrite(&record, 1, sizeof(record), index_file) != sizeof(record))
+		return -1;
+
+	data_size += padded_size;
+	new_bytes += size;
+	*offset = records[num_records - 1].offset;
+	return 0;
+}
+
+static int add_entry(DedupEntry **entries, uint32_t *num_entries, uint32_t *capacity, uint64_t offset, uint32_t size)
+{
+	// Runs of zeros are merged
+	if (offset == DEDUP_ZERO_CHUNK && *num_entries > 0)
+	{
+		DedupEntry *last = &(*entries)[*num_entries - 1];
+
+		if (last->offset == DEDUP_ZERO_CHUNK && last->size + size <= DEDUP_MAX_CHUNK_SIZE)
+		{
+			last->size += size;
+			return 0;
+		}
+	}
+
+	if (*num_entries == *capacity)
+	{
+		*capacity = (*capacity) ? *capacity * 2 : 4096;
+		*entries = (DedupEntry *)realloc(*entries, *capacity * sizeof(DedupEntry));
+
+		if (!*entries)
+			return -1;
+	}
+
+	(*entries)[*num_entries].offset = offset;
+	(*entries)[*num_entries].size = size;
+	(*entries)[*num_entries].reserved = 0;
+	(*num_entries)++;
+	return 0;
+}
+
+static int write_manifest(const char *output, int64_t total_bytes, DedupEntry *entries, uint32_t num_entries)
+{
+	DedupHeader header;
+	char *tmp = (char *)malloc(strlen(output) + 5);
+
+	if (!tmp)
+		return -1;
+
+	sprintf(tmp, "%s.tmp", output);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = LE32(DEDUP_MAGIC);
+	header.header_size = LE32(sizeof(header));
+	header.total_bytes = LE64(total_bytes);
+	header.num_chunks = LE32(num_entries);
+	header.store_len = LE16(strlen(store));
+	header.version = 1;
+
+	for (uint32_t i = 0; i < num_entries; i++)
+	{
+		entries[i].offset = LE64(entries[i].offset);
+		entries[i].size = LE32(entries[i].size);
+	}
+
+	// Written aside and renamed, so the server never sees half a manifest
+	FILE *f = fopen(tmp, "wb");
+
+	if (!f || fwrite(&header, 1, sizeof(header), f) != sizeof(header) || fwrite(store, 1, strlen(store), f) != strlen(store) ||
+		fwrite(entries, sizeof(DedupEntry), num_entries, f) != num_entries || fclose(f) != 0)
+	{
+		free(tmp);
+		return -1;
+	}
+
+#ifdef WIN32
+	remove(output);
+#endif
+
+	int ret = rename(tmp, output);
+	free(tmp);
+	return ret;
+}
+
+static int import_image(const char *input, const char *output)
+{
+	File in;
+	file_stat_t st;
+
+	if (in.open(input, O_RDONLY) < 0 || in.fstat(&st) < 0)
+	{
+		printf("Cannot open %s.\n", input);
+		return -1;
+	}
+
+	char *dir = DedupFile::get_store_file(output, store, ".");
+	if (!dir)
+		return -1;
+
+	// Without the trailing "/."
+	dir[strlen(dir) - 2] = 0;
+
+	if (open_store(dir) != 0)
+	{
+		printf("Cannot open the chunk store %s.\n", dir);
+		return -1;
+	}
+
+	int64_t total_bytes = st.file_size;
+	uint32_t avg_size = chunk_kb * 1024;
+	uint32_t min_size = (cdc) ? avg_size / 4 : avg_size;
+	uint32_t max_size = (cdc) ? avg_size * 4 : avg_size;
+	uint32_t avg_sectors = avg_size / DEDUP_SECTOR_SIZE;
+
+	uint8_t *buf = (uint8_t *)malloc(READ_BUFFER_SIZE);
+	DedupEntry *entries = NULL;
+	uint32_t num_entries = 0, capacity = 0;
+
+	if (!buf)
+	{
+		printf("Out of memory.\n");
+		return -1;
+	}
+
+	int64_t buf_offset = 0; // position of buf in the iso
+	uint32_t filled = 0;
+	uint32_t start = 0; // current chunk in buf
+	uint32_t pos = 0;
+	uint64_t hash = 0;
+	int64_t next_progress = 0;
+
+	for (;;)
+	{
+		if (pos + DEDUP_SECTOR_SIZE > filled && buf_offset + filled < total_bytes)
+		{
+			// The current chunk is moved to the front and the rest of the buffer is filled
+			memmove(buf, buf + start, filled - start);
+			buf_offset += start;
+			filled -= start;
+			pos -= start;
+			start = 0;
+
+			ssize_t n = (ssize_t)MIN((int64_t)(READ_BUFFER_SIZE - filled), total_bytes - buf_offset - filled);
+
+			if (in.pread(buf + filled, n, buf_offset + filled) != n)
+			{
+				printf("Error reading %s.\n", input);
+				return -1;
+			}
+
+			filled += n;
+
+			if (buf_offset >= next_progress)
+			{
+				printf("\r%3d%%", (int)(buf_offset * 100 / total_bytes));
+				fflush(stdout);
+				next_progress = buf_offset + 256*1048576LL;
+			}
+		}
+
+		// All of the iso is in buf and consumed
+		bool end = (pos == filled);
+		bool cut = end;
+
+		if (!end)
+		{
+			uint32_t sector_size = MIN((uint32_t)DEDUP_SECTOR_SIZE, filled - pos);
+			uint64_t h = hash_sector(buf + pos, sector_size);
+
+			pos += sector_size;
+			hash = mix64(hash ^ h);
+
+			// A boundary only depends on the sector before it, so chunks come back in step after an insertion
+			uint32_t size = pos - start;
+			cut = (size >= max_size || (size >= min_size && (!cdc || (h % avg_sectors) == 0)));
+		}
+
+		if (cut && pos > start)
+		{
+			uint32_t size = pos - start;
+			uint64_t offset = DEDUP_ZERO_CHUNK;
+			int ret = 0;
+
+			if (is_zero(buf + start, size))
+				zero_bytes += size;
+			else
+				ret = store_chunk(buf + start, size, hash, &offset);
+
+			if (ret != 0 || add_entry(&entries, &num_entries, &capacity, offset, size) != 0)
+			{
+				printf("Error writing the chunk store %s.\n", dir);
+				return -1;
+			}
+
+			start = pos;
+			hash = 0;
+		}
+
+		if (end)
+			break;
+	}
+
+	// The records have to be there before a manifest uses them
+	if (fflush(index_file) != 0 || write_manifest(output, total_bytes, entries, num_entries) != 0)
+	{
+		printf("Error writing %s.\n", output);
+		return -1;
+	}
+
+	fclose(index_file);
+	close_file(data_fd);
+
+	printf("\r%s: %u chunks, %lld new bytes, %lld bytes already in the store, %lld bytes of zeros\n", output, num_entries,
+		(long long int)new_bytes, (long long int)shared_bytes, (long long int)zero_bytes);
+	printf("Store %s: %lld bytes in %u chunks\n", dir, (long long int)data_size, num_records);
+
+	free(entries);
+	free(buf);
+	free(dir);
+	free(records);
+	free(table);
+	free(compare_buf);
+	return 0;
+}
+
+static int extract_image(const char *input, const char *output)
+{
+	DedupFile in;
+	file_stat_t st;
+
+	if (in.open(input, O_RDONLY) < 0 || in.fstat(&st) < 0)
+	{
+		printf("%s is not a valid manifest.\n", input);
+		return -1;
+	}
+
+	FILE *f = fopen(output, "wb");
+	uint8_t *buf = (uint8_t *)malloc(EXTRACT_BUFFER_SIZE);
+
+	if (!f || !buf)
+	{
+		printf("Cannot create %s.\n", output);
+		return -1;
+	}
+
+	for (int64_t offset = 0; offset < (int64_t)st.file_size; offset += EXTRACT_BUFFER_SIZE)
+	{
+		ssize_t size = (ssize_t)MIN((int64_t)st.file_size - offset, (int64_t)EXTRACT_BUFFER_SIZE);
+
+		if (in.pread(buf, size, offset) != size)
+		{
+			printf("Error reading %s at %lld.\n", input, (long long int)offset);
+			return -1;
+		}
+
+		if (fwrite(buf, 1, size, f) != (size_t)size)
+		{
+			printf("Error writing %s.\n", output);
+			return -1;
+		}
+	}
+
+	free(buf);
+
+	if (fclose(f) != 0)
+	{
+		printf("Error writing %s.\n", output);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int parse_options(int argc, char *argv[])
+{
+	int n = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--", 2) != 0)
+		{
+			argv[n++] = argv[i];
+			continue;
+		}
+
+		char *p = strchr(argv[i], '=');
+		unsigned int j;
+
+		for (j = 0; j < sizeof(options)/sizeof(option_t); j++)
+		{
+			if (p && strlen(options[j].name) == (size_t)(p-argv[i]-2) && strncmp(argv[i]+2, options[j].name, p-argv[i]-2) == 0)
+				break;
+		}
+
+		if (j == sizeof(options)/sizeof(option_t))
+		{
+			printf("Unknown option %s\n", argv[i]);
+			return -1;
+		}
+
+		if (options[j].string)
+		{
+			*options[j].string = p+1;
+			continue;
+		}
+
+		int value;
+
+		if (sscanf(p+1, "%d", &value) != 1 || value < options[j].min || value > options[j].max)
+		{
+			printf("Option --%s must be in %d-%d range.\n", options[j].name, options[j].min, options[j].max);
+			return -1;
+		}
+
+		*options[j].value = value;
+	}
+
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	argc = parse_options(argc, argv);
+
+	if (argc != 3 || (!extract && (!store || !*store || strlen(store) > 1024)))
+	{
+		printf("Usage: %s [options] input.iso output.iso" DEDUP_EXTENSION "\nOptions:\n", argv[0]);
+
+		for (unsigned int i = 0; i < sizeof(options)/sizeof(option_t); i++)
+		{
+			printf("  --%s=%s  %s\n", options[i].name, (options[i].string) ? "s" : "n", options[i].description);
+		}
+
+		return -1;
+	}
+
+	if (extract)
+		return extract_image(argv[1], argv[2]);
+
+	if ((chunk_kb % 2) != 0)
+	{
+		printf("The chunk size must be a multiple of 2 KB.\n");
+		return -1;
+	}
+
+	return import_image(argv[1], argv[2]);
+}
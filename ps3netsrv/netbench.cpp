@@ -0,0 +1,1046 @@
+// netbench: load generator for ps3netsrv. Simulates consoles speaking the netiso protocol, so the
+// server can be measured without a PS3.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "common.h"
+#include "netiso.h"
+
+#define BUFFER_SIZE	(3*1048576)
+#define MAX_PATH_LEN	1024
+#define MAX_CONSOLES	1024
+#define MAX_DIRS	64
+#define MAX_TRACE_OPS	65536
+
+// Files statted after each listing of the dirs workload, as the game list does for the new entries
+#define DIRS_STATS	16
+// Reads between two seeks of the psx workload
+#define PSX_SEEK_INTERVAL	64
+
+enum
+{
+	OP_OPEN,
+	OP_READ,
+	OP_READ_CD,
+	OP_STAT,
+	OP_OPEN_DIR,
+	OP_READ_DIR,
+	OP_DIR_SIZE,
+	OP_SLEEP,
+	NUM_OPS = OP_SLEEP
+};
+
+static const char *op_names[NUM_OPS] =
+{
+	"open_file",
+	"read_file_critical",
+	"read_cd_2048",
+	"stat_file",
+	"open_dir",
+	"read_dir",
+	"get_dir_size",
+};
+
+enum
+{
+	WORKLOAD_SEQ,
+	WORKLOAD_RANDOM,
+	WORKLOAD_PSX,
+	WORKLOAD_DIRS,
+	WORKLOAD_TRACE,
+	NUM_WORKLOADS
+};
+
+static const char *workload_names[NUM_WORKLOADS] =
+{
+	"seq",
+	"random",
+	"psx",
+	"dirs",
+	"trace",
+};
+
+typedef struct
+{
+	int op;
+	char *path;
+	uint64_t offset;
+	uint32_t size;
+} trace_op_t;
+
+typedef struct
+{
+	uint32_t *latencies; // microseconds
+	size_t count;
+	size_t max_count;
+	uint64_t bytes;
+	uint64_t errors;
+} op_stats_t;
+
+typedef struct
+{
+	int id;
+	int workload;
+	int s;
+	uint8_t *buf;
+	int64_t file_size;
+	uint32_t seed;
+	int failed;
+	op_stats_t stats[NUM_OPS];
+} console_t;
+
+typedef struct
+{
+	const char *name;
+	int *value;
+	int min;
+	int max;
+	const char *description;
+	char **string; // set for options taking a string instead of a number
+} option_t;
+
+static int num_consoles = 1;
+static int duration = 10;
+static int read_size = 64;
+static int server_pid = 0;
+static char *workload_list = (char *)"seq";
+static char *file_path = NULL;
+static char *dir_list = NULL;
+static char *trace_path = NULL;
+static char *bind_address = NULL;
+
+static option_t options[] =
+{
+	{ "consoles", &num_consoles, 1, MAX_CONSOLES, "number of simulated consoles, each with its own connection (default: 1)" },
+	{ "time", &duration, 1, 86400, "seconds the test runs (default: 10)" },
+	{ "size", &read_size, 2, 3072, "size of each read in KB (default: 64)" },
+	{ "server-pid", &server_pid, 0, 0x7FFFFFFF, "pid of a local ps3netsrv, to report its cpu time per GB" },
+	{ "workload", NULL, 0, 0, "comma separated workloads given to the consoles in turn: seq, random, psx, dirs, trace (default: seq)", &workload_list },
+	{ "file", NULL, 0, 0, "file read by the seq, random and psx workloads, e.g. /PS3ISO/game.iso", &file_path },
+	{ "dirs", NULL, 0, 0, "comma separated directories listed by the dirs workload, e.g. /PS3ISO,/GAMES", &dir_list },
+	{ "trace", NULL, 0, 0, "file with the commands replayed by the trace workload", &trace_path },
+	{ "bind", NULL, 0, 0, "source address of the first console, the next ones use the following addresses", &bind_address },
+};
+
+static struct sockaddr_in server_addr;
+static struct in_addr source_addr;
+static int use_source_addr = 0;
+
+static int workloads[NUM_WORKLOADS];
+static int num_workloads = 0;
+static char *dirs[MAX_DIRS];
+static int num_dirs = 0;
+static trace_op_t *trace_ops = NULL;
+static int num_trace_ops = 0;
+
+static volatile int stop = 0;
+
+static uint64_t get_time_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static uint32_t next_random(console_t *console)
+{
+	// xorshift32, each console has its own sequence
+	console->seed ^= console->seed << 13;
+	console->seed ^= console->seed >> 17;
+	console->seed ^= console->seed << 5;
+	return console->seed;
+}
+
+static void add_sample(console_t *console, int op, uint64_t start_time, uint64_t bytes, int error)
+{
+	op_stats_t *stats = &console->stats[op];
+
+	if (error)
+	{
+		stats->errors++;
+		return;
+	}
+
+	if (stats->count == stats->max_count)
+	{
+		size_t max_count = (stats->max_count) ? stats->max_count*2 : 4096;
+		uint32_t *latencies = (uint32_t *)realloc(stats->latencies, max_count*sizeof(uint32_t));
+
+		if (!latencies)
+			return;
+
+		stats->latencies = latencies;
+		stats->max_count = max_count;
+	}
+
+	stats->latencies[stats->count++] = (uint32_t)(get_time_usec() - start_time);
+	stats->bytes += bytes;
+}
+
+static int send_all(int s, const void *buf, size_t size)
+{
+	const char *p = (const char *)buf;
+
+	while (size > 0)
+	{
+		ssize_t ret = send(s, p, size, 0);
+		if (ret <= 0)
+		{
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int recv_all(int s, void *buf, size_t size)
+{
+	char *p = (char *)buf;
+
+	while (size > 0)
+	{
+		ssize_t ret = recv(s, p, size, 0);
+		if (ret <= 0)
+		{
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int connect_console(console_t *console)
+{
+	int flag = 1;
+
+	console->s = socket(AF_INET, SOCK_STREAM, 0);
+	if (console->s < 0)
+		return -1;
+
+	setsockopt(console->s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	// ps3netsrv takes a second connection from the same address for a reconnection of the console
+	if (use_source_addr)
+	{
+		struct sockaddr_in addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(ntohl(source_addr.s_addr) + console->id);
+
+		if (bind(console->s, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		{
+			printf("Console %d: cannot bind to %s.\n", console->id, inet_ntoa(addr.sin_addr));
+			return -1;
+		}
+	}
+
+	if (connect(console->s, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0)
+	{
+		printf("Console %d: cannot connect (%s).\n", console->id, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+// OPEN_FILE, STAT_FILE, OPEN_DIR and GET_DIR_SIZE are all followed by the path
+static int send_path_cmd(console_t *console, uint16_t opcode, const char *path)
+{
+	netiso_open_cmd cmd;
+	uint16_t len = strlen(path);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = BE16(opcode);
+	cmd.fp_len = BE16(len);
+
+	if (send_all(console->s, &cmd, sizeof(cmd)) != 0 || send_all(console->s, path, len) != 0)
+		return -1;
+
+	return 0;
+}
+
+// The server listens with a backlog of 1: a connection is only known to be accepted once a command got its answer
+static int probe_console(console_t *console)
+{
+	netiso_stat_result result;
+
+	if (send_path_cmd(console, NETISO_CMD_STAT_FILE, "/") != 0 || recv_all(console->s, &result, sizeof(result)) != 0)
+	{
+		printf("Console %d: the server closed the connection.\n", console->id);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int do_open(console_t *console, const char *path)
+{
+	netiso_open_result result;
+	uint64_t start_time = get_time_usec();
+
+	if (send_path_cmd(console, NETISO_CMD_OPEN_FILE, path) != 0 || recv_all(console->s, &result, sizeof(result)) != 0)
+		return -1;
+
+	console->file_size = BE64(result.file_size);
+	add_sample(console, OP_OPEN, start_time, 0, console->file_size < 0);
+
+	return 0;
+}
+
+static int do_read(console_t *console, uint64_t offset, uint32_t size)
+{
+	netiso_read_file_critical_cmd cmd;
+	uint64_t start_time = get_time_usec();
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = BE16(NETISO_CMD_READ_FILE_CRITICAL);
+	cmd.num_bytes = BE32(size);
+	cmd.offset = BE64(offset);
+
+	// The server drops the connection when a critical read fails
+	if (send_all(console->s, &cmd, sizeof(cmd)) != 0 || recv_all(console->s, console->buf, size) != 0)
+		return -1;
+
+	add_sample(console, OP_READ, start_time, size, 0);
+	return 0;
+}
+
+static int do_read_cd(console_t *console, uint32_t sector, uint32_t count)
+{
+	netiso_read_cd_2048_critical_cmd cmd;
+	uint64_t start_time = get_time_usec();
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = BE16(NETISO_CMD_READ_CD_2048_CRITICAL);
+	cmd.start_sector = BE32(sector);
+	cmd.sector_count = BE32(count);
+
+	if (send_all(console->s, &cmd, sizeof(cmd)) != 0 || recv_all(console->s, console->buf, count*2048) != 0)
+		return -1;
+
+	add_sample(console, OP_READ_CD, start_time, count*2048, 0);
+	return 0;
+}
+
+static int do_stat(console_t *console, const char *path)
+{
+	netiso_stat_result result;
+	uint64_t start_time = get_time_usec();
+
+	if (send_path_cmd(console, NETISO_CMD_STAT_FILE, path) != 0 || recv_all(console->s, &result, sizeof(result)) != 0)
+		return -1;
+
+	add_sample(console, OP_STAT, start_time, 0, (int64_t)BE64(result.file_size) < 0);
+	return 0;
+}
+
+// OPEN_DIR followed by READ_DIR. Returns the number of entries left in console->buf, or -1 if the connection failed.
+static int64_t do_list_dir(console_t *console, const char *path)
+{
+	netiso_open_dir_result open_result;
+	netiso_read_dir_entry_cmd cmd;
+	netiso_read_dir_result result;
+	uint64_t start_time = get_time_usec();
+
+	if (send_path_cmd(console, NETISO_CMD_OPEN_DIR, path) != 0 || recv_all(console->s, &open_result, sizeof(open_result)) != 0)
+		return -1;
+
+	add_sample(console, OP_OPEN_DIR, start_time, 0, BE32(open_result.open_result) != 0);
+	if (BE32(open_result.open_result) != 0)
+		return 0;
+
+	start_time = get_time_usec();
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = BE16(NETISO_CMD_READ_DIR);
+
+	if (send_all(console->s, &cmd, sizeof(cmd)) != 0 || recv_all(console->s, &result, sizeof(result)) != 0)
+		return -1;
+
+	int64_t dir_size = BE64(result.dir_size);
+	if (dir_size < 0 || dir_size*sizeof(netiso_read_dir_result_data) > BUFFER_SIZE)
+	{
+		add_sample(console, OP_READ_DIR, start_time, 0, 1);
+		return (dir_size < 0) ? 0 : -1;
+	}
+
+	if (recv_all(console->s, console->buf, dir_size*sizeof(netiso_read_dir_result_data)) != 0)
+		return -1;
+
+	add_sample(console, OP_READ_DIR, start_time, sizeof(result) + dir_size*sizeof(netiso_read_dir_result_data), 0);
+	return dir_size;
+}
+
+static int do_dir_size(console_t *console, const char *path)
+{
+	netiso_get_dir_size_result result;
+	uint64_t start_time = get_time_usec();
+
+	if (send_path_cmd(console, NETISO_CMD_GET_DIR_SIZE, path) != 0 || recv_all(console->s, &result, sizeof(result)) != 0)
+		return -1;
+
+	add_sample(console, OP_DIR_SIZE, start_time, 0, (int64_t)BE64(result.dir_size) < 0);
+	return 0;
+}
+
+// A game loading: big sequential reads, the consoles starting at different points of the file
+static int run_seq(console_t *console)
+{
+	uint32_t size = read_size*1024;
+	uint64_t offset = ((console->file_size / num_consoles) * console->id) & ~2047ULL;
+
+	while (!stop)
+	{
+		if (offset + size > (uint64_t)console->file_size)
+			offset = 0;
+
+		if (do_read(console, offset, size) != 0)
+			return -1;
+
+		offset += size;
+	}
+
+	return 0;
+}
+
+// Seeks all over the file, at sector boundaries
+static int run_random(console_t *console)
+{
+	uint32_t size = read_size*1024;
+	uint64_t sectors = (console->file_size - size) / 2048;
+
+	while (!stop)
+	{
+		uint64_t sector = (((uint64_t)next_random(console) << 32) | next_random(console)) % (sectors + 1);
+
+		if (do_read(console, sector*2048, size) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+// A PSX game of a raw (2352 bytes per sector) image: 2048 bytes reads, sequential with a jump from time to time
+static int run_psx(console_t *console)
+{
+	uint32_t count = read_size / 2;
+	uint32_t sectors = console->file_size / 2352;
+	uint32_t sector = 0;
+
+	for (int n = 0; !stop; n++)
+	{
+		if (n % PSX_SEEK_INTERVAL == 0)
+			sector = next_random(console) % sectors;
+
+		if (sector + count > sectors)
+			sector = 0;
+
+		if (do_read_cd(console, sector, count) != 0)
+			return -1;
+
+		sector += count;
+	}
+
+	return 0;
+}
+
+// Game list refreshes: every folder is listed, then some of its entries are statted and the folder measured
+static int run_dirs(console_t *console)
+{
+	while (!stop)
+	{
+		for (int i = 0; i < num_dirs && !stop; i++)
+		{
+			int64_t num_entries = do_list_dir(console, dirs[i]);
+			if (num_entries < 0)
+				return -1;
+
+			// The names are copied first, the buffer is reused by the next commands
+			char names[DIRS_STATS][MAX_PATH_LEN];
+			int num_names = 0;
+
+			for (int64_t j = 0; j < num_entries && num_names < DIRS_STATS; j++)
+			{
+				netiso_read_dir_result_data *entry = (netiso_read_dir_result_data *)console->buf + j;
+
+				if (!entry->is_directory)
+					snprintf(names[num_names++], MAX_PATH_LEN, "%s/%s", dirs[i], entry->name);
+			}
+
+			for (int j = 0; j < num_names; j++)
+			{
+				if (do_stat(console, names[j]) != 0)
+					return -1;
+			}
+
+			if (do_dir_size(console, dirs[i]) != 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int run_trace(console_t *console)
+{
+	while (!stop)
+	{
+		for (int i = 0; i < num_trace_ops && !stop; i++)
+		{
+			trace_op_t *op = &trace_ops[i];
+			int ret = 0;
+
+			switch (op->op)
+			{
+				case OP_OPEN:
+					ret = do_open(console, op->path);
+				break;
+
+				case OP_READ:
+					ret = do_read(console, op->offset, op->size);
+				break;
+
+				case OP_READ_CD:
+					ret = do_read_cd(console, (uint32_t)op->offset, op->size);
+				break;
+
+				case OP_STAT:
+					ret = do_stat(console, op->path);
+				break;
+
+				case OP_READ_DIR:
+					ret = (do_list_dir(console, op->path) < 0) ? -1 : 0;
+				break;
+
+				case OP_DIR_SIZE:
+					ret = do_dir_size(console, op->path);
+				break;
+
+				case OP_SLEEP:
+					usleep(op->size*1000);
+				break;
+			}
+
+			if (ret != 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void *console_thread(void *arg)
+{
+	console_t *console = (console_t *)arg;
+	int ret;
+
+	if (console->workload == WORKLOAD_SEQ || console->workload == WORKLOAD_RANDOM || console->workload == WORKLOAD_PSX)
+	{
+		uint32_t min_size = (console->workload == WORKLOAD_PSX) ? 2352*(read_size/2) : read_size*1024;
+
+		if (do_open(console, file_path) != 0 || console->file_size < (int64_t)min_size)
+		{
+			printf("Console %d: cannot open %s or file too small.\n", console->id, file_path);
+			console->failed = 1;
+			close(console->s);
+			return NULL;
+		}
+	}
+
+	switch (console->workload)
+	{
+		case WORKLOAD_SEQ:
+			ret = run_seq(console);
+		break;
+
+		case WORKLOAD_RANDOM:
+			ret = run_random(console);
+		break;
+
+		case WORKLOAD_PSX:
+			ret = run_psx(console);
+		break;
+
+		case WORKLOAD_DIRS:
+			ret = run_dirs(console);
+		break;
+
+		default:
+			ret = run_trace(console);
+	}
+
+	if (ret != 0)
+	{
+		printf("Console %d: connection lost.\n", console->id);
+		console->failed = 1;
+	}
+
+	close(console->s);
+	return NULL;
+}
+
+// One command per line: open <path>, read <offset> <bytes>, cd <sector> <count>, stat <path>, dir <path>, size <path>
+// or sleep <ms>. Lines starting with # are ignored.
+static int load_trace(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[MAX_PATH_LEN+64];
+	int line_number = 0;
+
+	if (!f)
+	{
+		printf("Cannot open trace %s.\n", path);
+		return -1;
+	}
+
+	trace_ops = (trace_op_t *)calloc(MAX_TRACE_OPS, sizeof(trace_op_t));
+	if (!trace_ops)
+	{
+		fclose(f);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) && num_trace_ops < MAX_TRACE_OPS)
+	{
+		trace_op_t *op = &trace_ops[num_trace_ops];
+		char command[16], arg[MAX_PATH_LEN];
+		unsigned long long offset;
+		unsigned int size;
+
+		line_number++;
+		line[strcspn(line, "\r\n")] = 0;
+
+		if (line[0] == '#' || sscanf(line, "%15s", command) != 1)
+			continue;
+
+		if (strcmp(command, "read") == 0 && sscanf(line, "%*s %llu %u", &offset, &size) == 2 && size > 0 && size <= BUFFER_SIZE)
+		{
+			op->op = OP_READ;
+			op->offset = offset;
+			op->size = size;
+		}
+		else if (strcmp(command, "cd") == 0 && sscanf(line, "%*s %llu %u", &offset, &size) == 2 && size > 0 && size*2048 <= BUFFER_SIZE)
+		{
+			op->op = OP_READ_CD;
+			op->offset = offset;
+			op->size = size;
+		}
+		else if (strcmp(command, "sleep") == 0 && sscanf(line, "%*s %u", &size) == 1)
+		{
+			op->op = OP_SLEEP;
+			op->size = size;
+		}
+		else if (sscanf(line, "%*s %1023[^\n]", arg) == 1 && (strcmp(command, "open") == 0 || strcmp(command, "stat") == 0 ||
+				 strcmp(command, "dir") == 0 || strcmp(command, "size") == 0))
+		{
+			op->op = (command[0] == 'o') ? OP_OPEN : (command[1] == 't') ? OP_STAT : (command[0] == 'd') ? OP_READ_DIR : OP_DIR_SIZE;
+			op->path = strdup(arg);
+		}
+		else
+		{
+			printf("Wrong command in line %d of the trace: %s\n", line_number, line);
+			fclose(f);
+			return -1;
+		}
+
+		num_trace_ops++;
+	}
+
+	fclose(f);
+
+	if (num_trace_ops == 0)
+	{
+		printf("The trace is empty.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Split of a comma separated list, in place
+static int split_list(char *list, char **items, int max_items)
+{
+	int n = 0;
+
+	for (char *p = strtok(list, ","); p && n < max_items; p = strtok(NULL, ","))
+		items[n++] = p;
+
+	return n;
+}
+
+// utime+stime of a process, in seconds
+static double get_process_cpu(int pid)
+{
+	char path[64];
+	char line[1024];
+	unsigned long utime, stime;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1.0;
+
+	if (!fgets(line, sizeof(line), f))
+	{
+		fclose(f);
+		return -1.0;
+	}
+
+	fclose(f);
+
+	// The name in parenthesis may contain spaces
+	char *p = strrchr(line, ')');
+	if (!p || sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return -1.0;
+
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double get_own_cpu(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void print_report(console_t *consoles, double elapsed, double server_cpu, double client_cpu)
+{
+	uint64_t total_bytes = 0;
+	uint64_t total_count = 0;
+
+	printf("\n%-20s %10s %10s %10s %10s %10s %10s %8s\n", "command", "count", "cmd/s", "MB/s", "p50 ms", "p99 ms", "max ms", "errors");
+
+	for (int op = 0; op < NUM_OPS; op++)
+	{
+		op_stats_t all;
+
+		memset(&all, 0, sizeof(all));
+
+		for (int i = 0; i < num_consoles; i++)
+		{
+			all.max_count += consoles[i].stats[op].count;
+			all.bytes += consoles[i].stats[op].bytes;
+			all.errors += consoles[i].stats[op].errors;
+		}
+
+		if (all.max_count == 0 && all.errors == 0)
+			continue;
+
+		all.latencies = (uint32_t *)malloc((all.max_count+1)*sizeof(uint32_t));
+		if (!all.latencies)
+			continue;
+
+		for (int i = 0; i < num_consoles; i++)
+		{
+			memcpy(all.latencies + all.count, consoles[i].stats[op].latencies, consoles[i].stats[op].count*sizeof(uint32_t));
+			all.count += consoles[i].stats[op].count;
+		}
+
+		qsort(all.latencies, all.count, sizeof(uint32_t), compare_latencies);
+
+		double p50 = (all.count) ? all.latencies[all.count/2] / 1000.0 : 0.0;
+		double p99 = (all.count) ? all.latencies[(all.count*99)/100] / 1000.0 : 0.0;
+		double max = (all.count) ? all.latencies[all.count-1] / 1000.0 : 0.0;
+
+		printf("%-20s %10llu %10.1f %10.2f %10.3f %10.3f %10.3f %8llu\n", op_names[op], (long long unsigned int)all.count, all.count / elapsed,
+			all.bytes / elapsed / 1048576, p50, p99, max, (long long unsigned int)all.errors);
+
+		total_bytes += all.bytes;
+		total_count += all.count;
+		free(all.latencies);
+	}
+
+	printf("\n%llu commands in %.1f s: %.1f cmd/s, %.2f MB/s\n", (long long unsigned int)total_count, elapsed, total_count / elapsed, total_bytes / elapsed / 1048576);
+
+	double gb = total_bytes / 1073741824.0;
+
+	if (server_cpu >= 0.0)
+	{
+		printf("Server cpu: %.2f s", server_cpu);
+		if (total_bytes > 0)
+			printf(", %.2f s per GB", server_cpu / gb);
+		printf("\n");
+	}
+
+	printf("Client cpu: %.2f s", client_cpu);
+	if (total_bytes > 0)
+		printf(", %.2f s per GB", client_cpu / gb);
+	printf("\n");
+}
+
+static int parse_options(int argc, char *argv[])
+{
+	int n = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--", 2) != 0)
+		{
+			argv[n++] = argv[i];
+			continue;
+		}
+
+		char *p = strchr(argv[i], '=');
+		unsigned int j;
+
+		for (j = 0; j < sizeof(options)/sizeof(option_t); j++)
+		{
+			if (p && strlen(options[j].name) == (size_t)(p-argv[i]-2) && strncmp(argv[i]+2, options[j].name, p-argv[i]-2) == 0)
+				break;
+		}
+
+		if (j == sizeof(options)/sizeof(option_t))
+		{
+			printf("Unknown option %s\n", argv[i]);
+			return -1;
+		}
+
+		if (options[j].string)
+		{
+			*options[j].string = p+1;
+			continue;
+		}
+
+		int value;
+
+		if (sscanf(p+1, "%d", &value) != 1 || value < options[j].min || value > options[j].max)
+		{
+			printf("Option --%s must be in %d-%d range.\n", options[j].name, options[j].min, options[j].max);
+			return -1;
+		}
+
+		*options[j].value = value;
+	}
+
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	struct addrinfo hints, *info;
+	char *workload_items[NUM_WORKLOADS*4];
+	char port[8] = "38008";
+
+	argc = parse_options(argc, argv);
+
+	if (argc < 2)
+	{
+		printf("Usage: %s [options] host [port]\nOptions:\n", argv[0]);
+
+		for (unsigned int i = 0; i < sizeof(options)/sizeof(option_t); i++)
+		{
+			printf("  --%s=%s  %s\n", options[i].name, (options[i].string) ? "s" : "n", options[i].description);
+		}
+
+		return -1;
+	}
+
+	if (argc > 2)
+	{
+		snprintf(port, sizeof(port), "%s", argv[2]);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(argv[1], port, &hints, &info) != 0)
+	{
+		printf("Cannot resolve %s.\n", argv[1]);
+		return -1;
+	}
+
+	memcpy(&server_addr, info->ai_addr, sizeof(server_addr));
+	freeaddrinfo(info);
+
+	// The list is printed again later
+	int n = split_list(strdup(workload_list), workload_items, NUM_WORKLOADS*4);
+
+	for (int i = 0; i < n; i++)
+	{
+		int w;
+
+		for (w = 0; w < NUM_WORKLOADS; w++)
+		{
+			if (strcmp(workload_items[i], workload_names[w]) == 0)
+				break;
+		}
+
+		if (w == NUM_WORKLOADS)
+		{
+			printf("Unknown workload %s.\n", workload_items[i]);
+			return -1;
+		}
+
+		if ((w == WORKLOAD_SEQ || w == WORKLOAD_RANDOM || w == WORKLOAD_PSX) && !file_path)
+		{
+			printf("The %s workload needs --file.\n", workload_items[i]);
+			return -1;
+		}
+
+		if (w == WORKLOAD_DIRS && !dir_list)
+		{
+			printf("The dirs workload needs --dirs.\n");
+			return -1;
+		}
+
+		if (w == WORKLOAD_TRACE && !trace_path)
+		{
+			printf("The trace workload needs --trace.\n");
+			return -1;
+		}
+
+		workloads[num_workloads++] = w;
+	}
+
+	if (num_workloads == 0)
+	{
+		printf("No workload.\n");
+		return -1;
+	}
+
+	if (dir_list)
+	{
+		num_dirs = split_list(dir_list, dirs, MAX_DIRS);
+	}
+
+	if (trace_path && load_trace(trace_path) != 0)
+	{
+		return -1;
+	}
+
+	if (bind_address)
+	{
+		if (inet_aton(bind_address, &source_addr) == 0)
+		{
+			printf("Wrong bind address %s.\n", bind_address);
+			return -1;
+		}
+
+		use_source_addr = 1;
+	}
+	else if (num_consoles > 1)
+	{
+		// On loopback every console can have its own address
+		if ((ntohl(server_addr.sin_addr.s_addr) >> 24) == 127)
+		{
+			source_addr.s_addr = htonl(0x7F000102);
+			use_source_addr = 1;
+		}
+		else
+		{
+			printf("Warning: without --bind all the consoles connect from the same address, and the server takes each new one for a reconnection.\n");
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	console_t *consoles = (console_t *)calloc(num_consoles, sizeof(console_t));
+	pthread_t *threads = (pthread_t *)calloc(num_consoles, sizeof(pthread_t));
+
+	if (!consoles || !threads)
+	{
+		printf("Out of memory.\n");
+		return -1;
+	}
+
+	// The consoles connect one after the other
+	for (int i = 0; i < num_consoles; i++)
+	{
+		consoles[i].id = i;
+		consoles[i].workload = workloads[i % num_workloads];
+		consoles[i].seed = 0x9E3779B9 * (i+1);
+		consoles[i].buf = (uint8_t *)malloc(BUFFER_SIZE);
+
+		if (!consoles[i].buf)
+		{
+			printf("System seems low in resources.\n");
+			return -1;
+		}
+
+		if (connect_console(&consoles[i]) != 0 || probe_console(&consoles[i]) != 0)
+			return -1;
+	}
+
+	double server_cpu = (server_pid) ? get_process_cpu(server_pid) : -1.0;
+	double client_cpu = get_own_cpu();
+	uint64_t start_time = get_time_usec();
+
+	for (int i = 0; i < num_consoles; i++)
+	{
+		if (pthread_create(&threads[i], NULL, console_thread, &consoles[i]) != 0)
+		{
+			printf("System seems low in resources.\n");
+			return -1;
+		}
+	}
+
+	printf("%d consoles running %s for %d s...\n", num_consoles, workload_list, duration);
+
+	sleep(duration);
+	stop = 1;
+
+	int failed = 0;
+
+	for (int i = 0; i < num_consoles; i++)
+	{
+		pthread_join(threads[i], NULL);
+		failed += consoles[i].failed;
+	}
+
+	double elapsed = (get_time_usec() - start_time) / 1000000.0;
+
+	if (server_pid)
+	{
+		double cpu = get_process_cpu(server_pid);
+		server_cpu = (server_cpu >= 0.0 && cpu >= 0.0) ? cpu - server_cpu : -1.0;
+	}
+
+	print_report(consoles, elapsed, server_cpu, get_own_cpu() - client_cpu);
+
+	if (failed)
+	{
+		printf("%d consoles failed.\n", failed);
+		return -1;
+	}
+
+	return 0;
+}
@@ -48,8 +48,53 @@ enum NETISO_CMD
 
 	/* Replace this with any custom command */
 	NETISO_CMD_CUSTOM_0 = 0x2412,
+
+	/* Protocol extensions. Servers that don't know them close the connection, so a client that gets no reply
+	 * to NETISO_CMD_SET_FEATURES must reconnect and stick to the commands above. */
+
+	/* Enables the requested NETISO_FEATURE_* flags. The server returns the ones it accepted. */
+	NETISO_CMD_SET_FEATURES = 0x2420,
+	/* Reads the active ro file (NETISO_FEATURE_PIPELINE). The client can send more of them without waiting for
+	 * the results: they are processed concurrently and each result, carrying the tag of its command and followed
+	 * by the data read, is sent as soon as it is ready. Any other command waits for the tagged reads in flight. */
+	NETISO_CMD_READ_FILE_TAGGED,
+	/* Reads the active ro file like NETISO_CMD_READ_FILE (NETISO_FEATURE_SPARSE), but the runs of zeros found in the
+	 * data aren't sent: the result lists them, and only the data around them follows. */
+	NETISO_CMD_READ_FILE_SPARSE,
+	/* Gets a page of the contents of the open directory (NETISO_FEATURE_DIR_PAGES), as netiso_dir_page_entry records
+	 * with the name after each of them. The listing is taken when token is 0, and the next pages are asked with the
+	 * token of the previous result. There is no limit on the number of entries. */
+	NETISO_CMD_READ_DIR_PAGE,
+	/* Gets the PARAM.SFO and icon of the games in the open directory (NETISO_FEATURE_GAME_INFO), images or JB
+	 * folders, named by the list that follows the command. The result has a netiso_game_info for each game,
+	 * followed by its files, as long as they fit in max_size bytes. The rest of the list is asked again. */
+	NETISO_CMD_GET_GAME_INFO,
+};
+
+enum NETISO_FEATURE
+{
+	NETISO_FEATURE_PIPELINE = 0x00000001,
+	NETISO_FEATURE_SPARSE = 0x00000002,
+	/* The data of the results of NETISO_CMD_READ_FILE, NETISO_CMD_READ_FILE_SPARSE, NETISO_CMD_READ_DIR and
+	 * NETISO_CMD_READ_DIR_PAGE and NETISO_CMD_GET_GAME_INFO is preceded by a netiso_lz4_header. */
+	NETISO_FEATURE_LZ4 = 0x00000004,
+	NETISO_FEATURE_DIR_PAGES = 0x00000008,
+	NETISO_FEATURE_GAME_INFO = 0x00000010,
+};
+
+enum NETISO_GAME_ICON
+{
+	NETISO_GAME_ICON_NONE,
+	/* PS3_GAME/ICON0.PNG of the game */
+	NETISO_GAME_ICON_ICON0,
+	/* Cover next to the image, named after it */
+	NETISO_GAME_ICON_JPG,
+	NETISO_GAME_ICON_PNG,
 };
 
+/* Maximum number of zero runs in the result of a NETISO_CMD_READ_FILE_SPARSE */
+#define NETISO_MAX_ZERO_RUNS	64
+
 typedef struct _netiso_cmd
 {
 	uint16_t opcode;
@@ -237,10 +282,124 @@ typedef struct _netiso_get_dir_size_result
 	int64_t dir_size; //-1 on error
 } __attribute__((packed)) netiso_get_dir_size_result;
 
+typedef struct _netiso_set_features_cmd
+{
+	uint16_t opcode;
+	uint16_t pad;
+	uint32_t features;
+	uint64_t pad2;
+} __attribute__((packed)) netiso_set_features_cmd;
+
+typedef struct _netiso_set_features_result
+{
+	uint32_t features; // features enabled for the session
+	uint16_t pipeline_depth; // tagged reads processed at the same time
+	uint16_t pad;
+	uint32_t max_tagged_read; // maximum num_bytes of a tagged read
+} __attribute__((packed)) netiso_set_features_result;
+
+typedef struct _netiso_read_file_tagged_cmd
+{
+	uint16_t opcode;
+	uint16_t tag;
+	uint32_t num_bytes;
+	uint64_t offset;
+} __attribute__((packed)) netiso_read_file_tagged_cmd;
+
+typedef struct _netiso_read_file_tagged_result
+{
+	uint16_t tag;
+	uint16_t pad;
+	int32_t bytes_read; // -1 on error
+} __attribute__((packed)) netiso_read_file_tagged_result;
+
+typedef struct _netiso_read_file_sparse_cmd
+{
+	uint16_t opcode;
+	uint16_t pad;
+	uint32_t num_bytes;
+	uint64_t offset;
+} __attribute__((packed)) netiso_read_file_sparse_cmd;
+
+typedef struct _netiso_read_file_sparse_result
+{
+	int32_t bytes_read; // -1 on error. Includes the zero runs
+	uint16_t num_runs; // netiso_zero_run that follow, before the data
+	uint16_t pad;
+} __attribute__((packed)) netiso_read_file_sparse_result;
+
+typedef struct _netiso_zero_run
+{
+	uint32_t offset; // from the offset read, runs are sorted and don't overlap
+	uint32_t size;
+} __attribute__((packed)) netiso_zero_run;
+
+typedef struct _netiso_read_dir_page_cmd
+{
+	uint16_t opcode;
+	uint16_t pad;
+	uint32_t max_entries;
+	uint64_t token; // 0 for the first page
+} __attribute__((packed)) netiso_read_dir_page_cmd;
+
+typedef struct _netiso_read_dir_page_result
+{
+	int64_t dir_size; // entries in the listing, -1 on error
+	uint32_t num_entries; // entries in this page
+	uint32_t size; // bytes of data that follow
+	uint64_t token; // of the next page, 0 after the last one
+} __attribute__((packed)) netiso_read_dir_page_result;
+
+/* Followed by name_len bytes of name, not terminated. Never bigger than a netiso_read_dir_result_data. */
+typedef struct _netiso_dir_page_entry
+{
+	int64_t file_size;
+	uint64_t mtime;
+	int8_t is_directory;
+	uint16_t name_len;
+} __attribute__((packed)) netiso_dir_page_entry;
+
+/* Followed by names_len bytes: for each game, its name in the open directory and the name of its cover without
+ * extension (.jpg, then .png), both terminated by a 0. The cover name is empty for no cover. */
+typedef struct _netiso_get_game_info_cmd
+{
+	uint16_t opcode;
+	uint16_t num_names;
+	uint16_t names_len;
+	uint8_t want_icon0; // send the ICON0.PNG of games without a cover
+	uint8_t pad;
+	uint32_t max_size;
+	uint32_t pad2;
+} __attribute__((packed)) netiso_get_game_info_cmd;
+
+typedef struct _netiso_get_game_info_result
+{
+	int32_t num_entries; // games of the list answered, -1 on error
+	uint32_t size; // bytes of data that follow
+} __attribute__((packed)) netiso_get_game_info_result;
+
+/* Followed by sfo_size bytes of PARAM.SFO and icon_size bytes of icon. sfo_size is 0 if the entry isn't a PS3 game.
+ * A game whose files don't fit alone in max_size comes without them. */
+typedef struct _netiso_game_info
+{
+	uint32_t sfo_size;
+	uint32_t icon_size;
+	uint8_t icon_type; // NETISO_GAME_ICON_*
+	uint8_t pad[3];
+} __attribute__((packed)) netiso_game_info;
+
+/* Sent before the data of n bytes with NETISO_FEATURE_LZ4. If packed_size is 0, the n bytes follow as they are.
+ * Otherwise an LZ4 block of packed_size bytes follows, which gives the first n - raw_size bytes, and then the
+ * last raw_size bytes as they are. Put right before them at the end of a buffer of n bytes, the block can be
+ * decompressed in place to the start of the buffer. */
+typedef struct _netiso_lz4_header
+{
+	uint32_t packed_size;
+	uint32_t raw_size;
+} __attribute__((packed)) netiso_lz4_header;
 
 #ifdef __cplusplus
 }
 #endif
 
 #endif
-
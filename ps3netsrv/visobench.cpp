@@ -0,0 +1,233 @@
+// visobench: times VIsoFile::open (the build of a virtual iso) over synthetic trees of 1k, 10k and
+// 100k files, so changes to the build can be measured without a real game folder.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "compat.h"
+#include "VIsoFile.h"
+
+// Files of a leaf directory and leaf directories of a middle one
+#define FILES_PER_DIR	100
+#define DIRS_PER_DIR	10
+
+typedef struct
+{
+	const char *name;
+	int *value;
+	int min;
+	int max;
+	const char *description;
+} option_t;
+
+static int files = 0;
+static int runs = 5;
+static int keep = 0;
+
+static option_t options[] =
+{
+	{ "files", &files, 0, 1000000, "files of the only tree to time, 0 for trees of 1k, 10k and 100k files (default: 0)" },
+	{ "runs", &runs, 1, 100, "builds timed for each tree (default: 5)" },
+	{ "keep", &keep, 0, 1, "1 to leave the trees on disk, to rerun without creating them again" },
+};
+
+static uint8_t file_data[4096];
+
+static void make_dir(const char *path)
+{
+#ifdef WIN32
+	mkdir(path);
+#else
+	mkdir(path, 0777);
+#endif
+}
+
+static void get_file_path(char *path, const char *root, int i)
+{
+	sprintf(path, "%s/D%03d/S%d/F%05d.BIN", root, i / (FILES_PER_DIR*DIRS_PER_DIR), (i / FILES_PER_DIR) % DIRS_PER_DIR, i % FILES_PER_DIR);
+}
+
+// Returns 0 when the tree was already there
+static int create_tree(const char *root, int num_files)
+{
+	char path[1024];
+	file_stat_t st;
+
+	if (stat_file(root, &st) == 0)
+		return 0;
+
+	make_dir(root);
+
+	for (int i = 0; i < num_files; i++)
+	{
+		if ((i % FILES_PER_DIR) == 0)
+		{
+			sprintf(path, "%s/D%03d", root, i / (FILES_PER_DIR*DIRS_PER_DIR));
+			make_dir(path);
+			sprintf(path + strlen(path), "/S%d", (i / FILES_PER_DIR) % DIRS_PER_DIR);
+			make_dir(path);
+		}
+
+		get_file_path(path, root, i);
+
+		FILE *f = fopen(path, "wb");
+		if (!f)
+		{
+			printf("Cannot create %s\n", path);
+			return -1;
+		}
+
+		// From empty files to files spanning two sectors
+		fwrite(file_data, 1, (i % 9) * 512, f);
+		fclose(f);
+	}
+
+	return 1;
+}
+
+static void delete_tree(const char *root, int num_files)
+{
+	char path[1024];
+
+	for (int i = 0; i < num_files; i++)
+	{
+		get_file_path(path, root, i);
+		unlink(path);
+
+		if ((i % FILES_PER_DIR) == (FILES_PER_DIR-1) || i == (num_files-1))
+		{
+			*strrchr(path, '/') = 0;
+			rmdir(path);
+
+			if ((i % (FILES_PER_DIR*DIRS_PER_DIR)) == (FILES_PER_DIR*DIRS_PER_DIR-1) || i == (num_files-1))
+			{
+				*strrchr(path, '/') = 0;
+				rmdir(path);
+			}
+		}
+	}
+
+	rmdir(root);
+}
+
+static int time_tree(const char *dir, int num_files)
+{
+	char root[1024];
+	uint64_t min_time = 0, total_time = 0;
+	int64_t image_size = 0;
+
+	snprintf(root, sizeof(root), "%s/visobench_%d", dir, num_files);
+
+	int created = create_tree(root, num_files);
+	if (created < 0)
+		return -1;
+
+	for (int i = 0; i < runs; i++)
+	{
+		VIsoFile viso(false);
+		file_stat_t st;
+
+		uint64_t start_time = get_time_usec();
+
+		if (viso.open(root, O_RDONLY) < 0)
+		{
+			printf("Cannot build the image of %s\n", root);
+			return -1;
+		}
+
+		uint64_t elapsed = get_time_usec() - start_time;
+
+		if (i == 0 || elapsed < min_time)
+			min_time = elapsed;
+
+		total_time += elapsed;
+
+		if (viso.fstat(&st) == 0)
+			image_size = st.file_size;
+	}
+
+	printf("%7d files: min %8.1f ms, avg %8.1f ms, image %lld MB%s\n", num_files, min_time / 1000.0, total_time / 1000.0 / runs,
+		(long long)(image_size / 1048576), (created) ? "" : " (existing tree)");
+
+	if (!keep)
+		delete_tree(root, num_files);
+
+	return 0;
+}
+
+static int parse_options(int argc, char *argv[])
+{
+	int n = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--", 2) != 0)
+		{
+			argv[n++] = argv[i];
+			continue;
+		}
+
+		char *p = strchr(argv[i], '=');
+		unsigned int j;
+
+		for (j = 0; j < sizeof(options)/sizeof(option_t); j++)
+		{
+			if (p && strlen(options[j].name) == (size_t)(p-argv[i]-2) && strncmp(argv[i]+2, options[j].name, p-argv[i]-2) == 0)
+				break;
+		}
+
+		if (j == sizeof(options)/sizeof(option_t))
+		{
+			printf("Unknown option %s\n", argv[i]);
+			return -1;
+		}
+
+		int value;
+
+		if (sscanf(p+1, "%d", &value) != 1 || value < options[j].min || value > options[j].max)
+		{
+			printf("Option --%s must be in %d-%d range.\n", options[j].name, options[j].min, options[j].max);
+			return -1;
+		}
+
+		*options[j].value = value;
+	}
+
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	argc = parse_options(argc, argv);
+
+	if (argc < 1 || argc > 2 || (argc == 2 && strlen(argv[1]) > 512))
+	{
+		printf("Usage: %s [options] [work directory]\nOptions:\n", argv[0]);
+
+		for (unsigned int i = 0; i < sizeof(options)/sizeof(option_t); i++)
+		{
+			printf("  --%s=n  %s\n", options[i].name, options[i].description);
+		}
+
+		return -1;
+	}
+
+	const char *dir = (argc == 2) ? argv[1] : ".";
+
+	memset(file_data, 0xA5, sizeof(file_data));
+
+	if (files > 0)
+		return time_tree(dir, files);
+
+	for (int num_files = 1000; num_files <= 100000; num_files *= 10)
+	{
+		if (time_tree(dir, num_files) != 0)
+			return -1;
+	}
+
+	return 0;
+}